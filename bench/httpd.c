@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "httpd.h"
+
+#define REQUEST_MAX 8192
+
+static int send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int send_file(int fd, int filefd, off_t size) {
+  off_t offset = 0;
+
+  while (offset < size) {
+    ssize_t n = sendfile(fd, filefd, &offset, size - offset);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (n == 0) {
+      return -EIO;
+    }
+  }
+
+  return 0;
+}
+
+static int send_status(int fd, const char *status, bool keepalive) {
+  char buf[256];
+  int len = snprintf(buf, sizeof(buf),
+                     "HTTP/1.1 %s\r\nContent-Length: 0\r\n%s\r\n", status,
+                     keepalive ? "" : "Connection: close\r\n");
+
+  return send_all(fd, buf, len);
+}
+
+/* Finds a header's value in a request which ends with its last header's
+ * CRLF. */
+static const char *find_header(const char *req, const char *name,
+                               size_t *len) {
+  size_t namelen = strlen(name);
+
+  for (const char *line = strstr(req, "\r\n"); line && line[2];
+       line = strstr(line + 2, "\r\n")) {
+    const char *value = line + 2;
+
+    if (strncasecmp(value, name, namelen) != 0 || value[namelen] != ':') {
+      continue;
+    }
+
+    value += namelen + 1;
+    value += strspn(value, " \t");
+    *len = strcspn(value, "\r");
+    return value;
+  }
+
+  return NULL;
+}
+
+static bool not_modified(const char *req, const struct stat *st) {
+  char date[64];
+  struct tm tm = {};
+  const char *value;
+  size_t len;
+
+  value = find_header(req, "If-Modified-Since", &len);
+  if (value == NULL || len >= sizeof(date)) {
+    return false;
+  }
+
+  memcpy(date, value, len);
+  date[len] = '\0';
+  if (strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+    return false;
+  }
+
+  return st->st_mtime <= timegm(&tm);
+}
+
+/* Answers a single request. Returns whether the connection stays open. */
+static bool respond(int fd, int rootfd, const char *req) {
+  char method[8], target[PATH_MAX], version[16], buf[512], date[64];
+  const char *name, *value;
+  struct stat st;
+  struct tm tm;
+  bool keepalive;
+  size_t len;
+  int filefd, n, r;
+
+  if (sscanf(req, "%7s %4095s %15s", method, target, version) != 3) {
+    send_status(fd, "400 Bad Request", false);
+    return false;
+  }
+
+  keepalive = strcmp(version, "HTTP/1.1") == 0;
+  value = find_header(req, "Connection", &len);
+  if (value != NULL && len == 5 && strncasecmp(value, "close", 5) == 0) {
+    keepalive = false;
+  }
+
+  if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+    send_status(fd, "501 Not Implemented", false);
+    return false;
+  }
+
+  target[strcspn(target, "?")] = '\0';
+  name = strrchr(target, '/');
+  name = name ? name + 1 : target;
+
+  /* nothing outside of root, and none of its hidden files */
+  filefd = name[0] != '\0' && name[0] != '.'
+               ? openat(rootfd, name, O_RDONLY | O_CLOEXEC)
+               : -1;
+  if (filefd < 0 || fstat(filefd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    if (filefd >= 0) {
+      close(filefd);
+    }
+    return send_status(fd, "404 Not Found", keepalive) == 0 && keepalive;
+  }
+
+  if (not_modified(req, &st)) {
+    close(filefd);
+    return send_status(fd, "304 Not Modified", keepalive) == 0 && keepalive;
+  }
+
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT",
+           gmtime_r(&st.st_mtime, &tm));
+  n = snprintf(buf, sizeof(buf),
+               "HTTP/1.1 200 OK\r\n"
+               "Content-Type: application/octet-stream\r\n"
+               "Content-Length: %lld\r\n"
+               "Last-Modified: %s\r\n"
+               "%s\r\n",
+               (long long)st.st_size, date,
+               keepalive ? "" : "Connection: close\r\n");
+
+  r = send_all(fd, buf, n);
+  if (r == 0 && strcmp(method, "GET") == 0) {
+    r = send_file(fd, filefd, st.st_size);
+  }
+  close(filefd);
+
+  return r == 0 && keepalive;
+}
+
+static void serve_connection(int fd, int rootfd) {
+  char buf[REQUEST_MAX];
+  size_t len = 0;
+
+  for (;;) {
+    char *end;
+    size_t reqlen;
+
+    while ((end = memmem(buf, len, "\r\n\r\n", 4)) == NULL) {
+      ssize_t n;
+
+      /* too big for any request a client of ours would make */
+      if (len == sizeof(buf)) {
+        send_status(fd, "431 Request Header Fields Too Large", false);
+        return;
+      }
+
+      n = recv(fd, buf + len, sizeof(buf) - len, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return;
+      }
+      len += n;
+    }
+
+    /* the request ends with its last header's CRLF */
+    end[2] = '\0';
+    reqlen = end - buf + 4;
+
+    if (!respond(fd, rootfd, buf)) {
+      return;
+    }
+
+    /* whatever a client pipelined after it */
+    memmove(buf, buf + reqlen, len - reqlen);
+    len -= reqlen;
+  }
+}
+
+static void serve(int sock, int rootfd) {
+  /* the connections' children reap themselves */
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    pid_t pid;
+
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      _exit(1);
+    }
+
+    pid = fork();
+    if (pid == 0) {
+      close(sock);
+      serve_connection(fd, rootfd);
+      _exit(0);
+    }
+    close(fd);
+  }
+}
+
+int httpd_start(struct httpd_t *h, const char *root) {
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+  } addr = {.in = {
+                .sin_family = AF_INET,
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+            }};
+  socklen_t addrlen = sizeof(addr.in);
+  int sock = -1, rootfd, r = 0;
+
+  rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (rootfd < 0) {
+    return -errno;
+  }
+
+  sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0 || bind(sock, &addr.sa, sizeof(addr.in)) < 0 ||
+      listen(sock, 64) < 0 || getsockname(sock, &addr.sa, &addrlen) < 0) {
+    r = -errno;
+    goto done;
+  }
+  h->port = ntohs(addr.in.sin_port);
+
+  h->pid = fork();
+  if (h->pid < 0) {
+    r = -errno;
+    goto done;
+  }
+
+  /* in a group of its own, so that it's stopped along with its children */
+  if (h->pid == 0) {
+    setpgid(0, 0);
+    serve(sock, rootfd);
+  }
+  setpgid(h->pid, h->pid);
+
+done:
+  if (sock >= 0) {
+    close(sock);
+  }
+  close(rootfd);
+
+  return r;
+}
+
+void httpd_stop(struct httpd_t *h) {
+  if (h->pid <= 0) {
+    return;
+  }
+
+  kill(-h->pid, SIGTERM);
+  waitpid(h->pid, NULL, 0);
+  h->pid = 0;
+}
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A local HTTP mirror, served by a child process and its own children, one
+ * for each connection. */
+struct httpd_t {
+  pid_t pid;
+  uint16_t port;
+};
+
+/* Starts serving the files in root on a port of the loopback interface.
+ * Only the last component of a request's path is looked up, so that any
+ * mirror layout gets the same files. Requests are answered with keep-alive,
+ * and with a 304 when If-Modified-Since shows the client is up to date. */
+int httpd_start(struct httpd_t *h, const char *root);
+void httpd_stop(struct httpd_t *h);
+
+/* vim: set ts=2 sw=2 et: */
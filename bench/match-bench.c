@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "macro.h"
+#include "match.h"
+#include "pool.h"
+#include "synth.h"
+
+/* Measures what match_regex costs per line, over paths like those of a
+ * generated repo. Run it against builds configured with and without
+ * --with-pcre2 to compare the two backends. */
+
+/* NUL terminated paths, the last offset being where the last one ends */
+struct lines_t {
+  char *buf;
+  size_t *offsets;
+  size_t count;
+};
+
+struct task_t {
+  const filterpattern_t *filter;
+  const struct lines_t *lines;
+  uint64_t matches;
+};
+
+static const char *default_patterns[] = {
+    "bin/[^/]+$",
+    "^/usr/lib/.*\\.so$",
+    "file[0-9]*7\\.py$",
+    "(doc|man)/.*\\.gz$",
+    "qt6.*icons",
+};
+
+static struct {
+  unsigned lines;
+  unsigned rounds;
+  unsigned threads;
+  bool icase;
+  struct synth_config_t synth;
+} opts = {
+    .lines = 200000,
+    .rounds = 5,
+    .threads = 1,
+    .synth =
+        {
+            .repos = 1,
+            .files = 40,
+            .depth = 5,
+            .seed = 1,
+        },
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *backend(void) {
+#ifdef HAVE_PCRE2
+  return "libpcre2";
+#else
+  return "libpcre";
+#endif
+}
+
+/* Every file of every package, with a leading slash as they're stored. */
+static int lines_generate(struct lines_t *lines) {
+  size_t size = 0, capacity = (size_t)opts.lines * 64;
+
+  opts.synth.packages = (opts.lines + opts.synth.files - 1) / opts.synth.files;
+
+  MALLOC(lines->buf, capacity, return -ENOMEM);
+  MALLOC(lines->offsets, (opts.lines + 1) * sizeof(size_t), return -ENOMEM);
+
+  for (lines->count = 0; lines->count < opts.lines; ++lines->count) {
+    unsigned pkg = lines->count / opts.synth.files,
+             file = lines->count % opts.synth.files;
+    char path[PATH_MAX];
+    size_t len = synth_file_path(&opts.synth, 0, pkg, file, path, sizeof(path));
+
+    if (size + len + 2 > capacity) {
+      char *newbuf;
+
+      capacity = capacity * 2 + len + 2;
+      newbuf = realloc(lines->buf, capacity);
+      if (newbuf == NULL) {
+        return -ENOMEM;
+      }
+      lines->buf = newbuf;
+    }
+
+    lines->offsets[lines->count] = size;
+    lines->buf[size++] = '/';
+    memcpy(&lines->buf[size], path, len);
+    size += len;
+    lines->buf[size++] = '\0';
+  }
+  lines->offsets[lines->count] = size;
+
+  return 0;
+}
+
+static void match_task(void *arg) {
+  struct task_t *task = arg;
+  const struct lines_t *lines = task->lines;
+
+  for (unsigned r = 0; r < opts.rounds; ++r) {
+    for (size_t i = 0; i < lines->count; ++i) {
+      const char *line = &lines->buf[lines->offsets[i]];
+      size_t len = lines->offsets[i + 1] - lines->offsets[i] - 1;
+
+      task->matches += match_regex(task->filter, line, len, 0) == 0;
+    }
+  }
+}
+
+static int bench_pattern(const char *pattern, const struct lines_t *lines) {
+  _cleanup_free_ struct task_t *tasks = NULL;
+  _cleanup_free_ void **ptrs = NULL;
+  filterpattern_t filter = {};
+  double start, elapsed;
+
+  if (compile_regex(&filter.re, pattern, opts.icase) != 0) {
+    return 1;
+  }
+
+  CALLOC(tasks, opts.threads, sizeof(struct task_t), return 1);
+  CALLOC(ptrs, opts.threads, sizeof(void *), return 1);
+  for (unsigned t = 0; t < opts.threads; ++t) {
+    tasks[t].filter = &filter;
+    tasks[t].lines = lines;
+    ptrs[t] = &tasks[t];
+  }
+
+  /* every thread goes over every line, so the cost per line is as each one
+   * sees it */
+  start = now();
+  pool_run(ptrs, opts.threads, match_task, opts.threads);
+  elapsed = now() - start;
+
+  printf("%-28s %10.1f ns/line %10" PRIu64 " matches\n", pattern,
+         elapsed * 1e9 / ((double)lines->count * opts.rounds),
+         tasks[0].matches / opts.rounds);
+
+  free_regex(&filter);
+
+  return 0;
+}
+
+static void usage(void) {
+  fputs(
+      "Usage: match-bench [options] [pattern...]\n\n"
+      "  -n, --lines <n>         paths to match against (default: 200000)\n"
+      "  -r, --rounds <n>        times to go over them (default: 5)\n"
+      "  -j, --threads <n>       match from n threads at once (default: 1)\n"
+      "  -i, --ignorecase        match case insensitively\n"
+      "  -d, --depth <n>         path components of each file (default: 5)\n"
+      "  -s, --seed <n>          seed for the generated paths (default: 1)\n"
+      "  -h, --help              display this help and exit\n",
+      stdout);
+}
+
+static int parse_uint(const char *arg, unsigned min, unsigned max,
+                      unsigned *v) {
+  unsigned long n;
+  char *end;
+
+  errno = 0;
+  n = strtoul(arg, &end, 10);
+  if (errno != 0 || *end != '\0' || end == arg || n < min || n > max) {
+    fprintf(stderr, "error: invalid number %s (must be %u to %u)\n", arg, min,
+            max);
+    return -EINVAL;
+  }
+
+  *v = n;
+
+  return 0;
+}
+
+static int parse_opts(int argc, char **argv) {
+  static const char *shortopts = "d:hij:n:r:s:";
+  static const struct option longopts[] = {
+      {"depth", required_argument, 0, 'd'},
+      {"help", no_argument, 0, 'h'},
+      {"ignorecase", no_argument, 0, 'i'},
+      {"threads", required_argument, 0, 'j'},
+      {"lines", required_argument, 0, 'n'},
+      {"rounds", required_argument, 0, 'r'},
+      {"seed", required_argument, 0, 's'},
+      {0, 0, 0, 0}};
+  unsigned seed;
+  int opt, r = 0;
+
+  while (r == 0 &&
+         (opt = getopt_long(argc, argv, shortopts, longopts, NULL)) >= 0) {
+    switch (opt) {
+      case 'd':
+        r = parse_uint(optarg, 3, 32, &opts.synth.depth);
+        break;
+      case 'h':
+        usage();
+        return -1;
+      case 'i':
+        opts.icase = true;
+        break;
+      case 'j':
+        r = parse_uint(optarg, 1, 256, &opts.threads);
+        break;
+      case 'n':
+        r = parse_uint(optarg, 1, 100000000, &opts.lines);
+        break;
+      case 'r':
+        r = parse_uint(optarg, 1, 100000, &opts.rounds);
+        break;
+      case 's':
+        r = parse_uint(optarg, 0, UINT_MAX, &seed);
+        opts.synth.seed = seed;
+        break;
+      default:
+        return 1;
+    }
+  }
+
+  return r != 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct lines_t lines = {};
+  int ret;
+
+  ret = parse_opts(argc, argv);
+  if (ret != 0) {
+    return ret < 0 ? 0 : 2;
+  }
+
+  if (lines_generate(&lines) < 0) {
+    fputs("error: failed to generate paths\n", stderr);
+    free(lines.buf);
+    free(lines.offsets);
+    return 1;
+  }
+
+  printf(":: %s, %zu paths, %u rounds, %u threads\n", backend(), lines.count,
+         opts.rounds, opts.threads);
+
+  if (optind < argc) {
+    for (int i = optind; i < argc && ret == 0; ++i) {
+      ret = bench_pattern(argv[i], &lines);
+    }
+  } else {
+    for (size_t i = 0;
+         i < sizeof(default_patterns) / sizeof(default_patterns[0]) && ret == 0;
+         ++i) {
+      ret = bench_pattern(default_patterns[i], &lines);
+    }
+  }
+
+  free(lines.buf);
+  free(lines.offsets);
+
+  return ret;
+}
+
+/* vim: set ts=2 sw=2 et: */
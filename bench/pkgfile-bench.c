@@ -0,0 +1,687 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "repofile.h"
+#include "run.h"
+#include "synth.h"
+
+#define MAX_ARGS 16
+
+struct format_t {
+  char name[32];
+  const char *dbformat;
+  const char *compress;
+};
+
+struct query_t {
+  const char *mode;
+  const char *scope;
+  const char *args[5];
+  uint64_t db_lines;
+};
+
+/* What the queries look for, all of it in one repo. */
+struct targets_t {
+  char repo[64];
+  char pkgname[256];
+  char binary[PATH_MAX];
+  char file[PATH_MAX];
+  char glob[PATH_MAX + 16];
+  uint64_t repo_lines;
+};
+
+static struct {
+  const char *pkgfile;
+  const char *workdir;
+  const char *output;
+  const char *formats;
+  const char *mirror;
+  unsigned runs;
+  unsigned warmup;
+  bool keep;
+  struct synth_config_t synth;
+} opts = {
+    .pkgfile = "./pkgfile",
+    .formats = "cpio,cpio:gzip,cpio:xz,flat,compact",
+    .runs = 10,
+    .warmup = 1,
+    .synth =
+        {
+            .repos = 3,
+            .packages = 2000,
+            .files = 40,
+            .depth = 5,
+            .seed = 1,
+        },
+};
+
+static char conffile[PATH_MAX];
+static struct repofile_t repofile;
+
+/* A real repo stands in for all of the synthetic ones. */
+static unsigned repo_count(void) {
+  return opts.mirror ? 1 : opts.synth.repos;
+}
+
+static void repo_name(unsigned i, char *buf, size_t size) {
+  if (opts.mirror) {
+    snprintf(buf, size, "%s", repofile.repo);
+  } else {
+    synth_repo_name(i, buf, size);
+  }
+}
+
+/* Runs pkgfile with the given arguments after the config and cache options,
+ * counting the lines it writes to stdout. */
+static int run_pkgfile(const char *cachedir, const char *const *args,
+                       struct sample_t *sample) {
+  const char *argv[MAX_ARGS] = {opts.pkgfile, "-C", conffile, "--cachedir",
+                                cachedir};
+  int argc = 5;
+
+  for (; *args && argc < MAX_ARGS - 1; ++args) {
+    argv[argc++] = *args;
+  }
+  argv[argc] = NULL;
+
+  return run_command(argv, sample);
+}
+
+static int bench_query(FILE *out, const char *cachedir,
+                       const struct query_t *q) {
+  _cleanup_free_ double *latency = NULL;
+  struct sample_t sample;
+  unsigned failures = 0;
+  uint64_t lines = 0;
+  long maxrss = 0;
+  double total = 0;
+  int r;
+
+  MALLOC(latency, opts.runs * sizeof(double), return -ENOMEM);
+
+  for (unsigned i = 0; i < opts.warmup + opts.runs; ++i) {
+    r = run_pkgfile(cachedir, q->args, &sample);
+    if (r < 0) {
+      fprintf(stderr, "error: failed to run %s: %s\n", opts.pkgfile,
+              strerror(-r));
+      return r;
+    }
+
+    if (i < opts.warmup) {
+      continue;
+    }
+
+    latency[i - opts.warmup] = sample.latency;
+    total += sample.latency;
+    lines = sample.lines;
+    maxrss = MAX(maxrss, sample.maxrss);
+    if (sample.status != 0) {
+      failures++;
+    }
+  }
+
+  qsort(latency, opts.runs, sizeof(double), doublecmp);
+
+  fputs("        {\"mode\": ", out);
+  json_string(out, q->mode);
+  fputs(", \"scope\": ", out);
+  json_string(out, q->scope);
+  fputs(", \"args\": [", out);
+  for (const char *const *a = q->args; *a; ++a) {
+    if (a != q->args) {
+      fputs(", ", out);
+    }
+    json_string(out, *a);
+  }
+  fprintf(out,
+          "],\n"
+          "         \"db_lines\": %" PRIu64 ", \"output_lines\": %" PRIu64
+          ", \"failures\": %u,\n"
+          "         \"latency_ms\": {\"min\": %.3f, \"p50\": %.3f, "
+          "\"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f, \"mean\": %.3f},\n"
+          "         \"lines_per_sec\": %.0f, \"peak_rss_kib\": %ld}",
+          q->db_lines, lines, failures, latency[0] * 1e3,
+          percentile(latency, opts.runs, 50) * 1e3,
+          percentile(latency, opts.runs, 90) * 1e3,
+          percentile(latency, opts.runs, 99) * 1e3,
+          latency[opts.runs - 1] * 1e3, total / opts.runs * 1e3,
+          q->db_lines / percentile(latency, opts.runs, 50), maxrss);
+
+  return 0;
+}
+
+static int cache_size(const char *cachedir, const char *suffix,
+                      uint64_t *bytes) {
+  char path[PATH_MAX], repo[64];
+  struct stat st;
+
+  *bytes = 0;
+  for (unsigned i = 0; i < repo_count(); ++i) {
+    repo_name(i, repo, sizeof(repo));
+    snprintf(path, sizeof(path), "%s/%s%s", cachedir, repo, suffix);
+    if (stat(path, &st) < 0) {
+      if (errno == ENOENT) {
+        continue;
+      }
+      return -errno;
+    }
+    *bytes += st.st_size;
+  }
+
+  return 0;
+}
+
+static int bench_format(FILE *out, const struct format_t *fmt,
+                        const struct query_t *queries, size_t nqueries) {
+  char cachedir[PATH_MAX], compress[32];
+  const char *update[] = {"-uu", "-F", fmt->dbformat, NULL, NULL};
+  struct sample_t sample;
+  uint64_t db_bytes, index_bytes;
+  int r;
+
+  snprintf(cachedir, sizeof(cachedir), "%s/cache-%s", opts.workdir,
+           fmt->name);
+  if (mkdir(cachedir, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "error: failed to create %s: %s\n", cachedir,
+            strerror(errno));
+    return -errno;
+  }
+
+  if (fmt->compress) {
+    snprintf(compress, sizeof(compress), "--compress=%s", fmt->compress);
+    update[3] = compress;
+  }
+
+  r = run_pkgfile(cachedir, update, &sample);
+  if (r < 0 || sample.status != 0) {
+    fprintf(stderr, "error: failed to build the %s databases\n", fmt->name);
+    return r < 0 ? r : -EIO;
+  }
+
+  r = cache_size(cachedir, ".files", &db_bytes);
+  if (r == 0) {
+    r = cache_size(cachedir, ".files.idx", &index_bytes);
+  }
+  if (r < 0) {
+    fprintf(stderr, "error: failed to stat the %s databases: %s\n", fmt->name,
+            strerror(-r));
+    return r;
+  }
+
+  fputs("    {\"format\": ", out);
+  json_string(out, fmt->dbformat);
+  fputs(", \"compress\": ", out);
+  json_string(out, fmt->compress ? fmt->compress : "none");
+  fprintf(out,
+          ",\n     \"update_ms\": %.3f, \"db_bytes\": %" PRIu64
+          ", \"index_bytes\": %" PRIu64 ",\n     \"queries\": [\n",
+          sample.latency * 1e3, db_bytes, index_bytes);
+
+  for (size_t i = 0; i < nqueries; ++i) {
+    r = bench_query(out, cachedir, &queries[i]);
+    if (r < 0) {
+      return r;
+    }
+    fputs(i + 1 < nqueries ? ",\n" : "\n", out);
+  }
+
+  fputs("     ]}", out);
+
+  return 0;
+}
+
+static int parse_format(const char *spec, size_t len, struct format_t *fmt) {
+  static const char *dbformats[] = {"cpio", "flat", "compact"};
+  const char *colon = memchr(spec, ':', len);
+  size_t n = colon ? (size_t)(colon - spec) : len;
+
+  if (len >= sizeof(fmt->name)) {
+    return -EINVAL;
+  }
+
+  memcpy(fmt->name, spec, len);
+  fmt->name[len] = '\0';
+  fmt->dbformat = NULL;
+  fmt->compress = NULL;
+
+  for (size_t i = 0; i < sizeof(dbformats) / sizeof(dbformats[0]); ++i) {
+    if (strlen(dbformats[i]) == n && memcmp(dbformats[i], spec, n) == 0) {
+      fmt->dbformat = dbformats[i];
+    }
+  }
+
+  if (fmt->dbformat == NULL) {
+    return -EINVAL;
+  }
+
+  if (colon) {
+    /* the name doubles as the cache directory's suffix */
+    fmt->name[n] = '-';
+    fmt->compress = &fmt->name[n + 1];
+  }
+
+  return 0;
+}
+
+static int generate_mirror(uint64_t *lines) {
+  char path[PATH_MAX], repo[64];
+  FILE *conf;
+  int r;
+
+  if (snprintf(conffile, sizeof(conffile), "%s/pacman.conf", opts.workdir) >=
+      (int)sizeof(conffile)) {
+    return -ENAMETOOLONG;
+  }
+  conf = fopen(conffile, "we");
+  if (conf == NULL) {
+    fprintf(stderr, "error: failed to create %s: %s\n", conffile,
+            strerror(errno));
+    return -errno;
+  }
+
+  fputs("[options]\nArchitecture = auto\n", conf);
+
+  snprintf(path, sizeof(path), "%s/mirror", opts.workdir);
+  mkdir(path, 0755);
+
+  for (unsigned i = 0; i < repo_count(); ++i) {
+    repo_name(i, repo, sizeof(repo));
+    fprintf(conf, "\n[%s]\nServer = file://%s/mirror/$repo\n", repo,
+            opts.workdir);
+
+    snprintf(path, sizeof(path), "%s/mirror/%s", opts.workdir, repo);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/mirror/%s/%s.files", opts.workdir, repo,
+             repo);
+
+    if (opts.mirror) {
+      /* pkgfile only ever reads it */
+      r = symlink(opts.mirror, path) < 0 ? -errno : 0;
+      lines[i] = repofile.lines;
+    } else {
+      r = synth_write_repo(&opts.synth, i, path, &lines[i]);
+    }
+    if (r < 0) {
+      fprintf(stderr, "error: failed to generate %s: %s\n", path,
+              strerror(-r));
+      fclose(conf);
+      return r;
+    }
+  }
+
+  if (fclose(conf) != 0) {
+    return -errno;
+  }
+
+  return 0;
+}
+
+/* The first synthetic repo's middle package holds the targets: a binary which
+ * exists nowhere else, and a file which every package has a copy of. */
+static void synth_targets(struct targets_t *t, uint64_t repo_lines) {
+  char target[PATH_MAX], common[PATH_MAX];
+
+  synth_repo_name(0, t->repo, sizeof(t->repo));
+  synth_pkg_name(0, opts.synth.packages / 2, t->pkgname, sizeof(t->pkgname));
+  synth_file_path(&opts.synth, 0, opts.synth.packages / 2, 0, target,
+                  sizeof(target));
+  synth_file_path(&opts.synth, 0, opts.synth.packages / 2, 1, common,
+                  sizeof(common));
+  snprintf(t->glob, sizeof(t->glob), "*/bin/%.*s*",
+           (int)(strlen(t->pkgname) - 1), t->pkgname);
+  snprintf(t->binary, sizeof(t->binary), "%s", strrchr(target, '/') + 1);
+  snprintf(t->file, sizeof(t->file), "%s", strrchr(common, '/') + 1);
+  t->repo_lines = repo_lines;
+}
+
+/* A real repo's targets come from its middle package too, but there's no
+ * knowing how unique its binary is or how common its file. */
+static void mirror_targets(struct targets_t *t) {
+  snprintf(t->repo, sizeof(t->repo), "%s", repofile.repo);
+  snprintf(t->pkgname, sizeof(t->pkgname), "%s", repofile.pkgname);
+  snprintf(t->binary, sizeof(t->binary), "%s", repofile.binary);
+  snprintf(t->file, sizeof(t->file), "%s", repofile.file);
+  snprintf(t->glob, sizeof(t->glob), "*/bin/%.*s*",
+           (int)(strlen(t->binary) - (strlen(t->binary) > 1)), t->binary);
+  t->repo_lines = repofile.lines;
+}
+
+/* Each mode is timed against the targets' repo and against all of them. */
+static size_t make_queries(struct query_t *q, const struct targets_t *t,
+                           uint64_t total) {
+  const char *repo = t->repo, *pkgname = t->pkgname, *glob = t->glob;
+  const char *binary = t->binary, *file = t->file;
+  uint64_t repo_lines = t->repo_lines;
+  size_t n = 0;
+
+  q[n++] = (struct query_t){"exact", "all", {binary}, total};
+  q[n++] = (struct query_t){"exact", "single", {"-R", repo, binary},
+                            repo_lines};
+  q[n++] = (struct query_t){"binaries", "all", {"-b", binary}, total};
+  q[n++] = (struct query_t){"binaries", "single", {"-b", "-R", repo, binary},
+                            repo_lines};
+  q[n++] = (struct query_t){"glob", "all", {"-g", glob}, total};
+  q[n++] = (struct query_t){"glob", "single", {"-g", "-R", repo, glob},
+                            repo_lines};
+  q[n++] = (struct query_t){"regex", "all", {"-r", "/site/.*\\.py$"}, total};
+  q[n++] = (struct query_t){"regex", "single",
+                            {"-r", "-R", repo, "/site/.*\\.py$"},
+                            repo_lines};
+  q[n++] = (struct query_t){"list", "all", {"-l", pkgname}, total};
+  q[n++] = (struct query_t){"list", "single", {"-l", "-R", repo, pkgname},
+                            repo_lines};
+  q[n++] = (struct query_t){"verbose", "all", {"-v", file}, total};
+  q[n++] = (struct query_t){"verbose", "single", {"-v", "-R", repo, file},
+                            repo_lines};
+
+  return n;
+}
+
+static int remove_entry(const char *path, const struct stat *st UNUSED,
+                        int type UNUSED, struct FTW *ftw UNUSED) {
+  return remove(path);
+}
+
+static void usage(void) {
+  fputs(
+      "Usage: pkgfile-bench [options]\n\n"
+      "  -p, --pkgfile <path>    the pkgfile to benchmark (default: "
+      "./pkgfile)\n"
+      "  -w, --workdir <dir>     generate databases in an existing directory\n"
+      "                          and keep them\n"
+      "  -k, --keep              keep the generated databases\n"
+      "  -o, --output <file>     write the JSON report to a file\n"
+      "  -F, --formats <list>    formats to benchmark (default: "
+      "cpio,cpio:gzip,cpio:xz,flat,compact)\n"
+      "  -n, --runs <n>          timed runs of each query (default: 10)\n"
+      "  -W, --warmup <n>        untimed runs of each query (default: 1)\n"
+      "  -m, --mirror <file>     benchmark a real repo's .files instead of\n"
+      "                          generating repos\n\n"
+      "  -R, --repos <n>         repos to generate (default: 3)\n"
+      "  -P, --packages <n>      packages in each repo (default: 2000)\n"
+      "  -f, --files <n>         files in each package (default: 40)\n"
+      "  -d, --depth <n>         path components of each file (default: 5)\n"
+      "  -s, --seed <n>          seed for the generated paths (default: 1)\n"
+      "  -h, --help              display this help and exit\n",
+      stdout);
+}
+
+static int parse_uint(const char *arg, unsigned min, unsigned max,
+                      unsigned *v) {
+  unsigned long n;
+  char *end;
+
+  errno = 0;
+  n = strtoul(arg, &end, 10);
+  if (errno != 0 || *end != '\0' || end == arg || n < min || n > max) {
+    fprintf(stderr, "error: invalid number %s (must be %u to %u)\n", arg, min,
+            max);
+    return -EINVAL;
+  }
+
+  *v = n;
+
+  return 0;
+}
+
+static int parse_opts(int argc, char **argv) {
+  static const char *shortopts = "d:F:f:hkm:n:o:P:p:R:s:W:w:";
+  static const struct option longopts[] = {
+      {"depth", required_argument, 0, 'd'},
+      {"formats", required_argument, 0, 'F'},
+      {"files", required_argument, 0, 'f'},
+      {"help", no_argument, 0, 'h'},
+      {"keep", no_argument, 0, 'k'},
+      {"mirror", required_argument, 0, 'm'},
+      {"runs", required_argument, 0, 'n'},
+      {"output", required_argument, 0, 'o'},
+      {"packages", required_argument, 0, 'P'},
+      {"pkgfile", required_argument, 0, 'p'},
+      {"repos", required_argument, 0, 'R'},
+      {"seed", required_argument, 0, 's'},
+      {"warmup", required_argument, 0, 'W'},
+      {"workdir", required_argument, 0, 'w'},
+      {0, 0, 0, 0}};
+  unsigned seed;
+  int opt, r = 0;
+
+  while (r == 0 &&
+         (opt = getopt_long(argc, argv, shortopts, longopts, NULL)) >= 0) {
+    switch (opt) {
+      case 'd':
+        r = parse_uint(optarg, 3, 32, &opts.synth.depth);
+        break;
+      case 'F':
+        opts.formats = optarg;
+        break;
+      case 'f':
+        r = parse_uint(optarg, 2, 65535, &opts.synth.files);
+        break;
+      case 'h':
+        usage();
+        return -1;
+      case 'k':
+        opts.keep = true;
+        break;
+      case 'm':
+        opts.mirror = optarg;
+        break;
+      case 'n':
+        r = parse_uint(optarg, 1, 100000, &opts.runs);
+        break;
+      case 'o':
+        opts.output = optarg;
+        break;
+      case 'P':
+        r = parse_uint(optarg, 1, 99999, &opts.synth.packages);
+        break;
+      case 'p':
+        opts.pkgfile = optarg;
+        break;
+      case 'R':
+        r = parse_uint(optarg, 1, 64, &opts.synth.repos);
+        break;
+      case 's':
+        r = parse_uint(optarg, 0, UINT_MAX, &seed);
+        opts.synth.seed = seed;
+        break;
+      case 'W':
+        r = parse_uint(optarg, 0, 100000, &opts.warmup);
+        break;
+      case 'w':
+        /* never clean up a directory we didn't create */
+        opts.workdir = optarg;
+        opts.keep = true;
+        break;
+      default:
+        return 1;
+    }
+  }
+
+  if (r != 0) {
+    return 1;
+  }
+
+  if (optind < argc) {
+    fprintf(stderr, "error: unexpected argument %s\n", argv[optind]);
+    return 1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char workdir[PATH_MAX];
+  _cleanup_free_ uint64_t *lines = NULL;
+  char mirror[PATH_MAX];
+  struct query_t queries[12];
+  struct targets_t targets;
+  size_t nqueries;
+  struct format_t fmt;
+  uint64_t total = 0;
+  FILE *out = stdout;
+  int ret;
+
+  ret = parse_opts(argc, argv);
+  if (ret != 0) {
+    return ret < 0 ? 0 : 2;
+  }
+
+  if (opts.workdir == NULL) {
+    const char *tmpdir = getenv("TMPDIR");
+
+    snprintf(workdir, sizeof(workdir), "%s/pkgfile-bench-XXXXXX",
+             tmpdir ? tmpdir : "/tmp");
+    if (mkdtemp(workdir) == NULL) {
+      fprintf(stderr, "error: failed to create %s: %s\n", workdir,
+              strerror(errno));
+      return 1;
+    }
+  } else if (realpath(opts.workdir, workdir) == NULL) {
+    fprintf(stderr, "error: invalid workdir %s: %s\n", opts.workdir,
+            strerror(errno));
+    return 1;
+  }
+  opts.workdir = workdir;
+
+  if (opts.mirror) {
+    if (realpath(opts.mirror, mirror) == NULL) {
+      fprintf(stderr, "error: invalid mirror %s: %s\n", opts.mirror,
+              strerror(errno));
+      ret = 1;
+      goto cleanup;
+    }
+    opts.mirror = mirror;
+
+    if (repofile_scan(opts.mirror, &repofile) < 0) {
+      ret = 1;
+      goto cleanup;
+    }
+  }
+
+  CALLOC(lines, repo_count(), sizeof(uint64_t), ret = 1; goto cleanup);
+
+  ret = generate_mirror(lines);
+  if (ret < 0) {
+    ret = 1;
+    goto cleanup;
+  }
+
+  for (unsigned i = 0; i < repo_count(); ++i) {
+    total += lines[i];
+  }
+
+  if (opts.mirror) {
+    mirror_targets(&targets);
+  } else {
+    synth_targets(&targets, lines[0]);
+  }
+  nqueries = make_queries(queries, &targets, total);
+
+  if (opts.output) {
+    out = fopen(opts.output, "we");
+    if (out == NULL) {
+      fprintf(stderr, "error: failed to open %s: %s\n", opts.output,
+              strerror(errno));
+      ret = 1;
+      goto cleanup;
+    }
+  }
+
+  fputs("{\n  \"pkgfile\": ", out);
+  json_string(out, opts.pkgfile);
+  if (opts.mirror) {
+    fputs(",\n  \"mirror\": {\"file\": ", out);
+    json_string(out, opts.mirror);
+    fprintf(out, ", \"packages\": %" PRIu32 ", \"lines\": %" PRIu64 ",\n",
+            repofile.packages, total);
+    fputs("    \"pkgname\": ", out);
+    json_string(out, targets.pkgname);
+    fputs(", \"binary\": ", out);
+    json_string(out, targets.binary);
+    fputs(", \"file\": ", out);
+    json_string(out, targets.file);
+    fputc('}', out);
+  } else {
+    fprintf(out,
+            ",\n  \"synth\": {\"repos\": %u, \"packages\": %u, \"files\": "
+            "%u, \"depth\": %u, \"seed\": %" PRIu64 ", \"lines\": %" PRIu64
+            "}",
+            opts.synth.repos, opts.synth.packages, opts.synth.files,
+            opts.synth.depth, opts.synth.seed, total);
+  }
+  fprintf(out, ",\n  \"runs\": %u, \"warmup\": %u,\n  \"formats\": [\n",
+          opts.runs, opts.warmup);
+
+  for (const char *spec = opts.formats; *spec;) {
+    size_t len = strcspn(spec, ",");
+
+    if (parse_format(spec, len, &fmt) < 0) {
+      fprintf(stderr, "error: invalid format %.*s\n", (int)len, spec);
+      ret = 1;
+      break;
+    }
+
+    if (spec != opts.formats) {
+      fputs(",\n", out);
+    }
+
+    if (bench_format(out, &fmt, queries, nqueries) < 0) {
+      ret = 1;
+      break;
+    }
+
+    spec += len;
+    spec += *spec == ',';
+  }
+
+  fputs("\n  ]\n}\n", out);
+
+  if (out != stdout && fclose(out) != 0) {
+    fprintf(stderr, "error: failed to write %s: %s\n", opts.output,
+            strerror(errno));
+    ret = 1;
+  }
+
+cleanup:
+  if (!opts.keep) {
+    nftw(workdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  } else {
+    fprintf(stderr, "databases kept in %s\n", workdir);
+  }
+
+  return ret;
+}
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,976 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "httpd.h"
+#include "macro.h"
+#include "run.h"
+
+#define MAX_ARGS 32
+#define MAX_QUERY_ARGS 16
+
+enum {
+  METRIC_P50 = 0,
+  METRIC_P99,
+  METRIC_QPS,
+  METRIC_RSS,
+  METRIC_MINFLT,
+  METRIC_MAJFLT,
+  METRIC_SYSCR,
+  METRIC_SYSCW,
+  NMETRICS
+};
+
+/* A metric has regressed when it's worse than its baseline by more than
+ * threshold percent and by more than slack, which keeps the smallest numbers
+ * from failing on noise alone. A negative threshold never fails. */
+struct metric_t {
+  const char *name;
+  int precision;
+  bool lower_is_worse;
+  double threshold;
+  double slack;
+};
+
+static struct metric_t metrics[NMETRICS] = {
+    [METRIC_P50] = {"p50_ms", 3, false, 10, 0.5},
+    [METRIC_P99] = {"p99_ms", 3, false, 25, 1},
+    [METRIC_QPS] = {"queries_per_sec", 1, true, 10, 0},
+    [METRIC_RSS] = {"peak_rss_kib", 0, false, 10, 512},
+    [METRIC_MINFLT] = {"minor_faults", 0, false, 20, 64},
+    /* as much up to the page cache as to pkgfile */
+    [METRIC_MAJFLT] = {"major_faults", 0, false, -1, 16},
+    [METRIC_SYSCR] = {"read_syscalls", 0, false, 10, 8},
+    [METRIC_SYSCW] = {"write_syscalls", 0, false, 10, 8},
+};
+
+/* One line of the corpus: pkgfile's arguments, split at whitespace, and the
+ * same joined by single spaces to name it in the baseline. */
+struct query_t {
+  char *key;
+  char *buf;
+  const char *args[MAX_QUERY_ARGS + 1];
+};
+
+struct measure_t {
+  double values[NMETRICS];
+  uint64_t lines;
+  uint32_t hash;
+  int status;
+};
+
+/* A measurement, as kept in a baseline: tab separated format, query, metric
+ * and value, a line each. */
+struct record_t {
+  char *format;
+  char *key;
+  char *metric;
+  double value;
+};
+
+struct records_t {
+  struct record_t *v;
+  size_t size;
+  size_t capacity;
+};
+
+static struct {
+  const char *pkgfile;
+  const char *corpus;
+  const char *queryfile;
+  const char *baseline;
+  const char *save;
+  const char *output;
+  const char *formats;
+  const char *workdir;
+  unsigned runs;
+  unsigned warmup;
+  unsigned update_runs;
+  bool check_lines;
+  bool check_hash;
+  bool keep;
+} opts = {
+    .pkgfile = "./pkgfile",
+    .formats = "cpio,flat,compact",
+    .runs = 10,
+    .warmup = 1,
+    .update_runs = 3,
+    .check_lines = true,
+    .check_hash = true,
+};
+
+static char conffile[PATH_MAX];
+static struct records_t baseline, current;
+static unsigned regressions;
+
+static int records_add(struct records_t *r, const char *format,
+                       const char *key, const char *metric, double value) {
+  struct record_t *rec;
+
+  if (r->size == r->capacity) {
+    size_t newsz = MAX(r->capacity * 2, (size_t)64);
+    struct record_t *v = realloc(r->v, newsz * sizeof(struct record_t));
+
+    if (v == NULL) {
+      return -ENOMEM;
+    }
+    r->v = v;
+    r->capacity = newsz;
+  }
+
+  rec = &r->v[r->size];
+  rec->format = strdup(format);
+  rec->key = strdup(key);
+  rec->metric = strdup(metric);
+  rec->value = value;
+  if (rec->format == NULL || rec->key == NULL || rec->metric == NULL) {
+    free(rec->format);
+    free(rec->key);
+    free(rec->metric);
+    return -ENOMEM;
+  }
+  r->size++;
+
+  return 0;
+}
+
+static const double *records_find(const struct records_t *r,
+                                  const char *format, const char *key,
+                                  const char *metric) {
+  for (size_t i = 0; i < r->size; ++i) {
+    const struct record_t *rec = &r->v[i];
+
+    if (strcmp(rec->metric, metric) == 0 && strcmp(rec->key, key) == 0 &&
+        strcmp(rec->format, format) == 0) {
+      return &rec->value;
+    }
+  }
+
+  return NULL;
+}
+
+static void records_free(struct records_t *r) {
+  for (size_t i = 0; i < r->size; ++i) {
+    free(r->v[i].format);
+    free(r->v[i].key);
+    free(r->v[i].metric);
+  }
+  free(r->v);
+}
+
+static int records_load(struct records_t *r, const char *filename) {
+  _cleanup_free_ char *line = NULL;
+  size_t linesz = 0;
+  unsigned lineno = 0;
+  FILE *fp;
+  int ret = 0;
+
+  fp = fopen(filename, "re");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open %s: %s\n", filename,
+            strerror(errno));
+    return -errno;
+  }
+
+  while (ret == 0 && getline(&line, &linesz, fp) > 0) {
+    char *fields[4], *end, *save = NULL;
+    int n = 0;
+
+    lineno++;
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+
+    for (char *f = strtok_r(line, "\t", &save); f && n < 4;
+         f = strtok_r(NULL, "\t", &save)) {
+      fields[n++] = f;
+    }
+
+    errno = 0;
+    if (n < 4 || (strtod(fields[3], &end), errno != 0 || *end != '\0')) {
+      fprintf(stderr, "error: %s:%u: invalid baseline line\n", filename,
+              lineno);
+      ret = -EINVAL;
+      break;
+    }
+
+    ret = records_add(r, fields[0], fields[1], fields[2],
+                      strtod(fields[3], NULL));
+  }
+
+  fclose(fp);
+
+  return ret;
+}
+
+static int records_save(const struct records_t *r, const char *filename) {
+  FILE *fp = fopen(filename, "we");
+
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to create %s: %s\n", filename,
+            strerror(errno));
+    return -errno;
+  }
+
+  fputs("# format\tquery\tmetric\tvalue\n", fp);
+  for (size_t i = 0; i < r->size; ++i) {
+    fprintf(fp, "%s\t%s\t%s\t%.17g\n", r->v[i].format, r->v[i].key,
+            r->v[i].metric, r->v[i].value);
+  }
+
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "error: failed to write %s: %s\n", filename,
+            strerror(errno));
+    return -errno;
+  }
+
+  return 0;
+}
+
+static int query_parse(struct query_t *q, const char *line) {
+  char *save = NULL;
+  size_t keylen = 0;
+  int n = 0;
+
+  q->buf = strdup(line);
+  q->key = malloc(strlen(line) + 1);
+  if (q->buf == NULL || q->key == NULL) {
+    free(q->buf);
+    free(q->key);
+    return -ENOMEM;
+  }
+
+  for (char *arg = strtok_r(q->buf, " \t\n", &save); arg;
+       arg = strtok_r(NULL, " \t\n", &save)) {
+    if (n == MAX_QUERY_ARGS) {
+      free(q->buf);
+      free(q->key);
+      return -E2BIG;
+    }
+
+    q->args[n++] = arg;
+    if (keylen > 0) {
+      q->key[keylen++] = ' ';
+    }
+    memcpy(&q->key[keylen], arg, strlen(arg));
+    keylen += strlen(arg);
+  }
+  q->args[n] = NULL;
+  q->key[keylen] = '\0';
+
+  return n;
+}
+
+static void query_free(struct query_t *q) {
+  free(q->buf);
+  free(q->key);
+}
+
+/* Queries are read a line each, skipping blank lines and those starting with
+ * a #. Arguments can't contain whitespace, as there's no quoting. */
+static int queries_load(const char *filename, struct query_t **queries,
+                        size_t *count) {
+  _cleanup_free_ char *line = NULL;
+  size_t linesz = 0, capacity = 0;
+  unsigned lineno = 0;
+  FILE *fp;
+  int r = 0;
+
+  fp = fopen(filename, "re");
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to open %s: %s\n", filename,
+            strerror(errno));
+    return -errno;
+  }
+
+  *queries = NULL;
+  *count = 0;
+  while (getline(&line, &linesz, fp) > 0) {
+    struct query_t q;
+
+    lineno++;
+    if (line[strspn(line, " \t")] == '#') {
+      continue;
+    }
+
+    r = query_parse(&q, line);
+    if (r == 0) {
+      query_free(&q);
+      continue;
+    }
+    if (r < 0) {
+      fprintf(stderr, "error: %s:%u: %s\n", filename, lineno,
+              r == -E2BIG ? "too many arguments" : strerror(-r));
+      break;
+    }
+    r = 0;
+
+    if (*count == capacity) {
+      size_t newsz = MAX(capacity * 2, (size_t)16);
+      struct query_t *v = realloc(*queries, newsz * sizeof(struct query_t));
+
+      if (v == NULL) {
+        query_free(&q);
+        r = -ENOMEM;
+        break;
+      }
+      *queries = v;
+      capacity = newsz;
+    }
+    (*queries)[(*count)++] = q;
+  }
+
+  fclose(fp);
+
+  if (r == 0 && *count == 0) {
+    fprintf(stderr, "error: %s: no queries\n", filename);
+    r = -EINVAL;
+  }
+
+  return r;
+}
+
+static int is_repofile(const struct dirent *d) {
+  size_t len = strlen(d->d_name);
+
+  return d->d_name[0] != '.' && len > 6 &&
+         strcmp(&d->d_name[len - 6], ".files") == 0;
+}
+
+/* Every repo in the corpus is served from the fixture, in alphabetical
+ * order. */
+static int write_config(const struct httpd_t *httpd) {
+  struct dirent **repos;
+  FILE *conf;
+  int n;
+
+  n = scandir(opts.corpus, &repos, is_repofile, alphasort);
+  if (n < 0) {
+    fprintf(stderr, "error: failed to read %s: %s\n", opts.corpus,
+            strerror(errno));
+    return -errno;
+  }
+  if (n == 0) {
+    fprintf(stderr, "error: %s: no .files databases\n", opts.corpus);
+    free(repos);
+    return -EINVAL;
+  }
+
+  snprintf(conffile, sizeof(conffile), "%s/pacman.conf", opts.workdir);
+  conf = fopen(conffile, "we");
+  if (conf == NULL) {
+    fprintf(stderr, "error: failed to create %s: %s\n", conffile,
+            strerror(errno));
+    n = -errno;
+  } else {
+    fputs("[options]\nArchitecture = auto\n", conf);
+  }
+
+  for (int i = 0; i < n; ++i) {
+    if (conf != NULL) {
+      size_t len = strlen(repos[i]->d_name) - 6;
+
+      fprintf(conf, "\n[%.*s]\nServer = http://127.0.0.1:%u/$repo\n",
+              (int)len, repos[i]->d_name, httpd->port);
+    }
+    free(repos[i]);
+  }
+  free(repos);
+
+  if (conf != NULL && fclose(conf) != 0) {
+    return -errno;
+  }
+
+  return n < 0 ? n : 0;
+}
+
+/* Runs pkgfile with the given arguments after the config and cache options,
+ * and those of the query itself after those. */
+static int run_pkgfile(const char *cachedir, const char *const *pre,
+                       const char *const *args, struct sample_t *sample) {
+  const char *argv[MAX_ARGS] = {opts.pkgfile, "-C", conffile, "--cachedir",
+                                cachedir};
+  int argc = 5;
+
+  for (; *pre && argc < MAX_ARGS - 1; ++pre) {
+    argv[argc++] = *pre;
+  }
+  for (; *args && argc < MAX_ARGS - 1; ++args) {
+    argv[argc++] = *args;
+  }
+  argv[argc] = NULL;
+
+  return run_command(argv, sample);
+}
+
+/* Latencies are taken as percentiles over the runs, the peak RSS as the
+ * highest of them, and each count as its median. */
+static int measure(const char *cachedir, const char *const *pre,
+                   const char *const *args, unsigned warmup, unsigned runs,
+                   struct measure_t *m) {
+  _cleanup_free_ double *v = NULL;
+  struct sample_t sample;
+  double total = 0;
+  int r;
+
+  MALLOC(v, (size_t)NMETRICS * runs * sizeof(double), return -ENOMEM);
+
+  for (unsigned i = 0; i < warmup + runs; ++i) {
+    unsigned j = i - warmup;
+
+    r = run_pkgfile(cachedir, pre, args, &sample);
+    if (r < 0) {
+      fprintf(stderr, "error: failed to run %s: %s\n", opts.pkgfile,
+              strerror(-r));
+      return r;
+    }
+
+    if (i < warmup) {
+      continue;
+    }
+
+    v[METRIC_P50 * runs + j] = sample.latency * 1e3;
+    v[METRIC_RSS * runs + j] = sample.maxrss;
+    v[METRIC_MINFLT * runs + j] = sample.minflt;
+    v[METRIC_MAJFLT * runs + j] = sample.majflt;
+    v[METRIC_SYSCR * runs + j] = sample.syscr;
+    v[METRIC_SYSCW * runs + j] = sample.syscw;
+    total += sample.latency;
+    m->lines = sample.lines;
+    m->hash = sample.hash;
+    m->status = sample.status;
+  }
+
+  for (int i = 0; i < NMETRICS; ++i) {
+    qsort(&v[i * runs], runs, sizeof(double), doublecmp);
+  }
+
+  m->values[METRIC_P50] = percentile(&v[METRIC_P50 * runs], runs, 50);
+  m->values[METRIC_P99] = percentile(&v[METRIC_P50 * runs], runs, 99);
+  m->values[METRIC_QPS] = total > 0 ? runs / total : 0;
+  m->values[METRIC_RSS] = v[METRIC_RSS * runs + runs - 1];
+  for (int i = METRIC_MINFLT; i < NMETRICS; ++i) {
+    m->values[i] = percentile(&v[i * runs], runs, 50);
+  }
+
+  return 0;
+}
+
+/* Checks a measurement against the baseline, and keeps it for the next
+ * one. The output's hash is only checked when hashed is set, as an update
+ * reports how long it took. */
+static int compare(const char *format, const char *key,
+                   const struct measure_t *m, bool hashed) {
+  const double *base;
+  int r;
+
+  base = records_find(&baseline, format, key, "output_lines");
+  if (opts.check_lines && base != NULL && (uint64_t)*base != m->lines) {
+    fprintf(stderr,
+            "regression: %s: %s: output_lines %.0f -> %" PRIu64 "\n",
+            format, key, *base, m->lines);
+    regressions++;
+  }
+
+  r = records_add(&current, format, key, "output_lines", m->lines);
+
+  if (r == 0 && hashed) {
+    base = records_find(&baseline, format, key, "output_hash");
+    if (opts.check_hash && base != NULL && (uint32_t)*base != m->hash) {
+      fprintf(stderr,
+              "regression: %s: %s: output_hash %08" PRIx32 " -> %08" PRIx32
+              "\n",
+              format, key, (uint32_t)*base, m->hash);
+      regressions++;
+    }
+
+    r = records_add(&current, format, key, "output_hash", m->hash);
+  }
+
+  for (int i = 0; r == 0 && i < NMETRICS; ++i) {
+    const struct metric_t *metric = &metrics[i];
+    double value = m->values[i], worse;
+
+    r = records_add(&current, format, key, metric->name, value);
+
+    base = records_find(&baseline, format, key, metric->name);
+    if (base == NULL || metric->threshold < 0) {
+      continue;
+    }
+
+    worse = metric->lower_is_worse ? *base - value : value - *base;
+    if (worse > metric->slack && *base > 0 &&
+        worse / *base * 100 > metric->threshold) {
+      fprintf(stderr,
+              "regression: %s: %s: %s %.*f -> %.*f (%+.1f%%, limit %.0f%%)\n",
+              format, key, metric->name, metric->precision, *base,
+              metric->precision, value, (value - *base) / *base * 100,
+              metric->threshold);
+      regressions++;
+    }
+  }
+
+  return r;
+}
+
+static void report(FILE *out, const char *const *args,
+                   const struct measure_t *m) {
+  fputs("        {\"args\": [", out);
+  for (const char *const *a = args; *a; ++a) {
+    if (a != args) {
+      fputs(", ", out);
+    }
+    json_string(out, *a);
+  }
+  fprintf(out,
+          "], \"status\": %d, \"output_lines\": %" PRIu64
+          ", \"output_hash\": \"%08" PRIx32 "\",\n        ",
+          m->status, m->lines, m->hash);
+  for (int i = 0; i < NMETRICS; ++i) {
+    fprintf(out, "%s\"%s\": %.*f", i > 0 ? ", " : " ", metrics[i].name,
+            metrics[i].precision, m->values[i]);
+  }
+  fputc('}', out);
+}
+
+/* Times a full update over HTTP, one which finds every repo up to date, and
+ * then each query against what the update repacked. */
+static int regress_format(FILE *out, const char *spec,
+                          const struct query_t *queries, size_t nqueries) {
+  char cachedir[PATH_MAX], dbformat[32], compress[64], name[64];
+  const char *full[] = {"-uu", "-F", dbformat, NULL, NULL};
+  const char *noop[] = {"-u", "-F", dbformat, NULL, NULL};
+  const char *query[] = {"--query-cache=0", NULL};
+  const char *none[] = {NULL};
+  const char *colon = strchr(spec, ':');
+  struct measure_t m;
+  int r;
+
+  if (strlen(spec) >= sizeof(name)) {
+    return -ENAMETOOLONG;
+  }
+
+  /* the name doubles as the cache directory's suffix */
+  snprintf(name, sizeof(name), "%s", spec);
+  snprintf(dbformat, sizeof(dbformat), "%.*s",
+           colon ? (int)(colon - spec) : (int)strlen(spec), spec);
+  if (colon) {
+    snprintf(compress, sizeof(compress), "--compress=%s", colon + 1);
+    full[3] = noop[3] = compress;
+    name[colon - spec] = '-';
+  }
+
+  snprintf(cachedir, sizeof(cachedir), "%s/cache-%s", opts.workdir, name);
+  if (mkdir(cachedir, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "error: failed to create %s: %s\n", cachedir,
+            strerror(errno));
+    return -errno;
+  }
+
+  fputs("    {\"format\": ", out);
+  json_string(out, spec);
+  fputs(",\n     \"updates\": [\n", out);
+
+  for (int i = 0; i < 2; ++i) {
+    const char *const *args = i == 0 ? full : noop;
+
+    r = measure(cachedir, none, args, 0, opts.update_runs, &m);
+    if (r < 0) {
+      return r;
+    }
+    if (m.status != 0) {
+      fprintf(stderr, "error: %s: update failed with status %d\n", spec,
+              m.status);
+      return -EIO;
+    }
+
+    report(out, args, &m);
+    fputs(i == 0 ? ",\n" : "\n", out);
+
+    /* the format is already part of the baseline's key */
+    r = compare(spec, args[0], &m, false);
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  fputs("     ],\n     \"queries\": [\n", out);
+
+  for (size_t i = 0; i < nqueries; ++i) {
+    r = measure(cachedir, query, queries[i].args, opts.warmup, opts.runs, &m);
+    if (r < 0) {
+      return r;
+    }
+
+    report(out, queries[i].args, &m);
+    fputs(i + 1 < nqueries ? ",\n" : "\n", out);
+
+    r = compare(spec, queries[i].key, &m, true);
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  fputs("     ]}", out);
+
+  return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st UNUSED,
+                        int type UNUSED, struct FTW *ftw UNUSED) {
+  return remove(path);
+}
+
+static void usage(void) {
+  fputs(
+      "Usage: pkgfile-regress [options] --corpus <dir>\n\n"
+      "  -c, --corpus <dir>      the .files databases to serve, and by "
+      "default\n"
+      "                          the queries file\n"
+      "  -q, --queries <file>    the queries to replay, one per line "
+      "(default:\n"
+      "                          <corpus>/queries)\n"
+      "  -b, --baseline <file>   fail on regressions from a saved baseline\n"
+      "  -s, --save <file>       save this run as a baseline\n"
+      "  -t, --threshold <metric>=<percent>\n"
+      "                          how much worse a metric may get, or none\n"
+      "  -p, --pkgfile <path>    the pkgfile to test (default: ./pkgfile)\n"
+      "  -F, --formats <list>    formats to test (default: "
+      "cpio,flat,compact)\n"
+      "  -n, --runs <n>          timed runs of each query (default: 10)\n"
+      "  -W, --warmup <n>        untimed runs of each query (default: 1)\n"
+      "  -U, --update-runs <n>   timed runs of each update (default: 3)\n"
+      "  -o, --output <file>     write the JSON report to a file\n"
+      "  -w, --workdir <dir>     repack databases in an existing directory\n"
+      "                          and keep them\n"
+      "  -k, --keep              keep the repacked databases\n"
+      "  -h, --help              display this help and exit\n\n"
+      "Metrics, and how much worse than the baseline they may get by "
+      "default:\n",
+      stdout);
+  fputs("  output_lines            0%\n"
+        "  output_hash             0%\n",
+        stdout);
+  for (int i = 0; i < NMETRICS; ++i) {
+    if (metrics[i].threshold < 0) {
+      printf("  %-23s none\n", metrics[i].name);
+    } else {
+      printf("  %-23s %.0f%%\n", metrics[i].name, metrics[i].threshold);
+    }
+  }
+}
+
+static int parse_uint(const char *arg, unsigned min, unsigned max,
+                      unsigned *v) {
+  unsigned long n;
+  char *end;
+
+  errno = 0;
+  n = strtoul(arg, &end, 10);
+  if (errno != 0 || *end != '\0' || end == arg || n < min || n > max) {
+    fprintf(stderr, "error: invalid number %s (must be %u to %u)\n", arg, min,
+            max);
+    return -EINVAL;
+  }
+
+  *v = n;
+
+  return 0;
+}
+
+static int parse_threshold(const char *arg) {
+  const char *eq = strchr(arg, '=');
+  size_t len = eq ? (size_t)(eq - arg) : 0;
+  bool none = eq && strcmp(eq + 1, "none") == 0;
+  double threshold = 0;
+  char *end;
+
+  if (eq && !none) {
+    errno = 0;
+    threshold = strtod(eq + 1, &end);
+    if (errno != 0 || *end != '\0' || end == eq + 1 || threshold < 0) {
+      eq = NULL;
+    }
+  }
+
+  if (eq != NULL) {
+    if (len == 12 && memcmp(arg, "output_lines", len) == 0) {
+      opts.check_lines = !none;
+      return 0;
+    }
+    if (len == 11 && memcmp(arg, "output_hash", len) == 0) {
+      opts.check_hash = !none;
+      return 0;
+    }
+
+    for (int i = 0; i < NMETRICS; ++i) {
+      if (strlen(metrics[i].name) == len &&
+          memcmp(metrics[i].name, arg, len) == 0) {
+        metrics[i].threshold = none ? -1 : threshold;
+        return 0;
+      }
+    }
+  }
+
+  fprintf(stderr, "error: invalid threshold %s\n", arg);
+  return -EINVAL;
+}
+
+static int parse_opts(int argc, char **argv) {
+  static const char *shortopts = "b:c:F:hkn:o:p:q:s:t:U:W:w:";
+  static const struct option longopts[] = {
+      {"baseline", required_argument, 0, 'b'},
+      {"corpus", required_argument, 0, 'c'},
+      {"formats", required_argument, 0, 'F'},
+      {"help", no_argument, 0, 'h'},
+      {"keep", no_argument, 0, 'k'},
+      {"runs", required_argument, 0, 'n'},
+      {"output", required_argument, 0, 'o'},
+      {"pkgfile", required_argument, 0, 'p'},
+      {"queries", required_argument, 0, 'q'},
+      {"save", required_argument, 0, 's'},
+      {"threshold", required_argument, 0, 't'},
+      {"update-runs", required_argument, 0, 'U'},
+      {"warmup", required_argument, 0, 'W'},
+      {"workdir", required_argument, 0, 'w'},
+      {0, 0, 0, 0}};
+  int opt, r = 0;
+
+  while (r == 0 &&
+         (opt = getopt_long(argc, argv, shortopts, longopts, NULL)) >= 0) {
+    switch (opt) {
+      case 'b':
+        opts.baseline = optarg;
+        break;
+      case 'c':
+        opts.corpus = optarg;
+        break;
+      case 'F':
+        opts.formats = optarg;
+        break;
+      case 'h':
+        usage();
+        return -1;
+      case 'k':
+        opts.keep = true;
+        break;
+      case 'n':
+        r = parse_uint(optarg, 1, 100000, &opts.runs);
+        break;
+      case 'o':
+        opts.output = optarg;
+        break;
+      case 'p':
+        opts.pkgfile = optarg;
+        break;
+      case 'q':
+        opts.queryfile = optarg;
+        break;
+      case 's':
+        opts.save = optarg;
+        break;
+      case 't':
+        r = parse_threshold(optarg);
+        break;
+      case 'U':
+        r = parse_uint(optarg, 1, 1000, &opts.update_runs);
+        break;
+      case 'W':
+        r = parse_uint(optarg, 0, 100000, &opts.warmup);
+        break;
+      case 'w':
+        /* never clean up a directory we didn't create */
+        opts.workdir = optarg;
+        opts.keep = true;
+        break;
+      default:
+        return 1;
+    }
+  }
+
+  if (r != 0) {
+    return 1;
+  }
+
+  if (optind < argc) {
+    fprintf(stderr, "error: unexpected argument %s\n", argv[optind]);
+    return 1;
+  }
+
+  if (opts.corpus == NULL) {
+    fputs("error: no corpus given\n", stderr);
+    return 1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char workdir[PATH_MAX], queryfile[PATH_MAX];
+  struct query_t *queries = NULL;
+  struct httpd_t httpd = {};
+  size_t nqueries = 0;
+  FILE *out = stdout;
+  int ret;
+
+  ret = parse_opts(argc, argv);
+  if (ret != 0) {
+    return ret < 0 ? 0 : 2;
+  }
+
+  if (opts.queryfile == NULL) {
+    snprintf(queryfile, sizeof(queryfile), "%s/queries", opts.corpus);
+    opts.queryfile = queryfile;
+  }
+
+  if (queries_load(opts.queryfile, &queries, &nqueries) < 0 ||
+      (opts.baseline && records_load(&baseline, opts.baseline) < 0)) {
+    ret = 1;
+    goto done;
+  }
+
+  if (opts.workdir == NULL) {
+    const char *tmpdir = getenv("TMPDIR");
+
+    snprintf(workdir, sizeof(workdir), "%s/pkgfile-regress-XXXXXX",
+             tmpdir ? tmpdir : "/tmp");
+    if (mkdtemp(workdir) == NULL) {
+      fprintf(stderr, "error: failed to create %s: %s\n", workdir,
+              strerror(errno));
+      ret = 1;
+      goto done;
+    }
+  } else if (realpath(opts.workdir, workdir) == NULL) {
+    fprintf(stderr, "error: invalid workdir %s: %s\n", opts.workdir,
+            strerror(errno));
+    ret = 1;
+    goto done;
+  }
+  opts.workdir = workdir;
+
+  ret = httpd_start(&httpd, opts.corpus);
+  if (ret < 0) {
+    fprintf(stderr, "error: failed to serve %s: %s\n", opts.corpus,
+            strerror(-ret));
+    ret = 1;
+    goto cleanup;
+  }
+
+  if (write_config(&httpd) < 0) {
+    ret = 1;
+    goto cleanup;
+  }
+
+  if (opts.output) {
+    out = fopen(opts.output, "we");
+    if (out == NULL) {
+      fprintf(stderr, "error: failed to open %s: %s\n", opts.output,
+              strerror(errno));
+      ret = 1;
+      goto cleanup;
+    }
+  }
+
+  fputs("{\n  \"pkgfile\": ", out);
+  json_string(out, opts.pkgfile);
+  fputs(", \"corpus\": ", out);
+  json_string(out, opts.corpus);
+  fprintf(out,
+          ",\n  \"queries\": %zu, \"runs\": %u, \"warmup\": %u, "
+          "\"update_runs\": %u,\n  \"formats\": [\n",
+          nqueries, opts.runs, opts.warmup, opts.update_runs);
+
+  for (const char *spec = opts.formats; *spec;) {
+    size_t len = strcspn(spec, ",");
+    char format[64];
+
+    if (len == 0 || len >= sizeof(format)) {
+      fprintf(stderr, "error: invalid format %.*s\n", (int)len, spec);
+      ret = 1;
+      break;
+    }
+    memcpy(format, spec, len);
+    format[len] = '\0';
+
+    if (spec != opts.formats) {
+      fputs(",\n", out);
+    }
+
+    if (regress_format(out, format, queries, nqueries) < 0) {
+      ret = 1;
+      break;
+    }
+
+    spec += len;
+    spec += *spec == ',';
+  }
+
+  fprintf(out, "\n  ],\n  \"regressions\": %u\n}\n", regressions);
+
+  if (out != stdout && fclose(out) != 0) {
+    fprintf(stderr, "error: failed to write %s: %s\n", opts.output,
+            strerror(errno));
+    ret = 1;
+  }
+
+  if (ret == 0 && opts.save && records_save(&current, opts.save) < 0) {
+    ret = 1;
+  }
+
+  if (ret == 0 && regressions > 0) {
+    fprintf(stderr, "%u regressions from %s\n", regressions, opts.baseline);
+    ret = 1;
+  }
+
+cleanup:
+  httpd_stop(&httpd);
+  if (!opts.keep) {
+    nftw(workdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  } else {
+    fprintf(stderr, "databases kept in %s\n", workdir);
+  }
+
+done:
+  for (size_t i = 0; i < nqueries; ++i) {
+    query_free(&queries[i]);
+  }
+  free(queries);
+  records_free(&baseline);
+  records_free(&current);
+
+  return ret;
+}
+
+/* vim: set ts=2 sw=2 et: */
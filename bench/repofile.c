@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+#include "repofile.h"
+
+/* basenames of the middle package's files, counted in the packages after it */
+#define MAX_CANDIDATES 32
+
+struct candidate_t {
+  char *name;
+  size_t len;
+  uint64_t count;
+};
+
+static struct archive *repofile_open(const char *filename) {
+  struct archive *a = archive_read_new();
+
+  if (a == NULL) {
+    return NULL;
+  }
+
+  archive_read_support_format_tar(a);
+  archive_read_support_filter_all(a);
+  if (archive_read_open_filename(a, filename, 64 * 1024) != ARCHIVE_OK) {
+    fprintf(stderr, "error: failed to open %s: %s\n", filename,
+            archive_error_string(a));
+    archive_read_free(a);
+    return NULL;
+  }
+
+  return a;
+}
+
+static bool is_files_entry(struct archive_entry *ae) {
+  const char *name = archive_entry_pathname(ae);
+  size_t len = strlen(name);
+
+  return len > 6 && strcmp(&name[len - 6], "/files") == 0;
+}
+
+/* Reads all of an entry, NUL terminated. */
+static char *read_entry(struct archive *a, struct archive_entry *ae,
+                        size_t *len) {
+  la_int64_t size = archive_entry_size(ae);
+  char *buf;
+
+  if (size < 0) {
+    return NULL;
+  }
+
+  MALLOC(buf, size + 1, return NULL);
+  if (archive_read_data(a, buf, size) != size) {
+    free(buf);
+    return NULL;
+  }
+  buf[size] = '\0';
+  *len = size;
+
+  return buf;
+}
+
+/* Calls fn with the basename of each file in the entry, skipping the
+ * %FILES% header and directories. */
+static void foreach_basename(char *files,
+                             void (*fn)(const char *path, const char *base,
+                                        size_t len, void *data),
+                             void *data) {
+  char *saveptr = NULL;
+
+  for (char *line = strtok_r(files, "\n", &saveptr); line != NULL;
+       line = strtok_r(NULL, "\n", &saveptr)) {
+    size_t len = strlen(line);
+    const char *base;
+
+    if (line[0] == '%' || line[len - 1] == '/') {
+      continue;
+    }
+
+    base = strrchr(line, '/');
+    base = base ? base + 1 : line;
+    fn(line, base, len - (base - line), data);
+  }
+}
+
+static uint64_t count_lines(const char *files, size_t len) {
+  uint64_t lines = 0;
+
+  for (const char *p = files; (p = memchr(p, '\n', files + len - p)); ++p) {
+    lines++;
+  }
+
+  /* the %FILES% header isn't a file */
+  return lines > 0 ? lines - 1 : 0;
+}
+
+struct middle_t {
+  struct repofile_t *rf;
+  struct candidate_t candidates[MAX_CANDIDATES];
+  unsigned ncandidates;
+};
+
+static void add_candidate(const char *path, const char *base, size_t len,
+                          void *data) {
+  struct middle_t *m = data;
+  struct candidate_t *c;
+
+  if (m->rf->binary[0] == '\0' &&
+      (strstr(path, "bin/") != NULL && strchr(base, '.') == NULL)) {
+    snprintf(m->rf->binary, sizeof(m->rf->binary), "%s", base);
+  }
+
+  if (m->ncandidates == MAX_CANDIDATES) {
+    return;
+  }
+
+  c = &m->candidates[m->ncandidates];
+  c->name = strndup(base, len);
+  if (c->name != NULL) {
+    c->len = len;
+    c->count = 0;
+    m->ncandidates++;
+  }
+}
+
+static void count_candidates(const char *path UNUSED, const char *base,
+                             size_t len, void *data) {
+  struct middle_t *m = data;
+
+  for (unsigned i = 0; i < m->ncandidates; ++i) {
+    if (m->candidates[i].len == len &&
+        memcmp(m->candidates[i].name, base, len) == 0) {
+      m->candidates[i].count++;
+    }
+  }
+}
+
+/* $pkgname-$pkgver-$pkgrel/files, less everything from the version on */
+static void entry_pkgname(const char *entryname, char *buf, size_t size) {
+  char *dash;
+
+  snprintf(buf, size, "%s", entryname);
+  *strrchr(buf, '/') = '\0';
+  for (int i = 0; i < 2 && (dash = strrchr(buf, '-')) != NULL; ++i) {
+    *dash = '\0';
+  }
+}
+
+static int scan_middle(const char *filename, struct middle_t *m) {
+  struct repofile_t *rf = m->rf;
+  struct archive_entry *ae;
+  struct archive *a;
+  uint32_t pkg = 0;
+  int r = 0;
+
+  a = repofile_open(filename);
+  if (a == NULL) {
+    return -EIO;
+  }
+
+  while (r == 0 && archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+    _cleanup_free_ char *files = NULL;
+    size_t len;
+
+    if (!is_files_entry(ae) || pkg++ < rf->packages / 2) {
+      continue;
+    }
+
+    files = read_entry(a, ae, &len);
+    if (files == NULL) {
+      r = -EIO;
+      break;
+    }
+
+    if (pkg == rf->packages / 2 + 1) {
+      entry_pkgname(archive_entry_pathname(ae), rf->pkgname,
+                    sizeof(rf->pkgname));
+      foreach_basename(files, add_candidate, m);
+    } else {
+      foreach_basename(files, count_candidates, m);
+    }
+  }
+
+  archive_read_free(a);
+
+  return r;
+}
+
+int repofile_scan(const char *filename, struct repofile_t *rf) {
+  struct middle_t m = {.rf = rf};
+  struct archive_entry *ae;
+  struct archive *a;
+  const char *base;
+  int r = 0;
+
+  memset(rf, 0, sizeof(*rf));
+
+  /* the repo is named for its file, as it would be on a mirror */
+  base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  snprintf(rf->repo, sizeof(rf->repo), "%.*s", (int)strcspn(base, "."), base);
+
+  /* the first pass finds out how big the repo is... */
+  a = repofile_open(filename);
+  if (a == NULL) {
+    return -EIO;
+  }
+
+  while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+    _cleanup_free_ char *files = NULL;
+    size_t len;
+
+    if (!is_files_entry(ae)) {
+      continue;
+    }
+
+    files = read_entry(a, ae, &len);
+    if (files == NULL) {
+      r = -EIO;
+      break;
+    }
+
+    rf->packages++;
+    rf->lines += count_lines(files, len);
+  }
+  archive_read_free(a);
+
+  if (r == 0 && rf->packages == 0) {
+    fprintf(stderr, "error: no packages found in %s\n", filename);
+    r = -EINVAL;
+  }
+
+  /* ...and the second picks the targets out of it */
+  if (r == 0) {
+    r = scan_middle(filename, &m);
+  }
+
+  if (r == 0 && m.ncandidates == 0) {
+    fprintf(stderr, "error: the package %s in %s has no files\n", rf->pkgname,
+            filename);
+    r = -EINVAL;
+  }
+
+  if (r == 0) {
+    struct candidate_t *best = &m.candidates[0];
+
+    for (unsigned i = 1; i < m.ncandidates; ++i) {
+      if (m.candidates[i].count > best->count) {
+        best = &m.candidates[i];
+      }
+    }
+    snprintf(rf->file, sizeof(rf->file), "%s", best->name);
+
+    if (rf->binary[0] == '\0') {
+      snprintf(rf->binary, sizeof(rf->binary), "%s", m.candidates[0].name);
+    }
+  }
+
+  for (unsigned i = 0; i < m.ncandidates; ++i) {
+    free(m.candidates[i].name);
+  }
+
+  return r;
+}
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "run.h"
+
+/* 32 bit FNV-1a, whose hashes are kept exactly in a baseline's doubles */
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(out, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(out, "\\u%04x", *s);
+    } else {
+      fputc(*s, out);
+    }
+  }
+  fputc('"', out);
+}
+
+int doublecmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+double percentile(const double *v, unsigned n, double p) {
+  unsigned rank = (unsigned)ceil(p / 100 * n);
+
+  return v[rank > 0 ? rank - 1 : 0];
+}
+
+/* The kernel keeps a process's I/O accounting until it's reaped, so it's
+ * read while the process is still a zombie. */
+static void read_io(pid_t pid, struct sample_t *sample) {
+  char path[64], line[128];
+  FILE *fp;
+
+  sample->syscr = sample->syscw = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+  fp = fopen(path, "re");
+  if (fp == NULL) {
+    return;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    sscanf(line, "syscr: %" SCNu64, &sample->syscr);
+    sscanf(line, "syscw: %" SCNu64, &sample->syscw);
+  }
+  fclose(fp);
+}
+
+int run_command(const char *const *argv, struct sample_t *sample) {
+  struct rusage ru;
+  char buf[BUFSIZ];
+  double t_start;
+  int pipefd[2], status;
+  siginfo_t info;
+  ssize_t n;
+  pid_t pid;
+
+  if (pipe2(pipefd, O_CLOEXEC) < 0) {
+    return -errno;
+  }
+
+  sample->lines = 0;
+  sample->hash = FNV_OFFSET_BASIS;
+  t_start = now();
+
+  pid = fork();
+  if (pid < 0) {
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return -errno;
+  }
+
+  if (pid == 0) {
+    dup2(pipefd[1], STDOUT_FILENO);
+    execv(argv[0], (char *const *)argv);
+    fprintf(stderr, "error: failed to execute %s: %s\n", argv[0],
+            strerror(errno));
+    _exit(127);
+  }
+
+  close(pipefd[1]);
+  while ((n = read(pipefd[0], buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (char *p = buf; (p = memchr(p, '\n', n - (p - buf))); ++p) {
+      sample->lines++;
+    }
+    for (ssize_t i = 0; i < n; ++i) {
+      sample->hash = (sample->hash ^ (unsigned char)buf[i]) * FNV_PRIME;
+    }
+  }
+  close(pipefd[0]);
+
+  while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0) {
+    if (errno != EINTR) {
+      return -errno;
+    }
+  }
+  sample->latency = now() - t_start;
+  read_io(pid, sample);
+
+  while (wait4(pid, &status, 0, &ru) < 0) {
+    if (errno != EINTR) {
+      return -errno;
+    }
+  }
+
+  sample->maxrss = ru.ru_maxrss;
+  sample->minflt = ru.ru_minflt;
+  sample->majflt = ru.ru_majflt;
+  sample->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+
+  return 0;
+}
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* What a single run of a command cost it. Page faults and I/O syscalls are
+ * the kernel's counts for the command alone, not for anything it ran. */
+struct sample_t {
+  double latency;
+  uint64_t lines;
+  uint32_t hash;
+  long maxrss;
+  long minflt;
+  long majflt;
+  uint64_t syscr;
+  uint64_t syscw;
+  int status;
+};
+
+double now(void);
+void json_string(FILE *out, const char *s);
+int doublecmp(const void *a, const void *b);
+
+/* nearest rank, over sorted values */
+double percentile(const double *v, unsigned n, double p);
+
+/* Runs argv[0], which must be a path, counting the lines it writes to
+ * stdout and taking their FNV-1a hash. */
+int run_command(const char *const *argv, struct sample_t *sample);
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "macro.h"
+#include "synth.h"
+
+#define SYNTH_PKGVER "1.0-1"
+
+/* files are spread over a fixed vocabulary of directory names, so that like a
+ * real repo, most directory prefixes are shared by many packages */
+static const char *components[] = {
+    "lib",     "share",   "include", "doc",     "locale",
+    "python3", "site",    "modules", "plugins", "data",
+    "icons",   "hicolor", "apps",    "man",     "man1",
+    "gnu",     "qt6",     "gtk-4.0", "cmake",   "locale-langpack",
+};
+
+static const char *suffixes[] = {
+    ".so", ".py", ".h", ".png", ".txt", ".1.gz",
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void synth_repo_name(unsigned repo, char *buf, size_t size) {
+  snprintf(buf, size, "synth%u", repo);
+}
+
+void synth_pkg_name(unsigned repo, unsigned pkg, char *buf, size_t size) {
+  snprintf(buf, size, "synth%u-pkg%05u", repo, pkg);
+}
+
+size_t synth_file_path(const struct synth_config_t *cfg, unsigned repo,
+                       unsigned pkg, unsigned file, char *buf, size_t size) {
+  char pkgname[64];
+  uint64_t state;
+  size_t len;
+
+  /* every eighth file is a binary, named after its package so that it's
+   * unique across all repos */
+  if (file % 8 == 0) {
+    synth_pkg_name(repo, pkg, pkgname, sizeof(pkgname));
+    return snprintf(buf, size, "usr/bin/%s-%u", pkgname, file / 8);
+  }
+
+  /* runs of four files share a directory */
+  state = cfg->seed ^ ((uint64_t)repo << 48) ^ ((uint64_t)pkg << 20) ^
+          (file / 4);
+
+  len = snprintf(buf, size, "usr/");
+  for (unsigned d = 2; d < cfg->depth && len < size; ++d) {
+    const char *c = components[splitmix64(&state) % ARRAY_SIZE(components)];
+    len += snprintf(buf + len, size - len, "%s/", c);
+  }
+
+  if (len < size) {
+    len += snprintf(buf + len, size - len, "file%u%s", file,
+                    suffixes[file % ARRAY_SIZE(suffixes)]);
+  }
+
+  return MIN(len, size - 1);
+}
+
+static int linecmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int write_member(struct archive *a, const char *name, const char *data,
+                        size_t size) {
+  struct archive_entry *ae = archive_entry_new();
+  int r;
+
+  archive_entry_set_pathname(ae, name);
+  archive_entry_set_filetype(ae, AE_IFREG);
+  archive_entry_set_perm(ae, 0644);
+  archive_entry_set_size(ae, size);
+
+  r = archive_write_header(a, ae);
+  if (r == ARCHIVE_OK && archive_write_data(a, data, size) != (ssize_t)size) {
+    r = ARCHIVE_FATAL;
+  }
+
+  archive_entry_free(ae);
+
+  return r == ARCHIVE_OK ? 0 : -EIO;
+}
+
+/* Collects a package's paths along with every directory leading up to them,
+ * sorted and without duplicates, the way repo-add lists them. */
+static int pkg_lines(const struct synth_config_t *cfg, unsigned repo,
+                     unsigned pkg, char ***lines, size_t *count) {
+  size_t n = 0, capacity = (size_t)cfg->files * MAX(cfg->depth, 3u);
+  char **v;
+
+  CALLOC(v, capacity, sizeof(char *), return -ENOMEM);
+
+  for (unsigned f = 0; f < cfg->files; ++f) {
+    char path[PATH_MAX];
+    size_t len = synth_file_path(cfg, repo, pkg, f, path, sizeof(path));
+
+    for (char *slash = path; (slash = memchr(slash, '/', len - (slash - path)));
+         ++slash) {
+      v[n++] = strndup(path, slash + 1 - path);
+    }
+    v[n++] = strndup(path, len);
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (v[i] == NULL) {
+      for (size_t j = 0; j < n; ++j) {
+        free(v[j]);
+      }
+      free(v);
+      return -ENOMEM;
+    }
+  }
+
+  qsort(v, n, sizeof(char *), linecmp);
+
+  *count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (*count > 0 && strcmp(v[*count - 1], v[i]) == 0) {
+      free(v[i]);
+      continue;
+    }
+    v[(*count)++] = v[i];
+  }
+
+  *lines = v;
+
+  return 0;
+}
+
+static int write_pkg(const struct synth_config_t *cfg, struct archive *a,
+                     unsigned repo, unsigned pkg, uint64_t *lines) {
+  char pkgname[64], desc[256], entry[PATH_MAX];
+  _cleanup_free_ char *buf = NULL;
+  char **v = NULL;
+  size_t count = 0, size = 0;
+  FILE *stream;
+  int r;
+
+  synth_pkg_name(repo, pkg, pkgname, sizeof(pkgname));
+
+  snprintf(entry, sizeof(entry), "%s-" SYNTH_PKGVER "/desc", pkgname);
+  r = snprintf(desc, sizeof(desc),
+               "%%NAME%%\n%s\n\n%%VERSION%%\n" SYNTH_PKGVER "\n\n", pkgname);
+  r = write_member(a, entry, desc, r);
+  if (r < 0) {
+    return r;
+  }
+
+  r = pkg_lines(cfg, repo, pkg, &v, &count);
+  if (r < 0) {
+    return r;
+  }
+
+  stream = open_memstream(&buf, &size);
+  if (stream == NULL) {
+    r = -errno;
+  } else {
+    fputs("%FILES%\n", stream);
+    for (size_t i = 0; i < count; ++i) {
+      fprintf(stream, "%s\n", v[i]);
+    }
+    fclose(stream);
+
+    snprintf(entry, sizeof(entry), "%s-" SYNTH_PKGVER "/files", pkgname);
+    r = write_member(a, entry, buf, size);
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    free(v[i]);
+  }
+  free(v);
+
+  *lines += count;
+
+  return r;
+}
+
+int synth_write_repo(const struct synth_config_t *cfg, unsigned repo,
+                     const char *filename, uint64_t *lines) {
+  struct archive *a;
+  int r = 0;
+
+  *lines = 0;
+
+  /* mirrors serve gzipped tarballs */
+  a = archive_write_new();
+  if (a == NULL) {
+    return -ENOMEM;
+  }
+  archive_write_set_format_pax_restricted(a);
+  archive_write_add_filter_gzip(a);
+
+  if (archive_write_open_filename(a, filename) != ARCHIVE_OK) {
+    fprintf(stderr, "error: failed to open %s: %s\n", filename,
+            archive_error_string(a));
+    archive_write_free(a);
+    return -EIO;
+  }
+
+  for (unsigned pkg = 0; pkg < cfg->packages && r == 0; ++pkg) {
+    r = write_pkg(cfg, a, repo, pkg, lines);
+  }
+
+  if (archive_write_close(a) != ARCHIVE_OK && r == 0) {
+    r = -EIO;
+  }
+  archive_write_free(a);
+
+  return r;
+}
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Parameters of a synthetic repo, as served by a mirror. Every repo holds
+ * the same number of packages, and every package the same number of files,
+ * each of them depth path components deep. */
+struct synth_config_t {
+  unsigned repos;
+  unsigned packages;
+  unsigned files;
+  unsigned depth;
+  uint64_t seed;
+};
+
+void synth_repo_name(unsigned repo, char *buf, size_t size);
+void synth_pkg_name(unsigned repo, unsigned pkg, char *buf, size_t size);
+size_t synth_file_path(const struct synth_config_t *cfg, unsigned repo,
+                       unsigned pkg, unsigned file, char *buf, size_t size);
+
+int synth_write_repo(const struct synth_config_t *cfg, unsigned repo,
+                     const char *filename, uint64_t *lines);
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include "batch.h"
+#include "index.h"
+#include "macro.h"
+#include "util.h"
+
+static uint32_t key_hash(const char *key, size_t len, bool icase) {
+  uint32_t hash = 2166136261u;
+
+  if (!icase) {
+    return fnv1a_hash(key, len);
+  }
+
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)tolower((unsigned char)key[i]);
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static bool key_equal(const struct batch_t *b, const struct batch_target_t *t,
+                      const char *key, size_t keylen) {
+  if (t->keylen != keylen) {
+    return false;
+  }
+
+  return b->icase ? strncasecmp(t->key, key, keylen) == 0
+                  : memcmp(t->key, key, keylen) == 0;
+}
+
+int batch_add(struct batch_t *b, const char *target, size_t len) {
+  struct batch_target_t *t;
+
+  if (b->ntargets == b->capacity) {
+    uint32_t newsz = b->capacity ? b->capacity * 2 : 64;
+    struct batch_target_t *newtargets =
+        realloc(b->targets, newsz * sizeof(struct batch_target_t));
+    if (newtargets == NULL) {
+      return -ENOMEM;
+    }
+    b->targets = newtargets;
+    b->capacity = newsz;
+  }
+
+  t = &b->targets[b->ntargets];
+  memset(t, 0, sizeof(*t));
+
+  t->target = strndup(target, len);
+  if (t->target == NULL) {
+    return -ENOMEM;
+  }
+  t->len = len;
+  t->next = BATCH_NO_TARGET;
+
+  b->ntargets++;
+
+  return 0;
+}
+
+int batch_read(struct batch_t *b, FILE *fp) {
+  _cleanup_free_ char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+
+  /* targets may be separated by newlines or NULs */
+  while ((len = getdelim(&line, &size, '\n', fp)) >= 0) {
+    char *p = line, *end = line + len;
+
+    while (p < end) {
+      char *eol = memchr(p, '\0', end - p);
+      size_t n = (eol ? eol : end) - p;
+      int r;
+
+      if (n > 0 && p[n - 1] == '\n') {
+        n--;
+      }
+
+      if (n > 0) {
+        r = batch_add(b, p, n);
+        if (r < 0) {
+          return r;
+        }
+      }
+
+      p += n + 1;
+    }
+  }
+
+  return ferror(fp) ? -EIO : 0;
+}
+
+int batch_build(struct batch_t *b, bool icase) {
+  uint32_t nbuckets = 1;
+
+  while (nbuckets < b->ntargets * 2) {
+    nbuckets <<= 1;
+  }
+
+  free(b->buckets);
+  MALLOC(b->buckets, nbuckets * sizeof(uint32_t), return -ENOMEM);
+  memset(b->buckets, 0xff, nbuckets * sizeof(uint32_t));
+  b->nbuckets = nbuckets;
+  b->icase = icase;
+
+  /* chain in reverse, so that targets come out in the order they were given */
+  for (uint32_t i = b->ntargets; i-- > 0;) {
+    struct batch_target_t *t = &b->targets[i];
+    uint32_t bucket;
+
+    t->keylen = t->len;
+    t->key = index_basename(t->target, &t->keylen);
+    t->hash = key_hash(t->key, t->keylen, icase);
+    t->fullpath = memchr(t->target, '/', t->len) != NULL;
+
+    bucket = t->hash & (nbuckets - 1);
+    t->next = b->buckets[bucket];
+    b->buckets[bucket] = i;
+  }
+
+  return 0;
+}
+
+static uint32_t batch_chain(const struct batch_t *b, uint32_t id,
+                            uint32_t hash, const char *key, size_t keylen) {
+  while (id != BATCH_NO_TARGET) {
+    const struct batch_target_t *t = &b->targets[id];
+
+    if (t->hash == hash && key_equal(b, t, key, keylen)) {
+      return id;
+    }
+    id = t->next;
+  }
+
+  return BATCH_NO_TARGET;
+}
+
+uint32_t batch_first(const struct batch_t *b, const char *key, size_t keylen) {
+  uint32_t hash = key_hash(key, keylen, b->icase);
+
+  return batch_chain(b, b->buckets[hash & (b->nbuckets - 1)], hash, key,
+                     keylen);
+}
+
+uint32_t batch_next(const struct batch_t *b, uint32_t id, const char *key,
+                    size_t keylen) {
+  return batch_chain(b, b->targets[id].next, b->targets[id].hash, key, keylen);
+}
+
+void batch_free(struct batch_t *b, void (*filterfree)(filterpattern_t *)) {
+  for (uint32_t i = 0; i < b->ntargets; ++i) {
+    if (filterfree) {
+      filterfree(&b->targets[i].filter);
+    }
+    free(b->targets[i].literal);
+    free(b->targets[i].target);
+  }
+
+  free(b->targets);
+  free(b->buckets);
+  memset(b, 0, sizeof(*b));
+}
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pkgfile.h"
+
+#define BATCH_NO_TARGET UINT32_MAX
+
+struct batch_target_t {
+  char *target;
+  size_t len;
+  /* basename of an exact target, which its hash is keyed on */
+  const char *key;
+  size_t keylen;
+  uint32_t hash;
+  uint32_t next;
+  /* an exact target with a slash in it matches a full path */
+  bool fullpath;
+
+  /* a glob or regex target */
+  filterpattern_t filter;
+  char *literal;
+  size_t literallen;
+};
+
+/* Every target of a batch query. Exact targets are hashed on their basename,
+ * so that each line of a DB is looked up once rather than compared against
+ * every target. */
+struct batch_t {
+  struct batch_target_t *targets;
+  uint32_t ntargets;
+  uint32_t capacity;
+
+  uint32_t *buckets;
+  uint32_t nbuckets;
+  bool icase;
+};
+
+int batch_add(struct batch_t *b, const char *target, size_t len);
+int batch_read(struct batch_t *b, FILE *fp);
+int batch_build(struct batch_t *b, bool icase);
+void batch_free(struct batch_t *b, void (*filterfree)(filterpattern_t *));
+
+/* Iterate over the exact targets whose basename is key. start with
+ * batch_first, and continue with batch_next until BATCH_NO_TARGET. */
+uint32_t batch_first(const struct batch_t *b, const char *key, size_t keylen);
+uint32_t batch_next(const struct batch_t *b, uint32_t id, const char *key,
+                    size_t keylen);
+
+/* vim: set ts=2 sw=2 et: */
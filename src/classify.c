@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "classify.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_VECTORS 1
+#endif
+
+static size_t find_eol_scalar(const char *p, size_t n, char eol,
+                              size_t *slash) {
+  size_t s = *slash;
+
+  for (size_t i = 0; i < n; ++i) {
+    if (p[i] == eol) {
+      *slash = s;
+      return i;
+    }
+    if (p[i] == '/') {
+      s = i;
+    }
+  }
+
+  *slash = s;
+  return n;
+}
+
+#ifdef HAVE_X86_VECTORS
+/* finish off a line from wherever the vector loop stopped */
+static size_t find_eol_tail(const char *p, size_t i, size_t n, char eol,
+                            size_t s, size_t *slash) {
+  size_t pos;
+
+  *slash = SIZE_MAX;
+  pos = find_eol_scalar(p + i, n - i, eol, slash);
+  *slash = *slash == SIZE_MAX ? s : *slash + i;
+
+  return pos + i;
+}
+
+__attribute__((target("sse2"))) static size_t find_eol_sse2(
+    const char *p, size_t n, char eol, size_t *slash) {
+  const __m128i veol = _mm_set1_epi8(eol), vslash = _mm_set1_epi8('/');
+  size_t i = 0, s = SIZE_MAX;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    uint32_t e = _mm_movemask_epi8(_mm_cmpeq_epi8(v, veol));
+    uint32_t sl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vslash));
+
+    if (e) {
+      unsigned pos = __builtin_ctz(e);
+
+      sl &= (1u << pos) - 1;
+      *slash = sl ? i + 31 - __builtin_clz(sl) : s;
+      return i + pos;
+    }
+    if (sl) {
+      s = i + 31 - __builtin_clz(sl);
+    }
+  }
+
+  return find_eol_tail(p, i, n, eol, s, slash);
+}
+
+__attribute__((target("avx2"))) static size_t find_eol_avx2(
+    const char *p, size_t n, char eol, size_t *slash) {
+  const __m256i veol = _mm256_set1_epi8(eol), vslash = _mm256_set1_epi8('/');
+  size_t i = 0, s = SIZE_MAX;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    uint32_t e = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, veol));
+    uint32_t sl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vslash));
+
+    if (e) {
+      unsigned pos = __builtin_ctz(e);
+
+      sl &= (1u << pos) - 1;
+      *slash = sl ? i + 31 - __builtin_clz(sl) : s;
+      return i + pos;
+    }
+    if (sl) {
+      s = i + 31 - __builtin_clz(sl);
+    }
+  }
+
+  return find_eol_tail(p, i, n, eol, s, slash);
+}
+#endif
+
+static size_t find_eol_default(const char *p, size_t n, char eol,
+                               size_t *slash) {
+  *slash = SIZE_MAX;
+  return find_eol_scalar(p, n, eol, slash);
+}
+
+static size_t (*find_eol)(const char *p, size_t n, char eol,
+                          size_t *slash) = find_eol_default;
+
+__attribute__((constructor)) static void classify_init(void) {
+#ifdef HAVE_X86_VECTORS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    find_eol = find_eol_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    find_eol = find_eol_sse2;
+  }
+#endif
+}
+
+size_t classify_find_eol(const char *p, size_t n, char eol, size_t *slash) {
+  return find_eol(p, n, eol, slash);
+}
+
+unsigned classify_line_slash(const char *line, size_t len, size_t slash,
+                             size_t *basename) {
+  size_t p;
+
+  *basename = 0;
+  if (len == 0) {
+    return 0;
+  }
+
+  if (line[len - 1] == '/') {
+    const char *s = len > 1 ? memrchr(line, '/', len - 1) : NULL;
+
+    *basename = s ? (size_t)(s + 1 - line) : 0;
+    return LINE_DIRECTORY;
+  }
+
+  if (slash == SIZE_MAX) {
+    return 0;
+  }
+
+  *basename = slash + 1;
+
+  /* a binary lives directly in a bin/ or sbin/ directory */
+  if (slash < 3 || memcmp(&line[slash - 3], "bin", 3) != 0) {
+    return 0;
+  }
+
+  p = slash - 3;
+  if (p > 0 && line[p - 1] != '/' &&
+      !(line[p - 1] == 's' && (p == 1 || line[p - 2] == '/'))) {
+    return 0;
+  }
+
+  /* only the first bin/ in the path is considered, so /bin/foo/bin/bar isn't
+   * a binary */
+  if (memmem(line, p + 3, "bin/", 4) != NULL) {
+    return 0;
+  }
+
+  return LINE_BINARY;
+}
+
+unsigned classify_line(const char *line, size_t len, size_t *basename) {
+  const char *slash = memrchr(line, '/', len);
+
+  return classify_line_slash(
+      line, len, slash ? (size_t)(slash - line) : SIZE_MAX, basename);
+}
+
+/* vim: set ts=2 sw=2 et: */
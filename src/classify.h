@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINE_DIRECTORY 0x1
+#define LINE_BINARY 0x2
+
+/* Find the first eol in p, returning its offset or n if there isn't one. The
+ * offset of the last slash before the eol is stored in slash, or SIZE_MAX if
+ * there isn't one. This is done for a whole block at a time, with the widest
+ * vector instructions the CPU has. */
+size_t classify_find_eol(const char *p, size_t n, char eol, size_t *slash);
+
+/* Classify a line as LINE_DIRECTORY and/or LINE_BINARY, and find its
+ * basename, given the offset of its last slash as found by
+ * classify_find_eol. A directory's trailing slash belongs to its basename. */
+unsigned classify_line_slash(const char *line, size_t len, size_t slash,
+                             size_t *basename);
+unsigned classify_line(const char *line, size_t len, size_t *basename);
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "macro.h"
+#include "util.h"
+
+/* the first descriptor passed by systemd's socket activation */
+#define LISTEN_FDS_START 3
+
+#define DAEMON_MAX_ARGC 1024
+#define DAEMON_MAX_ARGVLEN (64 * 1024)
+
+/* how long a client may take to send its query */
+#define DAEMON_RECV_TIMEOUT 5
+
+/* how long a worker may take to answer, including however long its client
+ * takes to read the output */
+#define DAEMON_QUERY_TIMEOUT 120
+
+/* workers answering queries at once, past which new clients wait */
+#define DAEMON_MAX_WORKERS 16
+
+union sockaddr_union {
+  struct sockaddr sa;
+  struct sockaddr_un un;
+};
+
+union fdbuf {
+  struct cmsghdr align;
+  char buf[CMSG_SPACE(2 * sizeof(int))];
+};
+
+static int socket_address(union sockaddr_union *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->un.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr->un.sun_path)) {
+    return -ENAMETOOLONG;
+  }
+  strcpy(addr->un.sun_path, path);
+
+  return 0;
+}
+
+static int activated_socket(void) {
+  const char *e;
+  char *end;
+  long pid;
+
+  e = getenv("LISTEN_PID");
+  if (e == NULL) {
+    return -1;
+  }
+
+  pid = strtol(e, &end, 10);
+  if (*end != '\0' || pid != getpid()) {
+    return -1;
+  }
+
+  e = getenv("LISTEN_FDS");
+  if (e == NULL || strtol(e, &end, 10) < 1 || *end != '\0') {
+    return -1;
+  }
+
+  /* don't leak the socket to anything we might exec */
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  fcntl(LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+
+  return LISTEN_FDS_START;
+}
+
+static int listen_socket(const char *path) {
+  union sockaddr_union addr;
+  int fd, r;
+
+  fd = activated_socket();
+  if (fd >= 0) {
+    return fd;
+  }
+
+  r = socket_address(&addr, path);
+  if (r < 0) {
+    fprintf(stderr, "error: invalid socket path %s: %s\n", path, strerror(-r));
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "error: failed to create socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  /* a socket left behind by a previous daemon would make bind fail */
+  unlink(path);
+
+  if (bind(fd, &addr.sa, sizeof(addr.un)) < 0 ||
+      chmod(path, 0666) < 0 || listen(fd, SOMAXCONN) < 0) {
+    fprintf(stderr, "error: failed to listen on %s: %s\n", path,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int recv_request(int fd, struct daemon_request *req, int fds[2]) {
+  union fdbuf control;
+  struct iovec iov = {
+      .iov_base = req,
+      .iov_len = sizeof(*req),
+  };
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  struct cmsghdr *cmsg;
+  ssize_t n;
+
+  n = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  if (n < 0) {
+    return -errno;
+  }
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+    return -EBADMSG;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+  if ((size_t)n != sizeof(*req) || (msg.msg_flags & MSG_CTRUNC) ||
+      req->magic != DAEMON_MAGIC || req->argc == 0 ||
+      req->argc > DAEMON_MAX_ARGC || req->argvlen > DAEMON_MAX_ARGVLEN) {
+    close(fds[0]);
+    close(fds[1]);
+    return -EBADMSG;
+  }
+
+  return 0;
+}
+
+static char **unpack_argv(char *buf, size_t len, uint32_t argc) {
+  char **argv;
+  char *p = buf;
+
+  if (len == 0 || buf[len - 1] != '\0') {
+    return NULL;
+  }
+
+  CALLOC(argv, argc + 1, sizeof(char *), return NULL);
+
+  for (uint32_t i = 0; i < argc; ++i) {
+    if (p >= buf + len) {
+      free(argv);
+      return NULL;
+    }
+    argv[i] = p;
+    p += strlen(p) + 1;
+  }
+
+  if (p != buf + len) {
+    free(argv);
+    return NULL;
+  }
+
+  return argv;
+}
+
+static int run_query(int client, const int fds[2], int argc, char **argv,
+                     daemon_query_fn query, void *data) {
+  int saved[2], status;
+
+  fflush(stdout);
+  fflush(stderr);
+
+  saved[0] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+  saved[1] = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+  if (saved[0] < 0 || saved[1] < 0 || dup2(fds[0], STDOUT_FILENO) < 0 ||
+      dup2(fds[1], STDERR_FILENO) < 0) {
+    status = 1;
+  } else {
+    status = query(argc, argv, data);
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+
+  /* the client going away mid-query must not wedge our own stdio */
+  clearerr(stdout);
+  clearerr(stderr);
+
+  if (saved[0] >= 0) {
+    dup2(saved[0], STDOUT_FILENO);
+    close(saved[0]);
+  }
+  if (saved[1] >= 0) {
+    dup2(saved[1], STDERR_FILENO);
+    close(saved[1]);
+  }
+
+  return write_all(client, &(int32_t){status}, sizeof(int32_t));
+}
+
+static void serve_client(int client, daemon_query_fn query, void *data) {
+  struct timeval timeout = {.tv_sec = DAEMON_RECV_TIMEOUT};
+  struct daemon_request req;
+  _cleanup_free_ char *buf = NULL;
+  _cleanup_free_ char **argv = NULL;
+  int fds[2], r;
+
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  r = recv_request(client, &req, fds);
+  if (r < 0) {
+    fprintf(stderr, "error: failed to receive query: %s\n", strerror(-r));
+    return;
+  }
+
+  MALLOC(buf, MAX((size_t)req.argvlen, (size_t)1), goto done);
+
+  r = read_all(client, buf, req.argvlen);
+  if (r < 0) {
+    fprintf(stderr, "error: failed to receive query: %s\n", strerror(-r));
+    goto done;
+  }
+
+  argv = unpack_argv(buf, req.argvlen, req.argc);
+  if (argv == NULL) {
+    fprintf(stderr, "error: failed to receive query: %s\n", strerror(EBADMSG));
+    goto done;
+  }
+
+  run_query(client, fds, req.argc, argv, query, data);
+
+done:
+  close(fds[0]);
+  close(fds[1]);
+}
+
+/* Reaps the workers which have finished, waiting for one to if there are
+ * as many as there may be. */
+static void reap_workers(unsigned *nworkers) {
+  while (*nworkers > 0) {
+    int flags = *nworkers < DAEMON_MAX_WORKERS ? WNOHANG : 0;
+    pid_t pid = waitpid(-1, NULL, flags);
+
+    if (pid < 0 && errno == EINTR) {
+      continue;
+    }
+    if (pid <= 0) {
+      break;
+    }
+    (*nworkers)--;
+  }
+}
+
+int daemon_run(const char *path, daemon_query_fn query,
+               daemon_prepare_fn prepare, void *data) {
+  unsigned nworkers = 0;
+  int fd;
+
+  fd = listen_socket(path);
+  if (fd < 0) {
+    return 1;
+  }
+
+  /* a client which hangs up early is no reason for the daemon to die */
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    int client;
+    pid_t pid;
+
+    reap_workers(&nworkers);
+
+    client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "error: failed to accept connection: %s\n",
+              strerror(errno));
+      close(fd);
+      return 1;
+    }
+
+    prepare(data);
+
+    /* nothing buffered may be written twice */
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid == 0) {
+      close(fd);
+
+      /* a worker whose client never reads its output is given up on */
+      signal(SIGALRM, SIG_DFL);
+      alarm(DAEMON_QUERY_TIMEOUT);
+
+      serve_client(client, query, data);
+      fflush(stdout);
+      fflush(stderr);
+      _exit(0);
+    }
+
+    if (pid < 0) {
+      fprintf(stderr, "error: failed to start a worker: %s\n",
+              strerror(errno));
+    } else {
+      nworkers++;
+    }
+    close(client);
+  }
+}
+
+int daemon_client(const char *path, int argc, char **argv) {
+  union sockaddr_union addr;
+  struct daemon_request req = {.magic = DAEMON_MAGIC, .argc = argc};
+  union fdbuf control = {};
+  struct iovec iov = {
+      .iov_base = &req,
+      .iov_len = sizeof(req),
+  };
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  const int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+  _cleanup_free_ char *buf = NULL;
+  struct cmsghdr *cmsg;
+  int32_t status;
+  size_t len = 0;
+  char *p;
+  int fd, r;
+
+  r = socket_address(&addr, path);
+  if (r < 0) {
+    return r;
+  }
+
+  for (int i = 0; i < argc; ++i) {
+    len += strlen(argv[i]) + 1;
+  }
+  if (argc > DAEMON_MAX_ARGC || len > DAEMON_MAX_ARGVLEN) {
+    return -E2BIG;
+  }
+
+  MALLOC(buf, len, return -ENOMEM);
+  p = buf;
+  for (int i = 0; i < argc; ++i) {
+    p = stpcpy(p, argv[i]) + 1;
+  }
+  req.argvlen = len;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  /* no daemon to answer is for the caller to deal with */
+  if (connect(fd, &addr.sa, sizeof(addr.un)) < 0) {
+    r = -errno;
+    close(fd);
+    return r;
+  }
+
+  /* whatever we've buffered must come out before the daemon's output */
+  fflush(stdout);
+  fflush(stderr);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(req) ||
+      write_all(fd, buf, len) < 0) {
+    fprintf(stderr, "error: failed to send query to daemon: %s\n",
+            strerror(errno));
+    close(fd);
+    return 1;
+  }
+
+  r = read_all(fd, &status, sizeof(status));
+  close(fd);
+  if (r < 0) {
+    fprintf(stderr, "error: failed to read reply from daemon: %s\n",
+            strerror(-r));
+    return 1;
+  }
+
+  return status;
+}
+
+/* vim: set ts=2 sw=2 et: */
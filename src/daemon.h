@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define DAEMON_SOCKET "/run/pkgfile.sock"
+#define DAEMON_MAGIC 0x504b4644 /* PKFD */
+
+/* A query is a struct daemon_request, sent along with the client's stdout and
+ * stderr as SCM_RIGHTS, followed by argvlen bytes of NUL terminated argv.
+ * The daemon writes the query's output straight to the client's descriptors
+ * and answers with the int32_t exit status. */
+struct daemon_request {
+  uint32_t magic;
+  uint32_t argc;
+  uint32_t argvlen;
+};
+
+typedef int (*daemon_query_fn)(int argc, char **argv, void *data);
+typedef void (*daemon_prepare_fn)(void *data);
+
+/* Each query is answered by a worker forked off for it, so that a client
+ * which doesn't read its output holds up no one but itself. Before forking,
+ * prepare is called to load whatever the workers should share, rather than
+ * each loading it again. */
+int daemon_run(const char *path, daemon_query_fn query,
+               daemon_prepare_fn prepare, void *data);
+int daemon_client(const char *path, int argc, char **argv);
+
+/* vim: set ts=2 sw=2 et: */
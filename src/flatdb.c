@@ -0,0 +1,746 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "classify.h"
+#include "flatdb.h"
+#include "index.h"
+#include "macro.h"
+#include "util.h"
+
+bool flatdb_is_flatdb(const void *base, size_t size) {
+  return size >= sizeof(struct flatdb_header) &&
+         memcmp(base, FLATDB_MAGIC, sizeof(FLATDB_MAGIC)) == 0;
+}
+
+int flatdb_open(struct flatdb_t *db, const void *base, size_t size) {
+  const struct flatdb_header *hdr = base;
+
+  if (!flatdb_is_flatdb(base, size) || hdr->version != FLATDB_VERSION) {
+    return -EINVAL;
+  }
+
+  if (hdr->pkgs_offset > size ||
+      hdr->npkgs > (size - hdr->pkgs_offset) / sizeof(struct flatdb_pkg) ||
+      hdr->names_offset > size || hdr->names_size > size - hdr->names_offset) {
+    return -EINVAL;
+  }
+
+  db->base = base;
+  db->size = size;
+  db->hdr = hdr;
+  db->pkgs = (const struct flatdb_pkg *)(db->base + hdr->pkgs_offset);
+  db->names = db->base + hdr->names_offset;
+
+  return 0;
+}
+
+const char *flatdb_pkg_name(const struct flatdb_t *db, uint32_t i,
+                            size_t *len) {
+  const struct flatdb_pkg *pkg = &db->pkgs[i];
+
+  if ((uint64_t)pkg->name + pkg->namelen >= db->hdr->names_size) {
+    return NULL;
+  }
+
+  *len = pkg->namelen;
+  return &db->names[pkg->name];
+}
+
+const char *flatdb_pkg_files(const struct flatdb_t *db, uint32_t i,
+                             size_t *len) {
+  const struct flatdb_pkg *pkg = &db->pkgs[i];
+
+  if (pkg->files > db->size || pkg->fileslen > db->size - pkg->files) {
+    return NULL;
+  }
+
+  *len = pkg->fileslen;
+  return db->base + pkg->files;
+}
+
+int flatdb_writer_open(struct flatdb_writer_t *w, const char *filename) {
+  memset(w, 0, sizeof(*w));
+
+  w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (w->fd < 0) {
+    return -errno;
+  }
+
+  /* the header is written last, once all the offsets are known */
+  w->offset = sizeof(struct flatdb_header);
+
+  return 0;
+}
+
+static int writer_add_name(struct flatdb_writer_t *w, const char *name,
+                           size_t namelen, uint32_t *offset) {
+  if (w->names_size + namelen + 1 > UINT32_MAX) {
+    return -E2BIG;
+  }
+
+  if (w->names_size + namelen + 1 > w->names_capacity) {
+    size_t newsz = MAX(w->names_capacity * 2, w->names_size + namelen + 1);
+    char *newnames = realloc(w->names, newsz);
+    if (newnames == NULL) {
+      return -ENOMEM;
+    }
+    w->names = newnames;
+    w->names_capacity = newsz;
+  }
+
+  *offset = w->names_size;
+  memcpy(&w->names[w->names_size], name, namelen);
+  w->names[w->names_size + namelen] = '\0';
+  w->names_size += namelen + 1;
+
+  return 0;
+}
+
+int flatdb_writer_add(struct flatdb_writer_t *w, const char *name,
+                      size_t namelen, const char *files, size_t fileslen) {
+  struct flatdb_pkg *pkg;
+  int r;
+
+  if (w->npkgs == w->pkgs_capacity) {
+    uint32_t newsz = w->pkgs_capacity ? w->pkgs_capacity * 2 : 256;
+    struct flatdb_pkg *newpkgs =
+        realloc(w->pkgs, newsz * sizeof(struct flatdb_pkg));
+    if (newpkgs == NULL) {
+      return -ENOMEM;
+    }
+    w->pkgs = newpkgs;
+    w->pkgs_capacity = newsz;
+  }
+
+  pkg = &w->pkgs[w->npkgs];
+  pkg->namelen = namelen;
+  pkg->files = w->offset;
+  pkg->fileslen = fileslen;
+
+  r = writer_add_name(w, name, namelen, &pkg->name);
+  if (r < 0) {
+    return r;
+  }
+
+  r = pwrite_all(w->fd, files, fileslen, w->offset);
+  if (r < 0) {
+    return r;
+  }
+
+  w->offset += fileslen;
+  w->npkgs++;
+
+  return 0;
+}
+
+static void writer_free(struct flatdb_writer_t *w) {
+  FREE(w->pkgs);
+  FREE(w->names);
+}
+
+int flatdb_writer_close(struct flatdb_writer_t *w) {
+  struct flatdb_header hdr = {};
+  size_t pkgs_size = w->npkgs * sizeof(struct flatdb_pkg);
+  int r;
+
+  memcpy(hdr.magic, FLATDB_MAGIC, sizeof(FLATDB_MAGIC));
+  hdr.version = FLATDB_VERSION;
+  hdr.npkgs = w->npkgs;
+  /* keep the package table aligned for direct access from the mapping */
+  hdr.pkgs_offset = (w->offset + 7) & ~(uint64_t)7;
+  hdr.names_offset = hdr.pkgs_offset + pkgs_size;
+  hdr.names_size = w->names_size;
+
+  if ((r = pwrite_all(w->fd, w->pkgs, pkgs_size, hdr.pkgs_offset)) < 0 ||
+      (r = pwrite_all(w->fd, w->names, w->names_size, hdr.names_offset)) < 0 ||
+      (r = pwrite_all(w->fd, &hdr, sizeof(hdr), 0)) < 0) {
+    flatdb_writer_abort(w);
+    return r;
+  }
+
+  writer_free(w);
+
+  r = close(w->fd) < 0 ? -errno : 0;
+  w->fd = -1;
+
+  return r;
+}
+
+void flatdb_writer_abort(struct flatdb_writer_t *w) {
+  writer_free(w);
+
+  if (w->fd >= 0) {
+    close(w->fd);
+    w->fd = -1;
+  }
+}
+
+bool compactdb_is_compactdb(const void *base, size_t size) {
+  return size >= sizeof(struct compactdb_header) &&
+         memcmp(base, COMPACTDB_MAGIC, sizeof(COMPACTDB_MAGIC)) == 0;
+}
+
+static bool section_fits(size_t size, uint64_t offset, uint64_t count,
+                         size_t elemsz) {
+  return offset <= size && count <= (size - offset) / elemsz;
+}
+
+int compactdb_open(struct compactdb_t *db, const void *base, size_t size) {
+  const struct compactdb_header *hdr = base;
+
+  if (!compactdb_is_compactdb(base, size) ||
+      hdr->version != COMPACTDB_VERSION) {
+    return -EINVAL;
+  }
+
+  if (!section_fits(size, hdr->pkgs_offset, hdr->npkgs,
+                    sizeof(struct compactdb_pkg)) ||
+      !section_fits(size, hdr->dirs_offset, hdr->ndirs,
+                    sizeof(struct compactdb_dir)) ||
+      !section_fits(size, hdr->files_offset, hdr->nfiles,
+                    sizeof(struct compactdb_file)) ||
+      !section_fits(size, hdr->strings_offset, hdr->strings_size, 1)) {
+    return -EINVAL;
+  }
+
+  db->base = base;
+  db->size = size;
+  db->hdr = hdr;
+  db->pkgs = (const struct compactdb_pkg *)(db->base + hdr->pkgs_offset);
+  db->dirs = (const struct compactdb_dir *)(db->base + hdr->dirs_offset);
+  db->files = (const struct compactdb_file *)(db->base + hdr->files_offset);
+  db->strings = db->base + hdr->strings_offset;
+
+  return 0;
+}
+
+const char *compactdb_pkg_name(const struct compactdb_t *db, uint32_t i,
+                               size_t *len) {
+  const struct compactdb_pkg *pkg = &db->pkgs[i];
+
+  if ((uint64_t)pkg->name + pkg->namelen >= db->hdr->strings_size ||
+      (uint64_t)pkg->files + pkg->nfiles > db->hdr->nfiles) {
+    return NULL;
+  }
+
+  *len = pkg->namelen;
+  return &db->strings[pkg->name];
+}
+
+size_t compactdb_dirpath(const struct compactdb_t *db, uint32_t dir, char *buf,
+                         size_t bufsz) {
+  size_t pathlen, pos;
+
+  if (dir == COMPACTDB_NO_PARENT) {
+    return 0;
+  }
+
+  if (dir >= db->hdr->ndirs || db->dirs[dir].pathlen >= bufsz) {
+    return 0;
+  }
+
+  /* fill the path in from its last component up to the root */
+  pathlen = pos = db->dirs[dir].pathlen;
+  while (dir != COMPACTDB_NO_PARENT) {
+    const struct compactdb_dir *d;
+
+    if (dir >= db->hdr->ndirs) {
+      return 0;
+    }
+
+    d = &db->dirs[dir];
+    if (d->namelen > pos ||
+        (uint64_t)d->name + d->namelen >= db->hdr->strings_size) {
+      return 0;
+    }
+
+    pos -= d->namelen;
+    memcpy(&buf[pos], &db->strings[d->name], d->namelen);
+    dir = d->parent;
+  }
+
+  return pos == 0 ? pathlen : 0;
+}
+
+static void intern_table_free(struct intern_table_t *t) {
+  FREE(t->slots);
+  t->capacity = t->count = 0;
+}
+
+static uint32_t intern_hash_dir(uint32_t parent, uint32_t name) {
+  return (parent * 2654435761u) ^ (name * 2246822519u);
+}
+
+static uint32_t writer_hash_value(const struct compactdb_writer_t *w,
+                                  const struct intern_table_t *t,
+                                  uint32_t value) {
+  if (t == &w->dir_table) {
+    return intern_hash_dir(w->dirs[value].parent, w->dirs[value].name);
+  }
+
+  return fnv1a_hash(&w->strings[value], strlen(&w->strings[value]));
+}
+
+static int intern_table_grow(struct compactdb_writer_t *w,
+                             struct intern_table_t *t) {
+  uint32_t newcap = t->capacity ? t->capacity * 2 : 4096;
+  uint32_t *newslots;
+
+  CALLOC(newslots, newcap, sizeof(uint32_t), return -ENOMEM);
+
+  for (uint32_t i = 0; i < t->capacity; ++i) {
+    uint32_t pos;
+
+    if (t->slots[i] == 0) {
+      continue;
+    }
+
+    pos = writer_hash_value(w, t, t->slots[i] - 1) & (newcap - 1);
+    while (newslots[pos] != 0) {
+      pos = (pos + 1) & (newcap - 1);
+    }
+    newslots[pos] = t->slots[i];
+  }
+
+  free(t->slots);
+  t->slots = newslots;
+  t->capacity = newcap;
+
+  return 0;
+}
+
+static int writer_intern_string(struct compactdb_writer_t *w, const char *s,
+                                size_t len, uint32_t *offset) {
+  struct intern_table_t *t = &w->string_table;
+  uint32_t pos;
+
+  if (t->count * 2 >= t->capacity && intern_table_grow(w, t) < 0) {
+    return -ENOMEM;
+  }
+
+  pos = fnv1a_hash(s, len) & (t->capacity - 1);
+  while (t->slots[pos] != 0) {
+    const char *candidate = &w->strings[t->slots[pos] - 1];
+    if (memcmp(candidate, s, len) == 0 && candidate[len] == '\0') {
+      *offset = t->slots[pos] - 1;
+      return 0;
+    }
+    pos = (pos + 1) & (t->capacity - 1);
+  }
+
+  if (w->strings_size + len + 1 >= UINT32_MAX) {
+    return -E2BIG;
+  }
+
+  if (w->strings_size + len + 1 > w->strings_capacity) {
+    size_t newsz = MAX(w->strings_capacity * 2, w->strings_size + len + 1);
+    char *newstrings = realloc(w->strings, newsz);
+    if (newstrings == NULL) {
+      return -ENOMEM;
+    }
+    w->strings = newstrings;
+    w->strings_capacity = newsz;
+  }
+
+  *offset = w->strings_size;
+  memcpy(&w->strings[w->strings_size], s, len);
+  w->strings[w->strings_size + len] = '\0';
+  w->strings_size += len + 1;
+
+  t->slots[pos] = *offset + 1;
+  t->count++;
+
+  return 0;
+}
+
+static int writer_intern_dir(struct compactdb_writer_t *w, uint32_t parent,
+                             const char *name, size_t namelen, uint32_t *id) {
+  struct intern_table_t *t = &w->dir_table;
+  struct compactdb_dir *dir;
+  uint32_t nameoff, pos;
+  int r;
+
+  r = writer_intern_string(w, name, namelen, &nameoff);
+  if (r < 0) {
+    return r;
+  }
+
+  if (t->count * 2 >= t->capacity && intern_table_grow(w, t) < 0) {
+    return -ENOMEM;
+  }
+
+  pos = intern_hash_dir(parent, nameoff) & (t->capacity - 1);
+  while (t->slots[pos] != 0) {
+    const struct compactdb_dir *candidate = &w->dirs[t->slots[pos] - 1];
+    if (candidate->parent == parent && candidate->name == nameoff) {
+      *id = t->slots[pos] - 1;
+      return 0;
+    }
+    pos = (pos + 1) & (t->capacity - 1);
+  }
+
+  if (w->ndirs == w->dirs_capacity) {
+    uint32_t newsz = w->dirs_capacity ? w->dirs_capacity * 2 : 1024;
+    struct compactdb_dir *newdirs =
+        realloc(w->dirs, newsz * sizeof(struct compactdb_dir));
+    if (newdirs == NULL) {
+      return -ENOMEM;
+    }
+    w->dirs = newdirs;
+    w->dirs_capacity = newsz;
+  }
+
+  *id = w->ndirs++;
+  dir = &w->dirs[*id];
+  dir->parent = parent;
+  dir->name = nameoff;
+  dir->namelen = namelen;
+  dir->pathlen =
+      (parent == COMPACTDB_NO_PARENT ? 0 : w->dirs[parent].pathlen) + namelen;
+
+  t->slots[pos] = *id + 1;
+  t->count++;
+
+  return 0;
+}
+
+static int writer_lookup_dirpath(struct compactdb_writer_t *w,
+                                 const char *path, size_t len, uint32_t *id) {
+  uint32_t dir = COMPACTDB_NO_PARENT;
+  const char *p = path, *end = path + len;
+  int r;
+
+  if (len == w->lastdirlen && memcmp(path, w->lastdir, len) == 0) {
+    *id = w->lastdir_id;
+    return 0;
+  }
+
+  /* walk each component, trailing slashes included */
+  while (p < end) {
+    const char *slash = memchr(p, '/', end - p);
+    const char *next = slash ? slash + 1 : end;
+
+    r = writer_intern_dir(w, dir, p, next - p, &dir);
+    if (r < 0) {
+      return r;
+    }
+    p = next;
+  }
+
+  if (len > w->lastdirlen) {
+    char *newdir = realloc(w->lastdir, len);
+    if (newdir == NULL) {
+      return -ENOMEM;
+    }
+    w->lastdir = newdir;
+  }
+  memcpy(w->lastdir, path, len);
+  w->lastdirlen = len;
+  w->lastdir_id = dir;
+
+  *id = dir;
+  return 0;
+}
+
+static int writer_add_file(struct compactdb_writer_t *w, const char *path,
+                           size_t len) {
+  struct compactdb_file *file;
+  const char *base;
+  size_t baselen = len;
+  uint32_t dir, nameoff;
+  int r;
+
+  base = index_basename(path, &baselen);
+  if (baselen > UINT16_MAX) {
+    return -ENAMETOOLONG;
+  }
+
+  r = writer_lookup_dirpath(w, path, base - path, &dir);
+  if (r < 0) {
+    return r;
+  }
+
+  r = writer_intern_string(w, base, baselen, &nameoff);
+  if (r < 0) {
+    return r;
+  }
+
+  if (w->nfiles == w->files_capacity) {
+    uint32_t newsz = w->files_capacity ? w->files_capacity * 2 : 4096;
+    struct compactdb_file *newfiles =
+        realloc(w->files, newsz * sizeof(struct compactdb_file));
+    if (newfiles == NULL) {
+      return -ENOMEM;
+    }
+    w->files = newfiles;
+    w->files_capacity = newsz;
+  }
+
+  file = &w->files[w->nfiles++];
+  file->dir = dir;
+  file->name = nameoff;
+  file->namelen = baselen;
+  file->flags = classify_line(path, len, &(size_t){0}) |
+                COMPACTDB_FILE_CLASSIFIED;
+
+  return 0;
+}
+
+int compactdb_writer_open(struct compactdb_writer_t *w, const char *filename) {
+  memset(w, 0, sizeof(*w));
+
+  w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (w->fd < 0) {
+    return -errno;
+  }
+
+  w->lastdir_id = COMPACTDB_NO_PARENT;
+
+  return 0;
+}
+
+int compactdb_writer_add(struct compactdb_writer_t *w, const char *name,
+                         size_t namelen, const char *files, size_t fileslen) {
+  const char *p = files, *end = files + fileslen;
+  struct compactdb_pkg *pkg;
+  int r;
+
+  if (w->npkgs == w->pkgs_capacity) {
+    uint32_t newsz = w->pkgs_capacity ? w->pkgs_capacity * 2 : 256;
+    struct compactdb_pkg *newpkgs =
+        realloc(w->pkgs, newsz * sizeof(struct compactdb_pkg));
+    if (newpkgs == NULL) {
+      return -ENOMEM;
+    }
+    w->pkgs = newpkgs;
+    w->pkgs_capacity = newsz;
+  }
+
+  pkg = &w->pkgs[w->npkgs];
+  pkg->namelen = namelen;
+  pkg->files = w->nfiles;
+
+  r = writer_intern_string(w, name, namelen, &pkg->name);
+  if (r < 0) {
+    return r;
+  }
+
+  while (p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (eol == NULL) {
+      eol = end;
+    }
+
+    if (eol > p) {
+      r = writer_add_file(w, p, eol - p);
+      if (r < 0) {
+        return r;
+      }
+    }
+
+    p = eol + 1;
+  }
+
+  pkg->nfiles = w->nfiles - pkg->files;
+  w->npkgs++;
+
+  return 0;
+}
+
+static int writer_copy_dir(struct compactdb_writer_t *w,
+                           const struct compactdb_t *db, uint32_t dir,
+                           uint32_t *dirmap, uint32_t *id) {
+  const struct compactdb_dir *d;
+  uint32_t parent;
+  int r;
+
+  if (dir == COMPACTDB_NO_PARENT) {
+    *id = COMPACTDB_NO_PARENT;
+    return 0;
+  }
+
+  if (dir >= db->hdr->ndirs) {
+    return -EINVAL;
+  }
+
+  if (dirmap[dir] != COMPACTDB_NO_PARENT) {
+    *id = dirmap[dir];
+    return 0;
+  }
+
+  d = &db->dirs[dir];
+  if ((uint64_t)d->name + d->namelen >= db->hdr->strings_size) {
+    return -EINVAL;
+  }
+
+  r = writer_copy_dir(w, db, d->parent, dirmap, &parent);
+  if (r < 0) {
+    return r;
+  }
+
+  r = writer_intern_dir(w, parent, &db->strings[d->name], d->namelen, id);
+  if (r < 0) {
+    return r;
+  }
+
+  dirmap[dir] = *id;
+  return 0;
+}
+
+int compactdb_writer_copy(struct compactdb_writer_t *w,
+                          const struct compactdb_t *db, uint32_t i,
+                          uint32_t *dirmap) {
+  const struct compactdb_pkg *src = &db->pkgs[i];
+  struct compactdb_pkg *pkg;
+  const char *name;
+  size_t namelen;
+  int r;
+
+  name = compactdb_pkg_name(db, i, &namelen);
+  if (name == NULL) {
+    return -EINVAL;
+  }
+
+  if (w->npkgs == w->pkgs_capacity) {
+    uint32_t newsz = w->pkgs_capacity ? w->pkgs_capacity * 2 : 256;
+    struct compactdb_pkg *newpkgs =
+        realloc(w->pkgs, newsz * sizeof(struct compactdb_pkg));
+    if (newpkgs == NULL) {
+      return -ENOMEM;
+    }
+    w->pkgs = newpkgs;
+    w->pkgs_capacity = newsz;
+  }
+
+  pkg = &w->pkgs[w->npkgs];
+  pkg->namelen = namelen;
+  pkg->files = w->nfiles;
+
+  r = writer_intern_string(w, name, namelen, &pkg->name);
+  if (r < 0) {
+    return r;
+  }
+
+  for (uint32_t f = src->files; f < src->files + src->nfiles; ++f) {
+    const struct compactdb_file *from = &db->files[f];
+    struct compactdb_file *file;
+
+    if ((uint64_t)from->name + from->namelen >= db->hdr->strings_size) {
+      return -EINVAL;
+    }
+
+    if (w->nfiles == w->files_capacity) {
+      uint32_t newsz = w->files_capacity ? w->files_capacity * 2 : 4096;
+      struct compactdb_file *newfiles =
+          realloc(w->files, newsz * sizeof(struct compactdb_file));
+      if (newfiles == NULL) {
+        return -ENOMEM;
+      }
+      w->files = newfiles;
+      w->files_capacity = newsz;
+    }
+
+    file = &w->files[w->nfiles];
+    r = writer_copy_dir(w, db, from->dir, dirmap, &file->dir);
+    if (r < 0) {
+      return r;
+    }
+
+    r = writer_intern_string(w, &db->strings[from->name], from->namelen,
+                             &file->name);
+    if (r < 0) {
+      return r;
+    }
+
+    /* the classification travels with the file, it needn't be redone */
+    file->namelen = from->namelen;
+    file->flags = from->flags;
+    w->nfiles++;
+  }
+
+  pkg->nfiles = w->nfiles - pkg->files;
+  w->npkgs++;
+
+  return 0;
+}
+
+static void compactdb_writer_free(struct compactdb_writer_t *w) {
+  FREE(w->pkgs);
+  FREE(w->dirs);
+  FREE(w->files);
+  FREE(w->strings);
+  FREE(w->lastdir);
+  intern_table_free(&w->dir_table);
+  intern_table_free(&w->string_table);
+}
+
+int compactdb_writer_close(struct compactdb_writer_t *w) {
+  struct compactdb_header hdr = {};
+  int r;
+
+  memcpy(hdr.magic, COMPACTDB_MAGIC, sizeof(COMPACTDB_MAGIC));
+  hdr.version = COMPACTDB_VERSION;
+  hdr.npkgs = w->npkgs;
+  hdr.ndirs = w->ndirs;
+  hdr.nfiles = w->nfiles;
+  hdr.pkgs_offset = sizeof(hdr);
+  hdr.dirs_offset = hdr.pkgs_offset + w->npkgs * sizeof(struct compactdb_pkg);
+  hdr.files_offset = hdr.dirs_offset + w->ndirs * sizeof(struct compactdb_dir);
+  hdr.strings_offset =
+      hdr.files_offset + w->nfiles * sizeof(struct compactdb_file);
+  hdr.strings_size = w->strings_size;
+
+  if ((r = write_all(w->fd, &hdr, sizeof(hdr))) < 0 ||
+      (r = write_all(w->fd, w->pkgs,
+                     w->npkgs * sizeof(struct compactdb_pkg))) < 0 ||
+      (r = write_all(w->fd, w->dirs,
+                     w->ndirs * sizeof(struct compactdb_dir))) < 0 ||
+      (r = write_all(w->fd, w->files,
+                     w->nfiles * sizeof(struct compactdb_file))) < 0 ||
+      (r = write_all(w->fd, w->strings, w->strings_size)) < 0) {
+    compactdb_writer_abort(w);
+    return r;
+  }
+
+  compactdb_writer_free(w);
+
+  r = close(w->fd) < 0 ? -errno : 0;
+  w->fd = -1;
+
+  return r;
+}
+
+void compactdb_writer_abort(struct compactdb_writer_t *w) {
+  compactdb_writer_free(w);
+
+  if (w->fd >= 0) {
+    close(w->fd);
+    w->fd = -1;
+  }
+}
+
+/* vim: set ts=2 sw=2 et: */
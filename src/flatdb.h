@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FLATDB_MAGIC "PKGFDB"
+#define FLATDB_VERSION 1
+
+/* On-disk layout of a flat DB. Nothing in it is compressed, so that it can be
+ * searched directly from the mapped pages:
+ *
+ *   struct flatdb_header
+ *   char files[]                       per package, NUL terminated paths
+ *   struct flatdb_pkg pkgs[npkgs]
+ *   char names[names_size]             NUL terminated $pkgname-$pkgver-$pkgrel
+ *
+ * Paths are NUL rather than newline terminated so that each one can be handed
+ * to the matchers as a string without first being copied out. */
+struct flatdb_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t npkgs;
+  uint64_t pkgs_offset;
+  uint64_t names_offset;
+  uint64_t names_size;
+};
+
+struct flatdb_pkg {
+  uint32_t name;
+  uint32_t namelen;
+  uint64_t files;
+  uint64_t fileslen;
+};
+
+struct flatdb_t {
+  const char *base;
+  size_t size;
+  const struct flatdb_header *hdr;
+  const struct flatdb_pkg *pkgs;
+  const char *names;
+};
+
+struct flatdb_writer_t {
+  int fd;
+  uint64_t offset;
+
+  struct flatdb_pkg *pkgs;
+  uint32_t npkgs;
+  uint32_t pkgs_capacity;
+
+  char *names;
+  size_t names_size;
+  size_t names_capacity;
+};
+
+#define COMPACTDB_MAGIC "PKGFCDB"
+#define COMPACTDB_VERSION 1
+#define COMPACTDB_NO_PARENT UINT32_MAX
+#define COMPACTDB_FILE_CLASSIFIED 0x8000
+
+/* On-disk layout of a compact DB, a variant of the flat DB which doesn't store
+ * the same directory prefixes over and over:
+ *
+ *   struct compactdb_header
+ *   struct compactdb_pkg pkgs[npkgs]
+ *   struct compactdb_dir dirs[ndirs]   a tree of directory components
+ *   struct compactdb_file files[nfiles]
+ *   char strings[strings_size]         interned, NUL terminated names
+ *
+ * Each file is stored as its parent directory and its basename, and every
+ * name is stored exactly once no matter how many packages or directories
+ * share it. Directory names keep their trailing slash, and the root directory
+ * is simply named "/". A file's flags hold its LINE_* classification, which is
+ * only valid when COMPACTDB_FILE_CLASSIFIED is also set. */
+struct compactdb_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t npkgs;
+  uint32_t ndirs;
+  uint32_t nfiles;
+  uint64_t pkgs_offset;
+  uint64_t dirs_offset;
+  uint64_t files_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+};
+
+struct compactdb_pkg {
+  uint32_t name;
+  uint32_t namelen;
+  uint32_t files;
+  uint32_t nfiles;
+};
+
+struct compactdb_dir {
+  uint32_t parent;
+  uint32_t name;
+  uint32_t namelen;
+  uint32_t pathlen;
+};
+
+struct compactdb_file {
+  uint32_t dir;
+  uint32_t name;
+  uint16_t namelen;
+  uint16_t flags;
+};
+
+struct compactdb_t {
+  const char *base;
+  size_t size;
+  const struct compactdb_header *hdr;
+  const struct compactdb_pkg *pkgs;
+  const struct compactdb_dir *dirs;
+  const struct compactdb_file *files;
+  const char *strings;
+};
+
+struct intern_table_t {
+  uint32_t *slots;
+  uint32_t capacity;
+  uint32_t count;
+};
+
+struct compactdb_writer_t {
+  int fd;
+
+  struct compactdb_pkg *pkgs;
+  uint32_t npkgs;
+  uint32_t pkgs_capacity;
+
+  struct compactdb_dir *dirs;
+  uint32_t ndirs;
+  uint32_t dirs_capacity;
+  struct intern_table_t dir_table;
+
+  struct compactdb_file *files;
+  uint32_t nfiles;
+  uint32_t files_capacity;
+
+  char *strings;
+  size_t strings_size;
+  size_t strings_capacity;
+  struct intern_table_t string_table;
+
+  /* most files share a directory with the file before them */
+  char *lastdir;
+  size_t lastdirlen;
+  uint32_t lastdir_id;
+};
+
+bool flatdb_is_flatdb(const void *base, size_t size);
+int flatdb_open(struct flatdb_t *db, const void *base, size_t size);
+const char *flatdb_pkg_name(const struct flatdb_t *db, uint32_t i,
+                            size_t *len);
+const char *flatdb_pkg_files(const struct flatdb_t *db, uint32_t i,
+                             size_t *len);
+
+bool compactdb_is_compactdb(const void *base, size_t size);
+int compactdb_open(struct compactdb_t *db, const void *base, size_t size);
+const char *compactdb_pkg_name(const struct compactdb_t *db, uint32_t i,
+                               size_t *len);
+size_t compactdb_dirpath(const struct compactdb_t *db, uint32_t dir, char *buf,
+                         size_t bufsz);
+
+int flatdb_writer_open(struct flatdb_writer_t *w, const char *filename);
+int flatdb_writer_add(struct flatdb_writer_t *w, const char *name,
+                      size_t namelen, const char *files, size_t fileslen);
+int flatdb_writer_close(struct flatdb_writer_t *w);
+void flatdb_writer_abort(struct flatdb_writer_t *w);
+
+int compactdb_writer_open(struct compactdb_writer_t *w, const char *filename);
+int compactdb_writer_add(struct compactdb_writer_t *w, const char *name,
+                         size_t namelen, const char *files, size_t fileslen);
+
+/* Copies package i of an existing compact DB without going through its files
+ * as text. dirmap has a slot for each of the DB's directories, which must all
+ * start out as COMPACTDB_NO_PARENT, and remembers the directories already
+ * copied from one call to the next. */
+int compactdb_writer_copy(struct compactdb_writer_t *w,
+                          const struct compactdb_t *db, uint32_t i,
+                          uint32_t *dirmap);
+int compactdb_writer_close(struct compactdb_writer_t *w);
+void compactdb_writer_abort(struct compactdb_writer_t *w);
+
+/* vim: set ts=2 sw=2 et: */
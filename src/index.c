@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "index.h"
+#include "macro.h"
+#include "util.h"
+
+struct index_builder_t {
+  char *strings;
+  size_t strings_size;
+  size_t strings_capacity;
+
+  struct index_record *records;
+  uint32_t nrecords;
+  uint32_t records_capacity;
+
+  struct index_pkg *pkgs;
+  uint32_t npkgs;
+  uint32_t pkgs_capacity;
+
+  /* offset of the pkgname which files are currently being added for */
+  uint32_t pkg;
+};
+
+const char *index_basename(const char *path, size_t *len) {
+  /* a trailing slash belongs to the basename, just as it does when matching
+   * with match_exact_basename */
+  const char *slash = *len > 1 ? memrchr(path, '/', *len - 1) : NULL;
+
+  if (slash == NULL) {
+    return path;
+  }
+
+  *len -= slash + 1 - path;
+  return slash + 1;
+}
+
+static int builder_add_string(struct index_builder_t *b, const char *s,
+                              size_t len, uint32_t *offset) {
+  if (b->strings_size + len + 1 > UINT32_MAX) {
+    return -E2BIG;
+  }
+
+  if (b->strings_size + len + 1 > b->strings_capacity) {
+    size_t newsz = MAX(b->strings_capacity * 2, b->strings_size + len + 1);
+    char *newstrings = realloc(b->strings, newsz);
+    if (newstrings == NULL) {
+      return -ENOMEM;
+    }
+    b->strings = newstrings;
+    b->strings_capacity = newsz;
+  }
+
+  *offset = b->strings_size;
+  memcpy(&b->strings[b->strings_size], s, len);
+  b->strings[b->strings_size + len] = '\0';
+  b->strings_size += len + 1;
+
+  return 0;
+}
+
+struct index_builder_t *index_builder_new(void) {
+  struct index_builder_t *b;
+
+  CALLOC(b, 1, sizeof(struct index_builder_t), return NULL);
+
+  return b;
+}
+
+void index_builder_free(struct index_builder_t *b) {
+  if (b == NULL) {
+    return;
+  }
+
+  free(b->strings);
+  free(b->records);
+  free(b->pkgs);
+  free(b);
+}
+
+/* the length of a $pkgname-$pkgver-$pkgrel without its version */
+static size_t pkgname_len(const char *pkgname, size_t len) {
+  const char *dash = memrchr(pkgname, '-', len);
+
+  if (dash != NULL) {
+    dash = memrchr(pkgname, '-', dash - pkgname);
+  }
+
+  return dash != NULL ? (size_t)(dash - pkgname) : len;
+}
+
+int index_builder_add_pkg(struct index_builder_t *b, const char *pkgname,
+                          size_t len, uint64_t offset) {
+  struct index_pkg *pkg;
+  int r;
+
+  if (b->npkgs == b->pkgs_capacity) {
+    uint32_t newsz = b->pkgs_capacity ? b->pkgs_capacity * 2 : 256;
+    struct index_pkg *newpkgs =
+        realloc(b->pkgs, newsz * sizeof(struct index_pkg));
+    if (newpkgs == NULL) {
+      return -ENOMEM;
+    }
+    b->pkgs = newpkgs;
+    b->pkgs_capacity = newsz;
+  }
+
+  r = builder_add_string(b, pkgname, len, &b->pkg);
+  if (r < 0) {
+    return r;
+  }
+
+  pkg = &b->pkgs[b->npkgs];
+  pkg->name = b->pkg;
+  pkg->namelen = pkgname_len(pkgname, len);
+  pkg->ordinal = b->npkgs++;
+  pkg->reserved = 0;
+  pkg->offset = offset;
+
+  return 0;
+}
+
+int index_builder_add_file(struct index_builder_t *b, const char *path,
+                           size_t len) {
+  struct index_record *rec;
+  const char *base;
+  size_t baselen = len;
+  int r;
+
+  if (b->nrecords == b->records_capacity) {
+    uint32_t newsz = b->records_capacity ? b->records_capacity * 2 : 1024;
+    struct index_record *newrecords =
+        realloc(b->records, newsz * sizeof(struct index_record));
+    if (newrecords == NULL) {
+      return -ENOMEM;
+    }
+    b->records = newrecords;
+    b->records_capacity = newsz;
+  }
+
+  rec = &b->records[b->nrecords];
+  base = index_basename(path, &baselen);
+  rec->hash = fnv1a_hash_folded(base, baselen);
+  rec->pkg = b->pkg;
+  rec->pathlen = len;
+
+  r = builder_add_string(b, path, len, &rec->path);
+  if (r < 0) {
+    return r;
+  }
+
+  b->nrecords++;
+
+  return 0;
+}
+
+static uint32_t bucket_count(uint32_t nrecords) {
+  uint32_t n = 1;
+
+  while (n < nrecords) {
+    n <<= 1;
+  }
+
+  return n;
+}
+
+static int namecmp(const char *strings, const struct index_pkg *pkg,
+                   const char *name, size_t len) {
+  int r = memcmp(&strings[pkg->name], name, MIN(pkg->namelen, len));
+
+  if (r != 0) {
+    return r;
+  }
+
+  return pkg->namelen < len ? -1 : pkg->namelen > len;
+}
+
+static int pkgcmp(const void *p1, const void *p2, void *arg) {
+  const struct index_pkg *pkg1 = p1, *pkg2 = p2;
+  const char *strings = arg;
+
+  return namecmp(strings, pkg1, &strings[pkg2->name], pkg2->namelen);
+}
+
+int index_builder_write(struct index_builder_t *b, const char *filename,
+                        const struct stat *dbst) {
+  struct index_header hdr = {};
+  _cleanup_free_ uint32_t *buckets = NULL;
+  _cleanup_free_ struct index_record *sorted = NULL;
+  char tmpfile[PATH_MAX];
+  uint32_t nbuckets;
+  int fd, r;
+
+  nbuckets = bucket_count(b->nrecords);
+
+  CALLOC(buckets, nbuckets + 1, sizeof(uint32_t), return -ENOMEM);
+  MALLOC(sorted, MAX(b->nrecords, 1u) * sizeof(struct index_record),
+         return -ENOMEM);
+
+  /* counting sort on the bucket, which keeps records for the same basename in
+   * the order their packages appear in the DB. */
+  for (uint32_t i = 0; i < b->nrecords; ++i) {
+    buckets[(b->records[i].hash & (nbuckets - 1)) + 1]++;
+  }
+  for (uint32_t i = 0; i < nbuckets; ++i) {
+    buckets[i + 1] += buckets[i];
+  }
+  for (uint32_t i = 0; i < b->nrecords; ++i) {
+    uint32_t bucket = b->records[i].hash & (nbuckets - 1);
+    sorted[buckets[bucket]++] = b->records[i];
+  }
+
+  /* placement advanced each bucket's start to the start of the next */
+  memmove(&buckets[1], &buckets[0], nbuckets * sizeof(uint32_t));
+  buckets[0] = 0;
+
+  /* the packages are looked up by name, but keep their place in the DB */
+  qsort_r(b->pkgs, b->npkgs, sizeof(struct index_pkg), pkgcmp, b->strings);
+
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.version = INDEX_VERSION;
+  hdr.nbuckets = nbuckets;
+  hdr.nrecords = b->nrecords;
+  hdr.npkgs = b->npkgs;
+  hdr.strings_size = b->strings_size;
+  hdr.db_ino = dbst->st_ino;
+  hdr.db_size = dbst->st_size;
+  hdr.db_mtime = dbst->st_mtime;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s~", filename);
+  fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  if ((r = write_all(fd, &hdr, sizeof(hdr))) < 0 ||
+      (r = write_all(fd, b->pkgs, b->npkgs * sizeof(struct index_pkg))) < 0 ||
+      (r = write_all(fd, buckets, (nbuckets + 1) * sizeof(uint32_t))) < 0 ||
+      (r = write_all(fd, sorted, b->nrecords * sizeof(struct index_record))) <
+          0 ||
+      (r = write_all(fd, b->strings, b->strings_size)) < 0) {
+    close(fd);
+    unlink(tmpfile);
+    return r;
+  }
+
+  if (close(fd) < 0 || rename(tmpfile, filename) < 0) {
+    r = -errno;
+    unlink(tmpfile);
+    return r;
+  }
+
+  return 0;
+}
+
+int index_open(struct index_t *idx, const char *filename,
+               const struct stat *dbst) {
+  const struct index_header *hdr;
+  struct stat st;
+  size_t expected;
+  int fd;
+
+  memset(idx, 0, sizeof(*idx));
+  idx->map = MAP_FAILED;
+
+  fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+    close(fd);
+    return -EINVAL;
+  }
+
+  idx->size = st.st_size;
+  idx->map = mmap(NULL, idx->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (idx->map == MAP_FAILED) {
+    return -errno;
+  }
+
+  hdr = idx->map;
+  if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != INDEX_VERSION || hdr->nbuckets == 0 ||
+      (hdr->nbuckets & (hdr->nbuckets - 1)) != 0) {
+    index_close(idx);
+    return -EINVAL;
+  }
+
+  /* an index built from some other DB is useless */
+  if (hdr->db_ino != (uint64_t)dbst->st_ino ||
+      hdr->db_size != (int64_t)dbst->st_size ||
+      hdr->db_mtime != (int64_t)dbst->st_mtime) {
+    index_close(idx);
+    return -ESTALE;
+  }
+
+  expected = sizeof(*hdr) + hdr->npkgs * sizeof(struct index_pkg) +
+             (hdr->nbuckets + 1) * sizeof(uint32_t) +
+             hdr->nrecords * sizeof(struct index_record) + hdr->strings_size;
+  if (expected != idx->size) {
+    index_close(idx);
+    return -EINVAL;
+  }
+
+  idx->hdr = hdr;
+  idx->pkgs = (const struct index_pkg *)(hdr + 1);
+  idx->buckets = (const uint32_t *)(idx->pkgs + hdr->npkgs);
+  idx->records =
+      (const struct index_record *)(idx->buckets + hdr->nbuckets + 1);
+  idx->strings = (const char *)(idx->records + hdr->nrecords);
+
+  return 0;
+}
+
+void index_close(struct index_t *idx) {
+  if (idx->map != MAP_FAILED && idx->map != NULL) {
+    munmap(idx->map, idx->size);
+  }
+  idx->map = MAP_FAILED;
+  idx->hdr = NULL;
+}
+
+const struct index_pkg *index_find_pkg(const struct index_t *idx,
+                                       const char *name, size_t len) {
+  uint32_t lo = 0, hi = idx->hdr->npkgs;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const struct index_pkg *pkg = &idx->pkgs[mid];
+    int r;
+
+    if ((uint64_t)pkg->name + pkg->namelen >= idx->hdr->strings_size) {
+      return NULL;
+    }
+
+    r = namecmp(idx->strings, pkg, name, len);
+    if (r == 0) {
+      return pkg;
+    }
+    if (r < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return NULL;
+}
+
+void index_iter_init(struct index_iter_t *it, const struct index_t *idx,
+                     const char *key, size_t keylen, bool icase) {
+  uint32_t bucket;
+
+  it->idx = idx;
+  it->key = key;
+  it->keylen = keylen;
+  it->icase = icase;
+  it->hash = fnv1a_hash_folded(key, keylen);
+
+  bucket = it->hash & (idx->hdr->nbuckets - 1);
+  it->pos = idx->buckets[bucket];
+  it->end = idx->buckets[bucket + 1];
+}
+
+bool index_iter_next(struct index_iter_t *it, const char **pkgname,
+                     const char **path, size_t *pathlen) {
+  while (it->pos < it->end) {
+    const struct index_record *rec = &it->idx->records[it->pos++];
+    const char *p, *base;
+    size_t baselen;
+
+    if (rec->hash != it->hash) {
+      continue;
+    }
+
+    p = &it->idx->strings[rec->path];
+    baselen = rec->pathlen;
+    base = index_basename(p, &baselen);
+    if (baselen != it->keylen ||
+        !(it->icase ? ascii_equal_folded(it->key, base, baselen)
+                    : memcmp(base, it->key, baselen) == 0)) {
+      continue;
+    }
+
+    *pkgname = &it->idx->strings[rec->pkg];
+    *path = p;
+    *pathlen = rec->pathlen;
+    return true;
+  }
+
+  return false;
+}
+
+/* vim: set ts=2 sw=2 et: */
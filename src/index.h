@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define INDEX_MAGIC "PKGFIDX"
+#define INDEX_VERSION 3
+#define INDEX_SUFFIX ".idx"
+#define INDEX_NO_OFFSET UINT64_MAX
+
+/* On-disk layout of a basename index, written next to a repo's .files DB:
+ *
+ *   struct index_header
+ *   struct index_pkg pkgs[npkgs]       sorted by name, without the version
+ *   uint32_t buckets[nbuckets + 1]     record index where each bucket begins
+ *   struct index_record records[nrecords]
+ *   char strings[strings_size]         NUL terminated pkgnames and paths
+ *
+ * The header records the identity of the DB that the index was built from,
+ * and an index which doesn't match its DB is never used. Basenames are hashed
+ * with their ASCII letters folded to lower case, so that a case insensitive
+ * lookup lands in the same bucket as a case sensitive one. */
+struct index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nbuckets;
+  uint32_t nrecords;
+  uint32_t npkgs;
+  uint64_t strings_size;
+  uint64_t db_ino;
+  int64_t db_size;
+  int64_t db_mtime;
+};
+
+struct index_record {
+  uint32_t hash;
+  uint32_t pkg;
+  uint32_t path;
+  uint32_t pathlen;
+};
+
+/* A package's place in the DB: the ordinal is its position among the DB's
+ * packages, and the offset is where its entry starts in an uncompressed CPIO
+ * DB, or INDEX_NO_OFFSET when the DB can't be read from the middle. */
+struct index_pkg {
+  uint32_t name;
+  uint32_t namelen;
+  uint32_t ordinal;
+  uint32_t reserved;
+  uint64_t offset;
+};
+
+struct index_t {
+  void *map;
+  size_t size;
+  const struct index_header *hdr;
+  const struct index_pkg *pkgs;
+  const uint32_t *buckets;
+  const struct index_record *records;
+  const char *strings;
+};
+
+struct index_iter_t {
+  const struct index_t *idx;
+  const char *key;
+  size_t keylen;
+  bool icase;
+  uint32_t hash;
+  uint32_t pos;
+  uint32_t end;
+};
+
+struct index_builder_t;
+
+const char *index_basename(const char *path, size_t *len);
+
+struct index_builder_t *index_builder_new(void);
+int index_builder_add_pkg(struct index_builder_t *b, const char *pkgname,
+                          size_t len, uint64_t offset);
+int index_builder_add_file(struct index_builder_t *b, const char *path,
+                           size_t len);
+int index_builder_write(struct index_builder_t *b, const char *filename,
+                        const struct stat *dbst);
+void index_builder_free(struct index_builder_t *b);
+
+int index_open(struct index_t *idx, const char *filename,
+               const struct stat *dbst);
+void index_close(struct index_t *idx);
+
+/* Finds the package with the given name, which excludes the version. */
+const struct index_pkg *index_find_pkg(const struct index_t *idx,
+                                       const char *name, size_t len);
+
+/* With icase, the key must already be folded to lower case. */
+void index_iter_init(struct index_iter_t *it, const struct index_t *idx,
+                     const char *key, size_t keylen, bool icase);
+bool index_iter_next(struct index_iter_t *it, const char **pkgname,
+                     const char **path, size_t *pathlen);
+
+/* vim: set ts=2 sw=2 et: */
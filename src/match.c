@@ -20,16 +20,160 @@
  * THE SOFTWARE.
  */
 
+#include <ctype.h>
 #include <fnmatch.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "macro.h"
 #include "match.h"
 #include "pkgfile.h"
+#include "util.h"
 
-int match_glob(const filterpattern_t *pattern, const char *line, int UNUSED len,
+int match_glob(const filterpattern_t *pattern, const char *line, int len,
                int flags) {
-  return fnmatch(pattern->glob.glob, line, flags);
+  char folded[PATH_MAX];
+
+  if (!flags) {
+    return fnmatch(pattern->glob.glob, line, 0);
+  }
+
+  /* folding the line to match a folded glob against is much cheaper than
+   * having fnmatch fold every character as it goes */
+  if (pattern->glob.folded != NULL && (size_t)len < sizeof(folded)) {
+    ascii_fold(folded, line, len);
+    folded[len] = '\0';
+    return fnmatch(pattern->glob.folded, folded, 0);
+  }
+
+  return fnmatch(pattern->glob.glob, line, FNM_CASEFOLD);
+}
+
+#ifdef HAVE_PCRE2
+/* What a thread needs to run a match, made the first time it runs one and
+ * reused for every line after. The thread local pointer is what the matcher
+ * looks at, and the key only exists to free it when the thread exits. */
+struct regex_thread_t {
+  pcre2_match_data *md;
+  pcre2_match_context *mctx;
+  pcre2_jit_stack *stack;
+};
+
+static pthread_key_t regex_key;
+static pthread_once_t regex_once = PTHREAD_ONCE_INIT;
+static __thread struct regex_thread_t *regex_thread;
+
+static void regex_thread_free(void *arg) {
+  struct regex_thread_t *t = arg;
+
+  pcre2_match_data_free(t->md);
+  pcre2_match_context_free(t->mctx);
+  pcre2_jit_stack_free(t->stack);
+  free(t);
+}
+
+static void regex_key_create(void) {
+  pthread_key_create(&regex_key, regex_thread_free);
+}
+
+static struct regex_thread_t *regex_thread_get(void) {
+  struct regex_thread_t *t = regex_thread;
+
+  if (t != NULL) {
+    return t;
+  }
+
+  CALLOC(t, 1, sizeof(struct regex_thread_t), return NULL);
+
+  /* whether there's a match is all that's wanted, never where */
+  t->md = pcre2_match_data_create(1, NULL);
+  t->mctx = pcre2_match_context_create(NULL);
+  if (t->md == NULL || t->mctx == NULL) {
+    regex_thread_free(t);
+    return NULL;
+  }
+
+  /* without a stack of its own, the JIT makes do with 32K of the machine
+   * stack */
+  t->stack = pcre2_jit_stack_create(32 * 1024, 512 * 1024, NULL);
+  pcre2_jit_stack_assign(t->mctx, NULL, t->stack);
+
+  pthread_once(&regex_once, regex_key_create);
+  pthread_setspecific(regex_key, t);
+  regex_thread = t;
+
+  return t;
+}
+
+int compile_regex(struct pcre_data *re, const char *pattern, bool icase) {
+  PCRE2_SIZE err_offset;
+  int err;
+
+  re->re = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+                         icase ? PCRE2_CASELESS : 0, &err, &err_offset, NULL);
+  if (re->re == NULL) {
+    PCRE2_UCHAR msg[256];
+
+    pcre2_get_error_message(err, msg, sizeof(msg));
+    fprintf(stderr, "error: failed to compile regex at char %zu: %s\n",
+            (size_t)err_offset, (const char *)msg);
+    return 1;
+  }
+
+  /* a PCRE2 built without JIT support can still interpret the pattern */
+  re->jit = pcre2_jit_compile(re->re, PCRE2_JIT_COMPLETE) == 0;
+
+  return 0;
+}
+
+int match_regex(const filterpattern_t *pattern, const char *line, int len,
+                int UNUSED flags) {
+  const struct pcre_data *re = &pattern->re;
+  struct regex_thread_t *t = regex_thread_get();
+  int r = PCRE2_ERROR_JIT_STACKLIMIT;
+
+  if (t == NULL) {
+    return 1;
+  }
+
+  if (re->jit) {
+    r = pcre2_jit_match(re->re, (PCRE2_SPTR)line, len, 0, 0, t->md, t->mctx);
+  }
+
+  /* a pattern which outgrows the JIT stack still gets an answer */
+  if (r == PCRE2_ERROR_JIT_STACKLIMIT) {
+    r = pcre2_match(re->re, (PCRE2_SPTR)line, len, 0,
+                    PCRE2_NO_UTF_CHECK | PCRE2_NO_JIT, t->md, t->mctx);
+  }
+
+  return r < 0;
+}
+
+void free_regex(filterpattern_t *pattern) {
+  pcre2_code_free(pattern->re.re);
+}
+#else
+int compile_regex(struct pcre_data *re, const char *pattern, bool icase) {
+  const char *err;
+  int err_offset;
+
+  re->re = pcre_compile(pattern, icase ? PCRE_CASELESS : 0, &err, &err_offset,
+                        NULL);
+  if (!re->re) {
+    fprintf(stderr, "error: failed to compile regex at char %d: %s\n",
+            err_offset, err);
+    return 1;
+  }
+
+  re->re_extra = pcre_study(re->re, PCRE_STUDY_JIT_COMPILE, &err);
+  if (err) {
+    fprintf(stderr, "error: failed to study regex: %s\n", err);
+    pcre_free(re->re);
+    return 1;
+  }
+
+  return 0;
 }
 
 int match_regex(const filterpattern_t *pattern, const char *line, int len,
@@ -42,6 +186,7 @@ void free_regex(filterpattern_t *pattern) {
   pcre_free(pattern->re.re);
   pcre_free_study(pattern->re.re_extra);
 }
+#endif
 
 int match_exact_basename(const filterpattern_t *pattern, const char *line,
                          int len, int flags) {
@@ -61,8 +206,214 @@ int match_exact(const filterpattern_t *pattern, const char *line, int len,
     return -1;
   }
 
-  return flags ? strcasecmp(pattern->glob.glob, line)
-               : memcmp(pattern->glob.glob, line, len);
+  if (!flags) {
+    return memcmp(pattern->glob.glob, line, len);
+  }
+
+  if (pattern->glob.folded != NULL) {
+    return ascii_equal_folded(pattern->glob.folded, line, len) ? 0 : 1;
+  }
+
+  /* the locale decides what the case of anything beyond ASCII is */
+  return strcasecmp(pattern->glob.glob, line);
+}
+
+struct literal_run {
+  char *best;
+  size_t bestlen;
+  char *cur;
+  size_t curlen;
+};
+
+static void run_break(struct literal_run *run) {
+  if (run->curlen > run->bestlen) {
+    memcpy(run->best, run->cur, run->curlen);
+    run->bestlen = run->curlen;
+  }
+  run->curlen = 0;
+}
+
+/* Return the end of the bracket expression starting at p, or NULL if it can't
+ * be found for certain. */
+static const char *skip_bracket(const char *p) {
+  const char *q = p + 1;
+
+  if (*q == '!' || *q == '^') {
+    q++;
+  }
+  if (*q == ']') {
+    q++;
+  }
+
+  while (*q != ']') {
+    if (*q == '\0') {
+      return NULL;
+    } else if (*q == '\\' && q[1] != '\0') {
+      q += 2;
+    } else if (*q == '[' && (q[1] == ':' || q[1] == '=' || q[1] == '.')) {
+      const char close[] = {q[1], ']', '\0'};
+      const char *end = strstr(q + 2, close);
+      if (end == NULL) {
+        return NULL;
+      }
+      q = end + 2;
+    } else {
+      q++;
+    }
+  }
+
+  return q + 1;
+}
+
+size_t glob_literal(const char *glob, char *literal) {
+  _cleanup_free_ char *cur = NULL;
+  struct literal_run run = {.best = literal};
+  const char *p = glob;
+
+  MALLOC(cur, strlen(glob) + 1, return 0);
+  run.cur = cur;
+
+  while (*p != '\0') {
+    switch (*p) {
+      case '*':
+      case '?':
+      case ']':
+        run_break(&run);
+        p++;
+        break;
+      case '[':
+        run_break(&run);
+        p = skip_bracket(p);
+        if (p == NULL) {
+          goto done;
+        }
+        break;
+      case '\\':
+        if (p[1] == '\0') {
+          goto done;
+        }
+        run.cur[run.curlen++] = p[1];
+        p += 2;
+        break;
+      default:
+        run.cur[run.curlen++] = *p++;
+        break;
+    }
+  }
+
+done:
+  run_break(&run);
+  return run.bestlen;
+}
+
+/* Whether the regex has an escape which goes on past its next character,
+ * such as \x2e, \pL or \g{1}, or a backreference, the rest of which would
+ * otherwise be taken for a literal. */
+static bool has_long_escape(const char *re) {
+  for (const char *p = re; *p != '\0'; ++p) {
+    if (*p != '\\') {
+      continue;
+    }
+    if (p[1] == '\0') {
+      break;
+    }
+    if (isdigit((unsigned char)p[1]) || strchr("cgkNopPx", p[1]) != NULL) {
+      return true;
+    }
+    p++;
+  }
+
+  return false;
+}
+
+size_t regex_literal(const char *re, char *literal) {
+  _cleanup_free_ char *cur = NULL;
+  struct literal_run run = {.best = literal};
+  const char *p = re;
+  int depth = 0;
+
+  /* alternation means that no one literal is required at all, and option
+   * settings or quoting change what a literal even is */
+  if (strchr(re, '|') || strstr(re, "(?") || strstr(re, "\\Q") ||
+      has_long_escape(re)) {
+    return 0;
+  }
+
+  MALLOC(cur, strlen(re) + 1, return 0);
+  run.cur = cur;
+
+  while (*p != '\0') {
+    switch (*p) {
+      case '?':
+      case '*':
+      case '+':
+        /* the preceding character may not be there at all */
+        if (run.curlen > 0) {
+          run.curlen--;
+        }
+        run_break(&run);
+        p++;
+        break;
+      case '{':
+        if (run.curlen > 0) {
+          run.curlen--;
+        }
+        run_break(&run);
+        p = strchr(p, '}');
+        if (p == NULL) {
+          goto done;
+        }
+        p++;
+        break;
+      case '(':
+        run_break(&run);
+        depth++;
+        p++;
+        break;
+      case ')':
+        run_break(&run);
+        depth--;
+        p++;
+        break;
+      case '[':
+        run_break(&run);
+        p = skip_bracket(p);
+        if (p == NULL) {
+          goto done;
+        }
+        break;
+      case '\\':
+        if (p[1] == '\0' || isalnum((unsigned char)p[1]) || depth > 0) {
+          run_break(&run);
+          p += p[1] == '\0' ? 1 : 2;
+          break;
+        }
+        run.cur[run.curlen++] = p[1];
+        p += 2;
+        break;
+      case '.':
+      case '^':
+      case '$':
+      case ']':
+      case '}':
+        run_break(&run);
+        p++;
+        break;
+      default:
+        /* anything in a group might be made optional */
+        if (depth > 0) {
+          run_break(&run);
+        } else {
+          run.cur[run.curlen++] = *p;
+        }
+        p++;
+        break;
+    }
+  }
+
+done:
+  run_break(&run);
+  return run.bestlen;
 }
 
 /* vim: set ts=2 sw=2 et: */
@@ -34,4 +34,14 @@ int match_exact_basename(const filterpattern_t *filter, const char *line,
                          int len, int flags);
 void free_regex(filterpattern_t *pattern);
 
+/* Compiles a pattern for match_regex, writing out why it failed to if it
+ * can't be. Returns 0 on success. */
+int compile_regex(struct pcre_data *re, const char *pattern, bool icase);
+
+/* Find the longest literal which every match of a pattern must contain,
+ * storing it in literal, which must be as large as the pattern. Returns its
+ * length, which is 0 when no literal could be found. */
+size_t glob_literal(const char *glob, char *literal);
+size_t regex_literal(const char *re, char *literal);
+
 /* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "mirrors.h"
+
+/* how much a new measurement counts for against everything before it */
+#define MIRRORS_WEIGHT 0.5
+
+/* what the time to download is estimated for, about the size of a small
+ * repo */
+#define MIRRORS_ESTIMATE_BYTES (1024.0 * 1024.0)
+
+static struct mirror_t *mirrors_find(const struct mirrors_t *m,
+                                     const char *server) {
+  for (int i = 0; i < m->count; ++i) {
+    if (strcmp(m->mirrors[i].server, server) == 0) {
+      return &m->mirrors[i];
+    }
+  }
+
+  return NULL;
+}
+
+static struct mirror_t *mirrors_add(struct mirrors_t *m, const char *server) {
+  struct mirror_t *mirror;
+
+  if (m->count == m->capacity) {
+    int newsz = m->capacity ? m->capacity * 2 : 16;
+    struct mirror_t *newmirrors =
+        realloc(m->mirrors, newsz * sizeof(struct mirror_t));
+    if (newmirrors == NULL) {
+      return NULL;
+    }
+    m->mirrors = newmirrors;
+    m->capacity = newsz;
+  }
+
+  mirror = &m->mirrors[m->count];
+  mirror->server = strdup(server);
+  if (mirror->server == NULL) {
+    return NULL;
+  }
+  mirror->latency = -1;
+  mirror->rate = 0;
+  mirror->failures = 0;
+  m->count++;
+
+  return mirror;
+}
+
+static struct mirror_t *mirrors_get(struct mirrors_t *m, const char *server) {
+  struct mirror_t *mirror = mirrors_find(m, server);
+
+  return mirror ? mirror : mirrors_add(m, server);
+}
+
+void mirrors_load(struct mirrors_t *m, const char *cachedir) {
+  _cleanup_free_ char *filename = NULL, *line = NULL;
+  size_t linesz = 0;
+  ssize_t len;
+  FILE *fp;
+
+  memset(m, 0, sizeof(*m));
+
+  if (asprintf(&filename, "%s/" MIRRORS_FILE, cachedir) < 0) {
+    return;
+  }
+
+  fp = fopen(filename, "re");
+  if (fp == NULL) {
+    return;
+  }
+
+  /* each line is: failures latency rate server */
+  while ((len = getline(&line, &linesz, fp)) > 0) {
+    struct mirror_t *mirror;
+    double latency, rate;
+    unsigned failures;
+    int server = 0;
+
+    if (line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+
+    if (sscanf(line, "%u %lf %lf %n", &failures, &latency, &rate, &server) <
+            3 ||
+        server == 0 || line[server] == '\0' ||
+        mirrors_find(m, &line[server]) != NULL) {
+      continue;
+    }
+
+    mirror = mirrors_add(m, &line[server]);
+    if (mirror == NULL) {
+      break;
+    }
+    mirror->latency = latency;
+    mirror->rate = rate;
+    mirror->failures = failures;
+  }
+
+  fclose(fp);
+}
+
+int mirrors_save(const struct mirrors_t *m, const char *cachedir) {
+  char filename[PATH_MAX], tmpfile[PATH_MAX];
+  FILE *fp;
+  int r;
+
+  if (snprintf(filename, sizeof(filename), "%s/" MIRRORS_FILE, cachedir) >=
+          (int)sizeof(filename) ||
+      snprintf(tmpfile, sizeof(tmpfile), "%s~", filename) >=
+          (int)sizeof(tmpfile)) {
+    return -ENAMETOOLONG;
+  }
+
+  fp = fopen(tmpfile, "we");
+  if (fp == NULL) {
+    return -errno;
+  }
+
+  for (int i = 0; i < m->count; ++i) {
+    const struct mirror_t *mirror = &m->mirrors[i];
+
+    fprintf(fp, "%u %.6f %.0f %s\n", mirror->failures, mirror->latency,
+            mirror->rate, mirror->server);
+  }
+
+  if (ferror(fp)) {
+    fclose(fp);
+    unlink(tmpfile);
+    return -EIO;
+  }
+
+  if (fclose(fp) != 0 || rename(tmpfile, filename) < 0) {
+    r = -errno;
+    unlink(tmpfile);
+    return r;
+  }
+
+  return 0;
+}
+
+void mirrors_free(struct mirrors_t *m) {
+  for (int i = 0; i < m->count; ++i) {
+    free(m->mirrors[i].server);
+  }
+  free(m->mirrors);
+  memset(m, 0, sizeof(*m));
+}
+
+static double weigh(double old, double sample) {
+  return old <= 0 ? sample : old + MIRRORS_WEIGHT * (sample - old);
+}
+
+void mirrors_record_success(struct mirrors_t *m, const char *server,
+                            double latency, double rate) {
+  struct mirror_t *mirror = mirrors_get(m, server);
+
+  if (mirror == NULL) {
+    return;
+  }
+
+  if (latency >= 0) {
+    mirror->latency = weigh(mirror->latency, latency);
+  }
+  if (rate > 0) {
+    mirror->rate = weigh(mirror->rate, rate);
+  }
+  mirror->failures = 0;
+}
+
+void mirrors_record_lost(struct mirrors_t *m, const char *server,
+                         double elapsed) {
+  struct mirror_t *mirror = mirrors_get(m, server);
+
+  /* it's only known to be no quicker than this */
+  if (mirror != NULL && elapsed > mirror->latency) {
+    mirror->latency = weigh(mirror->latency, elapsed);
+  }
+}
+
+void mirrors_record_failure(struct mirrors_t *m, const char *server) {
+  struct mirror_t *mirror = mirrors_get(m, server);
+
+  if (mirror != NULL) {
+    mirror->failures++;
+  }
+}
+
+/* a server which has only ever failed has been measured too */
+static bool measured(const struct mirror_t *mirror) {
+  return mirror != NULL && (mirror->latency >= 0 || mirror->failures > 0);
+}
+
+/* Whether a is expected to do better than b. */
+static bool faster(const struct mirror_t *a, const struct mirror_t *b) {
+  double ta, tb;
+
+  if (!measured(a) || !measured(b)) {
+    return measured(a) && !measured(b);
+  }
+
+  /* a server which keeps failing is worse than any slow one */
+  if (a->failures != b->failures) {
+    return a->failures < b->failures;
+  }
+  if ((a->latency < 0) != (b->latency < 0)) {
+    return b->latency < 0;
+  }
+
+  /* without a rate, all that's known is how long it takes to start */
+  if (a->rate <= 0 || b->rate <= 0) {
+    return a->latency < b->latency;
+  }
+
+  ta = a->latency + MIRRORS_ESTIMATE_BYTES / a->rate;
+  tb = b->latency + MIRRORS_ESTIMATE_BYTES / b->rate;
+
+  return ta < tb;
+}
+
+void mirrors_sort(const struct mirrors_t *m, char **servers, int count) {
+  int first;
+
+  /* rarely more than a handful, and the configured order breaks ties */
+  for (int i = 1; i < count; ++i) {
+    char *server = servers[i];
+    const struct mirror_t *mirror = mirrors_find(m, server);
+    int j;
+
+    for (j = i; j > 0 && faster(mirror, mirrors_find(m, servers[j - 1]));
+         --j) {
+      servers[j] = servers[j - 1];
+    }
+    servers[j] = server;
+  }
+
+  /* the unmeasured are now at the end, and move up behind the fastest */
+  for (first = count; first > 0; --first) {
+    if (measured(mirrors_find(m, servers[first - 1]))) {
+      break;
+    }
+  }
+
+  if (first > 1 && first < count) {
+    for (int i = first; i < count; ++i) {
+      char *server = servers[i];
+
+      memmove(&servers[i - first + 2], &servers[i - first + 1],
+              (first - 1) * sizeof(char *));
+      servers[i - first + 1] = server;
+    }
+  }
+}
+
+/* vim: set ts=2 sw=2 et: */
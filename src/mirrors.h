@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#define MIRRORS_FILE "mirrors.stats"
+
+/* What earlier updates learned about a server, which is keyed by its URL as
+ * configured, before $repo and $arch are filled in, so that every repo served
+ * from the same mirror shares it. */
+struct mirror_t {
+  char *server;
+  /* seconds to the first byte, or -1 when never measured */
+  double latency;
+  /* bytes per second once data is flowing, or 0 when never measured */
+  double rate;
+  /* failed downloads since the last to succeed */
+  unsigned failures;
+};
+
+struct mirrors_t {
+  struct mirror_t *mirrors;
+  int count;
+  int capacity;
+};
+
+/* A missing or unreadable file only means that nothing has been learned
+ * yet. */
+void mirrors_load(struct mirrors_t *m, const char *cachedir);
+int mirrors_save(const struct mirrors_t *m, const char *cachedir);
+void mirrors_free(struct mirrors_t *m);
+
+void mirrors_record_success(struct mirrors_t *m, const char *server,
+                            double latency, double rate);
+/* For a server which hadn't started to deliver by the time another won. */
+void mirrors_record_lost(struct mirrors_t *m, const char *server,
+                         double elapsed);
+void mirrors_record_failure(struct mirrors_t *m, const char *server);
+
+/* Orders servers from the one expected to be fastest to the one expected to
+ * be slowest, except that servers never measured go right after the fastest
+ * so that they get a chance to prove themselves. */
+void mirrors_sort(const struct mirrors_t *m, char **servers, int count);
+
+/* vim: set ts=2 sw=2 et: */
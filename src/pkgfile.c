@@ -32,12 +32,22 @@
 #include <unistd.h>
 
 #include "pkgfile.h"
+#include "batch.h"
+#include "classify.h"
+#include "daemon.h"
+#include "flatdb.h"
+#include "index.h"
 #include "macro.h"
 #include "match.h"
 #include "missing.h"
+#include "pool.h"
+#include "qcache.h"
 #include "repo.h"
 #include "result.h"
+#include "stats.h"
+#include "trigram.h"
 #include "update.h"
+#include "util.h"
 
 #ifdef GIT_VERSION
 #undef PACKAGE_VERSION
@@ -50,11 +60,30 @@
 
 static struct config_t config;
 
+enum {
+  OPT_BATCH = 256,
+  OPT_DAEMON,
+  OPT_CLIENT,
+  OPT_SOCKET,
+  OPT_CACHEDIR,
+  OPT_STATS,
+  OPT_STREAM,
+  OPT_MAX_RESULTS,
+  OPT_FIRST,
+  OPT_RACE,
+  OPT_NO_MMAP,
+  OPT_TRIGRAMS,
+  OPT_QUERY_CACHE,
+  OPT_SORT_BUFFER,
+  OPT_ARCH,
+};
+
 static const char *filtermethods[] = {[FILTER_GLOB] = "glob",
                                       [FILTER_REGEX] = "regex"};
 
 static int reader_block_consume(struct archive_line_reader *reader,
                                 struct archive *a) {
+  struct stats_timer_t t;
   int64_t offset;
 
   /* end of the archive */
@@ -68,25 +97,31 @@ static int reader_block_consume(struct archive_line_reader *reader,
   }
 
   /* grab a new block of data from the archive */
+  stats_begin(&t, STATS_CLOCK_NONE);
   reader->ret = archive_read_data_block(a, (void *)&reader->block.base,
                                         &reader->block.size, &offset);
+  stats_end(&t, PHASE_DECOMPRESS);
   reader->block.offset = reader->block.base;
+  if (reader->ret == ARCHIVE_OK) {
+    stats_add(STATS_BYTES_DECOMPRESSED, reader->block.size);
+  }
 
   return reader->ret;
 }
 
 static void *reader_block_find_eol(struct archive_line_reader *reader) {
-  void *endp;
   size_t n = reader->block.base + reader->block.size - reader->block.offset;
+  size_t eol, slash;
 
   /* Find the end of the copy-worthy region. This might be a newline
-   * or simply the end of the data block read from the archive. */
-  endp = memchr(reader->block.offset, '\n', n);
-  if (endp == NULL) {
-    endp = reader->block.base + reader->block.size;
+   * or simply the end of the data block read from the archive. The last
+   * slash along the way marks where the line's basename starts. */
+  eol = classify_find_eol(reader->block.offset, n, '\n', &slash);
+  if (slash != SIZE_MAX) {
+    reader->slash = (reader->line.offset - reader->line.base) + slash;
   }
 
-  return endp;
+  return reader->block.offset + eol;
 }
 
 static bool reader_line_would_overflow(struct archive_line_reader *b,
@@ -113,10 +148,82 @@ static int reader_line_consume(struct archive_line_reader *reader) {
   return *endp == '\n' ? 0 : EAGAIN;
 }
 
+static int reader_getline_mapped(struct archive_line_reader *reader) {
+  size_t n = reader->block.base + reader->block.size - reader->block.offset;
+  size_t eol, slash;
+
+  if (n == 0) {
+    return ARCHIVE_EOF;
+  }
+
+  /* lines in a flat DB are NUL terminated, so they're handed out in place */
+  eol = classify_find_eol(reader->block.offset, n, '\0', &slash);
+
+  reader->line.base = reader->block.offset;
+  reader->line.size = eol;
+  reader->block.offset += eol < n ? eol + 1 : eol;
+  reader->flags = classify_line_slash(reader->line.base, reader->line.size,
+                                      slash, &reader->basename);
+
+  return ARCHIVE_OK;
+}
+
+static int reader_getline_compact(struct archive_line_reader *reader) {
+  const struct compactdb_t *db = reader->compact;
+
+  while (reader->file < reader->endfile) {
+    const struct compactdb_file *f = &db->files[reader->file++];
+
+    if ((uint64_t)f->name + f->namelen >= db->hdr->strings_size) {
+      continue;
+    }
+
+    /* the directory is left in the line buffer for the files that follow */
+    if (f->dir != reader->dir) {
+      reader->dirlen =
+          compactdb_dirpath(db, f->dir, reader->line.base, MAX_LINE_SIZE);
+      reader->dir = reader->dirlen > 0 ? f->dir : COMPACTDB_NO_PARENT;
+    }
+
+    if (reader->dirlen + f->namelen >= MAX_LINE_SIZE) {
+      return ENOBUFS;
+    }
+
+    memcpy(reader->line.base + reader->dirlen, &db->strings[f->name],
+           f->namelen);
+    reader->line.size = reader->dirlen + f->namelen;
+    reader->line.base[reader->line.size] = '\0';
+
+    /* classified when the DB was written */
+    if (f->flags & COMPACTDB_FILE_CLASSIFIED) {
+      reader->flags = f->flags & (LINE_DIRECTORY | LINE_BINARY);
+      reader->basename = reader->dirlen;
+    } else {
+      reader->flags = classify_line(reader->line.base, reader->line.size,
+                                    &reader->basename);
+    }
+
+    return ARCHIVE_OK;
+  }
+
+  return ARCHIVE_EOF;
+}
+
 int reader_getline(struct archive_line_reader *reader, struct archive *a) {
+  /* without an archive, we're reading straight from a mapped DB */
+  if (a == NULL) {
+    int r = reader->compact ? reader_getline_compact(reader)
+                            : reader_getline_mapped(reader);
+    if (r == ARCHIVE_OK) {
+      stats_add(STATS_LINES, 1);
+    }
+    return r;
+  }
+
   /* Reset the line */
   reader->line.offset = reader->line.base;
   reader->line.size = 0;
+  reader->slash = SIZE_MAX;
 
   for (;;) {
     int r;
@@ -131,97 +238,135 @@ int reader_getline(struct archive_line_reader *reader, struct archive *a) {
       continue;
     }
 
+    if (r == 0) {
+      reader->flags = classify_line_slash(reader->line.base, reader->line.size,
+                                          reader->slash, &reader->basename);
+      stats_add(STATS_LINES, 1);
+    }
+
     return r;
   }
 }
 
-static bool is_directory(const char *line, const size_t len) {
-  return line[len - 1] == '/';
-}
+/* shortest literal worth a prefilter for glob and regex matching */
+#define LITERAL_MIN 3
 
-static bool is_binary(const char *line, const size_t len) {
-  const char *ptr;
+/* room for $repo/$pkgname $pkgver-$pkgrel */
+#define PREFIX_MAX (2 * PATH_MAX)
 
-  if (is_directory(line, len)) {
-    return false;
+static int format_search_result(char *prefix, size_t size, const char *repo,
+                                struct pkg_t *pkg) {
+  int len;
+
+  if (config.verbose) {
+    len = snprintf(prefix, size, "%s/%.*s %.*s", repo, pkg->namelen,
+                   pkg->name, pkg->versionlen, pkg->version);
+  } else if (config.quiet) {
+    len = snprintf(prefix, size, "%.*s", pkg->namelen, pkg->name);
+  } else {
+    len = snprintf(prefix, size, "%s/%.*s", repo, pkg->namelen, pkg->name);
+  }
+
+  return (size_t)len < size ? len : -ENAMETOOLONG;
+}
+
+static bool literal_matches(const char *s, size_t len) {
+  if (config.literal == NULL ||
+      memmem(s, len, config.literal, config.literallen) != NULL) {
+    return true;
   }
 
-  ptr = memmem(line, len, "bin/", 4);
+  stats_add(STATS_PREFILTERED, 1);
+  return false;
+}
 
-  /* toss out the obvious non-matches */
-  if (!ptr) {
+static bool search_line_wanted(const size_t len, unsigned flags) {
+  if (len == 0) {
     return false;
   }
 
-  /* match bin/... */
-  if (ptr == line) {
-    goto found_match_candidate;
+  if ((!config.directories && (flags & LINE_DIRECTORY)) ||
+      (config.binaries && !(flags & LINE_BINARY))) {
+    stats_add(STATS_LINES_FILTERED, 1);
+    return false;
   }
 
-  /* match sbin/... */
-  if (line == ptr - 1 && ptr[-1] == 's') {
-    goto found_match_candidate;
+  return true;
+}
+
+/* every call to a matcher goes through here, so that --stats can count and
+ * time them */
+static int filter_match(int (*func)(const filterpattern_t *filter,
+                                    const char *line, int len, int flags),
+                        const filterpattern_t *filter, const char *line,
+                        int len, int flags) {
+  struct stats_timer_t t;
+  int r;
+
+  if (stats_current == NULL) {
+    return func(filter, line, len, flags);
   }
 
-  /* match .../bin/ */
-  if (ptr[-1] == '/') {
-    goto found_match_candidate;
+  stats_add(STATS_MATCHER_CALLS, 1);
+  stats_begin(&t, STATS_CLOCK_NONE);
+  r = func(filter, line, len, flags);
+  stats_end(&t, PHASE_MATCH);
+
+  return r;
+}
+
+static bool search_line_matches(const char *line, const size_t len,
+                                unsigned flags, size_t basename) {
+  if (!search_line_wanted(len, flags)) {
+    return false;
   }
 
-  /* match .../sbin/ */
-  if (ptr >= line + 2 && ptr[-2] == '/' && ptr[-1] == 's') {
-    goto found_match_candidate;
+  if (!literal_matches(line, len)) {
+    return false;
   }
 
-  return false;
+  /* the basename is already known, so there's no need to look for it again */
+  if (config.filterfunc == match_exact_basename) {
+    return filter_match(match_exact, &config.filter, line + basename,
+                        (int)(len - basename), config.icase) == 0;
+  }
 
-found_match_candidate:
-  /* ensure that we only match /bin/bar and not /bin/foo/bar */
-  return memchr(ptr + 4, '/', (line + len) - (ptr + 4)) == NULL;
+  return filter_match(config.filterfunc, &config.filter, line, (int)len,
+                      config.icase) == 0;
 }
 
-static int format_search_result(char **result, const char *repo,
-                                struct pkg_t *pkg) {
-  if (config.verbose) {
-    return asprintf(result, "%s/%s %s", repo, pkg->name, pkg->version);
-  }
+static bool search_path_matches(const char *path, const size_t len) {
+  size_t basename;
+  unsigned flags = classify_line(path, len, &basename);
 
-  if (config.quiet) {
-    *result = strdup(pkg->name);
-    return *result == NULL ? -ENOMEM : pkg->namelen;
+  return search_line_matches(path, len, flags, basename);
+}
+
+static int search_result_add(const char *repo, struct pkg_t *pkg,
+                             struct result_t *result, const char *entry,
+                             size_t entrylen) {
+  char prefix[PREFIX_MAX];
+  int prefixlen = format_search_result(prefix, sizeof(prefix), repo, pkg);
+  if (prefixlen < 0) {
+    fprintf(stderr, "error: failed to format result for %.*s: %s\n",
+            pkg->namelen, pkg->name, strerror(-prefixlen));
+    return -1;
   }
 
-  return asprintf(result, "%s/%s", repo, pkg->name);
+  return result_add(result, prefix, prefixlen, config.verbose ? entry : NULL,
+                    entrylen);
 }
 
 static int search_metafile(const char *repo, struct pkg_t *pkg,
                            struct archive *a, struct result_t *result,
                            struct archive_line_reader *buf) {
   while (reader_getline(buf, a) == ARCHIVE_OK) {
-    const size_t len = buf->line.size;
-
-    if (len == 0) {
-      continue;
-    }
-
-    if (!config.directories && is_directory(buf->line.base, len)) {
-      continue;
-    }
-
-    if (config.binaries && !is_binary(buf->line.base, len)) {
-      continue;
-    }
-
-    if (config.filterfunc(&config.filter, buf->line.base, (int)len,
-                          config.icase) == 0) {
-      _cleanup_free_ char *line = NULL;
-      int prefixlen = format_search_result(&line, repo, pkg);
-      if (prefixlen < 0) {
-        fputs("error: failed to allocate memory for result\n", stderr);
+    if (search_line_matches(buf->line.base, buf->line.size, buf->flags,
+                            buf->basename)) {
+      if (search_result_add(repo, pkg, result, buf->line.base,
+                            buf->line.size) < 0) {
         return -1;
       }
-      result_add(result, line, config.verbose ? buf->line.base : NULL,
-                 config.verbose ? prefixlen : 0);
 
       if (!config.verbose) {
         return 0;
@@ -232,37 +377,79 @@ static int search_metafile(const char *repo, struct pkg_t *pkg,
   return 0;
 }
 
+static bool list_pkg_matches(const struct pkg_t *pkg) {
+  char name[PATH_MAX];
+  const char *s = pkg->name;
+
+  if (!literal_matches(pkg->name, pkg->namelen)) {
+    return false;
+  }
+
+  /* the name runs on into its version, which fnmatch and strcasecmp would
+   * go on to read, so they're given a copy of it */
+  if (config.filterby == FILTER_GLOB ||
+      (config.filterby == FILTER_EXACT && config.icase &&
+       config.filter.glob.folded == NULL)) {
+    if ((size_t)pkg->namelen >= sizeof(name)) {
+      return false;
+    }
+    memcpy(name, pkg->name, pkg->namelen);
+    name[pkg->namelen] = '\0';
+    s = name;
+  }
+
+  return filter_match(config.filterfunc, &config.filter, s, pkg->namelen,
+                      config.icase) == 0;
+}
+
+/* how many lines of a package are listed between checks on its result */
+#define LIST_PROGRESS_LINES 1024
+
+static bool list_progress(struct result_t *result);
+
 static int list_metafile(const char *repo, struct pkg_t *pkg, struct archive *a,
                          struct result_t *result,
                          struct archive_line_reader *buf) {
-  if (config.filterfunc(&config.filter, pkg->name, pkg->namelen,
-                        config.icase) != 0) {
+  char prefix[PREFIX_MAX];
+  int prefixlen = 0;
+  size_t lines = 0;
+
+  if (!list_pkg_matches(pkg)) {
     return 0;
   }
 
+  /* every line of the package shares the one prefix */
+  if (!config.quiet) {
+    prefixlen = snprintf(prefix, sizeof(prefix), "%s/%.*s", repo,
+                         pkg->namelen, pkg->name);
+    if (prefixlen >= (int)sizeof(prefix)) {
+      fprintf(stderr, "error: failed to format result for %.*s: %s\n",
+              pkg->namelen, pkg->name, strerror(ENAMETOOLONG));
+      return 0;
+    }
+  }
+
   while (reader_getline(buf, a) == ARCHIVE_OK) {
     const size_t len = buf->line.size;
-    int prefixlen = 0;
-    _cleanup_free_ char *line = NULL;
 
-    if (len == 0 || (config.binaries && !is_binary(buf->line.base, len))) {
+    if (len == 0) {
+      continue;
+    }
+
+    if (config.binaries && !(buf->flags & LINE_BINARY)) {
+      stats_add(STATS_LINES_FILTERED, 1);
       continue;
     }
 
     if (config.quiet) {
-      line = strdup(buf->line.base);
-      if (line == NULL) {
-        fputs("error: failed to allocate memory\n", stderr);
-        return 0;
-      }
+      result_add(result, buf->line.base, len, NULL, 0);
     } else {
-      prefixlen = asprintf(&line, "%s/%s", repo, pkg->name);
-      if (prefixlen < 0) {
-        fputs("error: failed to allocate memory\n", stderr);
-        return 0;
-      }
+      result_add(result, prefix, prefixlen, buf->line.base, len);
+    }
+
+    if (++lines % LIST_PROGRESS_LINES == 0 && list_progress(result)) {
+      return -1;
     }
-    result_add(result, line, config.quiet ? NULL : buf->line.base, prefixlen);
   }
 
   /* When we encounter a match with fixed string matching, we know we're done.
@@ -271,6 +458,128 @@ static int list_metafile(const char *repo, struct pkg_t *pkg, struct archive *a,
   return config.filterby == FILTER_EXACT ? -1 : 0;
 }
 
+static struct batch_t batch;
+
+static bool batch_target_matches(const struct batch_target_t *t,
+                                 const char *line, size_t len) {
+  if (config.filterby == FILTER_EXACT) {
+    /* the basename has already matched */
+    if (!t->fullpath) {
+      return true;
+    }
+    return t->len == len &&
+           (config.icase ? strncasecmp(t->target, line, len)
+                         : memcmp(t->target, line, len)) == 0;
+  }
+
+  if (t->literal && memmem(line, len, t->literal, t->literallen) == NULL) {
+    stats_add(STATS_PREFILTERED, 1);
+    return false;
+  }
+
+  return filter_match(config.filterfunc, &t->filter, line, (int)len,
+                      config.icase ? FNM_CASEFOLD : 0) == 0;
+}
+
+static int batch_result_add(const char *repo, struct pkg_t *pkg,
+                            struct result_t *result, uint32_t id,
+                            const char *entry, size_t entrylen) {
+  const struct batch_target_t *t = &batch.targets[id];
+  char prefix[PREFIX_MAX];
+  int len, prefixlen;
+
+  /* results are tagged with the target they matched */
+  len = snprintf(prefix, sizeof(prefix), "%s\t", t->target);
+  prefixlen = (size_t)len < sizeof(prefix)
+                  ? format_search_result(prefix + len, sizeof(prefix) - len,
+                                         repo, pkg)
+                  : -ENAMETOOLONG;
+  if (prefixlen < 0) {
+    fprintf(stderr, "error: failed to format result for %.*s: %s\n",
+            pkg->namelen, pkg->name, strerror(-prefixlen));
+    return -1;
+  }
+
+  return result_add(result, prefix, len + prefixlen,
+                    config.verbose ? entry : NULL, entrylen);
+}
+
+struct batch_seen_t {
+  uint32_t *ids;
+  size_t size;
+  size_t capacity;
+};
+
+/* without --verbose, each target reports a package once */
+static bool batch_seen(struct batch_seen_t *seen, uint32_t id) {
+  if (config.verbose) {
+    return false;
+  }
+
+  for (size_t i = 0; i < seen->size; ++i) {
+    if (seen->ids[i] == id) {
+      return true;
+    }
+  }
+
+  if (seen->size == seen->capacity) {
+    size_t newsz = MAX(seen->capacity * 2, (size_t)16);
+    uint32_t *newids = realloc(seen->ids, newsz * sizeof(uint32_t));
+    if (newids == NULL) {
+      return false;
+    }
+    seen->ids = newids;
+    seen->capacity = newsz;
+  }
+  seen->ids[seen->size++] = id;
+
+  return false;
+}
+
+static int batch_metafile(const char *repo, struct pkg_t *pkg,
+                          struct archive *a, struct result_t *result,
+                          struct archive_line_reader *buf) {
+  struct batch_seen_t seen = {};
+  int r = 0;
+
+  while (r == 0 && reader_getline(buf, a) == ARCHIVE_OK) {
+    const char *line = buf->line.base;
+    const size_t len = buf->line.size;
+
+    if (!search_line_wanted(len, buf->flags)) {
+      continue;
+    }
+
+    if (config.filterby == FILTER_EXACT) {
+      const char *key = line + buf->basename;
+      size_t keylen = len - buf->basename;
+
+      for (uint32_t id = batch_first(&batch, key, keylen);
+           id != BATCH_NO_TARGET; id = batch_next(&batch, id, key, keylen)) {
+        if (batch_target_matches(&batch.targets[id], line, len) &&
+            !batch_seen(&seen, id) &&
+            batch_result_add(repo, pkg, result, id, line, len) < 0) {
+          r = -1;
+          break;
+        }
+      }
+    } else {
+      for (uint32_t id = 0; id < batch.ntargets; ++id) {
+        if (batch_target_matches(&batch.targets[id], line, len) &&
+            !batch_seen(&seen, id) &&
+            batch_result_add(repo, pkg, result, id, line, len) < 0) {
+          r = -1;
+          break;
+        }
+      }
+    }
+  }
+
+  free(seen.ids);
+
+  return r;
+}
+
 static int parse_pkgname(struct pkg_t *pkg, const char *entryname, size_t len) {
   const char *dash, *slash = &entryname[len];
 
@@ -284,141 +593,1376 @@ static int parse_pkgname(struct pkg_t *pkg, const char *entryname, size_t len) {
     return -EINVAL;
   }
 
-  memcpy(pkg->name, entryname, len);
-
-  /* ->name and ->version share the same memory */
-  pkg->name[dash - entryname] = pkg->name[slash - entryname] = '\0';
-  pkg->version = &pkg->name[dash - entryname + 1];
-  pkg->namelen = pkg->version - pkg->name - 1;
+  /* nothing is copied, ->name and ->version point into the entry's name */
+  pkg->name = entryname;
+  pkg->namelen = dash - entryname;
+  pkg->version = dash + 1;
+  pkg->versionlen = slash - pkg->version;
 
   return 0;
 }
 
-static void *load_repo(void *repo_obj) {
-  char repofile[FILENAME_MAX];
-  _cleanup_free_ char *line = NULL;
-  struct archive *a;
-  struct archive_entry *e;
+static bool can_use_index(void) {
+  if (config.filterby != FILTER_EXACT) {
+    return false;
+  }
+
+  if (config.filefunc == batch_metafile) {
+    return !config.icase;
+  }
+
+  /* basenames are hashed folded, so a folded target finds its bucket too */
+  return config.filefunc == search_metafile &&
+         (!config.icase || config.filter.glob.folded != NULL);
+}
+
+static bool can_list_from_index(void) {
+  return config.filefunc == list_metafile && config.filterby == FILTER_EXACT &&
+         !config.icase;
+}
+
+/* a glob or regex which has a literal to narrow the packages down with */
+static bool can_use_trigrams(void) {
+  return config.filefunc == search_metafile && config.literal != NULL &&
+         (config.filterby == FILTER_GLOB || config.filterby == FILTER_REGEX);
+}
+
+static void search_index(const struct repo_t *repo, const struct index_t *idx,
+                         struct result_t *result) {
+  struct index_iter_t it;
+  const char *key = config.icase ? config.filter.glob.folded
+                                  : config.filter.glob.glob,
+             *pkgname, *path, *lastpkg = NULL;
+  size_t keylen = config.filter.glob.globlen, pathlen;
   struct pkg_t pkg;
-  struct repo_t *repo;
-  struct result_t *result;
-  struct stat st;
-  void *repodata = MAP_FAILED;
-  struct archive_line_reader read_buffer = {};
 
-  repo = repo_obj;
-  snprintf(repofile, sizeof(repofile), CACHEPATH "/%s.files", repo->name);
-  result = result_new(repo->name, 50);
+  /* every candidate path shares the basename of the target, so the full path
+   * match provided by match_exact still happens on the candidates */
+  key = index_basename(key, &keylen);
 
-  a = archive_read_new();
-  archive_read_support_format_all(a);
-  archive_read_support_filter_all(a);
+  index_iter_init(&it, idx, key, keylen, config.icase);
+  while (index_iter_next(&it, &pkgname, &path, &pathlen)) {
+    stats_add(STATS_LINES, 1);
 
-  MALLOC(line, MAX_LINE_SIZE, return NULL);
+    /* records for a package are adjacent, and without --verbose we only
+     * report each package once */
+    if (!config.verbose && pkgname == lastpkg) {
+      continue;
+    }
 
-  repo->fd = open(repofile, O_RDONLY);
-  if (repo->fd < 0) {
-    /* fail silently if the file doesn't exist */
-    if (errno != ENOENT) {
-      fprintf(stderr, "error: failed to open repo: %s: %s\n", repofile,
-              strerror(errno));
+    if (!search_path_matches(path, pathlen)) {
+      continue;
     }
-    goto cleanup;
-  }
 
-  fstat(repo->fd, &st);
-  repodata =
-      mmap(0, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, repo->fd, 0);
-  if (repodata == MAP_FAILED) {
-    fprintf(stderr, "error: failed to map pages for %s: %s\n", repofile,
-            strerror(errno));
-    goto cleanup;
+    if (parse_pkgname(&pkg, pkgname, strlen(pkgname)) < 0) {
+      continue;
+    }
+
+    if (search_result_add(repo_label(repo), &pkg, result, path, pathlen) < 0) {
+      break;
+    }
+
+    lastpkg = pkgname;
   }
+}
 
-  if (archive_read_open_memory(a, repodata, st.st_size) != ARCHIVE_OK) {
-    fprintf(stderr, "error: failed to load repo: %s: %s\n", repofile,
-            archive_error_string(a));
-    goto cleanup;
+static void batch_search_index(const struct repo_t *repo,
+                               const struct index_t *idx,
+                               struct result_t *result) {
+  for (uint32_t id = 0; id < batch.ntargets; ++id) {
+    const struct batch_target_t *t = &batch.targets[id];
+    const char *pkgname, *path, *lastpkg = NULL;
+    struct index_iter_t it;
+    struct pkg_t pkg;
+    size_t pathlen;
+
+    index_iter_init(&it, idx, t->key, t->keylen, false);
+    while (index_iter_next(&it, &pkgname, &path, &pathlen)) {
+      size_t basename;
+      unsigned flags;
+
+      stats_add(STATS_LINES, 1);
+
+      if (!config.verbose && pkgname == lastpkg) {
+        continue;
+      }
+
+      flags = classify_line(path, pathlen, &basename);
+      if (!search_line_wanted(pathlen, flags) ||
+          !batch_target_matches(t, path, pathlen)) {
+        continue;
+      }
+
+      if (parse_pkgname(&pkg, pkgname, strlen(pkgname)) < 0) {
+        continue;
+      }
+
+      if (batch_result_add(repo_label(repo), &pkg, result, id, path,
+                           pathlen) < 0) {
+        return;
+      }
+
+      lastpkg = pkgname;
+    }
   }
+}
 
-  while (archive_read_next_header(a, &e) == ARCHIVE_OK) {
-    const char *entryname = archive_entry_pathname(e);
-    size_t len;
-    int r;
+static bool can_match_basename(void) {
+  return config.filefunc == search_metafile &&
+         config.filterfunc == match_exact_basename;
+}
 
-    if (entryname == NULL) {
-      /* libarchive error */
+static void search_compactdb_basename(const struct repo_t *repo,
+                                      const struct compactdb_t *db,
+                                      const struct compactdb_pkg *p,
+                                      struct pkg_t *pkg, char *line,
+                                      struct result_t *result) {
+  stats_add(STATS_LINES, p->nfiles);
+
+  for (uint32_t i = p->files; i < p->files + p->nfiles; ++i) {
+    const struct compactdb_file *f = &db->files[i];
+    size_t dirlen, basename;
+    unsigned flags;
+
+    /* compare against the basename alone, and only rebuild the full path for
+     * the candidates which survive */
+    if (f->namelen != config.filter.glob.globlen ||
+        (uint64_t)f->name + f->namelen >= db->hdr->strings_size ||
+        filter_match(match_exact, &config.filter, &db->strings[f->name],
+                     f->namelen, config.icase) != 0) {
       continue;
     }
 
-    len = strlen(entryname);
-    r = parse_pkgname(&pkg, entryname, len);
-    if (r < 0) {
-      fprintf(stderr, "error parsing pkgname from: %s: %s\n", entryname,
-              strerror(-r));
+    dirlen = compactdb_dirpath(db, f->dir, line, MAX_LINE_SIZE);
+    if (dirlen + f->namelen >= MAX_LINE_SIZE) {
       continue;
     }
+    memcpy(line + dirlen, &db->strings[f->name], f->namelen);
+    line[dirlen + f->namelen] = '\0';
 
-    memset(&read_buffer, 0, sizeof(struct archive_line_reader));
-    read_buffer.line.base = line;
-    r = config.filefunc(repo->name, &pkg, a, result, &read_buffer);
-    if (r < 0) {
+    flags = f->flags & COMPACTDB_FILE_CLASSIFIED
+                ? f->flags
+                : classify_line(line, dirlen + f->namelen, &basename);
+    if (!search_line_matches(line, dirlen + f->namelen, flags, dirlen)) {
+      continue;
+    }
+
+    if (search_result_add(repo_label(repo), pkg, result, line,
+                          dirlen + f->namelen) < 0 ||
+        !config.verbose) {
+      return;
+    }
+  }
+}
+
+/* How a DB is brought into memory, which depends on how much of it the query
+ * is going to touch. */
+typedef enum _loadstrategy_t {
+  /* all of it, up front */
+  LOAD_POPULATE = 0,
+  /* read ahead of each task as it goes, which might stop early */
+  LOAD_CHUNKED,
+  /* only the pages which are actually touched */
+  LOAD_LAZY,
+  /* read rather than mapped, for filesystems which mapping doesn't suit */
+  LOAD_READ
+} loadstrategy_t;
+
+/* a repo's DB, which stays open from one query to the next when running as a
+ * daemon */
+struct repo_scan_t {
+  struct repo_t *repo;
+  char repofile[FILENAME_MAX];
+  int fd;
+  struct stat st;
+  void *data;
+  loadstrategy_t strategy;
+  dbformat_t format;
+  struct flatdb_t flat;
+  struct compactdb_t compact;
+  struct index_t idx;
+  bool have_index;
+  struct trigram_t tri;
+  bool have_trigrams;
+  uint32_t npkgs;
+
+  /* per query state */
+  bool indexed;
+  /* an exact --list found the package in the index, or found that the repo
+   * doesn't have it, in which case first and end are the same */
+  bool listed;
+  uint32_t listfirst;
+  uint32_t listend;
+  uint64_t listoffset;
+  /* a bitmap of the packages which might match a glob or regex, going by the
+   * trigram index, or NULL when every package might */
+  uint8_t *candidates;
+  uint32_t ncandidates;
+  /* set once an exact --list has found its package, by whichever task found
+   * it, and read by the others as they go */
+  bool done;
+};
+
+/* a range of packages from a single repo, scanned into its own result */
+struct scan_task_t {
+  struct repo_scan_t *scan;
+  uint32_t start;
+  uint32_t end;
+  struct result_t *result;
+  struct stats_t stats;
+
+  /* position in the order results are written, for --stream */
+  size_t index;
+  bool finished;
+};
+
+/* results written as they're found, for --stream. Tasks finish in any order,
+ * but their results go out strictly in task order, so only the head task
+ * writes as it goes and the ones after it hold on to their results until
+ * they become the head. */
+static struct {
+  pthread_mutex_t lock;
+  struct scan_task_t *tasks;
+  size_t ntasks;
+  size_t head;
+  size_t written;
+  bool stop;
+} stream = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Writes out what the head task has so far, moving on to the tasks after it
+ * as each one finishes. A task still running is only ever written out by its
+ * own thread, as self, since it's still adding to its result. Called with the
+ * lock held. */
+static void stream_drain(struct scan_task_t *self) {
+  while (stream.head < stream.ntasks &&
+         !__atomic_load_n(&stream.stop, __ATOMIC_ACQUIRE)) {
+    struct scan_task_t *task = &stream.tasks[stream.head];
+    size_t written;
+
+    /* it'll write itself out the next time it gets here */
+    if (task != self && !task->finished) {
+      break;
+    }
+
+    written = result_flush(task->result, config.maxresults - stream.written,
+                           config.eol);
+
+    __atomic_store_n(&stream.written, stream.written + written,
+                     __ATOMIC_RELEASE);
+
+    /* stdout went away, most likely a closed pipe */
+    if (stream.written >= config.maxresults || ferror(stdout)) {
+      __atomic_store_n(&stream.stop, true, __ATOMIC_RELEASE);
+      break;
+    }
+
+    if (!task->finished) {
       break;
     }
+
+    __atomic_store_n(&stream.head, stream.head + 1, __ATOMIC_RELEASE);
   }
+}
 
-  archive_read_close(a);
+/* Called by a task at the end of each package and once more when it's done.
+ * Returns true once nothing more the task finds could be written. */
+static bool stream_progress(struct scan_task_t *task, bool finished) {
+  if (finished ||
+      __atomic_load_n(&stream.head, __ATOMIC_ACQUIRE) == task->index) {
+    pthread_mutex_lock(&stream.lock);
+    task->finished = finished;
+    stream_drain(task);
+    pthread_mutex_unlock(&stream.lock);
+  }
 
-cleanup:
-  archive_read_free(a);
-  if (repo->fd >= 0) {
-    close(repo->fd);
+  /* whatever a task holds goes out before anything it finds later */
+  return __atomic_load_n(&stream.stop, __ATOMIC_ACQUIRE) ||
+         task->result->size >=
+             config.maxresults -
+                 __atomic_load_n(&stream.written, __ATOMIC_ACQUIRE);
+}
+
+/* the task the calling thread is running */
+static __thread struct scan_task_t *scan_task_current;
+
+/* set when a listing couldn't be written out to a temporary file, after
+ * which it's kept in memory instead */
+static bool list_spill_failed;
+
+/* Keeps a long listing from piling up in memory. With --stream, it's written
+ * as it's read, in the order the DB holds it. Otherwise, it's sorted a part at
+ * a time into temporary files once it outgrows the sort buffer. Returns true
+ * once nothing more the listing finds could be written. */
+static bool list_progress(struct result_t *result) {
+  if (config.stream) {
+    return scan_task_current != NULL &&
+           stream_progress(scan_task_current, false);
   }
-  if (repodata != MAP_FAILED) {
-    munmap(repodata, st.st_size);
+
+  /* one error is enough, rather than another every few lines */
+  if (result->arena_size + result->size * sizeof(struct line_t) >=
+          config.sortbuffer &&
+      !__atomic_load_n(&list_spill_failed, __ATOMIC_ACQUIRE) &&
+      result_spill(result) != 0) {
+    __atomic_store_n(&list_spill_failed, true, __ATOMIC_RELEASE);
   }
 
-  return result;
+  return false;
 }
 
-static int compile_pcre_expr(struct pcre_data *re, const char *preg,
-                             int flags) {
-  const char *err;
-  int err_offset;
+/* Called after each package is scanned, with the number of lines the result
+ * held before it. Returns true when the scan should stop early. */
+static bool scan_task_package_done(struct scan_task_t *task, size_t mark) {
+  if (!config.stream) {
+    return false;
+  }
 
-  re->re = pcre_compile(preg, flags, &err, &err_offset, NULL);
-  if (!re->re) {
-    fprintf(stderr, "error: failed to compile regex at char %d: %s\n",
-            err_offset, err);
-    return 1;
+  /* sorting is bounded to a package at a time, and a listing may well have
+   * been written out already */
+  if (config.filefunc != list_metafile) {
+    result_sort(task->result, mark);
+  }
+
+  return stream_progress(task, false);
+}
+
+/* Starts reading in the part of a DB a task is about to scan, so that every
+ * task's I/O is in flight at once rather than one page fault at a time. */
+static void scan_task_willneed(const struct scan_task_t *task,
+                               const void *start, const void *end) {
+  const struct repo_scan_t *scan = task->scan;
+  uintptr_t page = sysconf(_SC_PAGESIZE), from, to;
+
+  if (scan->strategy != LOAD_CHUNKED || end <= start) {
+    return;
+  }
+
+  from = (uintptr_t)start & ~(page - 1);
+  to = (uintptr_t)end;
+  madvise((void *)from, to - from, MADV_WILLNEED);
+}
+
+static bool scan_done(struct repo_scan_t *scan) {
+  return __atomic_load_n(&scan->done, __ATOMIC_ACQUIRE);
+}
+
+static void scan_set_done(struct repo_scan_t *scan) {
+  __atomic_store_n(&scan->done, true, __ATOMIC_RELEASE);
+}
+
+/* Whether package i might match, which it can't if the trigram index shows it
+ * lacks some part of the literal. */
+static bool scan_candidate(const struct repo_scan_t *scan, uint32_t i) {
+  if (scan->candidates == NULL || i >= scan->tri.hdr->npkgs ||
+      scan->candidates[i >> 3] & (1u << (i & 7))) {
+    return true;
   }
 
-  re->re_extra = pcre_study(re->re, PCRE_STUDY_JIT_COMPILE, &err);
-  if (err) {
-    fprintf(stderr, "error: failed to study regex: %s\n", err);
-    pcre_free(re->re);
-    return 1;
-  }
+  stats_add(STATS_PREFILTERED, 1);
+  return false;
+}
+
+static void scan_flatdb(struct scan_task_t *task) {
+  struct repo_scan_t *scan = task->scan;
+  struct result_t *result = task->result;
+  struct pkg_t pkg;
+
+  if (task->start < task->end) {
+    const struct flatdb_pkg *first = &scan->flat.pkgs[task->start],
+                            *last = &scan->flat.pkgs[task->end - 1];
+
+    scan_task_willneed(task, scan->flat.base + first->files,
+                       scan->flat.base + last->files + last->fileslen);
+  }
+
+  for (uint32_t i = task->start; i < task->end && !scan_done(scan); ++i) {
+    struct archive_line_reader reader = {};
+    const char *name, *files;
+    size_t namelen, fileslen, mark = result->size;
+
+    if (!scan_candidate(scan, i)) {
+      continue;
+    }
+
+    stats_add(STATS_ENTRIES, 1);
+    name = flatdb_pkg_name(&scan->flat, i, &namelen);
+    files = flatdb_pkg_files(&scan->flat, i, &fileslen);
+    if (name == NULL || files == NULL) {
+      fprintf(stderr, "error: failed to load repo: %s: corrupt package entry\n",
+              scan->repofile);
+      break;
+    }
+
+    if (parse_pkgname(&pkg, name, namelen) < 0) {
+      fprintf(stderr, "error parsing pkgname from: %s: %s\n", name,
+              strerror(EINVAL));
+      continue;
+    }
+
+    /* a package without the literal anywhere in it can't match */
+    if (config.filefunc == search_metafile &&
+        !literal_matches(files, fileslen)) {
+      continue;
+    }
+
+    reader.block.base = reader.block.offset = (char *)files;
+    reader.block.size = fileslen;
+    if (config.filefunc(repo_label(scan->repo), &pkg, NULL, result,
+                        &reader) < 0) {
+      scan_set_done(scan);
+    }
+
+    if (scan_task_package_done(task, mark)) {
+      break;
+    }
+  }
+}
+
+static void scan_compactdb(struct scan_task_t *task) {
+  struct repo_scan_t *scan = task->scan;
+  struct result_t *result = task->result;
+  const struct compactdb_t *db = &scan->compact;
+  struct archive_line_reader reader = {};
+  _cleanup_free_ char *line = NULL;
+  struct pkg_t pkg;
+
+  MALLOC(line, MAX_LINE_SIZE, return);
+  stats_add(STATS_ALLOCATIONS, 1);
+
+  reader.line.base = line;
+  reader.compact = db;
+  reader.dir = COMPACTDB_NO_PARENT;
+
+  if (task->start < task->end) {
+    const struct compactdb_pkg *last = &db->pkgs[task->end - 1];
+
+    scan_task_willneed(task, &db->files[db->pkgs[task->start].files],
+                       &db->files[last->files + last->nfiles]);
+  }
+
+  for (uint32_t i = task->start; i < task->end && !scan_done(scan); ++i) {
+    const char *name;
+    size_t namelen, mark = result->size;
+
+    if (!scan_candidate(scan, i)) {
+      continue;
+    }
+
+    stats_add(STATS_ENTRIES, 1);
+    name = compactdb_pkg_name(db, i, &namelen);
+    if (name == NULL) {
+      fprintf(stderr, "error: failed to load repo: %s: corrupt package entry\n",
+              scan->repofile);
+      break;
+    }
+
+    if (parse_pkgname(&pkg, name, namelen) < 0) {
+      fprintf(stderr, "error parsing pkgname from: %s: %s\n", name,
+              strerror(EINVAL));
+      continue;
+    }
+
+    if (can_match_basename()) {
+      search_compactdb_basename(scan->repo, db, &db->pkgs[i], &pkg, line,
+                                result);
+    } else {
+      /* the reader's cached directory stays valid across packages */
+      reader.file = db->pkgs[i].files;
+      reader.endfile = db->pkgs[i].files + db->pkgs[i].nfiles;
+      if (config.filefunc(repo_label(scan->repo), &pkg, NULL, result,
+                          &reader) < 0) {
+        scan_set_done(scan);
+      }
+    }
+
+    if (scan_task_package_done(task, mark)) {
+      break;
+    }
+  }
+}
+
+static void scan_archive(struct scan_task_t *task) {
+  struct repo_scan_t *scan = task->scan;
+  struct result_t *result = task->result;
+  _cleanup_free_ char *line = NULL;
+  struct archive *a;
+  struct archive_entry *e;
+  struct pkg_t pkg;
+  struct archive_line_reader read_buffer = {};
+  struct stats_timer_t t;
+  off_t offset = 0;
+
+  MALLOC(line, MAX_LINE_SIZE, return);
+  stats_add(STATS_ALLOCATIONS, 1);
+
+  a = archive_read_new();
+  archive_read_support_format_all(a);
+  archive_read_support_filter_all(a);
+
+  /* an uncompressed archive can be read starting with the one entry wanted */
+  if (scan->listed && scan->listoffset != INDEX_NO_OFFSET &&
+      scan->listoffset < (uint64_t)scan->st.st_size) {
+    offset = scan->listoffset;
+  }
+
+  if (archive_read_open_memory(a, (char *)scan->data + offset,
+                               scan->st.st_size - offset) != ARCHIVE_OK) {
+    fprintf(stderr, "error: failed to load repo: %s: %s\n", scan->repofile,
+            archive_error_string(a));
+    archive_read_free(a);
+    return;
+  }
+
+  for (uint32_t i = 0;; ++i) {
+    const char *entryname;
+    size_t len, mark = result->size;
+    int r;
+
+    /* reading a header decompresses whatever came before it */
+    stats_begin(&t, STATS_CLOCK_NONE);
+    r = archive_read_next_header(a, &e);
+    stats_end(&t, PHASE_DECOMPRESS);
+    if (r != ARCHIVE_OK) {
+      break;
+    }
+
+    /* the entry's data is skipped over along with the next header */
+    if (!scan_candidate(scan, i)) {
+      continue;
+    }
+
+    stats_add(STATS_ENTRIES, 1);
+    entryname = archive_entry_pathname(e);
+    if (entryname == NULL) {
+      /* libarchive error */
+      continue;
+    }
+
+    len = strlen(entryname);
+    r = parse_pkgname(&pkg, entryname, len);
+    if (r < 0) {
+      fprintf(stderr, "error parsing pkgname from: %s: %s\n", entryname,
+              strerror(-r));
+      continue;
+    }
+
+    memset(&read_buffer, 0, sizeof(struct archive_line_reader));
+    read_buffer.line.base = line;
+    r = config.filefunc(repo_label(scan->repo), &pkg, a, result, &read_buffer);
+    if (r < 0 || scan_task_package_done(task, mark)) {
+      break;
+    }
+  }
+
+  archive_read_close(a);
+  archive_read_free(a);
+}
+
+static void repo_scan_close(struct repo_scan_t *scan) {
+  if (scan->have_index) {
+    index_close(&scan->idx);
+    scan->have_index = false;
+  }
+  if (scan->have_trigrams) {
+    trigram_close(&scan->tri);
+    scan->have_trigrams = false;
+  }
+  FREE(scan->candidates);
+  if (scan->data != MAP_FAILED) {
+    if (scan->strategy == LOAD_READ) {
+      free(scan->data);
+    } else {
+      munmap(scan->data, scan->st.st_size);
+    }
+    scan->data = MAP_FAILED;
+  }
+  if (scan->fd >= 0) {
+    close(scan->fd);
+    scan->fd = -1;
+  }
+  scan->format = DBFORMAT_CPIO;
+  scan->npkgs = 0;
+}
+
+static bool repo_scan_is_stale(const struct repo_scan_t *scan) {
+  struct stat st;
+
+  /* an update renames a new DB into place, never rewrites the old one */
+  if (stat(scan->repofile, &st) < 0) {
+    return true;
+  }
+
+  return st.st_dev != scan->st.st_dev || st.st_ino != scan->st.st_ino ||
+         st.st_size != scan->st.st_size || st.st_mtime != scan->st.st_mtime;
+}
+
+/* Decides how to load a DB for this query, from a peek at what sort of DB it
+ * is. */
+static loadstrategy_t repo_scan_strategy(const struct repo_scan_t *scan) {
+  char magic[sizeof(struct compactdb_header)] = {};
+  size_t len = MIN(sizeof(magic), (size_t)scan->st.st_size);
+
+  if (config.nommap || is_network_fs(scan->fd)) {
+    return LOAD_READ;
+  }
+
+  /* a daemon has every query to come to answer */
+  if (config.daemon || pread_all(scan->fd, magic, len, 0) < 0) {
+    return LOAD_POPULATE;
+  }
+
+  /* only the entry of the package being listed is read */
+  if (scan->listed) {
+    return LOAD_LAZY;
+  }
+
+  if (!flatdb_is_flatdb(magic, len) && !compactdb_is_compactdb(magic, len)) {
+    /* an archive is read from start to finish, unless it's cut short */
+    return config.maxresults != SIZE_MAX ? LOAD_CHUNKED : LOAD_POPULATE;
+  }
+
+  /* listing reads every package's name, but only the files of the few
+   * packages which match, as does a search which the trigram index has
+   * narrowed down to a few packages */
+  if (config.filefunc == list_metafile ||
+      (scan->candidates != NULL &&
+       scan->ncandidates < scan->tri.hdr->npkgs / 4)) {
+    return LOAD_LAZY;
+  }
+
+  return LOAD_CHUNKED;
+}
+
+static void *repo_scan_read(struct repo_scan_t *scan) {
+  void *data;
+  int r;
+
+  MALLOC(data, MAX(scan->st.st_size, 1), return MAP_FAILED);
+  r = pread_all(scan->fd, data, scan->st.st_size, 0);
+  if (r < 0) {
+    free(data);
+    errno = -r;
+    return MAP_FAILED;
+  }
+
+  return data;
+}
+
+/* The parts of a compact DB which every task looks things up in, rather
+ * than reading through. */
+static void compactdb_willneed(const struct compactdb_t *db) {
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t dirs = (uintptr_t)db->dirs & ~(page - 1),
+            strings = (uintptr_t)db->strings & ~(page - 1);
+
+  madvise((void *)dirs, (uintptr_t)db->files - dirs, MADV_WILLNEED);
+  madvise((void *)strings, (uintptr_t)(db->base + db->size) - strings,
+          MADV_WILLNEED);
+}
+
+static void repo_scan_map(struct repo_scan_t *scan) {
+  scan->strategy = repo_scan_strategy(scan);
+  if (scan->strategy == LOAD_READ) {
+    scan->data = repo_scan_read(scan);
+  } else {
+    scan->data = mmap(
+        0, scan->st.st_size, PROT_READ,
+        MAP_SHARED | (scan->strategy == LOAD_POPULATE ? MAP_POPULATE : 0),
+        scan->fd, 0);
+  }
+  if (scan->data == MAP_FAILED) {
+    fprintf(stderr, "error: failed to map pages for %s: %s\n", scan->repofile,
+            strerror(errno));
+    return;
+  }
+
+  /* the kernel's readahead is only a guess as to what comes next */
+  if (scan->strategy == LOAD_CHUNKED) {
+    madvise(scan->data, scan->st.st_size, MADV_SEQUENTIAL);
+  } else if (scan->strategy == LOAD_LAZY) {
+    madvise(scan->data, scan->st.st_size, MADV_RANDOM);
+  }
+
+  if (flatdb_is_flatdb(scan->data, scan->st.st_size)) {
+    scan->format = DBFORMAT_FLAT;
+    if (flatdb_open(&scan->flat, scan->data, scan->st.st_size) < 0) {
+      fprintf(stderr, "error: failed to load repo: %s: invalid flat database\n",
+              scan->repofile);
+      return;
+    }
+    scan->npkgs = scan->flat.hdr->npkgs;
+  } else if (compactdb_is_compactdb(scan->data, scan->st.st_size)) {
+    scan->format = DBFORMAT_COMPACT;
+    if (compactdb_open(&scan->compact, scan->data, scan->st.st_size) < 0) {
+      fprintf(stderr,
+              "error: failed to load repo: %s: invalid compact database\n",
+              scan->repofile);
+      return;
+    }
+    scan->npkgs = scan->compact.hdr->npkgs;
+    if (scan->strategy == LOAD_CHUNKED) {
+      compactdb_willneed(&scan->compact);
+    }
+  } else {
+    scan->format = DBFORMAT_CPIO;
+  }
+}
+
+/* Looks up the package an exact --list wants in the index. */
+static void repo_scan_find_pkg(struct repo_scan_t *scan) {
+  const struct index_pkg *pkg = index_find_pkg(
+      &scan->idx, config.filter.glob.glob, config.filter.glob.globlen);
+
+  scan->listed = true;
+  if (pkg == NULL) {
+    scan->listfirst = scan->listend = 0;
+    return;
+  }
+
+  scan->listfirst = pkg->ordinal;
+  scan->listend = pkg->ordinal + 1;
+  scan->listoffset = pkg->offset;
+}
+
+/* Narrows a glob or regex search down to the packages which contain every
+ * trigram of its literal. */
+static void repo_scan_find_candidates(struct repo_scan_t *scan) {
+  uint32_t npkgs = scan->tri.hdr->npkgs;
+
+  CALLOC(scan->candidates, MAX((npkgs + 7) / 8, 1u), sizeof(uint8_t),
+         return);
+  scan->ncandidates = trigram_candidates(&scan->tri, config.literal,
+                                         config.literallen, scan->candidates);
+}
+
+/* Opens the DB, unless it's still open from a previous query and hasn't been
+ * replaced by an update since. Returns whether it's open. */
+static bool repo_scan_open_fd(struct repo_scan_t *scan) {
+  if (scan->fd >= 0 && repo_scan_is_stale(scan)) {
+    repo_scan_close(scan);
+  }
+
+  if (scan->fd < 0) {
+    scan->fd = open(scan->repofile, O_RDONLY);
+    if (scan->fd < 0) {
+      /* fail silently if the file doesn't exist */
+      if (errno != ENOENT) {
+        fprintf(stderr, "error: failed to open repo: %s: %s\n", scan->repofile,
+                strerror(errno));
+      }
+      return false;
+    }
+
+    fstat(scan->fd, &scan->st);
+  }
+
+  return true;
+}
+
+static void repo_scan_open_index(struct repo_scan_t *scan) {
+  char indexfile[FILENAME_MAX + sizeof(INDEX_SUFFIX)];
+
+  if (scan->have_index) {
+    return;
+  }
+
+  snprintf(indexfile, sizeof(indexfile), "%s" INDEX_SUFFIX, scan->repofile);
+  scan->have_index = index_open(&scan->idx, indexfile, &scan->st) == 0;
+}
+
+static void repo_scan_open_trigrams(struct repo_scan_t *scan) {
+  char trifile[FILENAME_MAX + sizeof(TRIGRAM_SUFFIX)];
+
+  if (scan->have_trigrams) {
+    return;
+  }
+
+  snprintf(trifile, sizeof(trifile), "%s" TRIGRAM_SUFFIX, scan->repofile);
+  scan->have_trigrams = trigram_open(&scan->tri, trifile, &scan->st) == 0;
+}
+
+static void repo_scan_open_db(struct repo_scan_t *scan) {
+  scan->indexed = false;
+  scan->listed = false;
+  scan->done = false;
+  FREE(scan->candidates);
+
+  if (!repo_scan_open_fd(scan)) {
+    return;
+  }
+
+  /* answer exact searches from the basename index, and exact listings from
+   * its table of packages, if one exists for this version of the repo */
+  if (can_use_index() || can_list_from_index()) {
+    repo_scan_open_index(scan);
+  }
+  if (scan->have_index && can_use_index()) {
+    scan->indexed = true;
+    return;
+  }
+  if (scan->have_index && can_list_from_index()) {
+    repo_scan_find_pkg(scan);
+
+    /* a repo without the package has nothing to map */
+    if (scan->listfirst == scan->listend) {
+      return;
+    }
+  }
+
+  if (can_use_trigrams()) {
+    repo_scan_open_trigrams(scan);
+    if (scan->have_trigrams) {
+      repo_scan_find_candidates(scan);
+
+      /* nor does a repo without anything which could match */
+      if (scan->candidates != NULL && scan->ncandidates == 0) {
+        return;
+      }
+    }
+  }
+
+  if (scan->data == MAP_FAILED) {
+    repo_scan_map(scan);
+  }
+}
+
+/* where --stats collects what's done to a repo */
+static struct stats_t *repo_stats(struct repo_t *repo) {
+  return config.stats != STATS_NONE ? &repo->stats : NULL;
+}
+
+static void repo_scan_open(void *arg) {
+  struct repo_scan_t *scan = arg;
+  struct stats_t *saved = stats_current;
+  struct stats_timer_t t;
+
+  stats_current = repo_stats(scan->repo);
+  stats_begin(&t, STATS_CLOCK_THREAD);
+  repo_scan_open_db(scan);
+  stats_end(&t, PHASE_OPEN);
+
+  if (scan->fd >= 0) {
+    stats_add(STATS_DB_BYTES,
+              scan->indexed ? scan->idx.size : (size_t)scan->st.st_size);
+  }
+  stats_current = saved;
+}
+
+static struct repo_scan_t *repo_scans_new(struct repovec_t *repos) {
+  struct repo_scan_t *scans;
+
+  CALLOC(scans, MAX(repos->size, 1), sizeof(struct repo_scan_t), return NULL);
+
+  for (int i = 0; i < repos->size; ++i) {
+    scans[i].repo = repos->repos[i];
+    scans[i].fd = -1;
+    scans[i].data = MAP_FAILED;
+    repo_dbpath(repos->repos[i], config.cachedir, scans[i].repofile,
+                sizeof(scans[i].repofile));
+  }
+
+  return scans;
+}
+
+static void repo_scans_free(struct repo_scan_t *scans, int count) {
+  if (scans == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    repo_scan_close(&scans[i]);
+  }
+  free(scans);
+}
+
+static uint32_t repo_scan_chunks(const struct repo_scan_t *scan,
+                                 unsigned nthreads) {
+  if (scan->indexed) {
+    return 1;
+  }
+
+  if (scan->data == MAP_FAILED) {
+    return 0;
+  }
+
+  /* just the one package, if the repo has it */
+  if (scan->listed) {
+    return scan->listfirst < scan->listend;
+  }
+
+  if (scan->candidates != NULL && scan->ncandidates == 0) {
+    return 0;
+  }
+
+  /* an archive can only be read from the start */
+  if (scan->format == DBFORMAT_CPIO) {
+    return 1;
+  }
+
+  /* enough chunks that a big repo is spread over every thread, but not so
+   * many that a chunk is all overhead */
+  return MIN((scan->npkgs + 15) / 16, nthreads * 4);
+}
+
+static void scan_task_search(struct scan_task_t *task) {
+  struct repo_scan_t *scan = task->scan;
+
+  if (scan->indexed) {
+    if (config.batch) {
+      batch_search_index(scan->repo, &scan->idx, task->result);
+    } else {
+      search_index(scan->repo, &scan->idx, task->result);
+    }
+    return;
+  }
+
+  switch (scan->format) {
+    case DBFORMAT_FLAT:
+      scan_flatdb(task);
+      break;
+    case DBFORMAT_COMPACT:
+      scan_compactdb(task);
+      break;
+    default:
+      scan_archive(task);
+      break;
+  }
+}
+
+static void scan_task_run(void *arg) {
+  struct scan_task_t *task = arg;
+  struct stats_t *saved = stats_current;
+  struct stats_timer_t t;
+
+  /* each task counts on its own, and is merged into its repo's stats after */
+  stats_current = config.stats != STATS_NONE ? &task->stats : NULL;
+  scan_task_current = task;
+  stats_begin(&t, STATS_CLOCK_THREAD);
+  /* there's no use starting once the limit has been reached */
+  if (!config.stream || !__atomic_load_n(&stream.stop, __ATOMIC_ACQUIRE)) {
+    scan_task_search(task);
+  }
+  if (config.stream) {
+    /* an index answers all at once, rather than a package at a time */
+    if (task->scan->indexed) {
+      result_sort(task->result, 0);
+    }
+    stream_progress(task, true);
+  }
+  stats_end(&t, PHASE_SCAN);
+  scan_task_current = NULL;
+  stats_current = saved;
+}
+
+/* Opens every repo and splits each into tasks, in the order their results
+ * are to be written. */
+static struct scan_task_t *scan_tasks_new(struct repo_scan_t *scans, int count,
+                                          unsigned nthreads, size_t *ntasks) {
+  _cleanup_free_ void **ptrs = NULL;
+  struct scan_task_t *tasks;
+  size_t t = 0;
+
+  CALLOC(ptrs, MAX(count, 1), sizeof(void *), return NULL);
+
+  /* open and map every repo, in parallel */
+  for (int i = 0; i < count; ++i) {
+    ptrs[i] = &scans[i];
+  }
+  pool_run(ptrs, count, repo_scan_open, nthreads);
+
+  /* split each repo into chunks of packages */
+  *ntasks = 0;
+  for (int i = 0; i < count; ++i) {
+    *ntasks += repo_scan_chunks(&scans[i], nthreads);
+  }
+
+  CALLOC(tasks, MAX(*ntasks, 1u), sizeof(struct scan_task_t), return NULL);
+
+  for (int i = 0; i < count; ++i) {
+    uint32_t nchunks = repo_scan_chunks(&scans[i], nthreads), chunksz;
+    uint32_t first = 0, end = scans[i].npkgs;
+
+    if (nchunks == 0) {
+      continue;
+    }
+
+    if (scans[i].listed) {
+      first = MIN(scans[i].listfirst, end);
+      end = MIN(scans[i].listend, end);
+    }
+
+    chunksz = (end - first + nchunks - 1) / nchunks;
+    for (uint32_t c = 0; c < nchunks; ++c, ++t) {
+      tasks[t].scan = &scans[i];
+      tasks[t].start = MIN(first + c * chunksz, end);
+      tasks[t].end = MIN(first + (c + 1) * chunksz, end);
+      tasks[t].result = result_new(repo_label(scans[i].repo), 50);
+      tasks[t].index = t;
+    }
+  }
+
+  return tasks;
+}
+
+static void scan_tasks_run(struct scan_task_t *tasks, size_t ntasks,
+                           unsigned nthreads) {
+  _cleanup_free_ void **ptrs = NULL;
+
+  CALLOC(ptrs, MAX(ntasks, 1u), sizeof(void *), return);
+
+  for (size_t t = 0; t < ntasks; ++t) {
+    ptrs[t] = &tasks[t];
+  }
+
+  /* let every thread have at them */
+  pool_run(ptrs, ntasks, scan_task_run, nthreads);
+}
+
+static struct result_t **load_repos(struct repo_scan_t *scans, int count) {
+  _cleanup_free_ struct scan_task_t *tasks = NULL;
+  struct result_t **results;
+  unsigned nthreads = pool_default_threads();
+  size_t ntasks, t = 0;
+  struct stats_timer_t search;
+
+  stats_begin(&search, STATS_CLOCK_PROCESS);
+
+  CALLOC(results, count, sizeof(struct result_t *), return NULL);
+
+  tasks = scan_tasks_new(scans, count, nthreads, &ntasks);
+  if (tasks == NULL) {
+    free(results);
+    return NULL;
+  }
+
+  scan_tasks_run(tasks, ntasks, nthreads);
+
+  /* gather the chunks back together, in order */
+  for (int i = 0; i < count; ++i) {
+    struct stats_t *saved = stats_current;
+    struct stats_timer_t timer;
+
+    stats_current = repo_stats(scans[i].repo);
+    stats_begin(&timer, STATS_CLOCK_THREAD);
+    results[i] = result_new(repo_label(scans[i].repo), 50);
+    for (; t < ntasks && tasks[t].scan == &scans[i]; ++t) {
+      if (stats_current != NULL) {
+        stats_merge(stats_current, &tasks[t].stats);
+      }
+      if (results[i] != NULL && result_merge(results[i], tasks[t].result)) {
+        fputs("error: failed to allocate memory for result\n", stderr);
+        result_free(results[i]);
+        results[i] = NULL;
+      }
+      result_free(tasks[t].result);
+    }
+    stats_end(&timer, PHASE_MERGE);
+    stats_current = saved;
+  }
+
+  stats_end(&search, PHASE_SEARCH);
+
+  /* a repo missing some of its results would pass for one without them */
+  for (int i = 0; i < count; ++i) {
+    if (results[i] == NULL) {
+      for (int j = 0; j < count; ++j) {
+        result_free(results[j]);
+      }
+      free(results);
+      return NULL;
+    }
+  }
+
+  return results;
+}
+
+/* The query at hand, when its results can be kept for the next time it's
+ * asked. */
+static struct {
+  struct qcache_key_t key;
+  bool enabled;
+  /* whether the results came from the cache, and no DB was opened */
+  bool hit;
+} qcache;
+
+/* A stream stops once it's written enough, and a batch has its targets in no
+ * particular order, so neither is worth caching. */
+static bool can_use_qcache(void) {
+  return config.qcachesize > 0 && !config.stream && !config.batch;
+}
+
+/* Keys the query's results by everything which decides them. */
+static void qcache_setup(struct repovec_t *repos, struct repo_scan_t *scans,
+                         const char *target) {
+  const uint8_t flags[] = {
+      config.filterby,    config.filefunc == list_metafile,
+      config.binaries,    config.directories,
+      config.icase,       config.quiet,
+      config.verbose,
+  };
+  const char *targetrepo = config.targetrepo ? config.targetrepo : "";
+  struct repo_t *repo;
+  int found = 0;
+
+  if (!can_use_qcache() || qcache_key_init(&qcache.key) < 0) {
+    return;
+  }
+
+  /* a newer pkgfile might not give the same results */
+  qcache_key_add(&qcache.key, PACKAGE_VERSION, strlen(PACKAGE_VERSION));
+  qcache_key_add(&qcache.key, flags, sizeof(flags));
+  qcache_key_add(&qcache.key, target, strlen(target));
+  qcache_key_add(&qcache.key, targetrepo, strlen(targetrepo));
+  REPOVEC_FOREACH(repo, repos) {
+    qcache_key_add(&qcache.key, repo_label(repo), strlen(repo_label(repo)));
+    found += qcache_key_add_file(&qcache.key, scans[i_].repofile);
+  }
+
+  /* with no DBs at all, there's an error to report instead */
+  if (qcache_key_finish(&qcache.key) < 0 || found == 0) {
+    qcache_key_free(&qcache.key);
+    return;
+  }
+
+  qcache.enabled = true;
+}
+
+static void qcache_teardown(void) {
+  if (qcache.enabled) {
+    qcache_key_free(&qcache.key);
+  }
+  qcache.enabled = qcache.hit = false;
+}
+
+/* Like load_repos, but answers from the query cache when it can, and leaves
+ * what it had to search for in the cache. */
+static struct result_t **load_repos_cached(struct repo_scan_t *scans,
+                                           int count) {
+  struct result_t **results;
+  int r;
+
+  if (!qcache.enabled) {
+    return load_repos(scans, count);
+  }
+
+  results = qcache_load(config.cachedir, &qcache.key, count);
+  if (results != NULL) {
+    qcache.hit = true;
+    stats_add(STATS_CACHE_HITS, 1);
+    return results;
+  }
+
+  results = load_repos(scans, count);
+  if (results == NULL) {
+    return NULL;
+  }
+
+  /* whoever can't write to the cache directory can only read from it */
+  r = qcache_store(config.cachedir, &qcache.key, results, count,
+                   config.qcachesize);
+  if (r < 0 && r != -EACCES && r != -EPERM && r != -EROFS) {
+    fprintf(stderr, "warning: failed to cache query results: %s\n",
+            strerror(-r));
+  }
+
+  return results;
+}
+
+/* Like load_repos, but the results are written as they're found rather than
+ * returned. Returns the number of lines written. */
+static size_t stream_repos(struct repo_scan_t *scans, int count) {
+  _cleanup_free_ struct scan_task_t *tasks = NULL;
+  unsigned nthreads = pool_default_threads();
+  struct stats_timer_t search;
+  size_t ntasks;
+
+  stats_begin(&search, STATS_CLOCK_PROCESS);
+
+  tasks = scan_tasks_new(scans, count, nthreads, &ntasks);
+  if (tasks == NULL) {
+    return 0;
+  }
+
+  stream.tasks = tasks;
+  stream.ntasks = ntasks;
+  stream.head = 0;
+  stream.written = 0;
+  stream.stop = false;
+
+  scan_tasks_run(tasks, ntasks, nthreads);
+
+  /* whatever's left over belongs to tasks cut short by the limit */
+  for (size_t t = 0; t < ntasks; ++t) {
+    struct stats_t *repo = repo_stats(tasks[t].scan->repo);
+
+    if (repo != NULL) {
+      stats_merge(repo, &tasks[t].stats);
+    }
+    result_free(tasks[t].result);
+  }
+
+  fflush(stdout);
+  stream.tasks = NULL;
+
+  stats_end(&search, PHASE_SEARCH);
+
+  return stream.written;
+}
+
+static int validate_dbformat(const char *format) {
+  if (strcmp(format, "cpio") == 0) {
+    return DBFORMAT_CPIO;
+  } else if (strcmp(format, "flat") == 0) {
+    return DBFORMAT_FLAT;
+  } else if (strcmp(format, "compact") == 0) {
+    return DBFORMAT_COMPACT;
+  } else {
+    return -1;
+  }
+}
+
+static int validate_stats(const char *format) {
+  if (strcmp(format, "text") == 0) {
+    return STATS_TEXT;
+  } else if (strcmp(format, "json") == 0) {
+    return STATS_JSON;
+  } else {
+    return -1;
+  }
+}
+
+static int validate_max_results(const char *arg, size_t *max) {
+  unsigned long long n;
+  char *end;
+
+  errno = 0;
+  n = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' || n == 0 ||
+      n > SIZE_MAX) {
+    return -EINVAL;
+  }
+
+  *max = n;
+  return 0;
+}
+
+static int validate_jobs(const char *arg, unsigned *jobs) {
+  unsigned long n;
+  char *end;
+
+  errno = 0;
+  n = strtoul(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' || n == 0 ||
+      n > UINT_MAX) {
+    return -EINVAL;
+  }
+
+  *jobs = n;
+  return 0;
+}
+
+/* A number of bytes, which may be given in KiB, MiB or GiB with a suffix of K,
+ * M or G. */
+static int validate_size(const char *arg, size_t *size) {
+  unsigned long long n;
+  unsigned shift = 0;
+  char *end;
+
+  errno = 0;
+  n = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg || arg[0] == '-') {
+    return -EINVAL;
+  }
+
+  switch (*end) {
+    case 'G':
+      shift += 10;
+      /* fallthrough */
+    case 'M':
+      shift += 10;
+      /* fallthrough */
+    case 'K':
+      shift += 10;
+      end++;
+      break;
+  }
+
+  if (*end != '\0' || n > (SIZE_MAX >> shift)) {
+    return -EINVAL;
+  }
+
+  *size = (size_t)n << shift;
+  return 0;
+}
+
+static int validate_race(const char *arg, unsigned *race) {
+  if (validate_jobs(arg, race) < 0 || *race > REPO_MAX_TRANSFERS) {
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+/* zstd decompresses several times faster than anything else on offer, which
+ * is what every search pays for */
+#ifdef ARCHIVE_FILTER_ZSTD
+#define COMPRESS_DEFAULT ARCHIVE_FILTER_ZSTD
+#else
+#define COMPRESS_DEFAULT ARCHIVE_FILTER_GZIP
+#endif
+
+static const struct {
+  const char *name;
+  int filter;
+  /* the levels it accepts, if any */
+  int minlevel;
+  int maxlevel;
+} compressors[] = {
+    {"none", ARCHIVE_FILTER_NONE, 0, -1},
+    {"gzip", ARCHIVE_FILTER_GZIP, 1, 9},
+    {"bzip2", ARCHIVE_FILTER_BZIP2, 1, 9},
+    {"lzma", ARCHIVE_FILTER_LZMA, 0, 9},
+    {"lzop", ARCHIVE_FILTER_LZOP, 1, 9},
+    {"xz", ARCHIVE_FILTER_XZ, 0, 9},
+#ifdef ARCHIVE_FILTER_LZ4
+    {"lz4", ARCHIVE_FILTER_LZ4, 1, 9},
+#endif
+#ifdef ARCHIVE_FILTER_ZSTD
+    {"zstd", ARCHIVE_FILTER_ZSTD, 1, 22},
+#endif
+};
+
+/* Parses a compression method, optionally followed by a colon and the level
+ * to compress at. */
+static int validate_compression(const char *compress, int *level) {
+  size_t len = strcspn(compress, ":");
+
+  for (size_t i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i) {
+    long n;
+    char *end;
+
+    if (strlen(compressors[i].name) != len ||
+        memcmp(compressors[i].name, compress, len) != 0) {
+      continue;
+    }
+
+    if (compress[len] == '\0') {
+      *level = -1;
+      return compressors[i].filter;
+    }
 
-  return 0;
-}
+    errno = 0;
+    n = strtol(&compress[len + 1], &end, 10);
+    if (errno != 0 || end == &compress[len + 1] || *end != '\0' ||
+        n < compressors[i].minlevel || n > compressors[i].maxlevel) {
+      return -1;
+    }
 
-static int validate_compression(const char *compress) {
-  if (strcmp(compress, "none") == 0) {
-    return ARCHIVE_FILTER_NONE;
-  } else if (strcmp(compress, "gzip") == 0) {
-    return ARCHIVE_FILTER_GZIP;
-  } else if (strcmp(compress, "bzip2") == 0) {
-    return ARCHIVE_FILTER_BZIP2;
-  } else if (strcmp(compress, "lzma") == 0) {
-    return ARCHIVE_FILTER_LZMA;
-  } else if (strcmp(compress, "lzop") == 0) {
-    return ARCHIVE_FILTER_LZOP;
-  } else if (strcmp(compress, "xz") == 0) {
-    return ARCHIVE_FILTER_XZ;
-  } else {
-    return -1;
+    *level = n;
+    return compressors[i].filter;
   }
+
+  return -1;
 }
 
 static void usage(void) {
@@ -438,6 +1982,9 @@ static void usage(void) {
       "  -g, --glob              enable matching with glob characters\n"
       "  -i, --ignorecase        use case insensitive matching\n"
       "  -R, --repo <repo>       search a singular repo\n"
+      "      --arch <arch>       use the repos for another architecture "
+      "(repeatable)\n"
+      "      --batch             search for many targets at once\n"
       "  -r, --regex             enable matching with regular expressions\n\n",
       stdout);
   fputs(
@@ -445,16 +1992,47 @@ static void usage(void) {
       "  -q, --quiet             output less when listing\n"
       "  -v, --verbose           output more\n"
       "  -w, --raw               disable output justification\n"
-      "  -0, --null              null terminate output\n\n",
+      "  -0, --null              null terminate output\n"
+      "      --stream            write results as they're found\n"
+      "      --max-results <n>   stop after writing n results (implies "
+      "--stream)\n"
+      "      --first             stop at the first result (implies --stream)\n"
+      "      --sort-buffer <size>\n"
+      "                          sort at most size bytes of a listing in "
+      "memory\n"
+      "      --stats[=format]    print timings and counters to stderr as text "
+      "or json\n\n",
       stdout);
   fputs(
       " Downloading:\n"
-      "  -z, --compress[=type]   compress downloaded repos\n\n",
+      "  -F, --format <format>   repack downloaded repos as cpio, flat or "
+      "compact\n"
+      "  -z, --compress[=type[:level]]\n"
+      "                          compress downloaded repos\n"
+      "  -j, --jobs <n>          repack at most n repos at once (default: one "
+      "per CPU)\n"
+      "      --race <n>          download from the n fastest known servers at "
+      "once\n"
+      "      --trigrams          index trigrams to speed up glob and regex "
+      "searches\n\n",
+      stdout);
+  fputs(
+      " Daemon:\n"
+      "      --daemon            answer queries from memory over a socket\n"
+      "      --client            send the query to a running daemon\n"
+      "      --socket <path>     use an alternate socket (default: "
+      DAEMON_SOCKET ")\n\n",
       stdout);
   fputs(
       " General:\n"
       "  -C, --config <file>     use an alternate config (default: "
       "/etc/pacman.conf)\n"
+      "      --cachedir <dir>    use an alternate cache directory (default: "
+      CACHEPATH ")\n"
+      "      --no-mmap           read databases instead of mapping them\n"
+      "      --query-cache <size>\n"
+      "                          keep up to size bytes of query results "
+      "(0 disables)\n"
       "  -h, --help              display this help and exit\n"
       "  -V, --version           display the version and exit\n\n",
       stdout);
@@ -466,15 +2044,17 @@ static void print_version(void) {
 
 static int parse_opts(int argc, char **argv) {
   int opt;
-  static const char *shortopts = "0bC:dghilqR:rsuVvwz::";
+  static const char *shortopts = "0bC:dF:ghij:lqR:rsuVvwz::";
   static const struct option longopts[] = {
       {"binaries", no_argument, 0, 'b'},
       {"compress", optional_argument, 0, 'z'},
       {"config", required_argument, 0, 'C'},
       {"directories", no_argument, 0, 'd'},
+      {"format", required_argument, 0, 'F'},
       {"glob", no_argument, 0, 'g'},
       {"help", no_argument, 0, 'h'},
       {"ignorecase", no_argument, 0, 'i'},
+      {"jobs", required_argument, 0, 'j'},
       {"list", no_argument, 0, 'l'},
       {"quiet", no_argument, 0, 'q'},
       {"repo", required_argument, 0, 'R'},
@@ -485,12 +2065,33 @@ static int parse_opts(int argc, char **argv) {
       {"verbose", no_argument, 0, 'v'},
       {"raw", no_argument, 0, 'w'},
       {"null", no_argument, 0, '0'},
+      {"batch", no_argument, 0, OPT_BATCH},
+      {"daemon", no_argument, 0, OPT_DAEMON},
+      {"client", no_argument, 0, OPT_CLIENT},
+      {"socket", required_argument, 0, OPT_SOCKET},
+      {"cachedir", required_argument, 0, OPT_CACHEDIR},
+      {"stats", optional_argument, 0, OPT_STATS},
+      {"stream", no_argument, 0, OPT_STREAM},
+      {"max-results", required_argument, 0, OPT_MAX_RESULTS},
+      {"first", no_argument, 0, OPT_FIRST},
+      {"race", required_argument, 0, OPT_RACE},
+      {"no-mmap", no_argument, 0, OPT_NO_MMAP},
+      {"trigrams", no_argument, 0, OPT_TRIGRAMS},
+      {"query-cache", required_argument, 0, OPT_QUERY_CACHE},
+      {"sort-buffer", required_argument, 0, OPT_SORT_BUFFER},
+      {"arch", required_argument, 0, OPT_ARCH},
       {0, 0, 0, 0}};
 
   /* defaults */
   config.filefunc = search_metafile;
   config.eol = '\n';
   config.cfgfile = PACMANCONFIG;
+  config.socket = DAEMON_SOCKET;
+  config.cachedir = CACHEPATH;
+  config.maxresults = SIZE_MAX;
+  config.compress_level = -1;
+  config.qcachesize = QCACHE_DEFAULT_SIZE;
+  config.sortbuffer = SORT_BUFFER_DEFAULT_SIZE;
 
   for (;;) {
     opt = getopt_long(argc, argv, shortopts, longopts, NULL);
@@ -510,6 +2111,13 @@ static int parse_opts(int argc, char **argv) {
       case 'd':
         config.directories = true;
         break;
+      case 'F':
+        config.dbformat = validate_dbformat(optarg);
+        if ((int)config.dbformat < 0) {
+          fprintf(stderr, "error: invalid database format %s\n", optarg);
+          return 1;
+        }
+        break;
       case 'g':
         if (config.filterby != FILTER_EXACT) {
           fprintf(stderr, "error: --glob cannot be used with --%s option\n",
@@ -520,10 +2128,16 @@ static int parse_opts(int argc, char **argv) {
         break;
       case 'h':
         usage();
-        exit(EXIT_SUCCESS);
+        return -1;
       case 'i':
         config.icase = true;
         break;
+      case 'j':
+        if (validate_jobs(optarg, &config.jobs) < 0) {
+          fprintf(stderr, "error: invalid number of jobs %s\n", optarg);
+          return 1;
+        }
+        break;
       case 'l':
         config.filefunc = list_metafile;
         break;
@@ -549,7 +2163,7 @@ static int parse_opts(int argc, char **argv) {
         break;
       case 'V':
         print_version();
-        exit(EXIT_SUCCESS);
+        return -1;
       case 'v':
         config.verbose = true;
         break;
@@ -558,13 +2172,94 @@ static int parse_opts(int argc, char **argv) {
         break;
       case 'z':
         if (optarg != NULL) {
-          config.compress = validate_compression(optarg);
+          config.compress =
+              validate_compression(optarg, &config.compress_level);
           if (config.compress < 0) {
             fprintf(stderr, "error: invalid compression option %s\n", optarg);
             return 1;
           }
         } else {
-          config.compress = ARCHIVE_FILTER_GZIP;
+          config.compress = COMPRESS_DEFAULT;
+          config.compress_level = -1;
+        }
+        break;
+      case OPT_BATCH:
+        config.batch = true;
+        break;
+      case OPT_DAEMON:
+        config.daemon = true;
+        break;
+      case OPT_CLIENT:
+        config.client = true;
+        break;
+      case OPT_SOCKET:
+        config.socket = optarg;
+        break;
+      case OPT_CACHEDIR:
+        config.cachedir = optarg;
+        break;
+      case OPT_STATS:
+        if (optarg != NULL) {
+          config.stats = validate_stats(optarg);
+          if ((int)config.stats < 0) {
+            fprintf(stderr, "error: invalid stats format %s\n", optarg);
+            return 1;
+          }
+        } else {
+          config.stats = STATS_TEXT;
+        }
+        break;
+      case OPT_STREAM:
+        config.stream = true;
+        break;
+      case OPT_MAX_RESULTS:
+        if (validate_max_results(optarg, &config.maxresults) < 0) {
+          fprintf(stderr, "error: invalid result limit %s\n", optarg);
+          return 1;
+        }
+        config.stream = true;
+        break;
+      case OPT_FIRST:
+        config.maxresults = 1;
+        config.stream = true;
+        break;
+      case OPT_NO_MMAP:
+        config.nommap = true;
+        break;
+      case OPT_TRIGRAMS:
+        config.trigrams = true;
+        break;
+      case OPT_ARCH:
+        if (strchr(optarg, '/') || optarg[0] == '\0' ||
+            strcmp(optarg, ".") == 0 || strcmp(optarg, "..") == 0) {
+          fprintf(stderr, "error: invalid architecture %s\n", optarg);
+          return 1;
+        }
+        if (config.narches == MAX_ARCHES) {
+          fprintf(stderr, "error: no more than %d architectures may be given\n",
+                  MAX_ARCHES);
+          return 1;
+        }
+        config.arches[config.narches++] = optarg;
+        break;
+      case OPT_QUERY_CACHE:
+        if (validate_size(optarg, &config.qcachesize) < 0) {
+          fprintf(stderr, "error: invalid query cache size %s\n", optarg);
+          return 1;
+        }
+        break;
+      case OPT_SORT_BUFFER:
+        if (validate_size(optarg, &config.sortbuffer) < 0 ||
+            config.sortbuffer == 0) {
+          fprintf(stderr, "error: invalid sort buffer size %s\n", optarg);
+          return 1;
+        }
+        break;
+      case OPT_RACE:
+        if (validate_race(optarg, &config.race) < 0) {
+          fprintf(stderr, "error: invalid number of servers to race %s\n",
+                  optarg);
+          return 1;
         }
         break;
       default:
@@ -572,10 +2267,51 @@ static int parse_opts(int argc, char **argv) {
     }
   }
 
+  if (config.dbformat != DBFORMAT_CPIO &&
+      config.compress != ARCHIVE_FILTER_NONE) {
+    fprintf(stderr,
+            "error: --compress cannot be used with the %s database format\n",
+            config.dbformat == DBFORMAT_FLAT ? "flat" : "compact");
+    return 1;
+  }
+
+  if (config.batch && config.filefunc == list_metafile) {
+    fputs("error: --batch cannot be used with --list\n", stderr);
+    return 1;
+  }
+
+  if (config.daemon && config.client) {
+    fputs("error: --daemon cannot be used with --client\n", stderr);
+    return 1;
+  }
+
   return 0;
 }
 
-static int search_single_repo(struct repovec_t *repos, char *searchstring) {
+/* With --ignorecase, an ASCII target is folded once here rather than on every
+ * comparison. A glob with a bracket expression is left to fnmatch, as folding
+ * would change what a range like [A-Z] means. */
+static void fold_setup(void) {
+  struct glob_data *glob = &config.filter.glob;
+
+  /* a regex has no target of this sort */
+  if (config.filterby == FILTER_REGEX) {
+    return;
+  }
+
+  FREE(glob->folded);
+  if (!config.icase || !ascii_only(glob->glob, glob->globlen) ||
+      (config.filterby == FILTER_GLOB && strchr(glob->glob, '['))) {
+    return;
+  }
+
+  MALLOC(glob->folded, (size_t)glob->globlen + 1, return);
+  ascii_fold(glob->folded, glob->glob, glob->globlen);
+  glob->folded[glob->globlen] = '\0';
+}
+
+static int search_single_repo(struct repovec_t *repos,
+                              struct repo_scan_t *scans, char *searchstring) {
   struct repo_t *repo;
 
   if (!config.targetrepo) {
@@ -583,20 +2319,37 @@ static int search_single_repo(struct repovec_t *repos, char *searchstring) {
     config.filter.glob.glob = searchstring;
     config.filter.glob.globlen = strlen(searchstring);
     config.filterby = FILTER_EXACT;
+    fold_setup();
   }
 
   REPOVEC_FOREACH(repo, repos) {
     if (strcmp(repo->name, config.targetrepo) == 0) {
-      struct result_t *result;
-      int r;
+      _cleanup_free_ struct result_t **results = NULL;
+      size_t lines = 0;
+      int count = 1, prefixlen;
+
+      /* and its copies for the other architectures, which come right after */
+      while (i_ + count < repos->size &&
+             strcmp(repos->repos[i_ + count]->name, config.targetrepo) == 0) {
+        count++;
+      }
+
+      if (config.stream) {
+        return stream_repos(&scans[i_], count) == 0;
+      }
 
-      result = load_repo(repo);
-      r = result->size == 0;
+      results = load_repos_cached(&scans[i_], count);
+      if (results == NULL) {
+        return 1;
+      }
 
-      result_print(result, config.raw ? 0 : result->max_prefixlen, config.eol);
-      result_free(result);
+      prefixlen = config.raw ? 0 : results_get_prefixlen(results, count);
+      for (int i = 0; i < count; ++i) {
+        lines += result_print(results[i], prefixlen, config.eol);
+        result_free(results[i]);
+      }
 
-      return r;
+      return lines == 0;
     }
   }
 
@@ -606,23 +2359,38 @@ static int search_single_repo(struct repovec_t *repos, char *searchstring) {
   return 1;
 }
 
-static struct result_t **search_all_repos(struct repovec_t *repos) {
-  struct result_t **results;
-  pthread_t *t;
-  struct repo_t *repo;
+static struct result_t **search_all_repos(struct repovec_t *repos,
+                                          struct repo_scan_t *scans) {
+  return load_repos_cached(scans, repos->size);
+}
 
-  t = alloca(repos->size * sizeof(pthread_t));
-  CALLOC(results, repos->size, sizeof(struct result_t *), return NULL);
+static void literal_setup(const char *arg) {
+  size_t (*extract)(const char *pattern, char *literal);
 
-  /* load and process DBs */
-  REPOVEC_FOREACH(repo, repos) {
-    pthread_create(&t[i_], NULL, load_repo, repo);
+  /* the literal has to be found case sensitively */
+  if (config.icase) {
+    return;
+  }
+
+  switch (config.filterby) {
+    case FILTER_GLOB:
+      extract = glob_literal;
+      break;
+    case FILTER_REGEX:
+      extract = regex_literal;
+      break;
+    default:
+      return;
   }
 
-  /* gather results */
-  REPOVEC_FOREACH(repo, repos) { pthread_join(t[i_], (void **)&results[i_]); }
+  MALLOC(config.literal, strlen(arg) + 1, return);
+  config.literallen = extract(arg, config.literal);
 
-  return results;
+  /* too short to be worth searching for first */
+  if (config.literallen < LITERAL_MIN) {
+    FREE(config.literal);
+    config.literallen = 0;
+  }
 }
 
 static int filter_setup(char *arg) {
@@ -634,68 +2402,187 @@ static int filter_setup(char *arg) {
       config.filterfunc = strchr(arg, '/') ? match_exact : match_exact_basename;
       break;
     case FILTER_GLOB:
-      config.icase *= FNM_CASEFOLD;
       config.filter.glob.glob = arg;
       config.filterfunc = match_glob;
       break;
     case FILTER_REGEX:
-      config.icase *= PCRE_CASELESS;
       config.filterfunc = match_regex;
       config.filterfree = free_regex;
-      return compile_pcre_expr(&config.filter.re, arg, config.icase);
+      if (compile_regex(&config.filter.re, arg, config.icase) != 0) {
+        return 1;
+      }
+      break;
   }
 
+  fold_setup();
+  literal_setup(arg);
+
   return 0;
 }
 
-int main(int argc, char *argv[]) {
-  int reposfound = 0, ret = 0;
-  struct repovec_t *repos = NULL;
-  _cleanup_free_ struct result_t **results = NULL;
+static int batch_setup(int argc, char **argv) {
+  int r;
 
-  setlocale(LC_ALL, "");
+  for (int i = optind; i < argc; ++i) {
+    r = batch_add(&batch, argv[i], strlen(argv[i]));
+    if (r < 0) {
+      fprintf(stderr, "error: failed to add target %s: %s\n", argv[i],
+              strerror(-r));
+      return 1;
+    }
+  }
 
-  if (parse_opts(argc, argv) != 0) {
-    return 2;
+  /* without any targets on the command line, read them from stdin */
+  if (optind == argc) {
+    r = batch_read(&batch, stdin);
+    if (r < 0) {
+      fprintf(stderr, "error: failed to read targets: %s\n", strerror(-r));
+      return 1;
+    }
   }
 
-  ret = load_repos_from_file(config.cfgfile, &repos);
-  if (ret < 0) {
+  if (batch.ntargets == 0) {
+    fputs("error: no target specified (use -h for help)\n", stderr);
     return 1;
   }
 
-  if (repos == NULL || repos->size == 0) {
-    fprintf(stderr, "error: no repos found in %s\n", config.cfgfile);
+  switch (config.filterby) {
+    case FILTER_EXACT:
+      break;
+    case FILTER_GLOB:
+      config.filterfunc = match_glob;
+      break;
+    case FILTER_REGEX:
+      config.filterfunc = match_regex;
+      config.filterfree = free_regex;
+      break;
+  }
+
+  for (uint32_t i = 0; i < batch.ntargets; ++i) {
+    struct batch_target_t *t = &batch.targets[i];
+
+    if (config.filterby == FILTER_EXACT) {
+      continue;
+    }
+
+    if (config.filterby == FILTER_GLOB) {
+      t->filter.glob.glob = t->target;
+      t->filter.glob.globlen = t->len;
+    } else if (compile_regex(&t->filter.re, t->target, config.icase) != 0) {
+      /* only the targets compiled so far need freeing */
+      batch.ntargets = i;
+      return 1;
+    }
+
+    if (!config.icase) {
+      MALLOC(t->literal, t->len + 1, return 1);
+      t->literallen = (config.filterby == FILTER_GLOB ? glob_literal
+                                                      : regex_literal)(
+          t->target, t->literal);
+      if (t->literallen < LITERAL_MIN) {
+        FREE(t->literal);
+      }
+    }
+  }
+
+  r = batch_build(&batch, config.icase);
+  if (r < 0) {
+    fprintf(stderr, "error: failed to set up targets: %s\n", strerror(-r));
     return 1;
   }
 
-  if (config.doupdate) {
-    ret = !!pkgfile_update(repos, &config);
-    goto cleanup;
+  config.filefunc = batch_metafile;
+
+  return 0;
+}
+
+static struct stats_t query_stats;
+
+static void search_stats_print(struct repovec_t *repos) {
+  _cleanup_free_ const char **names = NULL;
+  _cleanup_free_ struct stats_t **stats = NULL;
+  struct repo_t *repo;
+  int count = 0;
+
+  CALLOC(names, repos->size, sizeof(char *), return);
+  CALLOC(stats, repos->size, sizeof(struct stats_t *), return);
+
+  /* only the repos that were searched */
+  REPOVEC_FOREACH(repo, repos) {
+    if (repo->stats.phases[PHASE_OPEN].count > 0) {
+      names[count] = repo_label(repo);
+      stats[count++] = &repo->stats;
+    }
   }
 
-  if (optind == argc) {
-    fputs("error: no target specified (use -h for help)\n", stderr);
-    goto cleanup;
+  stats_print(stderr, config.stats, "search", &query_stats, names, stats,
+              count);
+}
+
+static int search_repos(struct repovec_t *repos, struct repo_scan_t *scans,
+                        int argc, char **argv) {
+  int reposfound = 0, ret = 0;
+  _cleanup_free_ struct result_t **results = NULL;
+  struct stats_timer_t t;
+
+  stats_current = NULL;
+  if (config.stats != STATS_NONE) {
+    struct repo_t *repo;
+
+    stats_reset(&query_stats);
+    REPOVEC_FOREACH(repo, repos) { stats_reset(&repo->stats); }
+    stats_current = &query_stats;
   }
 
-  if (filter_setup(argv[optind]) != 0) {
-    goto cleanup;
+  stats_begin(&t, STATS_CLOCK_PROCESS);
+  if (config.batch) {
+    if (batch_setup(argc, argv) != 0) {
+      ret = 1;
+      goto cleanup;
+    }
+  } else {
+    if (optind == argc) {
+      fputs("error: no target specified (use -h for help)\n", stderr);
+      return ret;
+    }
+
+    if (filter_setup(argv[optind]) != 0) {
+      return ret;
+    }
   }
+  if (!config.batch) {
+    qcache_setup(repos, scans, argv[optind]);
+  }
+  stats_end(&t, PHASE_SETUP);
 
   /* override behavior on $repo/$pkg syntax or --repo */
   if ((config.filefunc == list_metafile && config.filterby == FILTER_EXACT &&
        strchr(argv[optind], '/')) ||
       config.targetrepo) {
-    ret = search_single_repo(repos, argv[optind]);
+    ret = search_single_repo(repos, scans,
+                             config.batch ? NULL : argv[optind]);
+  } else if (config.stream) {
+    struct repo_t *repo;
+
+    ret = stream_repos(scans, repos->size) > 0 ? 0 : 1;
+
+    REPOVEC_FOREACH(repo, repos) { reposfound += scans[i_].fd >= 0; }
+    if (!reposfound) {
+      fputs("error: No repo files found. Please run `pkgfile --update'.\n",
+            stderr);
+    }
   } else {
     int prefixlen;
     struct repo_t *repo;
-    results = search_all_repos(repos);
+    results = search_all_repos(repos, scans);
+    if (results == NULL) {
+      ret = 1;
+      goto cleanup;
+    }
 
     prefixlen = config.raw ? 0 : results_get_prefixlen(results, repos->size);
     REPOVEC_FOREACH(repo, repos) {
-      reposfound += repo->fd >= 0;
+      reposfound += qcache.hit || scans[i_].fd >= 0;
       ret += (int)result_print(results[i_], prefixlen, config.eol);
       result_free(results[i_]);
     }
@@ -708,11 +2595,215 @@ int main(int argc, char *argv[]) {
     ret = ret > 0 ? 0 : 1;
   }
 
-  if (config.filterfree) {
+cleanup:
+  qcache_teardown();
+  if (config.batch) {
+    batch_free(&batch, config.filterfree);
+  } else if (config.filterfree) {
     config.filterfree(&config.filter);
+  } else {
+    FREE(config.filter.glob.folded);
+  }
+  free(config.literal);
+
+  if (config.stats != STATS_NONE) {
+    search_stats_print(repos);
+  }
+  stats_current = NULL;
+
+  return ret;
+}
+
+struct daemon_state_t {
+  struct repovec_t *repos;
+  struct repo_scan_t *scans;
+  const char *cfgfile;
+  const char *cachedir;
+};
+
+static int daemon_query(int argc, char **argv, void *data) {
+  struct daemon_state_t *state = data;
+  int r;
+
+  /* every query starts over from the defaults */
+  memset(&config, 0, sizeof(config));
+  optind = 0;
+
+  r = parse_opts(argc, argv);
+  if (r != 0) {
+    return r < 0 ? 0 : 2;
+  }
+
+  if (config.doupdate || config.daemon || config.narches > 0) {
+    fprintf(stderr, "error: --%s cannot be used with a daemon query\n",
+            config.doupdate ? "update"
+            : config.daemon ? "daemon"
+                            : "arch");
+    return 2;
+  }
+
+  /* the daemon's stdin isn't the client's */
+  if (config.batch && optind == argc) {
+    fputs("error: a daemon query must give its --batch targets as arguments\n",
+          stderr);
+    return 2;
+  }
+
+  if (strcmp(config.cfgfile, PACMANCONFIG) != 0 &&
+      strcmp(config.cfgfile, state->cfgfile) != 0) {
+    fprintf(stderr, "error: the daemon only answers queries for %s\n",
+            state->cfgfile);
+    return 2;
+  }
+
+  if (strcmp(config.cachedir, CACHEPATH) != 0 &&
+      strcmp(config.cachedir, state->cachedir) != 0) {
+    fprintf(stderr, "error: the daemon only answers queries for %s\n",
+            state->cachedir);
+    return 2;
+  }
+
+  return search_repos(state->repos, state->scans, argc, argv);
+}
+
+/* Loads all there is of every repo, and reloads whatever an update has
+ * replaced, before a worker is forked off to answer a query. */
+static void daemon_prepare(void *data) {
+  struct daemon_state_t *state = data;
+
+  for (int i = 0; i < state->repos->size; ++i) {
+    struct repo_scan_t *scan = &state->scans[i];
+
+    if (!repo_scan_open_fd(scan)) {
+      continue;
+    }
+
+    repo_scan_open_index(scan);
+    repo_scan_open_trigrams(scan);
+    if (scan->data == MAP_FAILED) {
+      repo_scan_map(scan);
+    }
+  }
+}
+
+static int run_daemon(struct repovec_t *repos) {
+  struct daemon_state_t state = {
+      .repos = repos,
+      .cfgfile = config.cfgfile,
+      .cachedir = config.cachedir,
+  };
+  int ret;
+
+  state.scans = repo_scans_new(repos);
+  if (state.scans == NULL) {
+    return 1;
+  }
+
+  ret = daemon_run(config.socket, daemon_query, daemon_prepare, &state);
+  repo_scans_free(state.scans, repos->size);
+
+  return ret;
+}
+
+/* A query only needs the names of the repos, which the last update left a
+ * snapshot of unless the config has changed since. */
+static int load_query_repos(struct repovec_t **repos) {
+  char snapshot[PATH_MAX];
+  bool ok = snprintf(snapshot, sizeof(snapshot), "%s/" REPOS_SNAPSHOT_FILE,
+                     config.cachedir) < (int)sizeof(snapshot);
+
+  return load_repo_names_from_file(config.cfgfile, ok ? snapshot : NULL, repos);
+}
+
+static void write_repos_snapshot(const struct repovec_t *repos) {
+  char snapshot[PATH_MAX];
+  int r;
+
+  if (snprintf(snapshot, sizeof(snapshot), "%s/" REPOS_SNAPSHOT_FILE,
+               config.cachedir) >= (int)sizeof(snapshot)) {
+    return;
+  }
+
+  r = repos_snapshot_write(repos, config.cfgfile, snapshot);
+  if (r < 0) {
+    fprintf(stderr, "warning: failed to write %s: %s\n", snapshot,
+            strerror(-r));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int ret = 0;
+  struct repovec_t *repos = NULL, *archrepos = NULL;
+  struct repo_scan_t *scans;
+
+  setlocale(LC_ALL, "");
+
+  ret = parse_opts(argc, argv);
+  if (ret != 0) {
+    return ret < 0 ? 0 : 2;
+  }
+
+  /* without a daemon to answer, just answer the query ourselves */
+  if (config.client) {
+    ret = daemon_client(config.socket, argc, argv);
+    if (ret >= 0) {
+      return ret;
+    }
+  }
+
+  if (config.doupdate) {
+    ret = load_repos_from_file(config.cfgfile, &repos);
+  } else {
+    ret = load_query_repos(&repos);
+  }
+  if (ret < 0) {
+    return 1;
+  }
+
+  if (repos == NULL || repos->size == 0) {
+    fprintf(stderr, "error: no repos found in %s\n", config.cfgfile);
+    repos_free(repos);
+    return 1;
   }
 
+  if (config.narches > 0) {
+    if (repos_for_arches(repos, config.arches, config.narches, &archrepos) <
+        0) {
+      ret = 1;
+      goto cleanup;
+    }
+  }
+
+  if (config.doupdate) {
+    ret = !!pkgfile_update(archrepos ? archrepos : repos, &config);
+    /* the snapshot only names the repos in the config */
+    write_repos_snapshot(repos);
+    goto cleanup;
+  }
+
+  /* from here on, the repos for each architecture are what's searched */
+  if (archrepos != NULL) {
+    repos_free(repos);
+    repos = archrepos;
+    archrepos = NULL;
+  }
+
+  if (config.daemon) {
+    ret = run_daemon(repos);
+    goto cleanup;
+  }
+
+  scans = repo_scans_new(repos);
+  if (scans == NULL) {
+    ret = 1;
+    goto cleanup;
+  }
+
+  ret = search_repos(repos, scans, argc, argv);
+  repo_scans_free(scans, repos->size);
+
 cleanup:
+  repos_free(archrepos);
   repos_free(repos);
 
   return ret;
@@ -24,20 +24,32 @@
 
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <archive.h>
 #include <archive_entry.h>
 
+#ifdef HAVE_PCRE2
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#else
 #include <pcre.h>
+#endif
 
 #include "result.h"
+#include "stats.h"
 
 #ifndef BUFSIZ
 #define BUFSIZ 8192
 #endif
 
+/* the most architectures which can be updated or searched at once */
+#define MAX_ARCHES 8
+/* how much of a listing is sorted in memory before it goes out to disk */
+#define SORT_BUFFER_DEFAULT_SIZE ((size_t)64 << 20)
+
 /* allow compilation with pcre < 8.30 */
-#ifndef PCRE_STUDY_JIT_COMPILE
+#if !defined(HAVE_PCRE2) && !defined(PCRE_STUDY_JIT_COMPILE)
 #define PCRE_STUDY_JIT_COMPILE 0
 #endif
 
@@ -47,11 +59,26 @@ struct memblock_t {
   size_t size;
 };
 
+struct compactdb_t;
+
 struct archive_line_reader {
   struct memblock_t line;
   struct memblock_t block;
 
   long ret;
+
+  /* the line's LINE_* classification, and the offset of its basename */
+  unsigned flags;
+  size_t basename;
+  /* last slash seen so far in a line being copied out of an archive */
+  size_t slash;
+
+  /* set when lines are rebuilt from a compact DB rather than read */
+  const struct compactdb_t *compact;
+  uint32_t file;
+  uint32_t endfile;
+  uint32_t dir;
+  size_t dirlen;
 };
 
 typedef enum _filterstyle_t {
@@ -60,27 +87,49 @@ typedef enum _filterstyle_t {
   FILTER_REGEX
 } filterstyle_t;
 
+typedef enum _dbformat_t {
+  DBFORMAT_CPIO = 0,
+  DBFORMAT_FLAT,
+  DBFORMAT_COMPACT
+} dbformat_t;
+
 typedef union _filterpattern_t {
   struct pcre_data {
+#ifdef HAVE_PCRE2
+    pcre2_code *re;
+    /* whether the pattern was JIT compiled, and can skip the interpreter */
+    bool jit;
+#else
     pcre *re;
     pcre_extra *re_extra;
+#endif
   } re;
   struct glob_data {
     char *glob;
     int globlen;
+    /* for --ignorecase, the target in lower case, when folding it doesn't
+     * change what it matches */
+    char *folded;
   } glob;
 } filterpattern_t;
 
+/* A package's name and version, as views into the name of the entry or the
+ * DB record it was parsed from. Neither is NUL terminated. */
 struct pkg_t {
-  char name[PATH_MAX];
+  const char *name;
   const char *version;
   int namelen;
+  int versionlen;
 };
 
 struct config_t {
   const char *cfgfile;
+  const char *cachedir;
   filterstyle_t filterby;
   filterpattern_t filter;
+  /* a substring which everything matching the filter must contain */
+  char *literal;
+  size_t literallen;
   int (*filefunc)(const char *repo, struct pkg_t *pkg, struct archive *a,
                   struct result_t *result, struct archive_line_reader *buf);
   int (*filterfunc)(const filterpattern_t *filter, const char *line, int len,
@@ -95,7 +144,34 @@ struct config_t {
   bool verbose;
   bool raw;
   char eol;
+  /* write results as they're found, and stop after maxresults of them */
+  bool stream;
+  size_t maxresults;
   int compress;
+  /* -1 for the compressor's own default */
+  int compress_level;
+  dbformat_t dbformat;
+  /* most repack workers running at once, 0 for one per CPU */
+  unsigned jobs;
+  /* servers to download each repo from at once, or 0 to use them in the
+   * configured order, one at a time */
+  unsigned race;
+  /* build a trigram index alongside each repo, for glob and regex searches */
+  bool trigrams;
+  bool batch;
+  bool daemon;
+  bool client;
+  const char *socket;
+  statsformat_t stats;
+  /* read DBs into memory rather than mapping them */
+  bool nommap;
+  /* most bytes of results kept from one query to the next, 0 for none */
+  size_t qcachesize;
+  /* most bytes of a listing held in memory per thread, for sorting */
+  size_t sortbuffer;
+  /* each given with --arch, whose repos are kept apart from the others' */
+  const char *arches[MAX_ARCHES];
+  int narches;
 };
 
 int reader_getline(struct archive_line_reader *b, struct archive *a);
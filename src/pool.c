@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <alloca.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "pool.h"
+
+struct pool_t;
+
+struct pool_worker_t {
+  struct pool_t *pool;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  /* the worker's remaining share of tasks, [head, tail) */
+  size_t head;
+  size_t tail;
+};
+
+struct pool_t {
+  void **tasks;
+  void (*func)(void *task);
+  struct pool_worker_t *workers;
+  unsigned nworkers;
+};
+
+static bool worker_pop(struct pool_worker_t *w, size_t *task) {
+  bool found = false;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->head < w->tail) {
+    *task = w->head++;
+    found = true;
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return found;
+}
+
+static bool worker_steal(struct pool_worker_t *w, size_t *task) {
+  struct pool_t *pool = w->pool;
+  unsigned self = w - pool->workers;
+
+  for (unsigned i = 1; i < pool->nworkers; ++i) {
+    struct pool_worker_t *victim = &pool->workers[(self + i) % pool->nworkers];
+    bool found = false;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail) {
+      *task = --victim->tail;
+      found = true;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (found) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void *worker_run(void *arg) {
+  struct pool_worker_t *w = arg;
+  size_t task;
+
+  /* no task ever creates more work, so once there's nothing left to steal,
+   * there's nothing left at all */
+  while (worker_pop(w, &task) || worker_steal(w, &task)) {
+    w->pool->func(w->pool->tasks[task]);
+  }
+
+  return NULL;
+}
+
+unsigned pool_default_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n > 0 ? (unsigned)n : 1;
+}
+
+void pool_run(void **tasks, size_t ntasks, void (*func)(void *task),
+              unsigned nthreads) {
+  struct pool_t pool = {
+      .tasks = tasks,
+      .func = func,
+  };
+  unsigned started = 1;
+
+  nthreads = MIN(nthreads, ntasks);
+  if (nthreads <= 1) {
+    for (size_t i = 0; i < ntasks; ++i) {
+      func(tasks[i]);
+    }
+    return;
+  }
+
+  pool.workers = alloca(nthreads * sizeof(struct pool_worker_t));
+  pool.nworkers = nthreads;
+
+  for (unsigned i = 0; i < nthreads; ++i) {
+    struct pool_worker_t *w = &pool.workers[i];
+
+    w->pool = &pool;
+    w->head = ntasks * i / nthreads;
+    w->tail = ntasks * (i + 1) / nthreads;
+    pthread_mutex_init(&w->lock, NULL);
+  }
+
+  /* the caller is worker 0. if a thread can't be started, its share of the
+   * work is simply stolen by the others, the caller included. */
+  for (unsigned i = 1; i < nthreads; ++i) {
+    if (pthread_create(&pool.workers[i].thread, NULL, worker_run,
+                       &pool.workers[i]) != 0) {
+      break;
+    }
+    started++;
+  }
+
+  worker_run(&pool.workers[0]);
+
+  for (unsigned i = 1; i < started; ++i) {
+    pthread_join(pool.workers[i].thread, NULL);
+  }
+
+  for (unsigned i = 0; i < nthreads; ++i) {
+    pthread_mutex_destroy(&pool.workers[i].lock);
+  }
+}
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,443 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "qcache.h"
+#include "util.h"
+
+/* how a line's missing entry is written out */
+#define QCACHE_NO_ENTRY UINT64_MAX
+
+struct qcache_file_id {
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+struct qcache_entry {
+  char name[NAME_MAX + 1];
+  struct timespec mtime;
+  off_t size;
+};
+
+static uint64_t key_hash(const struct qcache_key_t *key) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (size_t i = 0; i < key->size; ++i) {
+    hash ^= (unsigned char)key->data[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static int entry_path(char *buf, size_t size, const char *cachedir,
+                      const struct qcache_key_t *key) {
+  if (snprintf(buf, size, "%s/" QCACHE_DIR "/%016" PRIx64, cachedir,
+               key_hash(key)) >= (int)size) {
+    return -ENAMETOOLONG;
+  }
+
+  return 0;
+}
+
+int qcache_key_init(struct qcache_key_t *key) {
+  key->data = NULL;
+  key->size = 0;
+  key->fp = open_memstream(&key->data, &key->size);
+
+  return key->fp != NULL ? 0 : -errno;
+}
+
+void qcache_key_add(struct qcache_key_t *key, const void *data, size_t len) {
+  uint64_t n = len;
+
+  /* length prefixed, so that no two different keys run together the same */
+  fwrite(&n, sizeof(n), 1, key->fp);
+  fwrite(data, 1, len, key->fp);
+}
+
+bool qcache_key_add_file(struct qcache_key_t *key, const char *path) {
+  struct qcache_file_id id = {};
+  struct stat st;
+  bool exists = stat(path, &st) == 0;
+
+  if (exists) {
+    id.dev = st.st_dev;
+    id.ino = st.st_ino;
+    id.size = st.st_size;
+    id.mtime_sec = st.st_mtim.tv_sec;
+    id.mtime_nsec = st.st_mtim.tv_nsec;
+  }
+
+  qcache_key_add(key, &id, sizeof(id));
+
+  return exists;
+}
+
+int qcache_key_finish(struct qcache_key_t *key) {
+  int r = fclose(key->fp) == 0 ? 0 : -ENOMEM;
+
+  key->fp = NULL;
+  return r;
+}
+
+void qcache_key_free(struct qcache_key_t *key) {
+  if (key->fp != NULL) {
+    fclose(key->fp);
+    key->fp = NULL;
+  }
+  FREE(key->data);
+  key->size = 0;
+}
+
+/* Reads back one result, from *p onward, and moves past it. Returns NULL if
+ * it runs off the end or doesn't hold together. */
+static struct result_t *entry_result(const char **p, const char *end) {
+  struct qcache_result r;
+  struct result_t *result;
+  const char *name, *lines, *arena;
+
+  if ((size_t)(end - *p) < sizeof(r)) {
+    return NULL;
+  }
+  memcpy(&r, *p, sizeof(r));
+  *p += sizeof(r);
+
+  if (r.namelen >= (size_t)(end - *p) || (*p)[r.namelen] != '\0') {
+    return NULL;
+  }
+  name = *p;
+  *p += r.namelen + 1;
+
+  if (r.nlines > (size_t)(end - *p) / (2 * sizeof(uint64_t))) {
+    return NULL;
+  }
+  lines = *p;
+  *p += r.nlines * 2 * sizeof(uint64_t);
+
+  if (r.arena_size > (size_t)(end - *p) ||
+      (r.arena_size > 0 && (*p)[r.arena_size - 1] != '\0')) {
+    return NULL;
+  }
+  arena = *p;
+  *p += r.arena_size;
+
+  result = result_new(name, r.nlines + 1);
+  if (result == NULL) {
+    return NULL;
+  }
+
+  if (r.arena_size > 0) {
+    MALLOC(result->arena, r.arena_size, goto fail);
+    memcpy(result->arena, arena, r.arena_size);
+    result->arena_size = result->arena_capacity = r.arena_size;
+  }
+
+  for (uint64_t i = 0; i < r.nlines; ++i) {
+    uint64_t off[2];
+
+    memcpy(off, lines + i * sizeof(off), sizeof(off));
+    if (off[0] >= r.arena_size ||
+        (off[1] != QCACHE_NO_ENTRY && off[1] >= r.arena_size)) {
+      goto fail;
+    }
+
+    result->lines[i].prefix = off[0];
+    result->lines[i].entry =
+        off[1] == QCACHE_NO_ENTRY ? LINE_NO_ENTRY : off[1];
+  }
+  result->size = r.nlines;
+  result->max_prefixlen = r.max_prefixlen;
+
+  return result;
+
+fail:
+  result_free(result);
+  return NULL;
+}
+
+static struct result_t **entry_parse(const char *buf, size_t size,
+                                     const struct qcache_key_t *key,
+                                     int count) {
+  const struct qcache_header *hdr = (const struct qcache_header *)buf;
+  const char *p, *end = buf + size;
+  struct result_t **results;
+
+  /* a hash which collides only costs a miss */
+  if (memcmp(hdr->magic, QCACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != QCACHE_VERSION || hdr->nresults != (uint32_t)count ||
+      hdr->keysize != key->size || size - sizeof(*hdr) < key->size ||
+      memcmp(buf + sizeof(*hdr), key->data, key->size) != 0) {
+    return NULL;
+  }
+  p = buf + sizeof(*hdr) + key->size;
+
+  CALLOC(results, count, sizeof(struct result_t *), return NULL);
+
+  for (int i = 0; i < count; ++i) {
+    results[i] = entry_result(&p, end);
+    if (results[i] == NULL) {
+      for (int j = 0; j < i; ++j) {
+        result_free(results[j]);
+      }
+      free(results);
+      return NULL;
+    }
+  }
+
+  return results;
+}
+
+struct result_t **qcache_load(const char *cachedir,
+                              const struct qcache_key_t *key, int count) {
+  _cleanup_free_ char *buf = NULL;
+  char path[PATH_MAX];
+  struct stat st;
+  int fd;
+
+  if (entry_path(path, sizeof(path), cachedir, key) < 0) {
+    return NULL;
+  }
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct qcache_header)) {
+    close(fd);
+    return NULL;
+  }
+
+  MALLOC(buf, (size_t)st.st_size, close(fd); return NULL);
+  if (read_all(fd, buf, st.st_size) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  /* an entry just used is the last to be evicted */
+  futimens(fd, NULL);
+  close(fd);
+
+  return entry_parse(buf, st.st_size, key, count);
+}
+
+static int entrycmp(const void *a, const void *b) {
+  const struct qcache_entry *ea = a, *eb = b;
+
+  if (ea->mtime.tv_sec != eb->mtime.tv_sec) {
+    return ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1;
+  }
+  if (ea->mtime.tv_nsec != eb->mtime.tv_nsec) {
+    return ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1;
+  }
+
+  return 0;
+}
+
+/* Removes the least recently used entries until what's left fits within
+ * limit. */
+static void qcache_evict(const char *dir, size_t limit) {
+  _cleanup_free_ struct qcache_entry *entries = NULL;
+  size_t count = 0, capacity = 0, total = 0;
+  struct dirent *ent;
+  DIR *d;
+
+  d = opendir(dir);
+  if (d == NULL) {
+    return;
+  }
+
+  while ((ent = readdir(d)) != NULL) {
+    struct stat st;
+
+    if (ent->d_name[0] == '.' ||
+        fstatat(dirfd(d), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    if (count == capacity) {
+      size_t newsz = MAX(capacity * 2, (size_t)64);
+      struct qcache_entry *newentries =
+          realloc(entries, newsz * sizeof(struct qcache_entry));
+      if (newentries == NULL) {
+        break;
+      }
+      entries = newentries;
+      capacity = newsz;
+    }
+
+    snprintf(entries[count].name, sizeof(entries[count].name), "%s",
+             ent->d_name);
+    entries[count].mtime = st.st_mtim;
+    entries[count].size = st.st_size;
+    total += st.st_size;
+    count++;
+  }
+
+  if (total > limit) {
+    qsort(entries, count, sizeof(struct qcache_entry), entrycmp);
+    for (size_t i = 0; i < count && total > limit; ++i) {
+      if (unlinkat(dirfd(d), entries[i].name, 0) == 0) {
+        total -= entries[i].size;
+      }
+    }
+  }
+
+  closedir(d);
+}
+
+int qcache_store(const char *cachedir, const struct qcache_key_t *key,
+                 struct result_t *const *results, int count, size_t limit) {
+  struct qcache_header hdr = {};
+  _cleanup_free_ char *body = NULL;
+  char dir[PATH_MAX], path[PATH_MAX], tmpfile[PATH_MAX];
+  size_t bodysz = 0;
+  FILE *fp;
+  int fd, r;
+
+  for (int i = 0; i < count; ++i) {
+    if (results[i] == NULL) {
+      return -ENOMEM;
+    }
+    /* too big to have been kept in memory, let alone in the cache */
+    if (results[i]->nruns > 0) {
+      return 0;
+    }
+  }
+
+  fp = open_memstream(&body, &bodysz);
+  if (fp == NULL) {
+    return -errno;
+  }
+
+  fwrite(key->data, 1, key->size, fp);
+  for (int i = 0; i < count; ++i) {
+    const struct result_t *result = results[i];
+    struct qcache_result out = {
+        .namelen = strlen(result->name),
+        .max_prefixlen = result->max_prefixlen,
+        .nlines = result->size,
+        .arena_size = result->arena_size,
+    };
+
+    fwrite(&out, sizeof(out), 1, fp);
+    fwrite(result->name, 1, out.namelen + 1, fp);
+    for (size_t j = 0; j < result->size; ++j) {
+      const struct line_t *line = &result->lines[j];
+      uint64_t off[2] = {
+          line->prefix,
+          line->entry == LINE_NO_ENTRY ? QCACHE_NO_ENTRY : line->entry,
+      };
+
+      fwrite(off, sizeof(off), 1, fp);
+    }
+    fwrite(result->arena, 1, result->arena_size, fp);
+  }
+
+  if (fclose(fp) != 0) {
+    return -ENOMEM;
+  }
+
+  /* an entry which would crowd out most of the others isn't worth it */
+  if (sizeof(hdr) + bodysz > limit / 4) {
+    return 0;
+  }
+
+  memcpy(hdr.magic, QCACHE_MAGIC, sizeof(hdr.magic));
+  hdr.version = QCACHE_VERSION;
+  hdr.nresults = count;
+  hdr.keysize = key->size;
+
+  if (snprintf(dir, sizeof(dir), "%s/" QCACHE_DIR, cachedir) >=
+          (int)sizeof(dir) ||
+      entry_path(path, sizeof(path), cachedir, key) < 0 ||
+      snprintf(tmpfile, sizeof(tmpfile), "%s.%ld~", path, (long)getpid()) >=
+          (int)sizeof(tmpfile)) {
+    return -ENAMETOOLONG;
+  }
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    return -errno;
+  }
+
+  fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  if ((r = write_all(fd, &hdr, sizeof(hdr))) < 0 ||
+      (r = write_all(fd, body, bodysz)) < 0) {
+    close(fd);
+    unlink(tmpfile);
+    return r;
+  }
+
+  if (close(fd) < 0 || rename(tmpfile, path) < 0) {
+    r = -errno;
+    unlink(tmpfile);
+    return r;
+  }
+
+  qcache_evict(dir, limit);
+
+  return 0;
+}
+
+void qcache_invalidate(const char *cachedir) {
+  char dir[PATH_MAX];
+  struct dirent *ent;
+  DIR *d;
+
+  if (snprintf(dir, sizeof(dir), "%s/" QCACHE_DIR, cachedir) >=
+      (int)sizeof(dir)) {
+    return;
+  }
+
+  d = opendir(dir);
+  if (d == NULL) {
+    return;
+  }
+
+  while ((ent = readdir(d)) != NULL) {
+    if (ent->d_name[0] != '.') {
+      unlinkat(dirfd(d), ent->d_name, 0);
+    }
+  }
+
+  closedir(d);
+}
+
+/* vim: set ts=2 sw=2 et: */
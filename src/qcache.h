@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "result.h"
+
+#define QCACHE_DIR "queries"
+#define QCACHE_MAGIC "PKGFQRY"
+#define QCACHE_VERSION 1
+#define QCACHE_DEFAULT_SIZE ((size_t)8 << 20)
+
+/* On-disk layout of a cached query, which lives in QCACHE_DIR of the cache
+ * directory, in a file named for a hash of its key:
+ *
+ *   struct qcache_header
+ *   char key[keysize]
+ *   nresults of:
+ *     struct qcache_result
+ *     char name[]                      NUL terminated
+ *     uint64_t lines[nlines][2]        offsets of each line's prefix and entry
+ *     char arena[arena_size]
+ *
+ * The key covers everything which decides a query's results, down to the
+ * identity of each repo's DB, so that an entry is never used once an update
+ * has replaced a DB it was answered from. The least recently used entries are
+ * evicted once the cache outgrows its limit. */
+struct qcache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nresults;
+  uint64_t keysize;
+};
+
+struct qcache_result {
+  uint32_t namelen;
+  int32_t max_prefixlen;
+  uint64_t nlines;
+  uint64_t arena_size;
+};
+
+struct qcache_key_t {
+  FILE *fp;
+  char *data;
+  size_t size;
+};
+
+int qcache_key_init(struct qcache_key_t *key);
+void qcache_key_add(struct qcache_key_t *key, const void *data, size_t len);
+
+/* Adds the identity of a file, such as a repo's DB, and returns whether it
+ * exists. */
+bool qcache_key_add_file(struct qcache_key_t *key, const char *path);
+int qcache_key_finish(struct qcache_key_t *key);
+void qcache_key_free(struct qcache_key_t *key);
+
+/* Returns the count results cached under key, or NULL on a miss. */
+struct result_t **qcache_load(const char *cachedir,
+                              const struct qcache_key_t *key, int count);
+
+/* Caches results under key, then evicts entries until the cache holds at most
+ * limit bytes. A cache which can't be written to is only a cache missed. */
+int qcache_store(const char *cachedir, const struct qcache_key_t *key,
+                 struct result_t *const *results, int count, size_t limit);
+
+/* Forgets every cached query, for when a DB has been replaced. */
+void qcache_invalidate(const char *cachedir);
+
+/* vim: set ts=2 sw=2 et: */
@@ -22,7 +22,9 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glob.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +32,7 @@
 
 #include "macro.h"
 #include "repo.h"
+#include "util.h"
 
 struct repo_t *repo_new(const char *reponame) {
   struct repo_t *repo;
@@ -45,12 +48,15 @@ struct repo_t *repo_new(const char *reponame) {
 
   repo->err = 1;
   repo->tmpfile.fd = -1;
+  repo->stats_fd = -1;
+  repo->pipe_fd = -1;
 
   return repo;
 }
 
 void repo_free(struct repo_t *repo) {
   free(repo->name);
+  free(repo->label);
   for (int i = 0; i < repo->servercount; ++i) {
     free(repo->servers[i]);
   }
@@ -60,6 +66,15 @@ void repo_free(struct repo_t *repo) {
     close(repo->tmpfile.fd);
   }
 
+  if (repo->stats_fd >= 0) {
+    close(repo->stats_fd);
+  }
+
+  if (repo->pipe_fd >= 0) {
+    close(repo->pipe_fd);
+  }
+  stats_reset(&repo->stats);
+
   free(repo);
 }
 
@@ -112,25 +127,93 @@ void repos_free(struct repovec_t *repos) {
 
   REPOVEC_FOREACH(repo, repos) { repo_free(repo); }
 
+  for (int i = 0; i < repos->nsources; ++i) {
+    free(repos->sources[i].path);
+  }
+  free(repos->sources);
   free(repos->architecture);
   free(repos->repos);
   free(repos);
 }
 
 int repo_add_server(struct repo_t *repo, const char *server) {
+  char **servers;
+
   if (!repo) {
     return 1;
   }
 
-  repo->servers =
-      realloc(repo->servers, sizeof(char *) * (repo->servercount + 1));
+  servers = realloc(repo->servers, sizeof(char *) * (repo->servercount + 1));
+  if (servers == NULL) {
+    return -ENOMEM;
+  }
+  repo->servers = servers;
 
   repo->servers[repo->servercount] = strdup(server);
+  if (repo->servers[repo->servercount] == NULL) {
+    return -ENOMEM;
+  }
   repo->servercount++;
 
   return 0;
 }
 
+/* Returns where the source is in repos->sources, which it's only added to the
+ * first time. */
+static int repos_add_source(struct repovec_t *repos, const char *path,
+                            const struct stat *st) {
+  struct repo_source_t *newsources, *source;
+
+  /* the same mirrorlist is usually included by every repo */
+  for (int i = 0; i < repos->nsources; ++i) {
+    if (strcmp(repos->sources[i].path, path) == 0) {
+      return i;
+    }
+  }
+
+  newsources = realloc(repos->sources, (repos->nsources + 1) *
+                                           sizeof(struct repo_source_t));
+  if (newsources == NULL) {
+    return -ENOMEM;
+  }
+  repos->sources = newsources;
+
+  source = &repos->sources[repos->nsources];
+  source->path = strdup(path);
+  if (source->path == NULL) {
+    return -ENOMEM;
+  }
+  source->mtime = st->st_mtim;
+  source->size = st->st_size;
+  source->servers_only = false;
+
+  return repos->nsources++;
+}
+
+static bool source_fresh(const struct repo_source_t *source) {
+  struct stat st;
+
+  return stat(source->path, &st) == 0 &&
+         st.st_mtim.tv_sec == source->mtime.tv_sec &&
+         st.st_mtim.tv_nsec == source->mtime.tv_nsec &&
+         st.st_size == source->size;
+}
+
+/* Whether a file is known to hold nothing but servers, as it did when the
+ * sources in known were read. */
+static bool source_servers_only(const struct repovec_t *known,
+                                const char *path) {
+  for (int i = 0; i < known->nsources; ++i) {
+    const struct repo_source_t *source = &known->sources[i];
+
+    if (strcmp(source->path, path) == 0) {
+      return source->servers_only && source_fresh(source);
+    }
+  }
+
+  return false;
+}
+
 static size_t strtrim(char *str) {
   char *left = str, *right;
 
@@ -164,10 +247,40 @@ static char *split_keyval(char *line, const char *sep) {
   return line;
 }
 
-static int parse_one_file(const char *, char **, struct repovec_t *);
+static int parse_one_file(const char *, char **, struct repovec_t *,
+                          const struct repovec_t *);
+
+/* A file added to the directory that an Include is globbed in changes what
+ * the glob matches. */
+static void add_include_dir(struct repovec_t *repos, const char *include) {
+  char dir[PATH_MAX];
+  size_t dirlen;
+  struct stat st;
+
+  dirlen = strcspn(include, "*?[");
+  if (include[dirlen] == '\0') {
+    return;
+  }
+
+  /* the directory only counts if it isn't globbed itself */
+  while (dirlen > 0 && include[dirlen] != '/') {
+    dirlen--;
+  }
+  if (include[dirlen] != '/' || strchr(&include[dirlen + 1], '/') != NULL) {
+    return;
+  }
+
+  snprintf(dir, sizeof(dir), "%.*s", dirlen ? (int)dirlen : 1, include);
+  if (stat(dir, &st) == 0) {
+    repos_add_source(repos, dir, &st);
+  }
+}
 
+/* With known, only the repo names are wanted, and a file included in a repo's
+ * section is skipped if it's known to hold nothing else but servers. */
 static int parse_include(const char *include, char **section,
-                         struct repovec_t *repos) {
+                         struct repovec_t *repos,
+                         const struct repovec_t *known, bool in_repo) {
   glob_t globbuf;
 
   if (glob(include, GLOB_NOCHECK, NULL, &globbuf) != 0) {
@@ -176,8 +289,14 @@ static int parse_include(const char *include, char **section,
     return -ENOMEM;
   }
 
+  add_include_dir(repos, include);
+
   for (size_t i = 0; i < globbuf.gl_pathc; ++i) {
-    parse_one_file(globbuf.gl_pathv[i], section, repos);
+    if (known != NULL && in_repo &&
+        source_servers_only(known, globbuf.gl_pathv[i])) {
+      continue;
+    }
+    parse_one_file(globbuf.gl_pathv[i], section, repos, known);
   }
 
   globfree(&globbuf);
@@ -186,14 +305,17 @@ static int parse_include(const char *include, char **section,
 }
 
 static int parse_one_file(const char *filename, char **section,
-                          struct repovec_t *repos) {
+                          struct repovec_t *repos,
+                          const struct repovec_t *known) {
   FILE *fp;
   char *ptr;
   char line[4096];
   const char *const server = "Server";
   const char *const include = "Include";
   const char *const architecture = "Architecture";
-  int in_options = 0, r = 0, lineno = 0;
+  int in_options = 0, r = 0, lineno = 0, source = -1;
+  bool servers_only = true;
+  struct stat st;
 
   fp = fopen(filename, "r");
   if (!fp) {
@@ -202,6 +324,10 @@ static int parse_one_file(const char *filename, char **section,
     return -errno;
   }
 
+  if (fstat(fileno(fp), &st) == 0) {
+    source = repos_add_source(repos, filename, &st);
+  }
+
   while (fgets(line, sizeof(line), fp)) {
     size_t len;
     ++lineno;
@@ -219,6 +345,7 @@ static int parse_one_file(const char *filename, char **section,
 
     /* found a section header */
     if (line[0] == '[' && line[len - 1] == ']') {
+      servers_only = false;
       free(*section);
       *section = strndup(&line[1], len - 2);
       in_options = len - 2 == 7 && memcmp(*section, "options", 7) == 0;
@@ -248,12 +375,17 @@ static int parse_one_file(const char *filename, char **section,
               filename, lineno);
           continue;
         }
+        if (known != NULL) {
+          continue;
+        }
         r = repo_add_server(repos->repos[repos->size - 1], val);
         if (r < 0) {
           break;
         }
       } else if (keysz == strlen(include) && memcmp(key, include, keysz) == 0) {
-        parse_include(val, section, repos);
+        servers_only = false;
+        parse_include(val, section, repos, known,
+                      *section != NULL && !in_options);
       } else if (in_options && keysz == strlen(architecture) &&
                  memcmp(key, architecture, keysz) == 0) {
         if (valsz != 4 || memcmp(val, "auto", 4) != 0) {
@@ -266,15 +398,25 @@ static int parse_one_file(const char *filename, char **section,
 
   fclose(fp);
 
+  /* only known once the whole file has been read */
+  if (source >= 0 && r == 0) {
+    repos->sources[source].servers_only = servers_only;
+  }
+
   return r;
 }
 
-int load_repos_from_file(const char *filename, struct repovec_t **repos) {
+static int load_repos(const char *filename, struct repovec_t **repos,
+                      const struct repovec_t *known) {
   _cleanup_free_ char *section = NULL;
   struct repovec_t *r = repos_new();
   int k;
 
-  k = parse_one_file(filename, &section, r);
+  if (r == NULL) {
+    return -ENOMEM;
+  }
+
+  k = parse_one_file(filename, &section, r, known);
   if (k < 0) {
     repos_free(r);
     return k;
@@ -285,4 +427,258 @@ int load_repos_from_file(const char *filename, struct repovec_t **repos) {
   return 0;
 }
 
+int load_repos_from_file(const char *filename, struct repovec_t **repos) {
+  return load_repos(filename, repos, NULL);
+}
+
+static int snapshot_read(const char *filename, const char *cfgfile,
+                         struct repovec_t *r);
+
+int load_repo_names_from_file(const char *filename, const char *snapshot,
+                              struct repovec_t **repos) {
+  static const struct repovec_t none;
+  struct repovec_t *known = repos_new();
+  int k;
+
+  if (known == NULL) {
+    return -ENOMEM;
+  }
+
+  k = snapshot != NULL ? snapshot_read(snapshot, filename, known) : -ENOENT;
+  if (k == 0) {
+    *repos = known;
+    return 0;
+  }
+
+  /* a stale snapshot still knows which files held only servers */
+  k = load_repos(filename, repos, k == -ESTALE ? known : &none);
+  repos_free(known);
+
+  return k;
+}
+
+int repos_for_arches(const struct repovec_t *repos, const char *const *arches,
+                     int narches, struct repovec_t **out) {
+  struct repovec_t *copies;
+  struct repo_t *repo;
+
+  copies = repos_new();
+  if (copies == NULL) {
+    return -ENOMEM;
+  }
+
+  REPOVEC_FOREACH(repo, repos) {
+    for (int a = 0; a < narches; ++a) {
+      struct repo_t *copy;
+
+      if (repos_add_repo(copies, repo->name) < 0) {
+        goto fail;
+      }
+      copy = copies->repos[copies->size - 1];
+      copy->arch = (char *)arches[a];
+      copy->archdir = arches[a];
+      if (narches > 1 &&
+          asprintf(&copy->label, "%s/%s", arches[a], repo->name) < 0) {
+        copy->label = NULL;
+        goto fail;
+      }
+
+      for (int s = 0; s < repo->servercount; ++s) {
+        if (repo_add_server(copy, repo->servers[s]) < 0) {
+          goto fail;
+        }
+      }
+    }
+  }
+
+  *out = copies;
+  return 0;
+
+fail:
+  fputs("error: failed to allocate memory for repos\n", stderr);
+  repos_free(copies);
+  return -ENOMEM;
+}
+
+int repo_dbpath(const struct repo_t *repo, const char *cachedir, char *buf,
+                size_t size) {
+  int len;
+
+  if (repo->archdir != NULL) {
+    len = snprintf(buf, size, "%s/%s/%s.files", cachedir, repo->archdir,
+                   repo->name);
+  } else {
+    len = snprintf(buf, size, "%s/%s.files", cachedir, repo->name);
+  }
+
+  return (size_t)len < size ? 0 : -ENAMETOOLONG;
+}
+
+int repos_snapshot_write(const struct repovec_t *repos, const char *cfgfile,
+                         const char *filename) {
+  struct repos_snapshot_header hdr = {};
+  _cleanup_free_ char *body = NULL;
+  char tmpfile[PATH_MAX];
+  size_t bodysz = 0;
+  FILE *fp;
+  int fd, r;
+
+  fp = open_memstream(&body, &bodysz);
+  if (fp == NULL) {
+    return -errno;
+  }
+
+  fwrite(cfgfile, 1, strlen(cfgfile) + 1, fp);
+  for (int i = 0; i < repos->nsources; ++i) {
+    const struct repo_source_t *source = &repos->sources[i];
+    struct repos_snapshot_source out = {
+        .mtime_sec = source->mtime.tv_sec,
+        .mtime_nsec = source->mtime.tv_nsec,
+        .size = source->size,
+        .flags = source->servers_only ? REPOS_SNAPSHOT_SERVERS_ONLY : 0,
+    };
+
+    fwrite(&out, sizeof(out), 1, fp);
+    fwrite(source->path, 1, strlen(source->path) + 1, fp);
+  }
+  for (int i = 0; i < repos->size; ++i) {
+    fwrite(repos->repos[i]->name, 1, strlen(repos->repos[i]->name) + 1, fp);
+  }
+
+  if (fclose(fp) != 0 || bodysz > UINT32_MAX) {
+    return -ENOMEM;
+  }
+
+  memcpy(hdr.magic, REPOS_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+  hdr.version = REPOS_SNAPSHOT_VERSION;
+  hdr.nsources = repos->nsources;
+  hdr.nrepos = repos->size;
+  hdr.size = bodysz;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s~", filename);
+  fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  if ((r = write_all(fd, &hdr, sizeof(hdr))) < 0 ||
+      (r = write_all(fd, body, bodysz)) < 0) {
+    close(fd);
+    unlink(tmpfile);
+    return r;
+  }
+
+  if (close(fd) < 0 || rename(tmpfile, filename) < 0) {
+    r = -errno;
+    unlink(tmpfile);
+    return r;
+  }
+
+  return 0;
+}
+
+/* Returns the NUL terminated string at *p and moves past it, or NULL if it
+ * runs off the end. */
+static const char *snapshot_string(const char **p, const char *end) {
+  const char *s = *p, *nul = memchr(s, '\0', end - s);
+
+  if (nul == NULL) {
+    return NULL;
+  }
+
+  *p = nul + 1;
+  return s;
+}
+
+/* Reads the sources and then the names of the repos from a snapshot into r.
+ * If any source has changed, it stops short of the names and returns
+ * -ESTALE. */
+static int snapshot_read(const char *filename, const char *cfgfile,
+                         struct repovec_t *r) {
+  _cleanup_free_ char *buf = NULL;
+  const struct repos_snapshot_header *hdr;
+  const char *p, *end, *s;
+  bool fresh = true;
+  struct stat st;
+  int fd;
+
+  fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  /* it holds a few names, anything much bigger isn't one */
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr) ||
+      st.st_size > 1024 * 1024) {
+    close(fd);
+    return -EINVAL;
+  }
+
+  MALLOC(buf, st.st_size, close(fd); return -ENOMEM);
+  if (read_all(fd, buf, st.st_size) < 0) {
+    close(fd);
+    return -EIO;
+  }
+  close(fd);
+
+  hdr = (const struct repos_snapshot_header *)buf;
+  if (memcmp(hdr->magic, REPOS_SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != REPOS_SNAPSHOT_VERSION ||
+      hdr->size != st.st_size - sizeof(*hdr)) {
+    return -EINVAL;
+  }
+
+  p = (const char *)(hdr + 1);
+  end = p + hdr->size;
+
+  /* a snapshot of some other config is no use */
+  s = snapshot_string(&p, end);
+  if (s == NULL || strcmp(s, cfgfile) != 0) {
+    return -ESTALE;
+  }
+
+  for (uint32_t i = 0; i < hdr->nsources; ++i) {
+    struct repos_snapshot_source source;
+    int k;
+
+    if ((size_t)(end - p) < sizeof(source)) {
+      return -EINVAL;
+    }
+    memcpy(&source, p, sizeof(source));
+    p += sizeof(source);
+
+    s = snapshot_string(&p, end);
+    if (s == NULL) {
+      return -EINVAL;
+    }
+
+    st.st_mtim.tv_sec = source.mtime_sec;
+    st.st_mtim.tv_nsec = source.mtime_nsec;
+    st.st_size = source.size;
+    k = repos_add_source(r, s, &st);
+    if (k < 0) {
+      return k;
+    }
+    r->sources[k].servers_only = source.flags & REPOS_SNAPSHOT_SERVERS_ONLY;
+    fresh = fresh && source_fresh(&r->sources[k]);
+  }
+
+  if (!fresh) {
+    return -ESTALE;
+  }
+
+  for (uint32_t i = 0; i < hdr->nrepos; ++i) {
+    s = snapshot_string(&p, end);
+    if (s == NULL) {
+      return -EINVAL;
+    }
+    if (repos_add_repo(r, s) < 0) {
+      return -ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+
 /* vim: set ts=2 sw=2 et: */
@@ -23,11 +23,36 @@
 #pragma once
 
 #include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 
 #include <curl/curl.h>
 
+#include "stats.h"
+
+/* the most servers a repo is downloaded from at once */
+#define REPO_MAX_TRANSFERS 8
+
+struct repo_t;
+
+/* One server's attempt at downloading a repo. When servers are raced, several
+ * of them start at once and only the first to deliver any data carries on. */
+struct transfer_t {
+  struct repo_t *repo;
+  /* curl easy handle */
+  CURL *curl;
+  /* index of the server it's downloading from */
+  int server_idx;
+  /* added to the multi handle, and not yet done */
+  short active;
+  /* start time for download */
+  double start;
+  /* error buffer */
+  char errmsg[CURL_ERROR_SIZE];
+};
+
 struct repo_t {
   char *name;
   char **servers;
@@ -35,26 +60,42 @@ struct repo_t {
   int fd;
   char *arch;
 
+  /* for repos kept per architecture, the subdirectory of the cache which
+   * holds their DBs, and how they're told apart from each other's copies of
+   * the same repo */
+  const char *archdir;
+  char *label;
+
   const struct config_t *config;
 
   /* download stuff */
 
-  /* curl easy handle */
-  CURL *curl;
+  struct transfer_t transfers[REPO_MAX_TRANSFERS];
+  int ntransfers;
+  /* the transfer whose data is kept, once one has delivered any */
+  struct transfer_t *winner;
   /* destination */
   char diskfile[PATH_MAX];
-  /* index to currently in-use server */
+  /* index of the next server to try */
   int server_idx;
-  /* error buffer */
-  char errmsg[CURL_ERROR_SIZE];
   /* numeric err for determining success */
   int err;
   /* force update repos */
   short force;
-  /* start time for download */
-  double dl_time_start;
   /* PID of repo_repack worker */
   pid_t worker;
+  /* downloaded, but waiting for a worker to become free */
+  short repack_pending;
+  /* exit status of the worker, or of the repack if it was done in process */
+  int repack_err;
+  /* read end of a pipe the worker reports its repack time over */
+  int stats_fd;
+  /* write end of a pipe the download is fed to the worker through, while the
+   * worker repacks it */
+  int pipe_fd;
+
+  /* collected for --stats, by an update or a query */
+  struct stats_t stats;
 
   struct {
     int fd;
@@ -62,20 +103,93 @@ struct repo_t {
   } tmpfile;
 };
 
+/* A file the repos were read from, or a directory an Include was globbed in,
+ * as it was when it was read. */
+struct repo_source_t {
+  char *path;
+  struct timespec mtime;
+  off_t size;
+  /* a file with neither sections nor Includes of its own, such as a
+   * mirrorlist, which the repo names don't depend on */
+  bool servers_only;
+};
+
 struct repovec_t {
   struct repo_t **repos;
   int size;
   int capacity;
   char *architecture;
+
+  struct repo_source_t *sources;
+  int nsources;
+};
+
+#define REPOS_SNAPSHOT_FILE "repos.snapshot"
+#define REPOS_SNAPSHOT_MAGIC "PKGFREP"
+#define REPOS_SNAPSHOT_VERSION 2
+
+/* On-disk layout of a snapshot of the repo names, written to the cache
+ * directory by an update so that queries needn't parse the config at all:
+ *
+ *   struct repos_snapshot_header
+ *   char cfgfile[]                     NUL terminated
+ *   struct repos_snapshot_source sources[nsources], each followed by its
+ *                                      NUL terminated path
+ *   char names[]                       nrepos NUL terminated repo names
+ *
+ * A snapshot is stale as soon as any of its sources has changed. */
+struct repos_snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nsources;
+  uint32_t nrepos;
+  uint32_t size;
 };
 
+struct repos_snapshot_source {
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+#define REPOS_SNAPSHOT_SERVERS_ONLY (1 << 0)
+
 #define REPOVEC_FOREACH(r, repos) \
   for (int i_ = 0; i_ < repos->size && (r = repos->repos[i_]); ++i_)
 
+/* What a repo is called in results and messages. */
+static inline const char *repo_label(const struct repo_t *repo) {
+  return repo->label ? repo->label : repo->name;
+}
+
 struct repo_t *repo_new(const char *reponame);
 void repo_free(struct repo_t *repo);
 void repos_free(struct repovec_t *repos);
 int repo_add_server(struct repo_t *repo, const char *server);
 int load_repos_from_file(const char *filename, struct repovec_t **repos);
 
+/* Only finds out which repos there are, for a query, which has no use for
+ * their servers. They're taken from the snapshot, if it's given and none of
+ * its sources have changed. Otherwise, the config is parsed, but a file
+ * included in a repo's section isn't read if the snapshot found it held
+ * nothing but servers and it hasn't changed since. */
+int load_repo_names_from_file(const char *filename, const char *snapshot,
+                              struct repovec_t **repos);
+
+/* Makes a copy of every repo for each of the given architectures, which keeps
+ * its DB in a subdirectory of the cache named for its architecture. The copies
+ * of a repo are kept together, in the order the architectures are given, and
+ * are labelled $arch/$repo if there's more than one architecture. */
+int repos_for_arches(const struct repovec_t *repos, const char *const *arches,
+                     int narches, struct repovec_t **out);
+
+/* Where the repo's DB lives in cachedir. */
+int repo_dbpath(const struct repo_t *repo, const char *cachedir, char *buf,
+                size_t size);
+
+int repos_snapshot_write(const struct repovec_t *repos, const char *cfgfile,
+                         const char *filename);
+
 /* vim: set ts=2 sw=2 et: */
@@ -20,66 +20,78 @@
  * THE SOFTWARE.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "macro.h"
 #include "result.h"
+#include "stats.h"
+#include "util.h"
 
-static void line_free(struct line_t *line) {
-  if (!line) {
-    return;
-  }
+#define ARENA_MIN_SIZE ((size_t)4096)
 
-  free(line->prefix);
-  free(line->entry);
-  free(line);
-}
+static int arena_reserve(struct result_t *result, size_t len) {
+  size_t newsz;
+  char *newarena;
 
-static struct line_t *line_new(char *prefix, char *entry) {
-  struct line_t *line = calloc(1, sizeof(struct line_t));
-  if (line == NULL) {
-    goto alloc_fail;
+  if (result->arena_size + len <= result->arena_capacity) {
+    return 0;
   }
 
-  line->prefix = strdup(prefix);
-  if (line->prefix == NULL) {
-    goto alloc_fail;
+  newsz = MAX(result->arena_capacity * 2, ARENA_MIN_SIZE);
+  while (newsz < result->arena_size + len) {
+    newsz *= 2;
   }
 
-  if (entry) {
-    line->entry = strdup(entry);
-    if (line->entry == NULL) {
-      goto alloc_fail;
-    }
+  newarena = realloc(result->arena, newsz);
+  if (newarena == NULL) {
+    return 1;
   }
+  stats_add(STATS_ALLOCATIONS, 1);
 
-  return line;
+  result->arena = newarena;
+  result->arena_capacity = newsz;
 
-alloc_fail:
-  fputs("error: failed to allocate memory for result line\n", stderr);
-  line_free(line);
-  return NULL;
+  return 0;
+}
+
+static size_t arena_add(struct result_t *result, const char *s, size_t len) {
+  size_t offset = result->arena_size;
+
+  memcpy(&result->arena[offset], s, len);
+  result->arena[offset + len] = '\0';
+  result->arena_size += len + 1;
+
+  return offset;
 }
 
 static int result_grow(struct result_t *result) {
-  size_t newsz = result->capacity * 3;
-  result->lines = realloc(result->lines, newsz * sizeof(struct line_t *));
-  if (!result->lines) {
+  size_t newsz = MAX(result->capacity * 3, (size_t)16);
+  struct line_t *newlines =
+      realloc(result->lines, newsz * sizeof(struct line_t));
+  if (newlines == NULL) {
     return 1;
   }
+  stats_add(STATS_ALLOCATIONS, 1);
 
+  result->lines = newlines;
   result->capacity = newsz;
 
   return 0;
 }
 
-struct result_t *result_new(char *name, size_t initial_size) {
+struct result_t *result_new(const char *name, size_t initial_size) {
   struct result_t *result = calloc(1, sizeof(struct result_t));
   if (result == NULL) {
     goto alloc_fail;
   }
 
-  result->lines = calloc(initial_size, sizeof(struct line_t *));
+  result->lines = calloc(initial_size, sizeof(struct line_t));
   if (!result->lines) {
     goto alloc_fail;
   }
@@ -90,6 +102,7 @@ struct result_t *result_new(char *name, size_t initial_size) {
   }
 
   result->capacity = initial_size;
+  result->lastprefix = LINE_NO_ENTRY;
   return result;
 
 alloc_fail:
@@ -98,24 +111,149 @@ alloc_fail:
   return NULL;
 }
 
-int result_add(struct result_t *result, char *prefix, char *entry,
-               int prefixlen) {
+/* A prefix may start with a tag ending in a tab, as --batch results do, which
+ * is left out when justifying it so that the tags don't shift the columns. */
+static size_t justified_len(const char *prefix, size_t prefixlen) {
+  const char *tab = memrchr(prefix, '\t', prefixlen);
+
+  return tab ? prefixlen - (size_t)(tab + 1 - prefix) : prefixlen;
+}
+
+int result_add(struct result_t *result, const char *prefix, size_t prefixlen,
+               const char *entry, size_t entrylen) {
+  struct line_t *line;
+  bool shared;
+
   if (!result || !prefix) {
     return 1;
   }
 
   if (result->size + 1 >= result->capacity) {
     if (result_grow(result) != 0) {
+      goto alloc_fail;
+    }
+  }
+
+  /* lines come a package at a time, so there's rarely a need to store the
+   * same prefix twice in a row */
+  shared = result->lastprefix != LINE_NO_ENTRY &&
+           result->lastprefixlen == prefixlen &&
+           memcmp(&result->arena[result->lastprefix], prefix, prefixlen) == 0;
+
+  if (arena_reserve(result, (shared ? 0 : prefixlen + 1) +
+                                (entry ? entrylen + 1 : 0)) != 0) {
+    goto alloc_fail;
+  }
+
+  if (!shared) {
+    result->lastprefix = arena_add(result, prefix, prefixlen);
+    result->lastprefixlen = prefixlen;
+  }
+
+  line = &result->lines[result->size++];
+  line->prefix = result->lastprefix;
+  line->entry = entry ? arena_add(result, entry, entrylen) : LINE_NO_ENTRY;
+  stats_add(STATS_MATCHES, 1);
+
+  /* only lines with an entry are justified */
+  if (entry) {
+    result->max_prefixlen =
+        MAX(result->max_prefixlen, (int)justified_len(prefix, prefixlen));
+  }
+
+  return 0;
+
+alloc_fail:
+  fputs("error: failed to allocate memory for result line\n", stderr);
+  return 1;
+}
+
+/* Hands src's spilled runs over to dst, which sorts them in with its own. */
+static int result_merge_runs(struct result_t *dst, struct result_t *src) {
+  FILE **runs;
+
+  if (src->nruns == 0) {
+    return 0;
+  }
+
+  runs = realloc(dst->runs, (dst->nruns + src->nruns) * sizeof(FILE *));
+  if (runs == NULL) {
+    return 1;
+  }
+  stats_add(STATS_ALLOCATIONS, 1);
+
+  memcpy(&runs[dst->nruns], src->runs, src->nruns * sizeof(FILE *));
+  dst->runs = runs;
+  dst->nruns += src->nruns;
+  dst->spilled += src->spilled;
+  src->nruns = src->spilled = 0;
+
+  return 0;
+}
+
+int result_merge(struct result_t *dst, struct result_t *src) {
+  size_t base;
+
+  if (result_merge_runs(dst, src) != 0) {
+    return 1;
+  }
+
+  /* the common case of a repo searched in one piece */
+  if (dst->size == 0 && dst->arena_size == 0) {
+    struct result_t tmp = *dst;
+
+    dst->lines = src->lines;
+    dst->size = src->size;
+    dst->capacity = src->capacity;
+    dst->arena = src->arena;
+    dst->arena_size = src->arena_size;
+    dst->arena_capacity = src->arena_capacity;
+    dst->max_prefixlen = MAX(dst->max_prefixlen, src->max_prefixlen);
+    dst->lastprefix = LINE_NO_ENTRY;
+
+    src->lines = tmp.lines;
+    src->capacity = tmp.capacity;
+    src->arena = tmp.arena;
+    src->arena_capacity = tmp.arena_capacity;
+    src->size = src->arena_size = 0;
+    src->lastprefix = LINE_NO_ENTRY;
+
+    return 0;
+  }
+
+  if (dst->size + src->size >= dst->capacity) {
+    size_t newsz = dst->size + src->size + 1;
+    struct line_t *newlines =
+        realloc(dst->lines, newsz * sizeof(struct line_t));
+    if (newlines == NULL) {
       return 1;
     }
+    stats_add(STATS_ALLOCATIONS, 1);
+    dst->lines = newlines;
+    dst->capacity = newsz;
   }
 
-  if (prefixlen > result->max_prefixlen) {
-    result->max_prefixlen = prefixlen;
+  if (arena_reserve(dst, src->arena_size) != 0) {
+    return 1;
   }
 
-  result->lines[result->size] = line_new(prefix, entry);
-  result->size++;
+  base = dst->arena_size;
+  memcpy(&dst->arena[base], src->arena, src->arena_size);
+  dst->arena_size += src->arena_size;
+
+  for (size_t i = 0; i < src->size; ++i) {
+    struct line_t *line = &dst->lines[dst->size++];
+
+    line->prefix = src->lines[i].prefix + base;
+    line->entry = src->lines[i].entry == LINE_NO_ENTRY
+                      ? LINE_NO_ENTRY
+                      : src->lines[i].entry + base;
+  }
+
+  dst->max_prefixlen = MAX(dst->max_prefixlen, src->max_prefixlen);
+  dst->lastprefix = LINE_NO_ENTRY;
+  src->size = src->arena_size = 0;
+  src->lastprefix = LINE_NO_ENTRY;
 
   return 0;
 }
@@ -125,53 +263,387 @@ void result_free(struct result_t *result) {
     return;
   }
 
-  if (result->lines) {
-    for (size_t i = 0; i < result->size; ++i) {
-      line_free(result->lines[i]);
-    }
-    free(result->lines);
+  for (size_t i = 0; i < result->nruns; ++i) {
+    fclose(result->runs[i]);
   }
+
+  free(result->runs);
+  free(result->lines);
+  free(result->arena);
   free(result->name);
   free(result);
 }
 
-static int linecmp(const void *l1, const void *l2) {
-  const struct line_t *line1 = *(struct line_t **)l1;
-  const struct line_t *line2 = *(struct line_t **)l2;
-  int cmp = strcmp(line1->prefix, line2->prefix);
+static int linecmp(const void *l1, const void *l2, void *arena) {
+  const struct line_t *line1 = l1;
+  const struct line_t *line2 = l2;
+  const char *strings = arena;
+  int cmp = 0;
+
+  /* a shared prefix needn't be compared at all */
+  if (line1->prefix != line2->prefix) {
+    cmp = strcmp(&strings[line1->prefix], &strings[line2->prefix]);
+  }
 
-  if (cmp == 0 && line1->entry && line2->entry) {
-    return strcmp(line1->entry, line2->entry);
+  if (cmp == 0 && line1->entry != LINE_NO_ENTRY &&
+      line2->entry != LINE_NO_ENTRY) {
+    return strcmp(&strings[line1->entry], &strings[line2->entry]);
   } else {
     return cmp;
   }
 }
 
-static void result_print_long(struct result_t *result, int prefixlen,
-                              char eol) {
-  for (size_t i = 0; i < result->size; ++i) {
-    printf("%-*s\t%s%c", prefixlen, result->lines[i]->prefix,
-           result->lines[i]->entry, eol);
+/* Output is assembled here and handed to stdio a buffer at a time, rather
+ * than formatting every line with its own call. */
+#define OUTBUF_SIZE ((size_t)65536)
+
+struct outbuf_t {
+  size_t len;
+  char buf[OUTBUF_SIZE];
+};
+
+enum lineformat_t {
+  /* the prefix alone */
+  LINEFORMAT_SHORT,
+  /* the prefix padded out and the entry, which may be empty */
+  LINEFORMAT_LONG,
+  /* the prefix and, if there is one, the entry, unpadded */
+  LINEFORMAT_STREAM,
+};
+
+static void outbuf_flush(struct outbuf_t *out) {
+  fwrite_unlocked(out->buf, 1, out->len, stdout);
+  out->len = 0;
+}
+
+static void outbuf_add(struct outbuf_t *out, const char *s, size_t len) {
+  if (len > OUTBUF_SIZE - out->len) {
+    outbuf_flush(out);
+
+    /* too big to be worth copying */
+    if (len >= OUTBUF_SIZE) {
+      fwrite_unlocked(s, 1, len, stdout);
+      return;
+    }
+  }
+
+  memcpy(&out->buf[out->len], s, len);
+  out->len += len;
+}
+
+static void outbuf_pad(struct outbuf_t *out, size_t len) {
+  while (len > 0) {
+    size_t n;
+
+    if (out->len == OUTBUF_SIZE) {
+      outbuf_flush(out);
+    }
+
+    n = MIN(len, OUTBUF_SIZE - out->len);
+    memset(&out->buf[out->len], ' ', n);
+    out->len += n;
+    len -= n;
   }
 }
 
-static void result_print_short(struct result_t *result, char eol) {
+/* Formats a single line, whose entry is NULL when it doesn't have one. */
+static void outbuf_line(struct outbuf_t *out, const char *prefix,
+                        size_t prefixlen, const char *entry,
+                        enum lineformat_t format, int width, char eol) {
+  outbuf_add(out, prefix, prefixlen);
+
+  if (format == LINEFORMAT_LONG) {
+    size_t len = justified_len(prefix, prefixlen);
+
+    if (len < (size_t)width) {
+      outbuf_pad(out, width - len);
+    }
+    outbuf_add(out, "\t", 1);
+  }
+
+  if (format != LINEFORMAT_SHORT && entry != NULL) {
+    if (format == LINEFORMAT_STREAM) {
+      outbuf_add(out, "\t", 1);
+    }
+    outbuf_add(out, entry, strlen(entry));
+  }
+
+  outbuf_add(out, &eol, 1);
+}
+
+static void result_write(struct result_t *result, size_t count,
+                         enum lineformat_t format, int prefixlen, char eol) {
+  struct outbuf_t buf, *out = &buf;
+  size_t lastprefix = LINE_NO_ENTRY, lastlen = 0;
+
+  out->len = 0;
+
+  flockfile(stdout);
+  for (size_t i = 0; i < count; ++i) {
+    const struct line_t *line = &result->lines[i];
+
+    /* lines with the same prefix usually share its string, too */
+    if (line->prefix != lastprefix) {
+      lastprefix = line->prefix;
+      lastlen = strlen(&result->arena[lastprefix]);
+    }
+
+    outbuf_line(out, &result->arena[lastprefix], lastlen,
+                line->entry != LINE_NO_ENTRY ? &result->arena[line->entry]
+                                             : NULL,
+                format, prefixlen, eol);
+  }
+  outbuf_flush(out);
+  funlockfile(stdout);
+}
+
+/* A sorted run being merged: one of the result's temporary files, or, when
+ * fp is NULL, the lines it still holds in memory. Records in a file are a
+ * byte saying whether there's an entry, then the NUL terminated prefix and
+ * entry. */
+struct run_t {
+  FILE *fp;
+  size_t next;
+  char *buf[2];
+  size_t bufsz[2];
+
+  /* the line the run is up to */
+  const char *prefix;
+  size_t prefixlen;
+  const char *entry;
+  bool done;
+};
+
+static bool run_next(struct run_t *run, const struct result_t *result) {
+  ssize_t len;
+  int c;
+
+  if (run->fp == NULL) {
+    const struct line_t *line;
+
+    if (run->next == result->size) {
+      return false;
+    }
+
+    line = &result->lines[run->next++];
+    run->prefix = &result->arena[line->prefix];
+    run->prefixlen = strlen(run->prefix);
+    run->entry =
+        line->entry != LINE_NO_ENTRY ? &result->arena[line->entry] : NULL;
+    return true;
+  }
+
+  c = getc_unlocked(run->fp);
+  if (c == EOF) {
+    return false;
+  }
+
+  len = getdelim(&run->buf[0], &run->bufsz[0], '\0', run->fp);
+  if (len <= 0) {
+    return false;
+  }
+  run->prefix = run->buf[0];
+  run->prefixlen = len - 1;
+
+  run->entry = NULL;
+  if (c != 0) {
+    if (getdelim(&run->buf[1], &run->bufsz[1], '\0', run->fp) <= 0) {
+      return false;
+    }
+    run->entry = run->buf[1];
+  }
+
+  return true;
+}
+
+/* Compares the lines two runs are up to, as linecmp does. */
+static int runcmp(const struct run_t *run1, const struct run_t *run2) {
+  int cmp = strcmp(run1->prefix, run2->prefix);
+
+  if (cmp == 0 && run1->entry != NULL && run2->entry != NULL) {
+    return strcmp(run1->entry, run2->entry);
+  } else {
+    return cmp;
+  }
+}
+
+/* Writes a spilled result, merging its runs with the sorted lines it still
+ * holds. A merge rarely has more than a handful of runs, so the next line is
+ * simply the least of what each of them is up to. */
+static size_t result_write_runs(struct result_t *result,
+                                enum lineformat_t format, int prefixlen,
+                                char eol) {
+  struct outbuf_t buf, *out = &buf;
+  struct run_t *runs;
+  size_t nruns = result->nruns + 1, count = 0;
+
+  CALLOC(runs, nruns, sizeof(struct run_t), return 0);
+
+  for (size_t i = 0; i < nruns; ++i) {
+    runs[i].fp = i < result->nruns ? result->runs[i] : NULL;
+    runs[i].done = !run_next(&runs[i], result);
+  }
+
+  out->len = 0;
+
+  flockfile(stdout);
+  for (;;) {
+    struct run_t *least = NULL;
+
+    for (size_t i = 0; i < nruns; ++i) {
+      if (!runs[i].done && (least == NULL || runcmp(&runs[i], least) < 0)) {
+        least = &runs[i];
+      }
+    }
+
+    if (least == NULL) {
+      break;
+    }
+
+    outbuf_line(out, least->prefix, least->prefixlen, least->entry, format,
+                prefixlen, eol);
+    count++;
+
+    least->done = !run_next(least, result);
+  }
+  outbuf_flush(out);
+  funlockfile(stdout);
+
+  for (size_t i = 0; i < nruns; ++i) {
+    if (runs[i].fp != NULL && ferror(runs[i].fp)) {
+      fputs("error: failed to read back sorted results\n", stderr);
+    }
+    free(runs[i].buf[0]);
+    free(runs[i].buf[1]);
+  }
+  free(runs);
+
+  return count;
+}
+
+int result_spill(struct result_t *result) {
+  struct stats_timer_t t;
+  FILE *fp, **runs;
+  size_t lastprefix = LINE_NO_ENTRY, lastlen = 0;
+  int fd;
+
+  if (result->size == 0) {
+    return 0;
+  }
+
+  runs = realloc(result->runs, (result->nruns + 1) * sizeof(FILE *));
+  if (runs == NULL) {
+    fputs("error: failed to allocate memory for result\n", stderr);
+    return 1;
+  }
+  stats_add(STATS_ALLOCATIONS, 1);
+  result->runs = runs;
+
+  fd = open_tmpfile(O_RDWR | O_CLOEXEC);
+  fp = fd >= 0 ? fdopen(fd, "w+") : NULL;
+  if (fp == NULL) {
+    fprintf(stderr, "error: failed to create temporary file: %s\n",
+            strerror(fd < 0 ? -fd : errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+
+  stats_begin(&t, STATS_CLOCK_THREAD);
+  qsort_r(result->lines, result->size, sizeof(struct line_t), linecmp,
+          result->arena);
+  stats_end(&t, PHASE_SORT);
+
   for (size_t i = 0; i < result->size; ++i) {
-    printf("%s%c", result->lines[i]->prefix, eol);
+    const struct line_t *line = &result->lines[i];
+
+    if (line->prefix != lastprefix) {
+      lastprefix = line->prefix;
+      lastlen = strlen(&result->arena[lastprefix]);
+    }
+
+    putc_unlocked(line->entry != LINE_NO_ENTRY, fp);
+    fwrite_unlocked(&result->arena[lastprefix], 1, lastlen + 1, fp);
+    if (line->entry != LINE_NO_ENTRY) {
+      const char *entry = &result->arena[line->entry];
+
+      fwrite_unlocked(entry, 1, strlen(entry) + 1, fp);
+    }
+  }
+
+  if (fflush(fp) != 0 || ferror(fp) || fseek(fp, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "error: failed to write temporary file: %s\n",
+            strerror(errno));
+    fclose(fp);
+    return 1;
   }
+
+  result->runs[result->nruns++] = fp;
+  result->spilled += result->size;
+  stats_add(STATS_SPILLED_RUNS, 1);
+
+  /* the lines are all in the file now, but the justification they need
+   * carries over */
+  result->size = 0;
+  result->arena_size = 0;
+  result->lastprefix = LINE_NO_ENTRY;
+
+  return 0;
 }
 
 size_t result_print(struct result_t *result, int prefixlen, char eol) {
-  if (!result->size) {
+  enum lineformat_t format =
+      prefixlen == 0 ? LINEFORMAT_SHORT : LINEFORMAT_LONG;
+  struct stats_timer_t t;
+  size_t count = result->size;
+
+  if (!result->size && !result->nruns) {
     return 0;
   }
 
-  qsort(result->lines, result->size, sizeof(char *), linecmp);
+  stats_begin(&t, STATS_CLOCK_THREAD);
+  qsort_r(result->lines, result->size, sizeof(struct line_t), linecmp,
+          result->arena);
+  stats_end(&t, PHASE_SORT);
+
+  stats_begin(&t, STATS_CLOCK_THREAD);
+  if (result->nruns > 0) {
+    count = result_write_runs(result, format, prefixlen, eol);
+  } else {
+    result_write(result, result->size, format, prefixlen, eol);
+  }
+  /* without it, the last of the output would be written at exit */
+  if (stats_current != NULL) {
+    fflush(stdout);
+  }
+  stats_end(&t, PHASE_OUTPUT);
+
+  return count;
+}
+
+void result_sort(struct result_t *result, size_t start) {
+  if (result->size > start + 1) {
+    qsort_r(&result->lines[start], result->size - start, sizeof(struct line_t),
+            linecmp, result->arena);
+  }
+}
+
+size_t result_flush(struct result_t *result, size_t max, char eol) {
+  size_t count = MIN(result->size, max);
+  struct stats_timer_t t;
+
+  stats_begin(&t, STATS_CLOCK_THREAD);
+  result_write(result, count, LINEFORMAT_STREAM, 0, eol);
+  stats_end(&t, PHASE_OUTPUT);
 
-  prefixlen == 0 ? result_print_short(result, eol)
-                 : result_print_long(result, prefixlen, eol);
+  /* start over, keeping the memory for whatever comes next */
+  result->size = 0;
+  result->arena_size = 0;
+  result->lastprefix = LINE_NO_ENTRY;
+  result->max_prefixlen = 0;
 
-  return result->size;
+  return count;
 }
 
 int results_get_prefixlen(struct result_t **results, int count) {
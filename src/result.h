@@ -22,25 +22,59 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 
+#define LINE_NO_ENTRY SIZE_MAX
+
+/* offsets of a line's strings in its result's arena */
 struct line_t {
-  char *prefix;
-  char *entry;
+  size_t prefix;
+  size_t entry;
 };
 
 struct result_t {
   size_t size;
   size_t capacity;
   char *name;
-  struct line_t **lines;
+  struct line_t *lines;
   int max_prefixlen;
+
+  /* every string in the result, NUL terminated and packed end to end */
+  char *arena;
+  size_t arena_size;
+  size_t arena_capacity;
+
+  /* most recently added prefix, shared with the lines that follow it */
+  size_t lastprefix;
+  size_t lastprefixlen;
+
+  /* lines already sorted and written out to temporary files, each run in
+   * order, when the result grew past its memory limit */
+  FILE **runs;
+  size_t nruns;
+  size_t spilled;
 };
 
-struct result_t *result_new(char *name, size_t initial_size);
-int result_add(struct result_t *result, char *repo, char *entry, int prefixlen);
+struct result_t *result_new(const char *name, size_t initial_size);
+int result_add(struct result_t *result, const char *prefix, size_t prefixlen,
+               const char *entry, size_t entrylen);
+int result_merge(struct result_t *dst, struct result_t *src);
+
+/* Sorts the lines held in memory and moves them out to a temporary file,
+ * which result_print merges back in. The result keeps its memory for the
+ * lines to come. */
+int result_spill(struct result_t *result);
 void result_free(struct result_t *result);
 size_t result_print(struct result_t *result, int prefixlen, char eol);
+
+/* Sorts the lines added since the result held start lines. */
+void result_sort(struct result_t *result, size_t start);
+
+/* Writes out at most max lines, unjustified and in the order they're held,
+ * then empties the result. Returns the number of lines written. */
+size_t result_flush(struct result_t *result, size_t max, char eol);
 int results_get_prefixlen(struct result_t **results, int count);
 
 /* vim: set ts=2 sw=2 et: */
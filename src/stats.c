@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "macro.h"
+#include "stats.h"
+
+__thread struct stats_t *stats_current;
+
+static const char *counter_names[STATS_NCOUNTERS] = {
+    [STATS_DB_BYTES] = "db_bytes",
+    [STATS_BYTES_DOWNLOADED] = "bytes_downloaded",
+    [STATS_BYTES_DECOMPRESSED] = "bytes_decompressed",
+    [STATS_ENTRIES] = "entries",
+    [STATS_ENTRIES_REUSED] = "entries_reused",
+    [STATS_LINES] = "lines",
+    [STATS_LINES_FILTERED] = "lines_filtered",
+    [STATS_PREFILTERED] = "prefiltered",
+    [STATS_MATCHER_CALLS] = "matcher_calls",
+    [STATS_MATCHES] = "matches",
+    [STATS_ALLOCATIONS] = "allocations",
+    [STATS_CACHE_HITS] = "cache_hits",
+    [STATS_SPILLED_RUNS] = "spilled_runs",
+};
+
+static const char *phase_names[STATS_NPHASES] = {
+    [PHASE_SETUP] = "setup",
+    [PHASE_SEARCH] = "search",
+    [PHASE_SORT] = "sort",
+    [PHASE_OUTPUT] = "output",
+    [PHASE_OPEN] = "open",
+    [PHASE_SCAN] = "scan",
+    [PHASE_DECOMPRESS] = "decompress",
+    [PHASE_MATCH] = "match",
+    [PHASE_MERGE] = "merge",
+    [PHASE_DOWNLOAD] = "download",
+    [PHASE_REPACK] = "repack",
+    [PHASE_WAIT] = "wait",
+};
+
+static double clock_seconds(clockid_t id) {
+  struct timespec ts;
+
+  clock_gettime(id, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_seconds(statsclock_t clock) {
+  switch (clock) {
+    case STATS_CLOCK_THREAD:
+      return clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+    case STATS_CLOCK_PROCESS:
+      return clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    default:
+      return 0;
+  }
+}
+
+void stats_begin(struct stats_timer_t *t, statsclock_t clock) {
+  if (stats_current == NULL) {
+    return;
+  }
+
+  t->clock = clock;
+  t->cpu = cpu_seconds(clock);
+  t->wall = clock_seconds(CLOCK_MONOTONIC);
+}
+
+void stats_end(const struct stats_timer_t *t, int phase) {
+  double wall, cpu;
+
+  if (stats_current == NULL) {
+    return;
+  }
+
+  wall = clock_seconds(CLOCK_MONOTONIC) - t->wall;
+  cpu = t->clock != STATS_CLOCK_NONE ? cpu_seconds(t->clock) - t->cpu : 0;
+
+  stats_record(stats_current, phase, wall, cpu);
+}
+
+void stats_record(struct stats_t *stats, int phase, double wall, double cpu) {
+  stats->phases[phase].wall += wall;
+  stats->phases[phase].cpu += cpu;
+  stats->phases[phase].count++;
+}
+
+int stats_add_download(struct stats_t *stats, const char *url, double wall,
+                       off_t bytes, long response, const char *status) {
+  struct stats_download_t *d, *newdownloads;
+
+  newdownloads = realloc(stats->downloads, (stats->ndownloads + 1) *
+                                               sizeof(struct stats_download_t));
+  if (newdownloads == NULL) {
+    return -ENOMEM;
+  }
+  stats->downloads = newdownloads;
+
+  d = &stats->downloads[stats->ndownloads];
+  d->url = strdup(url);
+  if (d->url == NULL) {
+    return -ENOMEM;
+  }
+  d->wall = wall;
+  d->bytes = bytes;
+  d->response = response;
+  d->status = status;
+  stats->ndownloads++;
+
+  return 0;
+}
+
+void stats_merge(struct stats_t *dst, const struct stats_t *src) {
+  for (int i = 0; i < STATS_NCOUNTERS; ++i) {
+    dst->counters[i] += src->counters[i];
+  }
+
+  for (int i = 0; i < STATS_NPHASES; ++i) {
+    dst->phases[i].wall += src->phases[i].wall;
+    dst->phases[i].cpu += src->phases[i].cpu;
+    dst->phases[i].count += src->phases[i].count;
+  }
+}
+
+void stats_reset(struct stats_t *stats) {
+  for (int i = 0; i < stats->ndownloads; ++i) {
+    free(stats->downloads[i].url);
+  }
+  free(stats->downloads);
+
+  memset(stats, 0, sizeof(*stats));
+}
+
+static void json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(out, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(out, "\\u%04x", *s);
+    } else {
+      fputc(*s, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void print_text(FILE *out, const char *name,
+                       const struct stats_t *stats) {
+  bool first = true;
+
+  fprintf(out, ":: %s\n", name);
+
+  for (int i = 0; i < STATS_NPHASES; ++i) {
+    const struct stats_phase_t *p = &stats->phases[i];
+
+    if (p->count == 0) {
+      continue;
+    }
+
+    fprintf(out, "  %-12s %10.3f ms wall", phase_names[i], p->wall * 1e3);
+    if (p->cpu > 0) {
+      fprintf(out, " %10.3f ms cpu", p->cpu * 1e3);
+    }
+    fprintf(out, "  (x%" PRIu64 ")\n", p->count);
+  }
+
+  for (int i = 0; i < stats->ndownloads; ++i) {
+    const struct stats_download_t *d = &stats->downloads[i];
+
+    fprintf(out, "  %-12s %10.3f ms wall  %s %s [%ld, %jd bytes]\n",
+            "server", d->wall * 1e3, d->url, d->status, d->response,
+            (intmax_t)d->bytes);
+  }
+
+  for (int i = 0; i < STATS_NCOUNTERS; ++i) {
+    if (stats->counters[i] == 0) {
+      continue;
+    }
+
+    fprintf(out, "%s%s %" PRIu64, first ? "  " : ", ", counter_names[i],
+            stats->counters[i]);
+    first = false;
+  }
+  if (!first) {
+    fputc('\n', out);
+  }
+}
+
+static void print_json(FILE *out, const char *indent,
+                       const struct stats_t *stats) {
+  bool first = true;
+
+  fprintf(out, "%s\"phases\": {", indent);
+  for (int i = 0; i < STATS_NPHASES; ++i) {
+    const struct stats_phase_t *p = &stats->phases[i];
+
+    if (p->count == 0) {
+      continue;
+    }
+
+    fprintf(out,
+            "%s\n%s  \"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+            "\"count\": %" PRIu64 "}",
+            first ? "" : ",", indent, phase_names[i], p->wall * 1e3,
+            p->cpu * 1e3, p->count);
+    first = false;
+  }
+  fprintf(out, "%s%s},\n", first ? "" : "\n", first ? "" : indent);
+
+  fprintf(out, "%s\"counters\": {", indent);
+  for (int i = 0; i < STATS_NCOUNTERS; ++i) {
+    fprintf(out, "%s\"%s\": %" PRIu64, i ? ", " : "", counter_names[i],
+            stats->counters[i]);
+  }
+  fputc('}', out);
+
+  if (stats->ndownloads > 0) {
+    fprintf(out, ",\n%s\"downloads\": [", indent);
+    for (int i = 0; i < stats->ndownloads; ++i) {
+      const struct stats_download_t *d = &stats->downloads[i];
+
+      fprintf(out, "%s\n%s  {\"url\": ", i ? "," : "", indent);
+      json_string(out, d->url);
+      fprintf(out,
+              ", \"status\": \"%s\", \"response\": %ld, \"wall_ms\": %.3f, "
+              "\"bytes\": %jd}",
+              d->status, d->response, d->wall * 1e3, (intmax_t)d->bytes);
+    }
+    fprintf(out, "\n%s]", indent);
+  }
+}
+
+void stats_print(FILE *out, statsformat_t format, const char *kind,
+                 const struct stats_t *total, const char *const *names,
+                 struct stats_t *const *repos, int count) {
+  struct stats_t sum = *total;
+  struct rusage ru;
+
+  /* the totals include everything counted while working on each repo */
+  for (int i = 0; i < count; ++i) {
+    for (int c = 0; c < STATS_NCOUNTERS; ++c) {
+      sum.counters[c] += repos[i]->counters[c];
+    }
+  }
+
+  getrusage(RUSAGE_SELF, &ru);
+
+  if (format == STATS_TEXT) {
+    fprintf(out, ":: %s stats (peak rss %ld KiB)\n", kind, ru.ru_maxrss);
+    print_text(out, "total", &sum);
+    for (int i = 0; i < count; ++i) {
+      print_text(out, names[i], repos[i]);
+    }
+    return;
+  }
+
+  fprintf(out, "{\"kind\": \"%s\", \"peak_rss_kib\": %ld,\n \"total\": {\n",
+          kind, ru.ru_maxrss);
+  print_json(out, "  ", &sum);
+  fputs("},\n \"repos\": [", out);
+  for (int i = 0; i < count; ++i) {
+    fprintf(out, "%s\n  {\"name\": ", i ? "," : "");
+    json_string(out, names[i]);
+    fputs(",\n", out);
+    print_json(out, "   ", repos[i]);
+    fputc('}', out);
+  }
+  fputs("]}\n", out);
+}
+
+/* vim: set ts=2 sw=2 et: */
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+typedef enum _statsformat_t {
+  STATS_NONE = 0,
+  STATS_TEXT,
+  STATS_JSON
+} statsformat_t;
+
+enum {
+  STATS_DB_BYTES = 0,
+  STATS_BYTES_DOWNLOADED,
+  STATS_BYTES_DECOMPRESSED,
+  STATS_ENTRIES,
+  STATS_ENTRIES_REUSED,
+  STATS_LINES,
+  STATS_LINES_FILTERED,
+  STATS_PREFILTERED,
+  STATS_MATCHER_CALLS,
+  STATS_MATCHES,
+  STATS_ALLOCATIONS,
+  STATS_CACHE_HITS,
+  STATS_SPILLED_RUNS,
+  STATS_NCOUNTERS
+};
+
+enum {
+  /* a query, as a whole */
+  PHASE_SETUP = 0,
+  PHASE_SEARCH,
+  PHASE_SORT,
+  PHASE_OUTPUT,
+  /* a query, per repo */
+  PHASE_OPEN,
+  PHASE_SCAN,
+  PHASE_DECOMPRESS,
+  PHASE_MATCH,
+  PHASE_MERGE,
+  /* an update */
+  PHASE_DOWNLOAD,
+  PHASE_REPACK,
+  PHASE_WAIT,
+  STATS_NPHASES
+};
+
+/* which CPU time a timer measures, if any */
+typedef enum _statsclock_t {
+  STATS_CLOCK_NONE = 0,
+  STATS_CLOCK_THREAD,
+  STATS_CLOCK_PROCESS
+} statsclock_t;
+
+struct stats_phase_t {
+  double wall;
+  double cpu;
+  uint64_t count;
+};
+
+struct stats_download_t {
+  char *url;
+  double wall;
+  off_t bytes;
+  long response;
+  const char *status;
+};
+
+struct stats_t {
+  uint64_t counters[STATS_NCOUNTERS];
+  struct stats_phase_t phases[STATS_NPHASES];
+
+  /* every attempt at downloading a repo, in order */
+  struct stats_download_t *downloads;
+  int ndownloads;
+};
+
+struct stats_timer_t {
+  statsclock_t clock;
+  double wall;
+  double cpu;
+};
+
+/* Where the calling thread's counters and timers go. NULL unless --stats was
+ * given, which makes every other stats function a no-op. */
+extern __thread struct stats_t *stats_current;
+
+static inline void stats_add(int counter, uint64_t n) {
+  if (stats_current != NULL) {
+    stats_current->counters[counter] += n;
+  }
+}
+
+void stats_begin(struct stats_timer_t *t, statsclock_t clock);
+void stats_end(const struct stats_timer_t *t, int phase);
+void stats_record(struct stats_t *stats, int phase, double wall, double cpu);
+int stats_add_download(struct stats_t *stats, const char *url, double wall,
+                       off_t bytes, long response, const char *status);
+
+void stats_merge(struct stats_t *dst, const struct stats_t *src);
+void stats_reset(struct stats_t *stats);
+
+void stats_print(FILE *out, statsformat_t format, const char *kind,
+                 const struct stats_t *total, const char *const *names,
+                 struct stats_t *const *repos, int count);
+
+/* vim: set ts=2 sw=2 et: */
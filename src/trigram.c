@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "trigram.h"
+#include "util.h"
+
+/* one bit for every possible trigram */
+#define TRIGRAM_SPACE (1u << 24)
+
+struct trigram_builder_t {
+  /* each trigram of each package once, as trigram << 32 | package */
+  uint64_t *pairs;
+  size_t npairs;
+  size_t pairs_capacity;
+
+  /* the trigrams already seen in the current package, which are the pairs
+   * from pkg_start on */
+  uint8_t *seen;
+  size_t pkg_start;
+  uint32_t npkgs;
+};
+
+static uint32_t trigram_at(const char *s) {
+  const unsigned char *u = (const unsigned char *)s;
+
+  return (uint32_t)u[0] << 16 | (uint32_t)u[1] << 8 | u[2];
+}
+
+struct trigram_builder_t *trigram_builder_new(void) {
+  struct trigram_builder_t *b;
+
+  CALLOC(b, 1, sizeof(struct trigram_builder_t), return NULL);
+  CALLOC(b->seen, TRIGRAM_SPACE / 8, sizeof(uint8_t), free(b); return NULL);
+
+  return b;
+}
+
+void trigram_builder_free(struct trigram_builder_t *b) {
+  if (b == NULL) {
+    return;
+  }
+
+  free(b->pairs);
+  free(b->seen);
+  free(b);
+}
+
+int trigram_builder_add_pkg(struct trigram_builder_t *b) {
+  /* forget the last package's trigrams, which is cheaper than clearing the
+   * whole bitmap */
+  for (size_t i = b->pkg_start; i < b->npairs; ++i) {
+    uint32_t t = b->pairs[i] >> 32;
+    b->seen[t >> 3] &= ~(1u << (t & 7));
+  }
+
+  b->pkg_start = b->npairs;
+  b->npkgs++;
+
+  return 0;
+}
+
+int trigram_builder_add_file(struct trigram_builder_t *b, const char *path,
+                             size_t len) {
+  if (b->npkgs == 0) {
+    return -EINVAL;
+  }
+
+  for (size_t i = 0; i + 3 <= len; ++i) {
+    uint32_t t = trigram_at(&path[i]);
+
+    if (b->seen[t >> 3] & (1u << (t & 7))) {
+      continue;
+    }
+
+    if (b->npairs == b->pairs_capacity) {
+      size_t newsz = b->pairs_capacity ? b->pairs_capacity * 2 : 4096;
+      uint64_t *newpairs = realloc(b->pairs, newsz * sizeof(uint64_t));
+      if (newpairs == NULL) {
+        return -ENOMEM;
+      }
+      b->pairs = newpairs;
+      b->pairs_capacity = newsz;
+    }
+
+    b->seen[t >> 3] |= 1u << (t & 7);
+    b->pairs[b->npairs++] = (uint64_t)t << 32 | (b->npkgs - 1);
+  }
+
+  return 0;
+}
+
+static int paircmp(const void *p1, const void *p2) {
+  uint64_t a = *(const uint64_t *)p1, b = *(const uint64_t *)p2;
+
+  return a < b ? -1 : a > b;
+}
+
+int trigram_builder_write(struct trigram_builder_t *b, const char *filename,
+                          const struct stat *dbst) {
+  struct trigram_header hdr = {};
+  _cleanup_free_ struct trigram_entry *entries = NULL;
+  _cleanup_free_ uint32_t *postings = NULL;
+  char tmpfile[PATH_MAX];
+  uint32_t ntrigrams = 0;
+  int fd, r;
+
+  if (b->npairs > UINT32_MAX) {
+    return -E2BIG;
+  }
+
+  /* by trigram, and then by package */
+  qsort(b->pairs, b->npairs, sizeof(uint64_t), paircmp);
+
+  MALLOC(entries, (b->npairs + 1) * sizeof(struct trigram_entry),
+         return -ENOMEM);
+  MALLOC(postings, MAX(b->npairs, 1u) * sizeof(uint32_t), return -ENOMEM);
+
+  for (size_t i = 0; i < b->npairs; ++i) {
+    uint32_t t = b->pairs[i] >> 32;
+
+    if (i == 0 || t != entries[ntrigrams - 1].trigram) {
+      entries[ntrigrams].trigram = t;
+      entries[ntrigrams].postings = i;
+      ntrigrams++;
+    }
+    postings[i] = (uint32_t)b->pairs[i];
+  }
+  entries[ntrigrams].trigram = UINT32_MAX;
+  entries[ntrigrams].postings = b->npairs;
+
+  memcpy(hdr.magic, TRIGRAM_MAGIC, sizeof(hdr.magic));
+  hdr.version = TRIGRAM_VERSION;
+  hdr.npkgs = b->npkgs;
+  hdr.ntrigrams = ntrigrams;
+  hdr.npostings = b->npairs;
+  hdr.db_ino = dbst->st_ino;
+  hdr.db_size = dbst->st_size;
+  hdr.db_mtime = dbst->st_mtime;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s~", filename);
+  fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  if ((r = write_all(fd, &hdr, sizeof(hdr))) < 0 ||
+      (r = write_all(fd, entries,
+                     (ntrigrams + 1) * sizeof(struct trigram_entry))) < 0 ||
+      (r = write_all(fd, postings, b->npairs * sizeof(uint32_t))) < 0) {
+    close(fd);
+    unlink(tmpfile);
+    return r;
+  }
+
+  if (close(fd) < 0 || rename(tmpfile, filename) < 0) {
+    r = -errno;
+    unlink(tmpfile);
+    return r;
+  }
+
+  return 0;
+}
+
+int trigram_open(struct trigram_t *tri, const char *filename,
+                 const struct stat *dbst) {
+  const struct trigram_header *hdr;
+  struct stat st;
+  size_t expected;
+  int fd;
+
+  memset(tri, 0, sizeof(*tri));
+  tri->map = MAP_FAILED;
+
+  fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+    close(fd);
+    return -EINVAL;
+  }
+
+  tri->size = st.st_size;
+  tri->map = mmap(NULL, tri->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (tri->map == MAP_FAILED) {
+    return -errno;
+  }
+
+  hdr = tri->map;
+  if (memcmp(hdr->magic, TRIGRAM_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != TRIGRAM_VERSION) {
+    trigram_close(tri);
+    return -EINVAL;
+  }
+
+  if (hdr->db_ino != (uint64_t)dbst->st_ino ||
+      hdr->db_size != (int64_t)dbst->st_size ||
+      hdr->db_mtime != (int64_t)dbst->st_mtime) {
+    trigram_close(tri);
+    return -ESTALE;
+  }
+
+  expected = sizeof(*hdr) +
+             ((size_t)hdr->ntrigrams + 1) * sizeof(struct trigram_entry) +
+             hdr->npostings * sizeof(uint32_t);
+  if (expected != tri->size) {
+    trigram_close(tri);
+    return -EINVAL;
+  }
+
+  tri->hdr = hdr;
+  tri->entries = (const struct trigram_entry *)(hdr + 1);
+  tri->postings = (const uint32_t *)(tri->entries + hdr->ntrigrams + 1);
+
+  /* checked once here, so that a damaged file can't send a search past the
+   * end of the postings or of its candidates */
+  if (tri->entries[hdr->ntrigrams].postings != hdr->npostings) {
+    trigram_close(tri);
+    return -EINVAL;
+  }
+  for (uint32_t i = 0; i < hdr->ntrigrams; ++i) {
+    if (tri->entries[i].postings > tri->entries[i + 1].postings) {
+      trigram_close(tri);
+      return -EINVAL;
+    }
+  }
+  for (uint64_t i = 0; i < hdr->npostings; ++i) {
+    if (tri->postings[i] >= hdr->npkgs) {
+      trigram_close(tri);
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+void trigram_close(struct trigram_t *tri) {
+  if (tri->map != MAP_FAILED && tri->map != NULL) {
+    munmap(tri->map, tri->size);
+  }
+  tri->map = MAP_FAILED;
+  tri->hdr = NULL;
+}
+
+static const struct trigram_entry *trigram_find(const struct trigram_t *tri,
+                                                uint32_t t) {
+  uint32_t lo = 0, hi = tri->hdr->ntrigrams;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (tri->entries[mid].trigram == t) {
+      return &tri->entries[mid];
+    }
+    if (tri->entries[mid].trigram < t) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return NULL;
+}
+
+/* Keeps the packages in a which are also in b, both being sorted. */
+static uint32_t intersect(uint32_t *a, uint32_t n, const uint32_t *b,
+                          uint32_t m) {
+  uint32_t i = 0, j = 0, k = 0;
+
+  while (i < n && j < m) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (a[i] > b[j]) {
+      j++;
+    } else {
+      a[k++] = a[i++];
+      j++;
+    }
+  }
+
+  return k;
+}
+
+uint32_t trigram_candidates(const struct trigram_t *tri, const char *literal,
+                            size_t len, uint8_t *candidates) {
+  _cleanup_free_ const struct trigram_entry **found = NULL;
+  _cleanup_free_ uint32_t *pkgs = NULL;
+  size_t count = len - 2, shortest = 0;
+  uint32_t npkgs = tri->hdr->npkgs, n;
+
+  memset(candidates, 0, (npkgs + 7) / 8);
+
+  CALLOC(found, count, sizeof(struct trigram_entry *), goto everything);
+
+  for (size_t i = 0; i < count; ++i) {
+    found[i] = trigram_find(tri, trigram_at(&literal[i]));
+
+    /* no package has it, so none can match */
+    if (found[i] == NULL) {
+      return 0;
+    }
+
+    if (found[i][1].postings - found[i][0].postings <
+        found[shortest][1].postings - found[shortest][0].postings) {
+      shortest = i;
+    }
+  }
+
+  /* start from the rarest trigram, which narrows things down the fastest */
+  n = found[shortest][1].postings - found[shortest][0].postings;
+  MALLOC(pkgs, MAX(n, 1u) * sizeof(uint32_t), goto everything);
+  memcpy(pkgs, &tri->postings[found[shortest]->postings],
+         n * sizeof(uint32_t));
+
+  for (size_t i = 0; i < count && n > 0; ++i) {
+    if (i != shortest) {
+      n = intersect(pkgs, n, &tri->postings[found[i]->postings],
+                    found[i][1].postings - found[i][0].postings);
+    }
+  }
+
+  for (uint32_t i = 0; i < n; ++i) {
+    candidates[pkgs[i] >> 3] |= 1u << (pkgs[i] & 7);
+  }
+
+  return n;
+
+everything:
+  /* without the memory to narrow things down, every package is a candidate */
+  memset(candidates, 0xff, (npkgs + 7) / 8);
+  return npkgs;
+}
+
+/* vim: set ts=2 sw=2 et: */
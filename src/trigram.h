@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define TRIGRAM_MAGIC "PKGFTRI"
+#define TRIGRAM_VERSION 1
+#define TRIGRAM_SUFFIX ".tri"
+
+/* On-disk layout of a trigram index, optionally written next to a repo's
+ * .files DB:
+ *
+ *   struct trigram_header
+ *   struct trigram_entry entries[ntrigrams + 1]   sorted by trigram
+ *   uint32_t postings[npostings]                  package ordinals
+ *
+ * Each entry's postings run up to where the next entry's begin, and list in
+ * ascending order every package with a path containing the trigram. The last
+ * entry only marks where the postings end. As with the basename index, the
+ * header records the identity of the DB it was built from. */
+struct trigram_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t npkgs;
+  uint32_t ntrigrams;
+  uint32_t reserved;
+  uint64_t npostings;
+  uint64_t db_ino;
+  int64_t db_size;
+  int64_t db_mtime;
+};
+
+struct trigram_entry {
+  uint32_t trigram;
+  uint32_t postings;
+};
+
+struct trigram_t {
+  void *map;
+  size_t size;
+  const struct trigram_header *hdr;
+  const struct trigram_entry *entries;
+  const uint32_t *postings;
+};
+
+struct trigram_builder_t;
+
+struct trigram_builder_t *trigram_builder_new(void);
+int trigram_builder_add_pkg(struct trigram_builder_t *b);
+int trigram_builder_add_file(struct trigram_builder_t *b, const char *path,
+                             size_t len);
+int trigram_builder_write(struct trigram_builder_t *b, const char *filename,
+                          const struct stat *dbst);
+void trigram_builder_free(struct trigram_builder_t *b);
+
+int trigram_open(struct trigram_t *tri, const char *filename,
+                 const struct stat *dbst);
+void trigram_close(struct trigram_t *tri);
+
+/* Marks in candidates, a bitmap of npkgs bits, every package with a path
+ * which contains all of the literal's trigrams. Returns how many there are.
+ * The literal must be at least 3 bytes long. */
+uint32_t trigram_candidates(const struct trigram_t *tri, const char *literal,
+                            size_t len, uint8_t *candidates);
+
+/* vim: set ts=2 sw=2 et: */
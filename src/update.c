@@ -25,7 +25,10 @@
 #include <float.h>
 #include <limits.h>
 #include <math.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
@@ -33,19 +36,87 @@
 
 #include <curl/curl.h>
 
+#include "flatdb.h"
+#include "index.h"
 #include "macro.h"
+#include "mirrors.h"
 #include "pkgfile.h"
+#include "pool.h"
+#include "qcache.h"
 #include "repo.h"
+#include "stats.h"
+#include "trigram.h"
 #include "update.h"
+#include "util.h"
+
+/* The repo as it was before this update. Packages whose $pkgname-$pkgver
+ * hasn't changed are copied over from it rather than converted again. */
+struct prev_repo {
+  void *map;
+  size_t size;
+  struct flatdb_t flat;
+  struct compactdb_t compact;
+  uint32_t npkgs;
+
+  /* open addressed, holding each package's index plus one */
+  uint32_t *slots;
+  uint32_t capacity;
+
+  /* where each of the compact DB's directories went in the new one */
+  uint32_t *dirmap;
+};
 
 struct archive_conv {
   struct archive *in;
   struct archive *out;
   struct archive_entry *ae;
+  struct flatdb_writer_t flat;
+  struct compactdb_writer_t compact;
+  struct index_builder_t *index;
+  struct trigram_builder_t *trigrams;
+  dbformat_t dbformat;
   const char *reponame;
   char tmpfile[PATH_MAX];
+  struct prev_repo prev;
+
+  /* reused from one entry to the next: the entry's name, NUL terminated and
+   * followed by its converted data, and a line read from it */
+  char *scratch;
+  size_t scratch_capacity;
+  char *line;
 };
 
+/* The repack workers, of which no more than max run at once. */
+static struct {
+  /* every repo being updated, so that a newly forked worker can let go of
+   * the pipes feeding all the others */
+  struct repovec_t *repos;
+  unsigned max;
+  unsigned running;
+  /* for a multithreaded compressor, in each worker */
+  unsigned threads;
+} workers;
+
+/* what's known about every server, kept from one update to the next */
+static struct mirrors_t mirrors;
+
+/* The downloads are driven by what happens on their sockets, and by a worker
+ * exiting when a download is waiting to be repacked. */
+static struct {
+  int epfd;
+  /* until curl next wants to be called, or -1 for whenever */
+  long timeout;
+} events = {.epfd = -1};
+
+#define EVENT_MAX 64
+
+/* lookups, TLS sessions and, through the multi handle, connections are
+ * shared by every download */
+static CURLSH *curl_share;
+
+/* how much of a download may be in flight to its worker at once */
+#define PIPELINE_PIPE_SIZE (1024 * 1024)
+
 #if defined(CLOCK_MONOTONIC) && !defined(CLOCK_MONOTONIC_COARSE)
 #define CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC
 #endif
@@ -180,43 +251,12 @@ static int endswith(const char *s, const char *postfix) {
   return memcmp(s + sl - pl, postfix, pl) == 0;
 }
 
-static int write_cpio_entry(struct archive_conv *conv, const char *entryname) {
-  off_t entry_size = archive_entry_size(conv->ae);
-  off_t bytes_w = 0;
-  size_t alloc_size = entry_size * 1.1;
-  struct archive_line_reader reader = {};
-  _cleanup_free_ char *entry_data = NULL, *s = NULL, *line = NULL;
-
-  /* be generous */
-  MALLOC(entry_data, alloc_size, return -1);
-  MALLOC(line, MAX_LINE_SIZE, return -1);
-
-  reader.line.base = line;
-
-  /* discard the first line */
-  reader_getline(&reader, conv->in);
-
-  while (reader_getline(&reader, conv->in) == ARCHIVE_OK) {
-    /* ensure enough memory */
-    if (bytes_w + reader.line.size + 1 > alloc_size) {
-      alloc_size *= 1.1;
-      entry_data = realloc(entry_data, alloc_size);
-    }
-
-    /* do the copy, with a slash prepended */
-    entry_data[bytes_w++] = '/';
-    memcpy(&entry_data[bytes_w], reader.line.base, reader.line.size);
-    bytes_w += reader.line.size;
-    entry_data[bytes_w++] = '\n';
-  }
-
+static int write_cpio_entry(struct archive_conv *conv, const char *pkgname,
+                            const char *entry_data, off_t bytes_w) {
   /* adjust the entry size for removing the first line and adding slashes */
   archive_entry_set_size(conv->ae, bytes_w);
 
-  /* store the metadata as simply $pkgname-$pkgver-$pkgrel */
-  s = strdup(entryname);
-  *(strrchr(s, '/')) = '\0';
-  archive_entry_update_pathname_utf8(conv->ae, s);
+  archive_entry_update_pathname_utf8(conv->ae, pkgname);
 
   if (archive_write_header(conv->out, conv->ae) != ARCHIVE_OK) {
     fprintf(stderr, "error: failed to write entry header: %s/%s: %s\n",
@@ -233,11 +273,515 @@ static int write_cpio_entry(struct archive_conv *conv, const char *entryname) {
   return 0;
 }
 
+static int write_flat_entry(struct archive_conv *conv, const char *pkgname,
+                            size_t namelen, const char *entry_data,
+                            off_t bytes_w) {
+  int r =
+      flatdb_writer_add(&conv->flat, pkgname, namelen, entry_data, bytes_w);
+  if (r < 0) {
+    fprintf(stderr, "error: failed to write entry: %s/%s: %s\n", conv->reponame,
+            pkgname, strerror(-r));
+  }
+
+  return r;
+}
+
+static int write_compact_entry(struct archive_conv *conv, const char *pkgname,
+                               size_t namelen, const char *entry_data,
+                               off_t bytes_w) {
+  int r = compactdb_writer_add(&conv->compact, pkgname, namelen, entry_data,
+                               bytes_w);
+  if (r < 0) {
+    fprintf(stderr, "error: failed to write entry: %s/%s: %s\n", conv->reponame,
+            pkgname, strerror(-r));
+  }
+
+  return r;
+}
+
+static const char *prev_repo_pkg_name(const struct prev_repo *prev,
+                                      dbformat_t dbformat, uint32_t i,
+                                      size_t *len) {
+  return dbformat == DBFORMAT_FLAT ? flatdb_pkg_name(&prev->flat, i, len)
+                                   : compactdb_pkg_name(&prev->compact, i, len);
+}
+
+static void prev_repo_close(struct prev_repo *prev) {
+  if (prev->map != NULL) {
+    munmap(prev->map, prev->size);
+  }
+  free(prev->slots);
+  free(prev->dirmap);
+  memset(prev, 0, sizeof(*prev));
+}
+
+static int prev_repo_open(struct prev_repo *prev, const struct repo_t *repo) {
+  dbformat_t dbformat = repo->config->dbformat;
+  struct stat st;
+  int fd, r;
+
+  /* a CPIO repo would need decompressing to be read back, which is most of
+   * the cost of converting it in the first place */
+  if (repo->force || dbformat == DBFORMAT_CPIO) {
+    return -ENOENT;
+  }
+
+  fd = open(repo->diskfile, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return -EINVAL;
+  }
+
+  prev->size = st.st_size;
+  prev->map = mmap(NULL, prev->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (prev->map == MAP_FAILED) {
+    prev->map = NULL;
+    return -errno;
+  }
+
+  /* the repo was last written in some other format */
+  r = dbformat == DBFORMAT_FLAT
+          ? flatdb_open(&prev->flat, prev->map, prev->size)
+          : compactdb_open(&prev->compact, prev->map, prev->size);
+  if (r < 0) {
+    prev_repo_close(prev);
+    return r;
+  }
+
+  if (dbformat == DBFORMAT_FLAT) {
+    prev->npkgs = prev->flat.hdr->npkgs;
+  } else {
+    prev->npkgs = prev->compact.hdr->npkgs;
+    CALLOC(prev->dirmap, MAX(prev->compact.hdr->ndirs, 1u), sizeof(uint32_t),
+           goto fail);
+    memset(prev->dirmap, 0xff,
+           prev->compact.hdr->ndirs * sizeof(uint32_t));
+  }
+
+  prev->capacity = 16;
+  while (prev->capacity < prev->npkgs * 2) {
+    prev->capacity <<= 1;
+  }
+  CALLOC(prev->slots, prev->capacity, sizeof(uint32_t), goto fail);
+
+  for (uint32_t i = 0; i < prev->npkgs; ++i) {
+    size_t len;
+    const char *name = prev_repo_pkg_name(prev, dbformat, i, &len);
+    uint32_t pos;
+
+    if (name == NULL) {
+      goto fail;
+    }
+
+    pos = fnv1a_hash(name, len) & (prev->capacity - 1);
+    while (prev->slots[pos] != 0) {
+      pos = (pos + 1) & (prev->capacity - 1);
+    }
+    prev->slots[pos] = i + 1;
+  }
+
+  return 0;
+
+fail:
+  prev_repo_close(prev);
+  return -ENOMEM;
+}
+
+static bool prev_repo_find(const struct prev_repo *prev, dbformat_t dbformat,
+                           const char *name, size_t len, uint32_t *i) {
+  uint32_t pos;
+
+  if (prev->slots == NULL) {
+    return false;
+  }
+
+  pos = fnv1a_hash(name, len) & (prev->capacity - 1);
+  while (prev->slots[pos] != 0) {
+    size_t candidatelen;
+    const char *candidate =
+        prev_repo_pkg_name(prev, dbformat, prev->slots[pos] - 1, &candidatelen);
+
+    if (candidatelen == len && memcmp(candidate, name, len) == 0) {
+      *i = prev->slots[pos] - 1;
+      return true;
+    }
+    pos = (pos + 1) & (prev->capacity - 1);
+  }
+
+  return false;
+}
+
+/* Failing to build an index is not fatal, searches will just be slower, so
+ * an index which fails to take a package or a file is simply dropped. */
+static void index_drop(struct archive_conv *conv) {
+  index_builder_free(conv->index);
+  conv->index = NULL;
+  trigram_builder_free(conv->trigrams);
+  conv->trigrams = NULL;
+}
+
+static void index_add_pkg(struct archive_conv *conv, const char *pkgname,
+                          size_t len, uint64_t offset) {
+  if (conv->index &&
+      index_builder_add_pkg(conv->index, pkgname, len, offset) < 0) {
+    index_builder_free(conv->index);
+    conv->index = NULL;
+  }
+
+  if (conv->trigrams && trigram_builder_add_pkg(conv->trigrams) < 0) {
+    trigram_builder_free(conv->trigrams);
+    conv->trigrams = NULL;
+  }
+}
+
+static void index_add_file(struct archive_conv *conv, const char *path,
+                           size_t len) {
+  if (conv->index && index_builder_add_file(conv->index, path, len) < 0) {
+    index_builder_free(conv->index);
+    conv->index = NULL;
+  }
+
+  if (conv->trigrams &&
+      trigram_builder_add_file(conv->trigrams, path, len) < 0) {
+    trigram_builder_free(conv->trigrams);
+    conv->trigrams = NULL;
+  }
+}
+
+static bool index_wanted(const struct archive_conv *conv) {
+  return conv->index != NULL || conv->trigrams != NULL;
+}
+
+static void index_add_flat_files(struct archive_conv *conv, const char *files,
+                                 size_t len) {
+  const char *p = files, *end = files + len;
+
+  while (index_wanted(conv) && p < end) {
+    size_t pathlen = strnlen(p, end - p);
+
+    index_add_file(conv, p, pathlen);
+    p += pathlen + 1;
+  }
+}
+
+static void index_add_compact_files(struct archive_conv *conv, uint32_t i) {
+  const struct compactdb_t *db = &conv->prev.compact;
+  const struct compactdb_pkg *pkg = &db->pkgs[i];
+  char path[MAX_LINE_SIZE];
+
+  for (uint32_t f = pkg->files;
+       index_wanted(conv) && f < pkg->files + pkg->nfiles; ++f) {
+    const struct compactdb_file *file = &db->files[f];
+    size_t len = compactdb_dirpath(db, file->dir, path, sizeof(path));
+
+    if (len == 0 || len + file->namelen > sizeof(path) ||
+        (uint64_t)file->name + file->namelen >= db->hdr->strings_size) {
+      index_drop(conv);
+      break;
+    }
+
+    memcpy(&path[len], &db->strings[file->name], file->namelen);
+    len += file->namelen;
+
+    index_add_file(conv, path, len);
+  }
+}
+
+/* Reports that reading the repo failed, at entryname if it's not NULL, and
+ * returns why as a negative errno. r is what the read returned, and ENOBUFS
+ * means a line was too long to fit. */
+static int read_error(struct archive_conv *conv, const char *entryname,
+                      int r) {
+  const char *why = archive_error_string(conv->in);
+  int err = archive_errno(conv->in);
+
+  if (r == ENOBUFS) {
+    why = "line too long";
+    err = ENOBUFS;
+  }
+
+  fprintf(stderr, "error: failed to read repo: %s%s%s: %s\n", conv->reponame,
+          entryname ? "/" : "", entryname ? entryname : "",
+          why ? why : "unknown error");
+
+  return err > 0 ? -err : -EIO;
+}
+
+/* Copies a package over from the repo as it was before, if it's there and
+ * unchanged. Returns 1 if it isn't and the entry has to be converted. */
+static int copy_entry(struct archive_conv *conv, const char *entryname) {
+  size_t namelen = strrchr(entryname, '/') - entryname;
+  uint32_t i;
+  int r;
+
+  if (!prev_repo_find(&conv->prev, conv->dbformat, entryname, namelen, &i)) {
+    return 1;
+  }
+
+  /* the data still has to be decompressed to get past it, but it needn't be
+   * split into lines and converted */
+  r = archive_read_data_skip(conv->in);
+  if (r != ARCHIVE_OK) {
+    return read_error(conv, entryname, r);
+  }
+
+  index_add_pkg(conv, entryname, namelen, INDEX_NO_OFFSET);
+
+  if (conv->dbformat == DBFORMAT_FLAT) {
+    size_t fileslen;
+    const char *files = flatdb_pkg_files(&conv->prev.flat, i, &fileslen);
+
+    if (files == NULL) {
+      r = -EINVAL;
+    } else {
+      index_add_flat_files(conv, files, fileslen);
+      r = flatdb_writer_add(&conv->flat, entryname, namelen, files, fileslen);
+    }
+  } else {
+    index_add_compact_files(conv, i);
+    r = compactdb_writer_copy(&conv->compact, &conv->prev.compact, i,
+                              conv->prev.dirmap);
+  }
+
+  if (r < 0) {
+    fprintf(stderr, "error: failed to copy entry: %s/%.*s: %s\n",
+            conv->reponame, (int)namelen, entryname, strerror(-r));
+    return r;
+  }
+
+  stats_add(STATS_ENTRIES_REUSED, 1);
+
+  return 0;
+}
+
+/* Where the next entry of a CPIO repo will start, if the repo can be read
+ * from there without decompressing everything before it. */
+static uint64_t cpio_entry_offset(struct archive_conv *conv) {
+  if (conv->dbformat != DBFORMAT_CPIO ||
+      archive_filter_code(conv->out, 0) != ARCHIVE_FILTER_NONE) {
+    return INDEX_NO_OFFSET;
+  }
+
+  /* the padding after the previous entry is otherwise only written along
+   * with the next header */
+  if (archive_write_finish_entry(conv->out) != ARCHIVE_OK) {
+    return INDEX_NO_OFFSET;
+  }
+
+  return archive_filter_bytes(conv->out, 0);
+}
+
+/* Makes room for size bytes of scratch, which keeps whatever it held. It only
+ * ever grows, and soon fits the largest entry of the repo. */
+static int scratch_reserve(struct archive_conv *conv, size_t size) {
+  size_t newsz;
+  char *newscratch;
+
+  if (size <= conv->scratch_capacity) {
+    return 0;
+  }
+
+  newsz = MAX(conv->scratch_capacity * 2, (size_t)BUFSIZ);
+  while (newsz < size) {
+    newsz *= 2;
+  }
+
+  newscratch = realloc(conv->scratch, newsz);
+  if (newscratch == NULL) {
+    fprintf(stderr, "error: failed to allocate memory for entry: %s\n",
+            conv->reponame);
+    return -ENOMEM;
+  }
+  stats_add(STATS_ALLOCATIONS, 1);
+
+  conv->scratch = newscratch;
+  conv->scratch_capacity = newsz;
+
+  return 0;
+}
+
+static int write_entry(struct archive_conv *conv, const char *entryname) {
+  size_t entry_size = MAX(archive_entry_size(conv->ae), (off_t)0);
+  struct archive_line_reader reader = {};
+  /* store the metadata as simply $pkgname-$pkgver-$pkgrel */
+  size_t namelen = strrchr(entryname, '/') - entryname, start = namelen + 1,
+         bytes_w = start;
+  /* the flat format terminates paths with NUL so they can be matched without
+   * being copied out of the mapping */
+  const char eol = conv->dbformat == DBFORMAT_FLAT ? '\0' : '\n';
+  int k, r;
+
+  if (conv->line == NULL) {
+    MALLOC(conv->line, MAX_LINE_SIZE, return -ENOMEM);
+    stats_add(STATS_ALLOCATIONS, 1);
+  }
+
+  /* the converted entry rarely outgrows the original by much */
+  r = scratch_reserve(conv, start + entry_size + entry_size / 8);
+  if (r < 0) {
+    return r;
+  }
+
+  reader.line.base = conv->line;
+
+  memcpy(conv->scratch, entryname, namelen);
+  conv->scratch[namelen] = '\0';
+
+  index_add_pkg(conv, entryname, namelen, cpio_entry_offset(conv));
+
+  /* discard the first line */
+  k = reader_getline(&reader, conv->in);
+
+  while (k == ARCHIVE_OK &&
+         (k = reader_getline(&reader, conv->in)) == ARCHIVE_OK) {
+    char *p;
+
+    r = scratch_reserve(conv, bytes_w + reader.line.size + 2);
+    if (r < 0) {
+      return r;
+    }
+
+    /* do the copy, with a slash prepended */
+    p = &conv->scratch[bytes_w];
+    p[0] = '/';
+    memcpy(&p[1], reader.line.base, reader.line.size);
+
+    index_add_file(conv, p, reader.line.size + 1);
+
+    bytes_w += reader.line.size + 1;
+    conv->scratch[bytes_w++] = eol;
+  }
+
+  /* anything short of the end would leave the entry truncated */
+  if (k != ARCHIVE_EOF) {
+    return read_error(conv, entryname, k);
+  }
+
+  switch (conv->dbformat) {
+    case DBFORMAT_FLAT:
+      return write_flat_entry(conv, conv->scratch, namelen,
+                              &conv->scratch[start], bytes_w - start);
+    case DBFORMAT_COMPACT:
+      return write_compact_entry(conv, conv->scratch, namelen,
+                                 &conv->scratch[start], bytes_w - start);
+    default:
+      return write_cpio_entry(conv, conv->scratch, &conv->scratch[start],
+                              bytes_w - start);
+  }
+}
+
+static int archive_conv_finish(struct archive_conv *conv) {
+  int r = 0;
+
+  switch (conv->dbformat) {
+    case DBFORMAT_FLAT:
+      r = flatdb_writer_close(&conv->flat);
+      break;
+    case DBFORMAT_COMPACT:
+      r = compactdb_writer_close(&conv->compact);
+      break;
+    default:
+      /* the compressor's last block only goes out here */
+      if (archive_write_close(conv->out) < ARCHIVE_OK) {
+        r = archive_errno(conv->out) > 0 ? -archive_errno(conv->out) : -EIO;
+      }
+      break;
+  }
+
+  if (r < 0) {
+    fprintf(stderr, "error: failed to write repo: %s: %s\n", conv->tmpfile,
+            strerror(-r));
+  }
+
+  return r;
+}
+
 static void archive_conv_close(struct archive_conv *conv) {
-  archive_write_close(conv->out);
-  archive_write_free(conv->out);
+  switch (conv->dbformat) {
+    case DBFORMAT_FLAT:
+      flatdb_writer_abort(&conv->flat);
+      break;
+    case DBFORMAT_COMPACT:
+      compactdb_writer_abort(&conv->compact);
+      break;
+    default:
+      archive_write_close(conv->out);
+      archive_write_free(conv->out);
+      break;
+  }
   archive_read_close(conv->in);
   archive_read_free(conv->in);
+  index_drop(conv);
+  prev_repo_close(&conv->prev);
+  FREE(conv->scratch);
+  FREE(conv->line);
+}
+
+static int archive_conv_open_writer(struct archive_conv *conv,
+                                    const struct repo_t *repo) {
+  int r;
+
+  if (conv->dbformat != DBFORMAT_CPIO) {
+    r = conv->dbformat == DBFORMAT_FLAT
+            ? flatdb_writer_open(&conv->flat, conv->tmpfile)
+            : compactdb_writer_open(&conv->compact, conv->tmpfile);
+    if (r < 0) {
+      fprintf(stderr, "error: failed to open file for writing: %s: %s\n",
+              conv->tmpfile, strerror(-r));
+      return r;
+    }
+
+    return 0;
+  }
+
+  conv->out = archive_write_new();
+  if (conv->out == NULL) {
+    fputs("error: failed to allocate memory for archive objects\n", stderr);
+    return -ENOMEM;
+  }
+
+  archive_write_set_format_cpio_newc(conv->out);
+  if (archive_write_add_filter(conv->out, repo->config->compress) <
+      ARCHIVE_WARN) {
+    fprintf(stderr, "error: failed to set up compression for %s: %s\n",
+            repo_label(repo), archive_error_string(conv->out));
+    archive_write_free(conv->out);
+    return -EINVAL;
+  }
+  if (repo->config->compress_level >= 0) {
+    char level[16];
+
+    snprintf(level, sizeof(level), "%d", repo->config->compress_level);
+    if (archive_write_set_filter_option(conv->out, NULL, "compression-level",
+                                        level) < ARCHIVE_WARN) {
+      fprintf(stderr, "error: invalid compression level for %s: %s\n",
+              repo_label(repo), archive_error_string(conv->out));
+      archive_write_free(conv->out);
+      return -EINVAL;
+    }
+  }
+  if (workers.threads > 1) {
+    char threads[16];
+
+    /* a compressor which can't use them simply ignores the option */
+    snprintf(threads, sizeof(threads), "%u", workers.threads);
+    archive_write_set_filter_option(conv->out, NULL, "threads", threads);
+  }
+  r = archive_write_open_filename(conv->out, conv->tmpfile);
+  if (r != ARCHIVE_OK) {
+    fprintf(stderr, "error: failed to open file for writing: %s: %s\n",
+            conv->tmpfile, strerror(archive_errno(conv->out)));
+    r = archive_errno(conv->out);
+    archive_write_free(conv->out);
+    return -r;
+  }
+
+  return 0;
 }
 
 static int archive_conv_open(struct archive_conv *conv,
@@ -247,115 +791,402 @@ static int archive_conv_open(struct archive_conv *conv,
   /* generally, repo files are gzip compressed, but there's no guarantee of
    * this. in order to be compression-agnostic, use libarchive's reader/writer
    * methods. this also gives us an opportunity to rewrite the archive as CPIO,
-   * which is marginally faster given our staunch sequential access. */
+   * which is marginally faster given our staunch sequential access, or as a
+   * flat or compact DB which can be searched without libarchive at all. */
+
+  conv->reponame = repo_label(repo);
+  conv->dbformat = repo->config->dbformat;
+  stpcpy(stpcpy(conv->tmpfile, repo->diskfile), "~");
+
+  conv->in = archive_read_new();
+  if (conv->in == NULL) {
+    fputs("error: failed to allocate memory for archive objects\n", stderr);
+    return -ENOMEM;
+  }
+
+  archive_read_support_format_tar(conv->in);
+  archive_read_support_filter_all(conv->in);
+  r = archive_read_open_fd(conv->in, repo->tmpfile.fd, BUFSIZ);
+  if (r != ARCHIVE_OK) {
+    fprintf(stderr, "error: failed to create archive reader for %s: %s\n",
+            repo_label(repo), strerror(archive_errno(conv->in)));
+    r = archive_errno(conv->in);
+    archive_read_free(conv->in);
+    return -r;
+  }
+
+  r = archive_conv_open_writer(conv, repo);
+  if (r < 0) {
+    archive_read_free(conv->in);
+    return r;
+  }
+
+  /* failing to build the index is not fatal, searches will just be slower */
+  conv->index = index_builder_new();
+  if (repo->config->trigrams) {
+    conv->trigrams = trigram_builder_new();
+  }
+
+  /* nor is having nothing to carry over, every package is converted */
+  prev_repo_open(&conv->prev, repo);
+
+  return 0;
+}
+
+static void write_repo_index(struct archive_conv *conv,
+                             const struct repo_t *repo) {
+  char indexfile[PATH_MAX + sizeof(INDEX_SUFFIX)];
+  struct stat st;
+  int r;
+
+  snprintf(indexfile, sizeof(indexfile), "%s" INDEX_SUFFIX, repo->diskfile);
+
+  if (conv->index == NULL || stat(conv->tmpfile, &st) < 0) {
+    r = -ENOMEM;
+  } else {
+    r = index_builder_write(conv->index, indexfile, &st);
+  }
+
+  if (r < 0) {
+    fprintf(stderr, "warning: failed to write index for %s: %s\n",
+            repo_label(repo), strerror(-r));
+
+    /* a stale index would never be used, but don't leave it lying around */
+    unlink(indexfile);
+  }
+}
+
+static void write_repo_trigrams(struct archive_conv *conv,
+                                const struct repo_t *repo) {
+  char trifile[PATH_MAX + sizeof(TRIGRAM_SUFFIX)];
+  struct stat st;
+  int r;
+
+  snprintf(trifile, sizeof(trifile), "%s" TRIGRAM_SUFFIX, repo->diskfile);
+
+  /* one left over from an update which asked for it would never be used */
+  if (!repo->config->trigrams) {
+    unlink(trifile);
+    return;
+  }
+
+  if (conv->trigrams == NULL || stat(conv->tmpfile, &st) < 0) {
+    r = -ENOMEM;
+  } else {
+    r = trigram_builder_write(conv->trigrams, trifile, &st);
+  }
+
+  if (r < 0) {
+    fprintf(stderr, "warning: failed to write trigram index for %s: %s\n",
+            repo_label(repo), strerror(-r));
+    unlink(trifile);
+  }
+}
+
+static int repack_repo_data(const struct repo_t *repo) {
+  struct archive_conv conv = {};
+  int k, r = 0;
+
+  if (archive_conv_open(&conv, repo) < 0) {
+    return -1;
+  }
+
+  while ((k = archive_read_next_header(conv.in, &conv.ae)) == ARCHIVE_OK) {
+    const char *entryname = archive_entry_pathname(conv.ae);
+
+    /* ignore everything but the /files metadata */
+    if (endswith(entryname, "/files")) {
+      stats_add(STATS_ENTRIES, 1);
+      r = copy_entry(&conv, entryname);
+      if (r > 0) {
+        r = write_entry(&conv, entryname);
+      }
+      if (r < 0) {
+        break;
+      }
+    }
+  }
+
+  /* a repo cut short, say by a download which failed halfway, is never
+   * committed */
+  if (r == 0 && k != ARCHIVE_EOF) {
+    r = read_error(&conv, NULL, k);
+  }
+
+  if (r == 0) {
+    r = archive_conv_finish(&conv);
+  }
+
+  /* The index is written before the new repo is rotated into place. It
+   * identifies the file it belongs to, so a reader never pairs it with the old
+   * repo, and the rename() below preserves that identity. */
+  if (r == 0) {
+    write_repo_index(&conv, repo);
+    write_repo_trigrams(&conv, repo);
+  }
+
+  archive_conv_close(&conv);
+
+  if (r < 0) {
+    /* oh noes! */
+    if (unlink(conv.tmpfile) < 0 && errno != ENOENT) {
+      fprintf(stderr, "error: failed to unlink temporary file: %s: %s\n",
+              conv.tmpfile, strerror(errno));
+    }
+    return -1;
+  }
+
+  if (rename(conv.tmpfile, repo->diskfile) != 0) {
+    fprintf(stderr, "error: failed to rotate new repo for %s into place: %s\n",
+            repo_label(repo), strerror(errno));
+    return -1;
+  }
+
+  /* every cached query names the DB it was answered from, so none could be
+   * used again anyway, but they'd take up the cache until evicted */
+  qcache_invalidate(repo->config->cachedir);
+
+  return 0;
+}
+
+static int repack_repo_data_stats(const struct repo_t *repo,
+                                  struct stats_t *stats) {
+  struct stats_t *saved = stats_current;
+  struct stats_timer_t t;
+  int r;
+
+  stats_current = repo->config->stats != STATS_NONE ? stats : NULL;
+  stats_begin(&t, STATS_CLOCK_THREAD);
+  r = repack_repo_data(repo);
+  stats_end(&t, PHASE_REPACK);
+  stats_current = saved;
+
+  return r;
+}
+
+static void close_pipelines(void) {
+  struct repovec_t *repos = workers.repos;
+  struct repo_t *repo;
+
+  REPOVEC_FOREACH(repo, repos) {
+    if (repo->pipe_fd >= 0) {
+      close(repo->pipe_fd);
+      repo->pipe_fd = -1;
+    }
+  }
+}
+
+/* Forks a worker to repack what it reads from datafd, which is either the
+ * finished download or a pipe it's still arriving through. */
+static int repack_repo_data_async(struct repo_t *repo, int datafd) {
+  int pipefd[2] = {-1, -1};
+
+  /* the worker sends back what it counted when it's done, and the pipe
+   * hangs up when it exits */
+  if (pipe2(pipefd, O_CLOEXEC) < 0) {
+    pipefd[0] = pipefd[1] = -1;
+  }
+
+  /* or else the worker writes whatever is still buffered a second time */
+  fflush(stdout);
+
+  repo->worker = fork();
+
+  if (repo->worker < 0) {
+    perror("warning: failed to fork new process");
+    if (pipefd[0] >= 0) {
+      close(pipefd[0]);
+      close(pipefd[1]);
+    }
+
+    /* a download still in progress can't be repacked yet */
+    if (datafd != repo->tmpfile.fd) {
+      return -1;
+    }
+
+    /* don't just give up, try to repack the repo synchronously */
+    repo->worker = 0;
+    repo->repack_err = repack_repo_data_stats(repo, &repo->stats) != 0;
+    return 0;
+  }
 
-  conv->reponame = repo->name;
-  stpcpy(stpcpy(conv->tmpfile, repo->diskfile), "~");
+  if (repo->worker == 0) {
+    struct stats_t stats = {};
+    int r;
 
-  conv->in = archive_read_new();
-  conv->out = archive_write_new();
+    /* the pipe only reaches EOF once every writer has closed it */
+    close_pipelines();
+    repo->tmpfile.fd = datafd;
 
-  if (conv->in == NULL || conv->out == NULL) {
-    fputs("error: failed to allocate memory for archive objects\n", stderr);
-    return -ENOMEM;
+    r = repack_repo_data_stats(repo, &stats);
+    if (pipefd[1] >= 0 && repo->config->stats != STATS_NONE) {
+      write_all(pipefd[1], &stats, sizeof(stats));
+    }
+    exit(r);
   }
 
-  archive_read_support_format_tar(conv->in);
-  archive_read_support_filter_all(conv->in);
-  r = archive_read_open_fd(conv->in, repo->tmpfile.fd, BUFSIZ);
-  if (r != ARCHIVE_OK) {
-    fprintf(stderr, "error: failed to create archive reader for %s: %s\n",
-            repo->name, strerror(archive_errno(conv->in)));
-    r = archive_errno(conv->in);
-    goto open_error;
+  if (pipefd[1] >= 0) {
+    close(pipefd[1]);
   }
+  repo->stats_fd = pipefd[0];
+  workers.running++;
 
-  archive_write_set_format_cpio_newc(conv->out);
-  archive_write_add_filter(conv->out, repo->config->compress);
-  r = archive_write_open_filename(conv->out, conv->tmpfile);
-  if (r != ARCHIVE_OK) {
-    fprintf(stderr, "error: failed to open file for writing: %s: %s\n",
-            conv->tmpfile, strerror(archive_errno(conv->out)));
-    r = archive_errno(conv->out);
-    goto open_error;
+  /* only the hangup is of interest, which is always reported */
+  if (events.epfd >= 0 && repo->stats_fd >= 0) {
+    struct epoll_event ev = {.events = 0, .data.fd = repo->stats_fd};
+
+    epoll_ctl(events.epfd, EPOLL_CTL_ADD, repo->stats_fd, &ev);
   }
 
   return 0;
+}
 
-open_error:
-  archive_write_free(conv->out);
-  archive_read_free(conv->in);
+/* Reaps a worker which has finished, or waits for it to if options allows.
+ * Returns true if it was reaped. */
+static bool worker_reap(struct repo_t *repo, int options) {
+  int stat_loc;
+
+  if (repo->worker <= 0 || wait4(repo->worker, &stat_loc, options, NULL) <= 0) {
+    return false;
+  }
 
-  return -r;
+  repo->worker = 0;
+  repo->repack_err = WIFEXITED(stat_loc) ? WEXITSTATUS(stat_loc) : 1;
+  workers.running--;
+
+  return true;
 }
 
-static int repack_repo_data(const struct repo_t *repo) {
-  struct archive_conv conv = {};
-  int r = 0;
+/* Starts repacking as many of the downloads waiting on a worker as there are
+ * workers free, in the order the repos are configured. */
+static void workers_schedule(void) {
+  struct repovec_t *repos = workers.repos;
+  struct repo_t *repo;
 
-  if (archive_conv_open(&conv, repo) < 0) {
-    return -1;
+  REPOVEC_FOREACH(repo, repos) {
+    worker_reap(repo, WNOHANG);
   }
 
-  while (archive_read_next_header(conv.in, &conv.ae) == ARCHIVE_OK) {
-    const char *entryname = archive_entry_pathname(conv.ae);
+  REPOVEC_FOREACH(repo, repos) {
+    if (workers.running >= workers.max) {
+      break;
+    }
 
-    /* ignore everything but the /files metadata */
-    if (endswith(entryname, "/files")) {
-      r = write_cpio_entry(&conv, entryname);
-      if (r < 0) {
-        break;
-      }
+    if (repo->repack_pending) {
+      repo->repack_pending = 0;
+      lseek(repo->tmpfile.fd, 0, SEEK_SET);
+      repack_repo_data_async(repo, repo->tmpfile.fd);
     }
   }
+}
 
-  archive_conv_close(&conv);
+/* Starts repacking a download as soon as it begins to arrive, so that the
+ * repack overlaps the transfer rather than following it. */
+static int pipeline_start(struct repo_t *repo) {
+  int datafd[2];
+  int r;
 
-  if (r < 0) {
-    /* oh noes! */
-    if (unlink(conv.tmpfile) < 0 && errno != ENOENT) {
-      fprintf(stderr, "error: failed to unlink temporary file: %s: %s\n",
-              conv.tmpfile, strerror(errno));
-    }
-    return -1;
+  if (pipe2(datafd, O_CLOEXEC) < 0) {
+    return -errno;
   }
 
-  if (rename(conv.tmpfile, repo->diskfile) != 0) {
-    fprintf(stderr, "error: failed to rotate new repo for %s into place: %s\n",
-            repo->name, strerror(errno));
-    return -1;
+  /* the more that can be buffered, the less often a slow worker holds up
+   * the other downloads. failing this is harmless. */
+  fcntl(datafd[1], F_SETPIPE_SZ, PIPELINE_PIPE_SIZE);
+
+  repo->pipe_fd = datafd[1];
+  r = repack_repo_data_async(repo, datafd[0]);
+  close(datafd[0]);
+  if (r < 0) {
+    close(repo->pipe_fd);
+    repo->pipe_fd = -1;
+    return r;
   }
 
   return 0;
 }
 
-static int repack_repo_data_async(struct repo_t *repo) {
-  repo->worker = fork();
+/* Stops a worker fed by a download which then failed, so the download can be
+ * retried from the next server. */
+static void pipeline_abort(struct repo_t *repo) {
+  char tmpfile[PATH_MAX];
 
-  if (repo->worker < 0) {
-    perror("warning: failed to fork new process");
+  if (repo->pipe_fd < 0) {
+    return;
+  }
 
-    /* don't just give up, try to repack the repo synchronously */
-    return repack_repo_data(repo);
+  /* killed first, or else the worker would see EOF once the pipe closes and
+   * might commit the partial repo before the signal lands */
+  kill(repo->worker, SIGKILL);
+  worker_reap(repo, 0);
+  repo->repack_err = 0;
+
+  close(repo->pipe_fd);
+  repo->pipe_fd = -1;
+
+  if (repo->stats_fd >= 0) {
+    close(repo->stats_fd);
+    repo->stats_fd = -1;
   }
 
-  if (repo->worker == 0) {
-    exit(repack_repo_data(repo));
+  /* whatever it had written so far is useless */
+  stpcpy(stpcpy(tmpfile, repo->diskfile), "~");
+  unlink(tmpfile);
+}
+
+static void collect_worker_stats(struct repo_t *repo) {
+  struct stats_t stats;
+
+  if (repo->stats_fd < 0) {
+    return;
   }
 
-  return 0;
+  /* nothing arrives from a worker which died */
+  if (read_all(repo->stats_fd, &stats, sizeof(stats)) == 0) {
+    stats_merge(&repo->stats, &stats);
+  }
+
+  close(repo->stats_fd);
+  repo->stats_fd = -1;
 }
 
 static size_t write_handler(void *ptr, size_t size, size_t nmemb, void *data) {
-  struct repo_t *repo = data;
+  struct transfer_t *xfer = data;
+  struct repo_t *repo = xfer->repo;
   const uint8_t *p = ptr;
   size_t nbytes = size * nmemb;
   ssize_t n = 0;
+  int fd;
+
+  if (repo->winner != xfer) {
+    long resp = 0;
+
+    /* it lost the race, and is cancelled once curl lets go of it */
+    if (repo->winner != NULL) {
+      return 0;
+    }
+
+    /* an error page isn't worth keeping, it only has to be noticed */
+    curl_easy_getinfo(xfer->curl, CURLINFO_RESPONSE_CODE, &resp);
+    if (resp >= 400) {
+      return nbytes;
+    }
+
+    repo->winner = xfer;
+
+    /* with every worker busy, it waits its turn in the tmpfile. if the
+     * worker can't be started, the download is repacked from the tmpfile
+     * once it's done, just as it would be otherwise. */
+    if (workers.running < workers.max) {
+      pipeline_start(repo);
+    }
+  }
+  fd = repo->pipe_fd >= 0 ? repo->pipe_fd : repo->tmpfile.fd;
 
   while (nbytes > 0) {
     ssize_t k;
 
-    k = write(repo->tmpfile.fd, p, nbytes);
+    k = write(fd, p, nbytes);
     if (k < 0 && errno == EINTR) {
       continue;
     }
@@ -368,63 +1199,97 @@ static size_t write_handler(void *ptr, size_t size, size_t nmemb, void *data) {
     nbytes -= k;
     n += k;
   }
+  repo->tmpfile.size += n;
 
   return n;
 }
 
-static int open_tmpfile(int flags) {
-  const char *tmpdir;
-  _cleanup_free_ char *p = NULL;
-  int fd;
+static int transfer_start(CURLM *multi, struct transfer_t *xfer) {
+  struct repo_t *repo = xfer->repo;
+  _cleanup_free_ char *url = NULL;
+  struct stat st;
 
-  tmpdir = getenv("TMPDIR");
-  if (tmpdir == NULL) {
-    tmpdir = "/tmp";
+  if (xfer->curl == NULL) {
+    xfer->curl = curl_easy_init();
+    if (xfer->curl == NULL) {
+      fputs("error: failed to initialize curl\n", stderr);
+      return -1;
+    }
+    curl_easy_setopt(xfer->curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(xfer->curl, CURLOPT_WRITEFUNCTION, write_handler);
+    curl_easy_setopt(xfer->curl, CURLOPT_WRITEDATA, xfer);
+    curl_easy_setopt(xfer->curl, CURLOPT_PRIVATE, xfer);
+    curl_easy_setopt(xfer->curl, CURLOPT_ERRORBUFFER, xfer->errmsg);
+    curl_easy_setopt(xfer->curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
+    curl_easy_setopt(xfer->curl, CURLOPT_USERAGENT,
+                     PACKAGE "/v" PACKAGE_VERSION);
+    curl_easy_setopt(xfer->curl, CURLOPT_SHARE, curl_share);
+#ifdef CURLPIPE_MULTIPLEX
+    /* rather than open another connection to a server which is being
+     * connected to already, find out whether that one can be multiplexed */
+    curl_easy_setopt(xfer->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    curl_easy_setopt(xfer->curl, CURLOPT_HTTP_VERSION,
+                     (long)CURL_HTTP_VERSION_2TLS);
+#endif
   }
 
-#ifdef O_TMPFILE
-  fd = open(tmpdir, flags | O_TMPFILE, S_IRUSR | S_IWUSR);
-  if (fd >= 0) {
-    return fd;
+  xfer->server_idx = repo->server_idx++;
+  url = prepare_url(repo->servers[xfer->server_idx], repo->name, repo->arch);
+  if (url == NULL) {
+    fputs("error: failed to allocate URL for download\n", stderr);
+    return -1;
   }
-#endif
 
-  if (asprintf(&p, "%s/pkgfile-tmp-XXXXXX", tmpdir) < 0) {
-    return -ENOMEM;
-  }
+  curl_easy_setopt(xfer->curl, CURLOPT_URL, url);
 
-  fd = mkostemp(p, flags);
-  if (fd < 0) {
-    return -errno;
+  if (repo->force == 0 && stat(repo->diskfile, &st) == 0) {
+    curl_easy_setopt(xfer->curl, CURLOPT_TIMEVALUE, (long)st.st_mtime);
+    curl_easy_setopt(xfer->curl, CURLOPT_TIMECONDITION,
+                     CURL_TIMECOND_IFMODSINCE);
   }
 
-  /* ignore any (unlikely) error */
-  unlink(p);
+  xfer->errmsg[0] = '\0';
+  xfer->start = now();
+  xfer->active = 1;
+  curl_multi_add_handle(multi, xfer->curl);
+
+  return 0;
+}
+
+static int active_transfers(const struct repo_t *repo) {
+  int active = 0;
+
+  for (int i = 0; i < repo->ntransfers; ++i) {
+    active += repo->transfers[i].active;
+  }
 
-  return fd;
+  return active;
 }
 
+/* Starts downloading from as many of the servers not yet tried as are to be
+ * raced against the ones still going, unless one of them already won. */
 static int download_queue_request(CURLM *multi, struct repo_t *repo) {
-  struct stat st;
-  _cleanup_free_ char *url = NULL;
+  int want = repo->config->race ? (int)repo->config->race : 1;
 
-  if (repo->curl == NULL) {
+  if (repo->tmpfile.fd < 0) {
     /* it's my first time, be gentle */
     if (repo->servercount == 0) {
-      fprintf(stderr, "error: no servers configured for repo %s\n", repo->name);
+      fprintf(stderr, "error: no servers configured for repo %s\n",
+              repo_label(repo));
       return -1;
     }
-    repo->curl = curl_easy_init();
-    snprintf(repo->diskfile, sizeof(repo->diskfile), CACHEPATH "/%s.files",
-             repo->name);
-    curl_easy_setopt(repo->curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(repo->curl, CURLOPT_WRITEFUNCTION, write_handler);
-    curl_easy_setopt(repo->curl, CURLOPT_WRITEDATA, repo);
-    curl_easy_setopt(repo->curl, CURLOPT_PRIVATE, repo);
-    curl_easy_setopt(repo->curl, CURLOPT_ERRORBUFFER, repo->errmsg);
-    curl_easy_setopt(repo->curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
-    curl_easy_setopt(repo->curl, CURLOPT_USERAGENT,
-                     PACKAGE "/v" PACKAGE_VERSION);
+    if (repo_dbpath(repo, repo->config->cachedir, repo->diskfile,
+                    sizeof(repo->diskfile)) < 0) {
+      fprintf(stderr, "error: path to repo %s is too long\n",
+              repo_label(repo));
+      return -1;
+    }
+    repo->ntransfers = MIN(want, REPO_MAX_TRANSFERS);
+    for (int i = 0; i < repo->ntransfers; ++i) {
+      repo->transfers[i].repo = repo;
+    }
     repo->tmpfile.fd = open_tmpfile(O_RDWR | O_NONBLOCK);
     if (repo->tmpfile.fd < 0) {
       fprintf(stderr,
@@ -432,34 +1297,33 @@ static int download_queue_request(CURLM *multi, struct repo_t *repo) {
               strerror(-repo->tmpfile.fd));
       return -1;
     }
-  } else {
-    curl_multi_remove_handle(multi, repo->curl);
+  } else if (repo->winner == NULL) {
     lseek(repo->tmpfile.fd, 0, SEEK_SET);
     ftruncate(repo->tmpfile.fd, 0);
-    repo->server_idx++;
-  }
-
-  if (repo->server_idx >= repo->servercount) {
-    fprintf(stderr, "error: failed to update repo: %s\n", repo->name);
-    return -1;
+    repo->tmpfile.size = 0;
   }
 
-  url = prepare_url(repo->servers[repo->server_idx], repo->name, repo->arch);
-  if (url == NULL) {
-    fputs("error: failed to allocate URL for download\n", stderr);
-    return -1;
-  }
+  for (int i = 0; i < repo->ntransfers && repo->winner == NULL &&
+                  repo->server_idx < repo->servercount;
+       ++i) {
+    struct transfer_t *xfer = &repo->transfers[i];
 
-  curl_easy_setopt(repo->curl, CURLOPT_URL, url);
+    if (xfer->active) {
+      continue;
+    }
 
-  if (repo->force == 0 && stat(repo->diskfile, &st) == 0) {
-    curl_easy_setopt(repo->curl, CURLOPT_TIMEVALUE, (long)st.st_mtime);
-    curl_easy_setopt(repo->curl, CURLOPT_TIMECONDITION,
-                     CURL_TIMECOND_IFMODSINCE);
+    if (xfer->curl != NULL) {
+      curl_multi_remove_handle(multi, xfer->curl);
+    }
+    if (transfer_start(multi, xfer) < 0) {
+      return -1;
+    }
   }
 
-  repo->dl_time_start = now();
-  curl_multi_add_handle(multi, repo->curl);
+  if (active_transfers(repo) == 0) {
+    fprintf(stderr, "error: failed to update repo: %s\n", repo_label(repo));
+    return -1;
+  }
 
   return 0;
 }
@@ -481,10 +1345,10 @@ static void print_download_success(struct repo_t *repo, int remaining) {
   double rate, xfered_human;
   int width;
 
-  rate = repo->tmpfile.size / (now() - repo->dl_time_start);
+  rate = repo->tmpfile.size / (now() - repo->winner->start);
   xfered_human = humanize_size(repo->tmpfile.size, '\0', -1, &xfered_label);
 
-  printf("  download complete: %-20s [", repo->name);
+  printf("  download complete: %-20s [", repo_label(repo));
   if (fabs(rate - INFINITY) < DBL_EPSILON) {
     width = printf(" [%6.1f %3s  %7s ", xfered_human, xfered_label, "----");
   } else {
@@ -509,6 +1373,66 @@ static void print_total_dl_stats(int count, double duration, off_t total_xfer) {
   printf(" %2d file%c    >\n", count, count == 1 ? ' ' : 's');
 }
 
+static void record_download(struct transfer_t *xfer, const char *url,
+                            long resp, const char *status) {
+  struct repo_t *repo = xfer->repo;
+  double wall = 0;
+  off_t bytes;
+
+  if (repo->config->stats == STATS_NONE) {
+    return;
+  }
+
+  /* finer grained than now() */
+  curl_easy_getinfo(xfer->curl, CURLINFO_TOTAL_TIME, &wall);
+  bytes = repo->winner == xfer ? repo->tmpfile.size : 0;
+  stats_record(&repo->stats, PHASE_DOWNLOAD, wall, 0);
+  repo->stats.counters[STATS_BYTES_DOWNLOADED] += bytes;
+  stats_add_download(&repo->stats, url, wall, bytes, resp, status);
+}
+
+/* Learns how quick the server was, from a download which got somewhere. */
+static void record_mirror(struct transfer_t *xfer) {
+  struct repo_t *repo = xfer->repo;
+  double latency = -1, total = 0, rate = 0;
+
+  curl_easy_getinfo(xfer->curl, CURLINFO_STARTTRANSFER_TIME, &latency);
+  curl_easy_getinfo(xfer->curl, CURLINFO_TOTAL_TIME, &total);
+
+  /* a repo small enough to arrive in one go says nothing about the rate */
+  if (repo->winner == xfer && total > latency && repo->tmpfile.size > 0) {
+    rate = repo->tmpfile.size / (total - latency);
+  }
+
+  mirrors_record_success(&mirrors, repo->servers[xfer->server_idx], latency,
+                         rate);
+}
+
+/* Stops every transfer but the winner, which can't be done from within one of
+ * curl's callbacks, where the winner is decided. A server which lost took at
+ * least as long as it's been going to get started. */
+static void download_cancel_losers(CURLM *multi, struct repo_t *repo) {
+  for (int i = 0; i < repo->ntransfers; ++i) {
+    struct transfer_t *xfer = &repo->transfers[i];
+    char *effective_url;
+
+    if (!xfer->active || xfer == repo->winner) {
+      continue;
+    }
+
+    curl_easy_getinfo(xfer->curl, CURLINFO_EFFECTIVE_URL, &effective_url);
+    record_download(xfer, effective_url, 0, "cancelled");
+    mirrors_record_lost(&mirrors, repo->servers[xfer->server_idx],
+                        now() - xfer->start);
+
+    curl_multi_remove_handle(multi, xfer->curl);
+    xfer->active = 0;
+  }
+}
+
+/* Handles a finished download, if there is one. Returns -1 when there isn't,
+ * or else 1 when the download failed and was queued again from the next
+ * server. */
 static int download_check_complete(CURLM *multi, int remaining) {
   int msgs_left;
   CURLMsg *msg;
@@ -521,113 +1445,316 @@ static int download_check_complete(CURLM *multi, int remaining) {
   if (msg->msg == CURLMSG_DONE) {
     long uptodate, resp;
     char *effective_url;
+    struct transfer_t *xfer;
     struct repo_t *repo;
 
-    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &repo);
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &xfer);
     curl_easy_getinfo(msg->easy_handle, CURLINFO_CONDITION_UNMET, &uptodate);
     curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &resp);
     curl_easy_getinfo(msg->easy_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+    repo = xfer->repo;
+    xfer->active = 0;
+
+    /* a loser which finished before it could be cancelled */
+    if (repo->winner != NULL && repo->winner != xfer) {
+      record_download(xfer, effective_url, resp, "cancelled");
+      return 0;
+    }
 
     if (uptodate) {
-      printf("  %s is up to date\n", repo->name);
+      record_download(xfer, effective_url, resp, "up to date");
+      record_mirror(xfer);
+      repo->winner = xfer;
+      download_cancel_losers(multi, repo);
+      printf("  %s is up to date\n", repo_label(repo));
       repo->err = 1;
       return 0;
     }
 
     /* was it a success? */
     if (msg->data.result != CURLE_OK || resp >= 400) {
-      if (*repo->errmsg) {
+      record_download(xfer, effective_url, resp, "failed");
+      mirrors_record_failure(&mirrors, repo->servers[xfer->server_idx]);
+      if (*xfer->errmsg) {
         fprintf(stderr, "warning: download failed: %s: %s\n", effective_url,
-                repo->errmsg);
+                xfer->errmsg);
       } else {
         fprintf(stderr, "warning: download failed: %s [error %ld]\n",
                 effective_url, resp);
       }
 
-      return download_queue_request(multi, repo);
+      if (repo->winner == xfer) {
+        pipeline_abort(repo);
+        repo->winner = NULL;
+      }
+      if (download_queue_request(multi, repo) < 0) {
+        repo->err = -1;
+        return 0;
+      }
+
+      return 1;
     }
 
-    repo->tmpfile.size = lseek(repo->tmpfile.fd, 0, SEEK_CUR);
-    lseek(repo->tmpfile.fd, 0, SEEK_SET);
+    /* an empty repo wins without ever having written anything */
+    repo->winner = xfer;
+    download_cancel_losers(multi, repo);
 
+    record_download(xfer, effective_url, resp, "ok");
+    record_mirror(xfer);
     print_download_success(repo, remaining);
-    repack_repo_data_async(repo);
+
+    if (repo->pipe_fd >= 0) {
+      /* the worker has it all, and finishes once it sees EOF */
+      close(repo->pipe_fd);
+      repo->pipe_fd = -1;
+    } else {
+      repo->repack_pending = 1;
+      workers_schedule();
+    }
     repo->err = 0;
   }
 
   return 0;
 }
 
-static void download_wait_loop(CURLM *multi) {
-  int active_handles;
+static int event_socket(CURL *curl UNUSED, curl_socket_t sock, int what,
+                        void *userp UNUSED, void *socketp UNUSED) {
+  struct epoll_event ev = {.data.fd = sock};
 
-  do {
-    int nfd, rc = curl_multi_wait(multi, NULL, 0, 1000, &nfd);
-    if (rc != CURLM_OK) {
-      fprintf(stderr, "error: curl_multi_wait failed (%d)\n", rc);
-      break;
-    }
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(events.epfd, EPOLL_CTL_DEL, sock, NULL);
+    return 0;
+  }
 
-    if (nfd < 0) {
-      fprintf(stderr, "error: poll error, possible network problem\n");
-      break;
-    }
+  if (what & CURL_POLL_IN) {
+    ev.events |= EPOLLIN;
+  }
+  if (what & CURL_POLL_OUT) {
+    ev.events |= EPOLLOUT;
+  }
 
-    rc = curl_multi_perform(multi, &active_handles);
-    if (rc != CURLM_OK) {
-      fprintf(stderr, "error: curl_multi_perform failed (%d)\n", rc);
-      break;
+  if (epoll_ctl(events.epfd, EPOLL_CTL_MOD, sock, &ev) < 0 &&
+      (errno != ENOENT ||
+       epoll_ctl(events.epfd, EPOLL_CTL_ADD, sock, &ev) < 0)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int event_timer(CURLM *multi UNUSED, long timeout, void *userp UNUSED) {
+  events.timeout = timeout;
+  return 0;
+}
+
+/* Reaps the worker whose pipe hung up on exiting, if the event was one. */
+static bool event_worker(struct repovec_t *repos, int fd) {
+  struct repo_t *repo;
+
+  REPOVEC_FOREACH(repo, repos) {
+    if (repo->stats_fd == fd && repo->worker > 0) {
+      /* the pipe stays open until whatever was sent down it is read */
+      epoll_ctl(events.epfd, EPOLL_CTL_DEL, fd, NULL);
+
+      /* it closed its end on its way out, and has all but exited */
+      worker_reap(repo, 0);
+      return true;
     }
+  }
 
-    while (download_check_complete(multi, active_handles) == 0)
-      ;
-  } while (active_handles > 0);
+  return false;
 }
 
-static int reap_children(struct repovec_t *repos) {
-  int r = 0, running = 0;
+/* Hands whatever happened to curl, and deals with what came of it. */
+static bool download_dispatch(CURLM *multi, struct repovec_t *repos,
+                              const struct epoll_event *evs, int nfd,
+                              int *running) {
   struct repo_t *repo;
+  bool requeued = false;
+  int r;
+
+  if (nfd == 0) {
+    events.timeout = -1;
+    curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, running);
+  }
+
+  for (int i = 0; i < nfd; ++i) {
+    int flags = 0;
+
+    if (event_worker(repos, evs[i].data.fd)) {
+      continue;
+    }
+
+    if (evs[i].events & EPOLLIN) {
+      flags |= CURL_CSELECT_IN;
+    }
+    if (evs[i].events & EPOLLOUT) {
+      flags |= CURL_CSELECT_OUT;
+    }
+    if (evs[i].events & (EPOLLERR | EPOLLHUP)) {
+      flags |= CURL_CSELECT_ERR;
+    }
+    curl_multi_socket_action(multi, evs[i].data.fd, flags, running);
+  }
+
+  while ((r = download_check_complete(multi, *running)) >= 0) {
+    requeued |= r > 0;
+  }
 
-  /* immediately reap zombies, but don't wait on still active children */
+  /* the races which were won since the last time round */
   REPOVEC_FOREACH(repo, repos) {
-    int stat_loc;
-    if (repo->worker > 0) {
-      if (wait4(repo->worker, &stat_loc, WNOHANG, NULL) == 0) {
-        running++;
-      } else {
-        /* exited, grab the status */
-        r += WEXITSTATUS(stat_loc);
+    if (repo->winner != NULL) {
+      download_cancel_losers(multi, repo);
+    }
+  }
+
+  /* free up the workers which are done for the downloads waiting on one */
+  workers_schedule();
+
+  return requeued;
+}
+
+static void download_wait_loop(CURLM *multi, struct repovec_t *repos) {
+  struct epoll_event evs[EVENT_MAX];
+  int running = 0;
+  bool requeued;
+
+  /* get every download started */
+  requeued = download_dispatch(multi, repos, evs, 0, &running);
+
+  /* a download queued again isn't counted among the running ones yet */
+  while (running > 0 || requeued) {
+    int nfd = 0;
+
+    /* unless curl wants to be called right away */
+    if (events.timeout != 0) {
+      nfd = epoll_wait(events.epfd, evs, EVENT_MAX, (int)events.timeout);
+      if (nfd < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fprintf(stderr, "error: poll error, possible network problem\n");
+        break;
       }
     }
+
+    requeued = download_dispatch(multi, repos, evs, nfd, &running);
+  }
+}
+
+/* Sets up for the downloads to be driven by events, rather than by polling
+ * for them, before any of them are added. */
+static int download_events_init(CURLM *multi) {
+  events.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (events.epfd < 0) {
+    return -errno;
+  }
+  events.timeout = -1;
+
+  curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, event_socket);
+  curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, event_timer);
+#ifdef CURLPIPE_MULTIPLEX
+  /* every repo on the same HTTP/2 mirror goes over a single connection */
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+  curl_share = curl_share_init();
+  if (curl_share != NULL) {
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+
+  return 0;
+}
+
+static void download_events_close(void) {
+  if (events.epfd >= 0) {
+    close(events.epfd);
+    events.epfd = -1;
+  }
+
+  /* only once every handle using it has been cleaned up */
+  if (curl_share != NULL) {
+    curl_share_cleanup(curl_share);
+    curl_share = NULL;
   }
+}
+
+static int reap_children(struct repovec_t *repos) {
+  int r = 0, running, pending = 0;
+  struct repo_t *repo;
+
+  /* immediately reap zombies, and start on whatever is still waiting */
+  workers_schedule();
+
+  REPOVEC_FOREACH(repo, repos) { pending += repo->repack_pending; }
+  running = workers.running + pending;
 
   if (running > 0) {
-    int stat_loc;
+    struct stats_timer_t t;
+
+    stats_begin(&t, STATS_CLOCK_NONE);
     printf(":: waiting for %d process%s to finish repacking repos...\n",
            running, running == 1 ? "" : "es");
-    for (;;) {
-      pid_t pid = wait4(-1, &stat_loc, 0, NULL);
-      if (pid < 0 && errno == ECHILD) {
+    while (workers.running > 0) {
+      siginfo_t info;
+
+      /* find out who's done without reaping them, they're reaped by pid so
+       * that their repo's accounting stays straight */
+      if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
         /* no more children */
         break;
-      } else if (pid > 0) {
-        r += WEXITSTATUS(stat_loc);
       }
+
+      REPOVEC_FOREACH(repo, repos) {
+        if (repo->worker == info.si_pid) {
+          worker_reap(repo, 0);
+        }
+      }
+      workers_schedule();
     }
+    stats_end(&t, PHASE_WAIT);
   }
 
+  REPOVEC_FOREACH(repo, repos) { r += repo->repack_err; }
+
   return r;
 }
 
+static void print_update_stats(struct repovec_t *repos,
+                               const struct config_t *config,
+                               const struct stats_t *total) {
+  _cleanup_free_ const char **names = NULL;
+  _cleanup_free_ struct stats_t **stats = NULL;
+  struct repo_t *repo;
+
+  CALLOC(names, repos->size, sizeof(char *), return);
+  CALLOC(stats, repos->size, sizeof(struct stats_t *), return);
+
+  REPOVEC_FOREACH(repo, repos) {
+    collect_worker_stats(repo);
+    names[i_] = repo_label(repo);
+    stats[i_] = &repo->stats;
+  }
+
+  stats_print(stderr, config->stats, "update", total, names, stats,
+              repos->size);
+}
+
 int pkgfile_update(struct repovec_t *repos, struct config_t *config) {
   int r, xfer_count = 0, ret = 0;
   struct repo_t *repo;
   CURLM *curl_multi;
   off_t total_xfer = 0;
   double t_start, duration;
+  struct stats_t stats = {};
+  unsigned busy;
 
-  if (access(CACHEPATH, W_OK)) {
-    fprintf(stderr, "error: unable to write to " CACHEPATH ": %s\n",
+  if (access(config->cachedir, W_OK)) {
+    fprintf(stderr, "error: unable to write to %s: %s\n", config->cachedir,
             strerror(errno));
     return 1;
   }
@@ -642,6 +1769,14 @@ int pkgfile_update(struct repovec_t *repos, struct config_t *config) {
     return 1;
   }
 
+  r = download_events_init(curl_multi);
+  if (r < 0) {
+    fprintf(stderr, "error: failed to initialize event loop: %s\n",
+            strerror(-r));
+    curl_multi_cleanup(curl_multi);
+    return 1;
+  }
+
   if (repos->architecture == NULL) {
     struct utsname un;
     uname(&un);
@@ -651,11 +1786,47 @@ int pkgfile_update(struct repovec_t *repos, struct config_t *config) {
   /* ensure all our DBs are 0644 */
   umask(0022);
 
+  /* a worker which dies mid-download is a write error, not a reason to die */
+  signal(SIGPIPE, SIG_IGN);
+
+  workers.repos = repos;
+  workers.max = config->jobs ? config->jobs : pool_default_threads();
+  workers.running = 0;
+  /* whatever CPUs the workers leave idle go to their compressors */
+  busy = MIN(workers.max, (unsigned)repos->size);
+  busy = MAX(busy, 1u);
+  workers.threads = MAX(pool_default_threads() / busy, 1u);
+
+  stats_current = config->stats != STATS_NONE ? &stats : NULL;
+
+  /* only a race goes looking for the fastest server, otherwise the servers
+   * are tried in the order they were configured in */
+  mirrors_load(&mirrors, config->cachedir);
+  if (config->race > 0) {
+    REPOVEC_FOREACH(repo, repos) {
+      mirrors_sort(&mirrors, repo->servers, repo->servercount);
+    }
+  }
+
   /* prime the handle by adding a URL from each repo */
   REPOVEC_FOREACH(repo, repos) {
-    repo->arch = repos->architecture;
+    /* a repo kept per architecture already has its own */
+    if (repo->arch == NULL) {
+      repo->arch = repos->architecture;
+    }
     repo->force = config->doupdate > 1;
     repo->config = config;
+    if (repo->archdir != NULL) {
+      char dir[PATH_MAX];
+
+      snprintf(dir, sizeof(dir), "%s/%s", config->cachedir, repo->archdir);
+      if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "error: failed to create %s: %s\n", dir,
+                strerror(errno));
+        ret = 1;
+        continue;
+      }
+    }
     r = download_queue_request(curl_multi, repo);
     if (r != 0) {
       ret = r;
@@ -663,13 +1834,18 @@ int pkgfile_update(struct repovec_t *repos, struct config_t *config) {
   }
 
   t_start = now();
-  download_wait_loop(curl_multi);
+  download_wait_loop(curl_multi, repos);
   duration = now() - t_start;
+  stats_record(&stats, PHASE_DOWNLOAD, duration, 0);
 
   /* remove handles, aggregate results */
   REPOVEC_FOREACH(repo, repos) {
-    curl_multi_remove_handle(curl_multi, repo->curl);
-    curl_easy_cleanup(repo->curl);
+    for (int i = 0; i < repo->ntransfers; ++i) {
+      if (repo->transfers[i].curl != NULL) {
+        curl_multi_remove_handle(curl_multi, repo->transfers[i].curl);
+        curl_easy_cleanup(repo->transfers[i].curl);
+      }
+    }
 
     total_xfer += repo->tmpfile.size;
 
@@ -683,6 +1859,13 @@ int pkgfile_update(struct repovec_t *repos, struct config_t *config) {
     }
   }
 
+  /* a cache which can't hold it only forgets what was learned */
+  if (mirrors_save(&mirrors, config->cachedir) < 0) {
+    fprintf(stderr, "warning: failed to save mirror statistics in %s\n",
+            config->cachedir);
+  }
+  mirrors_free(&mirrors);
+
   /* print transfer stats if we downloaded more than 1 file */
   if (xfer_count > 0) {
     print_total_dl_stats(xfer_count, duration, total_xfer);
@@ -692,7 +1875,13 @@ int pkgfile_update(struct repovec_t *repos, struct config_t *config) {
     ret = 1;
   }
 
+  if (config->stats != STATS_NONE) {
+    print_update_stats(repos, config, &stats);
+  }
+  stats_current = NULL;
+
   curl_multi_cleanup(curl_multi);
+  download_events_close();
   curl_global_cleanup();
 
   return ret;
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "macro.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_VECTORS 1
+#endif
+
+uint32_t fnv1a_hash(const char *key, size_t len) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static char ascii_lower(char c) {
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+uint32_t fnv1a_hash_folded(const char *key, size_t len) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)ascii_lower(key[i]);
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+bool ascii_only(const char *s, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if ((unsigned char)s[i] >= 0x80) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void ascii_fold(char *dst, const char *src, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    dst[i] = ascii_lower(src[i]);
+  }
+}
+
+static bool ascii_equal_folded_scalar(const char *folded, const char *s,
+                                      size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (ascii_lower(s[i]) != folded[i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+#ifdef HAVE_X86_VECTORS
+__attribute__((target("sse2"))) static bool ascii_equal_folded_sse2(
+    const char *folded, const char *s, size_t len) {
+  const __m128i before_a = _mm_set1_epi8('A' - 1),
+                after_z = _mm_set1_epi8('Z' + 1),
+                casebit = _mm_set1_epi8('a' - 'A');
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i f = _mm_loadu_si128((const __m128i *)(folded + i));
+    /* bytes of 0x80 and up are negative, and never taken for upper case */
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a),
+                                  _mm_cmplt_epi8(v, after_z));
+
+    v = _mm_or_si128(v, _mm_and_si128(upper, casebit));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, f)) != 0xffff) {
+      return false;
+    }
+  }
+
+  return ascii_equal_folded_scalar(folded + i, s + i, len - i);
+}
+#endif
+
+static bool (*equal_folded)(const char *folded, const char *s,
+                            size_t len) = ascii_equal_folded_scalar;
+
+__attribute__((constructor)) static void util_init(void) {
+#ifdef HAVE_X86_VECTORS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    equal_folded = ascii_equal_folded_sse2;
+  }
+#endif
+}
+
+bool ascii_equal_folded(const char *folded, const char *s, size_t len) {
+  return equal_folded(folded, s, len);
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+int read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (n == 0) {
+      return -EPIPE;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+int pread_all(int fd, void *buf, size_t len, off_t offset) {
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (n == 0) {
+      return -EPIPE;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+bool is_network_fs(int fd) {
+  /* from linux/magic.h, which not every libc's headers agree with */
+  static const unsigned long magics[] = {
+      0x6969,     /* NFS */
+      0x517b,     /* SMB */
+      0xff534d42, /* CIFS */
+      0xfe534d42, /* SMB2 */
+      0x00c36400, /* Ceph */
+      0x01021997, /* 9P */
+      0x5346414f, /* AFS */
+      0x65735546, /* FUSE, often sshfs and the like */
+  };
+  struct statfs sfs;
+
+  if (fstatfs(fd, &sfs) < 0) {
+    return false;
+  }
+
+  for (size_t i = 0; i < sizeof(magics) / sizeof(magics[0]); ++i) {
+    if ((unsigned long)sfs.f_type == magics[i]) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+int open_tmpfile(int flags) {
+  const char *tmpdir;
+  _cleanup_free_ char *p = NULL;
+  int fd;
+
+  tmpdir = getenv("TMPDIR");
+  if (tmpdir == NULL) {
+    tmpdir = "/tmp";
+  }
+
+#ifdef O_TMPFILE
+  fd = open(tmpdir, flags | O_TMPFILE, S_IRUSR | S_IWUSR);
+  if (fd >= 0) {
+    return fd;
+  }
+#endif
+
+  if (asprintf(&p, "%s/pkgfile-tmp-XXXXXX", tmpdir) < 0) {
+    return -ENOMEM;
+  }
+
+  fd = mkostemp(p, flags);
+  if (fd < 0) {
+    return -errno;
+  }
+
+  /* ignore any (unlikely) error */
+  unlink(p);
+
+  return fd;
+}
+
+/* vim: set ts=2 sw=2 et: */
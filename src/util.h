@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2011-2014 by Dave Reisner <dreisner@archlinux.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+uint32_t fnv1a_hash(const char *key, size_t len);
+
+/* Case folding of ASCII letters alone, which unlike tolower() doesn't depend
+ * on the locale. Anything else is left as it is. */
+uint32_t fnv1a_hash_folded(const char *key, size_t len);
+bool ascii_only(const char *s, size_t len);
+void ascii_fold(char *dst, const char *src, size_t len);
+
+/* Whether s is the same as folded, which is already in lower case, once its
+ * ASCII letters are folded too. */
+bool ascii_equal_folded(const char *folded, const char *s, size_t len);
+int write_all(int fd, const void *buf, size_t len);
+int read_all(int fd, void *buf, size_t len);
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset);
+int pread_all(int fd, void *buf, size_t len, off_t offset);
+
+/* Whether fd is on a filesystem served over the network, where a mapped file
+ * can fault in one slow round trip at a time. */
+bool is_network_fs(int fd);
+
+/* Opens an unnamed file in $TMPDIR, or /tmp without it, which is gone as soon
+ * as it's closed. Returns the fd, or a negative errno. */
+int open_tmpfile(int flags);
+
+/* vim: set ts=2 sw=2 et: */